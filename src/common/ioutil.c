@@ -349,3 +349,31 @@ ssize_t iobuf_write( int fd, struct iobuf *iobuf )
 
 	return count;
 }
+
+/* Like iobuf_read(), but moves up to len bytes from fd_in to fd_out with
+ * splice() - so one of them must be a pipe - without blocking on either.
+ * Returns -1 if the operation failed or fd_in is at EOF, otherwise the number
+ * of bytes moved, which may be 0. */
+ssize_t splice_nonblock( int fd_in, int fd_out, size_t len )
+{
+	ssize_t count;
+
+	count = splice( fd_in, NULL, fd_out, NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+
+	if ( count > 0 ) {
+		debug( "splice() moved %"PRIu32" bytes from fd %i to fd %i", count, fd_in, fd_out );
+	} else if ( count == 0 ) {
+		warn( "splice() returned EOF on fd %i", fd_in );
+		errno = 0;
+		return -1;
+	} else if ( count == -1 ) {
+		if ( io_errno_permanent() ) {
+			warn( SHOW_ERRNO( "splice() from fd %i to fd %i failed", fd_in, fd_out ) );
+		} else {
+			debug( SHOW_ERRNO( "splice() moved 0 bytes" ) );
+			count = 0;
+		}
+	}
+
+	return count;
+}
@@ -10,6 +10,7 @@ struct iobuf {
 
 ssize_t iobuf_read( int fd, struct iobuf* iobuf, size_t default_size );
 ssize_t iobuf_write( int fd, struct iobuf* iobuf );
+ssize_t splice_nonblock( int fd_in, int fd_out, size_t len );
 
 #include "serve.h"
 struct bitset; /* don't need whole of bitset.h here */
@@ -26,6 +26,11 @@ void mode(char* mode, int argc, char **argv);
 #define OPT_CONNECT_PORT "conn-port"
 #define OPT_KILLSWITCH "killswitch"
 #define OPT_MAX_SPEED "max-speed"
+#define OPT_MAX_BURST "max-burst"
+#define OPT_POST_COPY "post-copy"
+#define OPT_VERIFY "verify"
+#define OPT_WRITEBACK "writeback"
+#define OPT_UNORDERED "unordered"
 
 #define CMD_SERVE  "serve"
 #define CMD_LISTEN "listen"
@@ -60,6 +65,11 @@ void mode(char* mode, int argc, char **argv);
 #define GETOPT_CONNECT_PORT GETOPT_ARG( OPT_CONNECT_PORT, 'P' )
 #define GETOPT_KILLSWITCH   GETOPT_ARG( OPT_KILLSWITCH,   'k' )
 #define GETOPT_MAX_SPEED    GETOPT_ARG( OPT_MAX_SPEED, 'm' )
+#define GETOPT_MAX_BURST    GETOPT_ARG( OPT_MAX_BURST, 'B' )
+#define GETOPT_POST_COPY    GETOPT_FLAG( OPT_POST_COPY, 'y' )
+#define GETOPT_VERIFY       GETOPT_FLAG( OPT_VERIFY, 'V' )
+#define GETOPT_WRITEBACK    GETOPT_ARG( OPT_WRITEBACK, 'w' )
+#define GETOPT_UNORDERED    GETOPT_FLAG( OPT_UNORDERED, 'U' )
 
 #define OPT_VERBOSE "verbose"
 #define SOPT_VERBOSE "v"
@@ -90,6 +100,8 @@ void mode(char* mode, int argc, char **argv);
 	 "\t--" OPT_BIND ",-b <BIND-ADDR>\tBind the local socket to a particular IP address.\n"
 #define MAX_SPEED_LINE \
 	 "\t--" OPT_MAX_SPEED ",-m <bps>\tMaximum speed of the migration, in bytes/sec.\n"
+#define MAX_BURST_LINE \
+	 "\t--" OPT_MAX_BURST ",-B <bytes>\tMost the migration may send at once under the limit.\n"
 
 char * help_help_text;
 
@@ -10,10 +10,71 @@
 #define REQUEST_READ 0
 #define REQUEST_WRITE 1
 #define REQUEST_DISCONNECT 2
+#define REQUEST_FLUSH 3
+#define REQUEST_WRITE_ZEROES 6
+
+/* flexnbd extension: reply with a hash64() of every NBD_HASH_BLOCK_SIZE
+ * bytes in the range, as big-endian 64-bit values following the reply.
+ * The last one covers whatever is left, if the range isn't a whole number
+ * of blocks. Only sent to servers whose hello has INIT_FLAG_HASH set. */
+#define REQUEST_HASH 0x0100
+#define NBD_HASH_BLOCK_SIZE ( 64 * 1024 )
+#define NBD_HASH_MAX_SIZE ( 256 * 1024 * 1024 )
+
+/* flexnbd extension: a write whose data is LZ4-compressed. len is the size
+ * of the data once decompressed; on the wire, the request is followed by the
+ * big-endian 32-bit length of the compressed data, then the data itself. Only
+ * sent to servers whose hello has INIT_FLAG_LZ4 set. */
+#define REQUEST_WRITE_LZ4 0x0101
+#define NBD_LZ4_MAX_SIZE ( 64 * 1024 * 1024 )
+
+/* flexnbd extension: the request carries 8 bytes of data, the big-endian
+ * generation ID of the migration the client is sending, which the server
+ * keeps in place of any it had. The reply is followed by the big-endian
+ * generation ID the server had before, or 0 if it had none. from must be 0.
+ * Only sent to servers whose hello has INIT_FLAG_GENERATION set. */
+#define REQUEST_GENERATION 0x0102
+
+/* flexnbd extension: the client hands control of the image to the server
+ * there and then, for a post-copy migration, and turns the connection round.
+ * Once it has the reply, the client sends a hello and answers read requests
+ * for the blocks the server doesn't have yet. Only sent to servers whose
+ * hello has INIT_FLAG_POSTCOPY set. */
+#define REQUEST_POSTCOPY 0x0103
+
+/* flexnbd extension: the server doesn't reply until a migration has handed
+ * the image to another server, if one ever does. Then, just before it closes
+ * the connection, it replies with where the image has gone, as a struct
+ * nbd_redirect_raw following the reply. Replies to other requests may come
+ * first. from and len must be 0. Only sent to servers whose hello has
+ * INIT_FLAG_REDIRECT set. */
+#define REQUEST_REDIRECT 0x0104
+
+/* flexnbd extension: as a write, write zeroes or compressed write, but only
+ * filling in the blocks a post-copy migration hasn't brought over yet. Any
+ * the server has had since, from the client or from its own clients, are
+ * left alone. Only sent to a server that has taken a post-copy migration. */
+#define REQUEST_WRITE_FILL 0x0105
+#define REQUEST_WRITE_ZEROES_FILL 0x0106
+#define REQUEST_WRITE_LZ4_FILL 0x0107
 
 /* The top 2 bytes of the type field are overloaded and can contain flags */
 #define REQUEST_MASK 0x0000ffff
 
+/* Flags sent in the hello, telling the client what the server supports. The
+ * values are the transmission flags of the NBD protocol. */
+#define INIT_FLAG_HAS_FLAGS (1 << 0)
+#define INIT_FLAG_SEND_FLUSH (1 << 2)
+#define INIT_FLAG_SEND_WRITE_ZEROES (1 << 6)
+
+/* The bottom 16 bits are the protocol's. We use the ones above for our own
+ * extensions, which only flexnbd peers will know to look for. */
+#define INIT_FLAG_HASH (1 << 16)
+#define INIT_FLAG_LZ4 (1 << 17)
+#define INIT_FLAG_GENERATION (1 << 18)
+#define INIT_FLAG_POSTCOPY (1 << 19)
+#define INIT_FLAG_REDIRECT (1 << 20)
+
 
 /* 1MiB is the de-facto standard for maximum size of header + data */
 #define NBD_MAX_SIZE ( 1024 * 1024 )
@@ -33,12 +94,13 @@ struct nbd_init_raw {
 	char passwd[8];
 	__be64 magic;
 	__be64 size;
-	char reserved[128];
+	__be32 flags;
+	char reserved[124];
 };
 
 struct nbd_request_raw {
 	__be32 magic;
-	__be32 type;    /* == READ || == WRITE  */
+	__be32 type;    /* == READ || == WRITE || == WRITE_ZEROES */
 	char handle[8];
 	__be64 from;
 	__be32 len;
@@ -50,18 +112,24 @@ struct nbd_reply_raw {
 	char handle[8];         /* handle you got from request  */
 };
 
+struct nbd_redirect_raw {
+	char address[46];       /* NUL-terminated, as inet_ntop() gives it */
+	__be16 port;
+};
+
 
 
 struct nbd_init {
 	char passwd[8];
 	uint64_t magic;
 	uint64_t size;
-	char reserved[128];
+	uint32_t flags;
+	char reserved[124];
 };
 
 struct nbd_request {
 	uint32_t magic;
-	uint32_t type;    /* == READ || == WRITE || == DISCONNECT */
+	uint32_t type;    /* == READ || == WRITE || == DISCONNECT || == WRITE_ZEROES */
 	char handle[8];
 	uint64_t from;
 	uint32_t len;
@@ -41,7 +41,7 @@ int socket_connect(struct sockaddr* to, struct sockaddr* from)
 	return fd;
 }
 
-int nbd_check_hello( struct nbd_init_raw* init_raw, uint64_t* out_size )
+int nbd_check_hello( struct nbd_init_raw* init_raw, uint64_t* out_size, uint32_t* out_flags )
 {
 	if ( strncmp( init_raw->passwd, INIT_PASSWD, 8 ) != 0 ) {
 		warn( "wrong passwd" );
@@ -56,13 +56,21 @@ int nbd_check_hello( struct nbd_init_raw* init_raw, uint64_t* out_size )
 		*out_size = be64toh( init_raw->size );
 	}
 
+	/* Servers that don't know about flags send zeroes here */
+	if ( NULL != out_flags ) {
+		*out_flags = be32toh( init_raw->flags );
+		if ( !( *out_flags & INIT_FLAG_HAS_FLAGS ) ) {
+			*out_flags = 0;
+		}
+	}
+
 	return 1;
 fail:
 	return 0;
 
 }
 
-int socket_nbd_read_hello( int fd, uint64_t* out_size )
+int socket_nbd_read_hello( int fd, uint64_t* out_size, uint32_t* out_flags )
 {
 	struct nbd_init_raw init_raw;
 
@@ -72,7 +80,7 @@ int socket_nbd_read_hello( int fd, uint64_t* out_size )
 		return 0;
 	}
 
-	return nbd_check_hello( &init_raw, out_size );
+	return nbd_check_hello( &init_raw, out_size, out_flags );
 }
 
 void nbd_hello_to_buf( struct nbd_init_raw *buf, off64_t out_size )
@@ -82,6 +90,7 @@ void nbd_hello_to_buf( struct nbd_init_raw *buf, off64_t out_size )
 	memcpy( &init.passwd, INIT_PASSWD, 8 );
 	init.magic  = INIT_MAGIC;
 	init.size   = out_size;
+	init.flags  = 0;
 
 	memset( buf, 0, sizeof( struct nbd_init_raw ) ); // ensure reserved is 0s
 	nbd_h2r_init( &init, buf );
@@ -198,6 +207,89 @@ void socket_nbd_write(int fd, uint64_t from, uint32_t len, int in_fd, void* in_b
 	read_reply(fd, &request, &reply);
 }
 
+/* Give the server our generation ID, and return the one it had before */
+uint64_t socket_nbd_generation( int fd, uint64_t generation, int timeout_secs )
+{
+	struct nbd_request request;
+	struct nbd_reply   reply;
+	uint64_t generation_raw = htobe64( generation );
+	uint64_t previous_raw;
+
+	fill_request( &request, REQUEST_GENERATION, 0, sizeof( generation_raw ) );
+	ERROR_IF_NEGATIVE( writeloop( fd, &request, sizeof( request ) ),
+	  "Couldn't write request" );
+	ERROR_IF_NEGATIVE( writeloop( fd, &generation_raw, sizeof( generation_raw ) ),
+	  "Couldn't write generation" );
+
+	wait_for_data( fd, timeout_secs );
+	read_reply( fd, &request, &reply );
+
+	ERROR_IF_NEGATIVE( readloop( fd, &previous_raw, sizeof( previous_raw ) ),
+	  "Couldn't read generation" );
+
+	return be64toh( previous_raw );
+}
+
+
+/* Hand control of the image to the server, which will then expect a hello
+ * from us on this connection */
+void socket_nbd_postcopy( int fd, int timeout_secs )
+{
+	struct nbd_request request;
+	struct nbd_reply   reply;
+
+	fill_request( &request, REQUEST_POSTCOPY, 0, 0 );
+	ERROR_IF_NEGATIVE( writeloop( fd, &request, sizeof( request ) ),
+	  "Couldn't write request" );
+
+	wait_for_data( fd, timeout_secs );
+	read_reply( fd, &request, &reply );
+}
+
+
+/* Ask the server to make everything it has acknowledged durable. Unlike the
+ * others, this returns 1 on success and 0 on failure rather than error()ing,
+ * so it can be called from an event loop. */
+int socket_nbd_flush( int fd, int timeout_secs )
+{
+	struct nbd_request request;
+	struct nbd_reply_raw reply_raw;
+	struct nbd_reply reply;
+	fd_set fds;
+	struct timeval tv = { timeout_secs, 0 };
+
+	fill_request( &request, REQUEST_FLUSH, 0, 0 );
+	if ( 0 > writeloop( fd, &request, sizeof( request ) ) ) {
+		warn( SHOW_ERRNO( "Couldn't write flush request" ) );
+		return 0;
+	}
+
+	FD_ZERO( &fds );
+	FD_SET( fd, &fds );
+	if ( 1 != sock_try_select( FD_SETSIZE, &fds, NULL, NULL, &tv ) ) {
+		warn( "Timed out waiting for flush" );
+		return 0;
+	}
+
+	if ( 0 > readloop( fd, &reply_raw, sizeof( reply_raw ) ) ) {
+		warn( "Couldn't read reply to flush" );
+		return 0;
+	}
+	nbd_r2h_reply( &reply_raw, &reply );
+
+	if ( reply.magic != REPLY_MAGIC ||
+			0 != memcmp( request.handle, reply.handle, sizeof( reply.handle ) ) ) {
+		warn( "Bad reply to flush" );
+		return 0;
+	}
+	if ( reply.error != 0 ) {
+		warn( "Server replied to flush with error %d", reply.error );
+		return 0;
+	}
+
+	return 1;
+}
+
 
 int socket_nbd_disconnect( int fd )
 {
@@ -215,7 +307,7 @@ int socket_nbd_disconnect( int fd )
 
 #define CHECK_RANGE(error_type) { \
 	uint64_t size;\
-	int success = socket_nbd_read_hello(params->client, &size); \
+	int success = socket_nbd_read_hello(params->client, &size, NULL); \
 	if ( success ) {\
 		uint64_t endpoint = params->from + params->len; \
 		if (endpoint > size || \
@@ -9,6 +9,11 @@
 #include "sockutil.h"
 #include "util.h"
 
+/* compat with older libc headers */
+#ifndef TCP_USER_TIMEOUT
+#define TCP_USER_TIMEOUT 18
+#endif
+
 size_t sockaddr_size( const struct sockaddr* sa )
 {
 	struct sockaddr_un* un = (struct sockaddr_un*) sa;
@@ -79,6 +84,25 @@ int sock_set_tcp_cork( int fd, int optval )
 	return setsockopt( fd, IPPROTO_TCP, TCP_CORK, &optval, sizeof(optval) );
 }
 
+int sock_set_tcp_keepalive( int fd, int idle, int interval, int count )
+{
+	int on = 1;
+
+	if ( setsockopt( fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on) ) == -1 ||
+		setsockopt( fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle) ) == -1 ||
+		setsockopt( fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval) ) == -1 ||
+		setsockopt( fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count) ) == -1 ) {
+		return -1;
+	}
+
+	return 0;
+}
+
+int sock_set_tcp_user_timeout( int fd, unsigned int timeout_ms )
+{
+	return setsockopt( fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout_ms, sizeof(timeout_ms) );
+}
+
 int sock_set_nonblock( int fd, int optval )
 {
 	int flags = fcntl( fd, F_GETFL );
@@ -23,6 +23,14 @@ int sock_set_tcp_nodelay(int fd, int optval);
 /* Set the tcp_cork option */
 int sock_set_tcp_cork(int fd, int optval);
 
+/* Turn on TCP keepalives, sending the first after idle seconds of silence
+ * and giving up after count more, interval seconds apart, go unanswered */
+int sock_set_tcp_keepalive(int fd, int idle, int interval, int count);
+
+/* Set the tcp_user_timeout option: how long, in ms, sent data may go
+ * unacknowledged before the connection is dropped */
+int sock_set_tcp_user_timeout(int fd, unsigned int timeout_ms);
+
 int sock_set_nonblock(int fd, int optval);
 
 /* Attempt to bind the fd to the sockaddr, retrying common transient failures */
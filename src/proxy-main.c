@@ -15,11 +15,13 @@ static struct option proxy_options[] = {
 	GETOPT_CONNECT_PORT,
 	GETOPT_BIND,
 	GETOPT_CACHE,
+	GETOPT_WRITEBACK,
+	GETOPT_UNORDERED,
 	GETOPT_QUIET,
 	GETOPT_VERBOSE,
 	{0}
 };
-static char proxy_short_options[] = "hl:p:C:P:b:" SOPT_QUIET SOPT_VERBOSE;
+static char proxy_short_options[] = "hl:p:C:P:b:w:U" SOPT_QUIET SOPT_VERBOSE;
 static char proxy_help_text[] =
 	"Usage: flexnbd-proxy <options>\n\n"
 	"Resiliently proxy an NBD connection between client and server\n"
@@ -27,10 +29,12 @@ static char proxy_help_text[] =
 	HELP_LINE
 	"\t--" OPT_ADDR ",-l <ADDR>\tThe address we will bind to as a proxy.\n"
 	"\t--" OPT_PORT ",-p <PORT>\tThe port we will bind to as a proxy, if required.\n"
-	"\t--" OPT_CONNECT_ADDR ",-C <ADDR>\tAddress of the proxied server.\n"
-	"\t--" OPT_CONNECT_PORT ",-P <PORT>\tPort of the proxied server.\n"
+	"\t--" OPT_CONNECT_ADDR ",-C <ADDR>\tAddress of the proxied server, or a comma-separated list to try in turn.\n"
+	"\t--" OPT_CONNECT_PORT ",-P <PORT>\tPort of the proxied server, or a list to match the addresses.\n"
 	"\t--" OPT_BIND ",-b <ADDR>\tThe address we connect from, as a proxy.\n"
 	"\t--" OPT_CACHE ",-c[=<CACHE-BYTES>]\tUse a RAM read cache of the given size.\n"
+	"\t--" OPT_WRITEBACK ",-w <FILE>\tKeep writes in FILE until upstream has them.\n"
+	"\t--" OPT_UNORDERED ",-U\t\tWrite back from FILE in image order, not the order written.\n"
 	QUIET_LINE
 	VERBOSE_LINE;
 
@@ -43,7 +47,9 @@ void read_proxy_param(
 			char **upstream_addr,
 			char **upstream_port,
 			char **bind_addr,
-			char **cache_bytes)
+			char **cache_bytes,
+			char **writeback_file,
+			int  *writeback_unordered)
 {
 	switch( c ) {
 		case 'h' :
@@ -67,6 +73,12 @@ void read_proxy_param(
 		case 'c':
 			*cache_bytes = optarg ? optarg : proxy_default_cache_size;
 			break;
+		case 'w':
+			*writeback_file = optarg;
+			break;
+		case 'U':
+			*writeback_unordered = 1;
+			break;
 		case 'q':
 			log_level = QUIET_LOG_LEVEL;
 			break;
@@ -99,6 +111,8 @@ int main( int argc, char *argv[] )
 	char *upstream_port   = NULL;
 	char *bind_addr       = NULL;
 	char *cache_bytes     = NULL;
+	char *writeback_file  = NULL;
+	int writeback_unordered = 0;
 	int success;
 
 	sigset_t mask;
@@ -124,7 +138,9 @@ int main( int argc, char *argv[] )
 				&upstream_addr,
 				&upstream_port,
 				&bind_addr,
-				&cache_bytes
+				&cache_bytes,
+				&writeback_file,
+				&writeback_unordered
 		);
 	}
 
@@ -142,7 +158,9 @@ int main( int argc, char *argv[] )
 		upstream_addr,
 		upstream_port,
 		bind_addr,
-		cache_bytes
+		cache_bytes,
+		writeback_file,
+		writeback_unordered
 	);
 
 	/* Set these *after* proxy has been assigned to */
@@ -0,0 +1,446 @@
+#include "cache.h"
+#include "util.h"
+
+#include <string.h>
+
+#define CACHE_NIL -1
+
+static inline char* cache_data( struct cache *cache, int32_t i )
+{
+	return cache->slab + ( (uint64_t) i * CACHE_BLOCK_SIZE );
+}
+
+static inline int cache_entry_resident( struct cache *cache, int32_t i )
+{
+	int queue = cache->entries[i].queue;
+	return queue == CACHE_A1IN || queue == CACHE_AM;
+}
+
+static inline int32_t* cache_bucket( struct cache *cache, uint64_t block )
+{
+	return &cache->buckets[( block * 0x9e3779b97f4a7c15ULL >> 32 ) & cache->bucket_mask];
+}
+
+
+/* Take entry i off whichever queue it's on */
+static void cache_queue_remove( struct cache *cache, int32_t i )
+{
+	struct cache_entry *entry = &cache->entries[i];
+	struct cache_queue *queue = &cache->queues[entry->queue];
+
+	if ( entry->prev == CACHE_NIL ) {
+		queue->head = entry->next;
+	} else {
+		cache->entries[entry->prev].next = entry->next;
+	}
+
+	if ( entry->next == CACHE_NIL ) {
+		queue->tail = entry->prev;
+	} else {
+		cache->entries[entry->next].prev = entry->prev;
+	}
+
+	entry->prev = entry->next = CACHE_NIL;
+	queue->count--;
+}
+
+/* Put entry i at the head of a queue. Entries leave from the tail */
+static void cache_queue_push( struct cache *cache, int q, int32_t i )
+{
+	struct cache_entry *entry = &cache->entries[i];
+	struct cache_queue *queue = &cache->queues[q];
+
+	entry->queue = q;
+	entry->prev = CACHE_NIL;
+	entry->next = queue->head;
+
+	if ( queue->head == CACHE_NIL ) {
+		queue->tail = i;
+	} else {
+		cache->entries[queue->head].prev = i;
+	}
+
+	queue->head = i;
+	queue->count++;
+}
+
+
+static int32_t cache_find( struct cache *cache, uint64_t block )
+{
+	int32_t i = *cache_bucket( cache, block );
+
+	while ( i != CACHE_NIL && cache->entries[i].block != block ) {
+		i = cache->entries[i].hnext;
+	}
+
+	return i;
+}
+
+static void cache_hash_add( struct cache *cache, int32_t i )
+{
+	int32_t *bucket = cache_bucket( cache, cache->entries[i].block );
+
+	cache->entries[i].hnext = *bucket;
+	*bucket = i;
+}
+
+static void cache_hash_remove( struct cache *cache, int32_t i )
+{
+	int32_t *link = cache_bucket( cache, cache->entries[i].block );
+
+	while ( *link != i ) {
+		link = &cache->entries[*link].hnext;
+	}
+
+	*link = cache->entries[i].hnext;
+}
+
+
+struct cache* cache_create( uint64_t size_bytes )
+{
+	struct cache *cache = xmalloc( sizeof( struct cache ) );
+	uint64_t buckets = 1;
+	int32_t entries;
+
+	cache->blocks = ( size_bytes + CACHE_BLOCK_SIZE - 1 ) / CACHE_BLOCK_SIZE;
+	if ( cache->blocks < 1 ) {
+		cache->blocks = 1;
+	}
+	cache->size = (uint64_t) cache->blocks * CACHE_BLOCK_SIZE;
+
+	cache->max_a1in = cache->blocks / 4;
+	if ( cache->max_a1in < 1 ) {
+		cache->max_a1in = 1;
+	}
+	cache->max_a1out = cache->blocks / 2;
+	if ( cache->max_a1out < 1 ) {
+		cache->max_a1out = 1;
+	}
+
+	entries = cache->blocks + cache->max_a1out;
+	while ( buckets < (uint64_t) entries ) {
+		buckets <<= 1;
+	}
+
+	cache->slab = xmalloc( cache->size );
+	cache->entries = xmalloc( entries * sizeof( struct cache_entry ) );
+	cache->buckets = xmalloc( buckets * sizeof( int32_t ) );
+	cache->bucket_mask = buckets - 1;
+
+	cache_clear( cache );
+
+	return cache;
+}
+
+void cache_destroy( struct cache *cache )
+{
+	if ( cache ) {
+		free( cache->slab );
+		free( cache->entries );
+		free( cache->buckets );
+		free( cache );
+	}
+}
+
+uint64_t cache_size( struct cache *cache )
+{
+	if ( cache ) {
+		return cache->size;
+	} else {
+		return 0;
+	}
+}
+
+
+/* Find an entry to hold a new block, evicting one if we have to */
+static int32_t cache_reclaim( struct cache *cache )
+{
+	int32_t i, ghost;
+
+	if ( cache->queues[CACHE_FREE].count > 0 ) {
+		i = cache->queues[CACHE_FREE].tail;
+		cache_queue_remove( cache, i );
+		return i;
+	}
+
+	if ( cache->queues[CACHE_A1IN].count > cache->max_a1in ||
+			cache->queues[CACHE_AM].count == 0 ) {
+		i = cache->queues[CACHE_A1IN].tail;
+
+		/* Remember the block on A1out, forgetting the oldest one there if
+		 * it's full */
+		ghost = cache->queues[CACHE_GHOST_FREE].tail;
+		if ( ghost == CACHE_NIL ) {
+			ghost = cache->queues[CACHE_A1OUT].tail;
+			cache_hash_remove( cache, ghost );
+		}
+		cache_queue_remove( cache, ghost );
+
+		cache->entries[ghost].block = cache->entries[i].block;
+		cache_queue_push( cache, CACHE_A1OUT, ghost );
+		cache_hash_add( cache, ghost );
+	} else {
+		i = cache->queues[CACHE_AM].tail;
+	}
+
+	cache_queue_remove( cache, i );
+	cache_hash_remove( cache, i );
+
+	return i;
+}
+
+/* Store a whole block, or replace what we have for it */
+static void cache_add( struct cache *cache, uint64_t block, char *buf )
+{
+	int32_t i = cache_find( cache, block );
+	int queue = CACHE_A1IN;
+
+	if ( i != CACHE_NIL ) {
+		if ( cache_entry_resident( cache, i ) ) {
+			memcpy( cache_data( cache, i ), buf, CACHE_BLOCK_SIZE );
+			return;
+		}
+
+		/* We threw it out of A1in not long ago, so it's worth keeping */
+		cache_queue_remove( cache, i );
+		cache_hash_remove( cache, i );
+		cache_queue_push( cache, CACHE_GHOST_FREE, i );
+		queue = CACHE_AM;
+	}
+
+	i = cache_reclaim( cache );
+	cache->entries[i].block = block;
+	memcpy( cache_data( cache, i ), buf, CACHE_BLOCK_SIZE );
+	cache_queue_push( cache, queue, i );
+	cache_hash_add( cache, i );
+}
+
+static void cache_drop( struct cache *cache, int32_t i )
+{
+	cache_queue_remove( cache, i );
+	cache_hash_remove( cache, i );
+	cache_queue_push( cache, CACHE_FREE, i );
+}
+
+
+/* True if every block of the range is cached */
+int cache_contains( struct cache *cache, uint64_t from, uint32_t len )
+{
+	NULLCHECK( cache );
+	uint64_t block, last;
+	int32_t i;
+
+	if ( len == 0 ) {
+		return 0;
+	}
+
+	last = ( from + len - 1 ) / CACHE_BLOCK_SIZE;
+
+	for ( block = from / CACHE_BLOCK_SIZE; block <= last; block++ ) {
+		i = cache_find( cache, block );
+		if ( i == CACHE_NIL || !cache_entry_resident( cache, i ) ) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* If every block of the range is cached, copy it into buf and return 1.
+ * Otherwise, return 0 and leave buf alone */
+int cache_read( struct cache *cache, uint64_t from, uint32_t len, char *buf )
+{
+	NULLCHECK( cache );
+	uint64_t block, last;
+	int32_t i;
+
+	if ( !cache_contains( cache, from, len ) ) {
+		cache->misses++;
+		return 0;
+	}
+
+	last = ( from + len - 1 ) / CACHE_BLOCK_SIZE;
+
+	for ( block = from / CACHE_BLOCK_SIZE; block <= last; block++ ) {
+		uint64_t start = block * CACHE_BLOCK_SIZE;
+		uint64_t copy_from = start > from ? start : from;
+		uint64_t copy_to = start + CACHE_BLOCK_SIZE;
+
+		if ( copy_to > from + len ) {
+			copy_to = from + len;
+		}
+
+		i = cache_find( cache, block );
+		memcpy(
+			buf + ( copy_from - from ),
+			cache_data( cache, i ) + ( copy_from - start ),
+			copy_to - copy_from
+		);
+
+		/* Blocks on A1in stay where they are, so a burst of reads of one
+		 * block doesn't make it look popular */
+		if ( cache->entries[i].queue == CACHE_AM ) {
+			cache_queue_remove( cache, i );
+			cache_queue_push( cache, CACHE_AM, i );
+		}
+	}
+
+	cache->hits++;
+	return 1;
+}
+
+
+/* Pass this to cache_insert() along with data read from upstream, having
+ * taken it when the read was sent. */
+uint64_t cache_epoch( struct cache *cache )
+{
+	NULLCHECK( cache );
+	return cache->epoch;
+}
+
+static void cache_log_write( struct cache *cache, uint64_t from, uint32_t len )
+{
+	struct cache_write *write;
+
+	cache->epoch++;
+	write = &cache->writes[cache->epoch % CACHE_WRITE_LOG_SIZE];
+	write->epoch = cache->epoch;
+	write->from = from;
+	write->len = len;
+}
+
+/* True if anything since epoch might have changed the given block */
+static int cache_written_since( struct cache *cache, uint64_t epoch, uint64_t block )
+{
+	uint64_t start = block * CACHE_BLOCK_SIZE;
+	uint64_t end = start + CACHE_BLOCK_SIZE;
+	uint64_t e;
+
+	if ( epoch < cache->cleared_epoch ||
+			cache->epoch - epoch > CACHE_WRITE_LOG_SIZE ) {
+		return 1;
+	}
+
+	for ( e = epoch + 1; e <= cache->epoch; e++ ) {
+		struct cache_write *write = &cache->writes[e % CACHE_WRITE_LOG_SIZE];
+
+		if ( write->from < end && start < write->from + write->len ) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Cache every whole block in data read from upstream, apart from any that
+ * have been written to since the read was sent. */
+void cache_insert( struct cache *cache, uint64_t epoch, uint64_t from, uint32_t len, char *buf )
+{
+	NULLCHECK( cache );
+	uint64_t block = ( from + CACHE_BLOCK_SIZE - 1 ) / CACHE_BLOCK_SIZE;
+	uint64_t end = ( from + len ) / CACHE_BLOCK_SIZE;
+
+	for ( ; block < end; block++ ) {
+		if ( !cache_written_since( cache, epoch, block ) ) {
+			cache_add( cache, block, buf + ( block * CACHE_BLOCK_SIZE - from ) );
+		}
+	}
+}
+
+
+/* Apply a write to whichever cached blocks it touches */
+void cache_write( struct cache *cache, uint64_t from, uint32_t len, char *buf )
+{
+	NULLCHECK( cache );
+	uint64_t block, first, last;
+	int32_t i;
+
+	cache_log_write( cache, from, len );
+
+	if ( len == 0 ) {
+		return;
+	}
+
+	first = from / CACHE_BLOCK_SIZE;
+	last = ( from + len - 1 ) / CACHE_BLOCK_SIZE;
+
+	for ( block = first; block <= last; block++ ) {
+		uint64_t start = block * CACHE_BLOCK_SIZE;
+		uint64_t copy_from = start > from ? start : from;
+		uint64_t copy_to = start + CACHE_BLOCK_SIZE;
+
+		i = cache_find( cache, block );
+		if ( i == CACHE_NIL || !cache_entry_resident( cache, i ) ) {
+			continue;
+		}
+
+		if ( copy_to > from + len ) {
+			copy_to = from + len;
+		}
+
+		memcpy(
+			cache_data( cache, i ) + ( copy_from - start ),
+			buf + ( copy_from - from ),
+			copy_to - copy_from
+		);
+	}
+}
+
+/* Forget whichever cached blocks the range touches */
+void cache_invalidate( struct cache *cache, uint64_t from, uint32_t len )
+{
+	NULLCHECK( cache );
+	uint64_t block, first, last;
+	int32_t i;
+
+	cache_log_write( cache, from, len );
+
+	if ( len == 0 ) {
+		return;
+	}
+
+	first = from / CACHE_BLOCK_SIZE;
+	last = ( from + len - 1 ) / CACHE_BLOCK_SIZE;
+
+	/* Big ranges are quicker to check the other way round */
+	if ( last - first >= (uint64_t) cache->blocks ) {
+		for ( i = 0; i < cache->blocks; i++ ) {
+			block = cache->entries[i].block;
+			if ( cache_entry_resident( cache, i ) && block >= first && block <= last ) {
+				cache_drop( cache, i );
+			}
+		}
+		return;
+	}
+
+	for ( block = first; block <= last; block++ ) {
+		i = cache_find( cache, block );
+		if ( i != CACHE_NIL && cache_entry_resident( cache, i ) ) {
+			cache_drop( cache, i );
+		}
+	}
+}
+
+/* Forget everything. Reads in flight at the time won't be cached either */
+void cache_clear( struct cache *cache )
+{
+	NULLCHECK( cache );
+	int32_t i;
+
+	cache->epoch++;
+	cache->cleared_epoch = cache->epoch;
+
+	for ( i = 0; i < CACHE_QUEUES; i++ ) {
+		cache->queues[i].head = cache->queues[i].tail = CACHE_NIL;
+		cache->queues[i].count = 0;
+	}
+
+	for ( i = 0; (uint64_t) i <= cache->bucket_mask; i++ ) {
+		cache->buckets[i] = CACHE_NIL;
+	}
+
+	for ( i = 0; i < cache->blocks + cache->max_a1out; i++ ) {
+		cache_queue_push( cache, i < cache->blocks ? CACHE_FREE : CACHE_GHOST_FREE, i );
+	}
+}
+
@@ -0,0 +1,93 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* The cache holds whole, aligned blocks of this many bytes */
+#define CACHE_BLOCK_SIZE 4096
+
+/* How many writes we remember, so a read that was in flight when they
+ * arrived knows which of its blocks not to cache */
+#define CACHE_WRITE_LOG_SIZE 64
+
+/* Where a block is. Blocks are evicted 2Q-style: a block read for the first
+ * time goes on A1in, and is evicted from there first in, first out. We keep
+ * its number for a while on A1out, and if it's read again before it drops
+ * off there, it goes on Am, which is evicted least recently used first. So
+ * one pass over lots of data can't push out the blocks that are read over
+ * and over again. */
+enum {
+	CACHE_FREE = 0,
+	CACHE_A1IN,
+	CACHE_AM,
+	CACHE_A1OUT,
+	CACHE_GHOST_FREE,
+	CACHE_QUEUES
+};
+
+struct cache_entry {
+	uint64_t block;
+	int32_t  prev;
+	int32_t  next;
+	/* Next entry in the same hash bucket */
+	int32_t  hnext;
+	int32_t  queue;
+};
+
+struct cache_queue {
+	int32_t head;
+	int32_t tail;
+	int32_t count;
+};
+
+struct cache_write {
+	uint64_t epoch;
+	uint64_t from;
+	uint32_t len;
+};
+
+struct cache {
+	/* The total size of the buffer, in bytes, and how many blocks that is */
+	uint64_t size;
+	int32_t  blocks;
+
+	/* Entry i's data is at slab + ( i * CACHE_BLOCK_SIZE ), for the first
+	 * 'blocks' entries. The rest only remember block numbers, for A1out */
+	char *slab;
+	struct cache_entry *entries;
+	struct cache_queue queues[CACHE_QUEUES];
+
+	/* How many blocks A1in and A1out may hold before we evict from them */
+	int32_t max_a1in;
+	int32_t max_a1out;
+
+	/* Block number -> entry, chained through cache_entry.hnext */
+	int32_t *buckets;
+	uint64_t bucket_mask;
+
+	/* Bumped by every write or invalidation, the most recent of which are in
+	 * writes[ epoch % CACHE_WRITE_LOG_SIZE ]. Nothing from before
+	 * cleared_epoch can be cached. */
+	uint64_t epoch;
+	uint64_t cleared_epoch;
+	struct cache_write writes[CACHE_WRITE_LOG_SIZE];
+
+	uint64_t hits;
+	uint64_t misses;
+};
+
+struct cache* cache_create( uint64_t size_bytes );
+void cache_destroy( struct cache *cache );
+uint64_t cache_size( struct cache *cache );
+
+int cache_contains( struct cache *cache, uint64_t from, uint32_t len );
+int cache_read( struct cache *cache, uint64_t from, uint32_t len, char *buf );
+uint64_t cache_epoch( struct cache *cache );
+void cache_insert( struct cache *cache, uint64_t epoch, uint64_t from, uint32_t len, char *buf );
+void cache_write( struct cache *cache, uint64_t from, uint32_t len, char *buf );
+void cache_invalidate( struct cache *cache, uint64_t from, uint32_t len );
+void cache_clear( struct cache *cache );
+
+#endif
+
@@ -1,7 +1,9 @@
 #include "proxy.h"
 #include "readwrite.h"
 
-#include "prefetch.h"
+#include "cache.h"
+#include "readahead.h"
+#include "writeback.h"
 
 
 #include "ioutil.h"
@@ -9,19 +11,42 @@
 #include "util.h"
 
 #include <errno.h>
+#include <fcntl.h>
 
 #include <sys/socket.h>
 #include <netinet/tcp.h>
 
+/* compat with older libev */
+#ifndef EVBREAK_ONE
+#define ev_run( loop, flags ) ev_loop( loop, flags )
+#endif
+
+typedef enum {
+	UPSTREAM_DISCONNECTED,
+	UPSTREAM_CONNECTING,
+	UPSTREAM_READ_INIT,
+	UPSTREAM_CONNECTED
+} proxy_upstream_states;
+
+static char* proxy_upstream_state_names[] = {
+  "UPSTREAM_DISCONNECTED",
+  "UPSTREAM_CONNECTING",
+  "UPSTREAM_READ_INIT",
+  "UPSTREAM_CONNECTED"
+};
+
 struct proxier* proxy_create(
 	char* s_downstream_address,
 	char* s_downstream_port,
 	char* s_upstream_address,
 	char* s_upstream_port,
 	char* s_upstream_bind,
-	char* s_cache_bytes )
+	char* s_cache_bytes,
+	char* s_writeback_file,
+	int writeback_unordered )
 {
 	struct proxier* out;
+	char *addr, *port, *next;
 	out = xmalloc( sizeof( struct proxier ) );
 
 	FATAL_IF_NULL(s_downstream_address, "Listen address not specified");
@@ -40,16 +65,39 @@ struct proxier* proxy_create(
 
 	FATAL_IF_NULL(s_upstream_address, "Upstream address not specified");
 	NULLCHECK( s_upstream_address );
-
-	FATAL_UNLESS(
-		parse_ip_to_sockaddr( &out->connect_to.generic, s_upstream_address ),
-		"Couldn't parse upstream address '%s'",
-		s_upstream_address
-	);
-
 	FATAL_IF_NULL( s_upstream_port, "Upstream port not specified" );
 	NULLCHECK( s_upstream_port );
-	parse_port( s_upstream_port, &out->connect_to.v4 );
+
+	/* As with a mirror's destinations, upstream may be a comma-separated
+	 * list of addresses, with a port for each or one for all of them. We
+	 * connect to the first we can */
+	addr = s_upstream_address;
+	port = s_upstream_port;
+	while ( addr != NULL ) {
+		union mysockaddr *to;
+
+		FATAL_IF( out->addresses == PROXY_ADDRESSES_MAX,
+				"More than %d upstream addresses", PROXY_ADDRESSES_MAX );
+		to = &out->connect_to[out->addresses];
+
+		if ( ( next = strchr( addr, ',' ) ) != NULL ) { *next++ = '\0'; }
+		FATAL_UNLESS(
+			parse_ip_to_sockaddr( &to->generic, addr ),
+			"Couldn't parse upstream address '%s'",
+			addr
+		);
+		addr = next;
+
+		if ( port != NULL ) {
+			if ( ( next = strchr( port, ',' ) ) != NULL ) { *next++ = '\0'; }
+			parse_port( port, &to->v4 );
+			port = next;
+		} else {
+			to->v4.sin_port = out->connect_to[out->addresses - 1].v4.sin_port;
+		}
+		out->addresses++;
+	}
+	FATAL_IF( port != NULL, "More upstream ports than addresses" );
 
 	if ( s_upstream_bind ) {
 		FATAL_IF_ZERO(
@@ -61,49 +109,61 @@ struct proxier* proxy_create(
 	}
 
 	out->listen_fd = -1;
-	out->downstream_fd = -1;
 	out->upstream_fd = -1;
+	out->ev_loop = EV_DEFAULT;
+
+	out->connections = PROXY_CONNECTIONS;
+	char * env_connections = getenv( "FLEXNBD_PROXY_CONNECTIONS" );
+	if ( NULL != env_connections ) {
+		int connections = atoi( env_connections );
+		if ( connections > 0 && connections <= PROXY_CONNECTIONS_MAX ) {
+			out->connections = connections;
+		} else {
+			warn( "Ignoring FLEXNBD_PROXY_CONNECTIONS=%s, must be 1-%d",
+					env_connections, PROXY_CONNECTIONS_MAX );
+		}
+	}
 
-	out->prefetch = NULL;
+	out->cache = NULL;
 	if ( s_cache_bytes ){
-		int cache_bytes = atoi( s_cache_bytes );
+		long long cache_bytes = atoll( s_cache_bytes );
 		/* leaving this off or setting a cache size of zero or
 		 * less results in no cache.
 		 */
-		if ( cache_bytes >= 0 ) {
-			out->prefetch = prefetch_create( cache_bytes );
+		if ( cache_bytes > 0 ) {
+			out->cache = cache_create( cache_bytes );
+			info( "Caching up to %"PRIu64" bytes", cache_size( out->cache ) );
+
+			/* Blocks we read ahead go on A1in, so there's no point reading
+			 * further ahead than that can hold */
+			uint64_t max_window = CACHE_BLOCK_SIZE * (uint64_t) out->cache->max_a1in;
+			out->readahead_window =
+				max_window < READAHEAD_MAX_WINDOW ? max_window : READAHEAD_MAX_WINDOW;
 		}
 	}
 
-	out->init.buf = xmalloc( sizeof( struct nbd_init_raw ) );
-	out->req.buf  = xmalloc( NBD_MAX_SIZE );
-	out->rsp.buf  = xmalloc( NBD_MAX_SIZE );
+	/* We can't open it until we know how big the image is */
+	out->writeback_file = s_writeback_file;
+	out->writeback_unordered = writeback_unordered;
 
 	return out;
 }
 
-int proxy_prefetches( struct proxier* proxy ) {
-	NULLCHECK( proxy );
-	return proxy->prefetch != NULL;
-}
-
-int proxy_prefetch_bufsize( struct proxier* proxy ){
+int proxy_caches( struct proxier* proxy ) {
 	NULLCHECK( proxy );
-	return prefetch_size( proxy->prefetch );
+	return proxy->cache != NULL;
 }
 
 void proxy_destroy( struct proxier* proxy )
 {
-	free( proxy->init.buf );
-	free( proxy->req.buf );
-	free( proxy->rsp.buf );
-	prefetch_destroy( proxy->prefetch );
+	cache_destroy( proxy->cache );
+	writeback_close( proxy->writeback );
 
 	free( proxy );
 }
 
 /* Shared between our two different connect_to_upstream paths */
-void proxy_finish_connect_to_upstream( struct proxier *proxy, uint64_t size );
+void proxy_finish_connect_to_upstream( struct proxier *proxy, int fd, uint64_t size );
 
 /* Try to establish a connection to our upstream server. Return 1 on success,
  * 0 on failure. this is a blocking call that returns a non-blocking socket.
@@ -115,24 +175,34 @@ int proxy_connect_to_upstream( struct proxier* proxy )
 		connect_from = &proxy->connect_from.generic;
 	}
 
-	int fd = socket_connect( &proxy->connect_to.generic, connect_from );
 	uint64_t size = 0;
+	uint32_t flags = 0;
+	int fd = -1;
+	int i;
 
-	if ( -1 == fd ) {
-		return 0;
+	for ( i = 0; i < proxy->addresses && fd == -1; i++ ) {
+		fd = socket_connect( &proxy->connect_to[i].generic, connect_from );
+
+		if ( -1 != fd && !socket_nbd_read_hello( fd, &size, &flags ) ) {
+			WARN_IF_NEGATIVE(
+				sock_try_close( fd ),
+				"Couldn't close() after failed read of NBD hello on fd %i", fd
+			);
+			fd = -1;
+		}
 	}
 
-	if( !socket_nbd_read_hello( fd, &size ) ) {
-		WARN_IF_NEGATIVE(
-			sock_try_close( fd ),
-			"Couldn't close() after failed read of NBD hello on fd %i", fd
-		);
+	if ( -1 == fd ) {
 		return 0;
 	}
 
+	proxy->address = i - 1;
 	proxy->upstream_fd = fd;
+	proxy->upstream_address = proxy->address;
+	proxy->upstream_redirect =
+		flags & INIT_FLAG_REDIRECT ? PROXY_REDIRECT_UNSENT : PROXY_REDIRECT_NONE;
 	sock_set_nonblock( fd, 1 );
-	proxy_finish_connect_to_upstream( proxy, size );
+	proxy_finish_connect_to_upstream( proxy, fd, size );
 
 	return 1;
 }
@@ -140,14 +210,16 @@ int proxy_connect_to_upstream( struct proxier* proxy )
 /* First half of non-blocking connection to upstream. Gets as far as calling
  * connect() on a non-blocking socket.
  */
-void proxy_start_connect_to_upstream( struct proxier* proxy )
+void proxy_start_connect_to_upstream( struct proxy_upstream* up )
 {
 	int fd, result;
 	struct sockaddr* from = NULL;
-	struct sockaddr* to = &proxy->connect_to.generic;
+	struct proxier* proxy = up->session->proxy;
+	struct sockaddr* to = &proxy->connect_to[proxy->address].generic;
 
-	if ( proxy->bind ) {
-		from = &proxy->connect_from.generic;
+	up->address = proxy->address;
+	if ( up->session->proxy->bind ) {
+		from = &up->session->proxy->connect_from.generic;
 	}
 
 	fd = socket( to->sa_family , SOCK_STREAM, 0 );
@@ -157,7 +229,8 @@ void proxy_start_connect_to_upstream( struct proxier* proxy )
 		return;
 	}
 
-	info( "Beginning non-blocking connection to upstream on fd %i", fd );
+	info( "Beginning non-blocking connection to upstream address %d on fd %i",
+			up->address, fd );
 
 	if ( NULL != from ) {
 		if ( 0 > bind( fd, from, sockaddr_size( from ) ) ) {
@@ -177,7 +250,7 @@ void proxy_start_connect_to_upstream( struct proxier* proxy )
 		goto error;
 	}
 
-	proxy->upstream_fd = fd;
+	up->fd = fd;
 	return;
 
 error:
@@ -188,7 +261,29 @@ error:
 	return;
 }
 
-void proxy_finish_connect_to_upstream( struct proxier *proxy, uint64_t size ) {
+/* Set up a new connection to upstream so we notice quickly if it goes away */
+void proxy_set_upstream_sockopts( struct proxier *proxy, int address, int fd )
+{
+	if ( AF_UNIX == proxy->connect_to[address].family ) {
+		return;
+	}
+
+	if ( sock_set_tcp_nodelay( fd, 1 ) == -1 ) {
+		warn( SHOW_ERRNO( "Failed to set TCP_NODELAY" ) );
+	}
+
+	if ( sock_set_tcp_keepalive(
+			fd, UPSTREAM_KEEPALIVE_IDLE, UPSTREAM_KEEPALIVE_INTERVAL,
+			UPSTREAM_KEEPALIVE_COUNT ) == -1 ) {
+		warn( SHOW_ERRNO( "Failed to set TCP keepalive" ) );
+	}
+
+	if ( sock_set_tcp_user_timeout( fd, UPSTREAM_USER_TIMEOUT ) == -1 ) {
+		warn( SHOW_ERRNO( "Failed to set TCP_USER_TIMEOUT" ) );
+	}
+}
+
+void proxy_finish_connect_to_upstream( struct proxier *proxy, int fd, uint64_t size ) {
 
 	if ( proxy->upstream_size == 0 ) {
 		info( "Size of upstream image is %"PRIu64" bytes", size );
@@ -200,30 +295,28 @@ void proxy_finish_connect_to_upstream( struct proxier *proxy, uint64_t size ) {
 	}
 
 	proxy->upstream_size = size;
+	proxy_set_upstream_sockopts( proxy, proxy->upstream_address, fd );
 
-	if ( AF_UNIX != proxy->connect_to.family ) {
-		if ( sock_set_tcp_nodelay( proxy->upstream_fd, 1 ) == -1 ) {
-			warn( SHOW_ERRNO( "Failed to set TCP_NODELAY" ) );
-		}
-	}
-
-	info( "Connected to upstream on fd %i", proxy->upstream_fd );
+	info( "Connected to upstream on fd %i", fd );
 
 	return;
 }
 
-void proxy_disconnect_from_upstream( struct proxier* proxy )
+void proxy_disconnect_from_upstream( struct proxy_upstream* up )
 {
-	if ( -1 != proxy->upstream_fd ) {
-		info("Closing upstream connection on fd %i", proxy->upstream_fd );
+	if ( -1 != up->fd ) {
+		info("Closing upstream connection on fd %i", up->fd );
+
+		/* libev mustn't be watching an fd when it's closed */
+		ev_io_stop( up->session->proxy->ev_loop, &up->watcher );
 
 		/* TODO: An NBD disconnect would be pleasant here */
 		WARN_IF_NEGATIVE(
-			sock_try_close( proxy->upstream_fd ),
+			sock_try_close( up->fd ),
 			"Failed to close() fd %i when disconnecting from upstream",
-			proxy->upstream_fd
+			up->fd
 		);
-		proxy->upstream_fd = -1;
+		up->fd = -1;
 	}
 }
 
@@ -256,9 +349,8 @@ void proxy_open_listen_socket(struct proxier* params)
 		SHOW_ERRNO( "Failed to bind to listening socket" )
 	);
 
-	/* We're only serving one client at a time, hence backlog of 1 */
 	FATAL_IF_NEGATIVE(
-		listen(params->listen_fd, 1),
+		listen(params->listen_fd, SOMAXCONN),
 		SHOW_ERRNO( "Failed to listen on listening socket" )
 	);
 
@@ -267,652 +359,2146 @@ void proxy_open_listen_socket(struct proxier* params)
 	return;
 }
 
-typedef enum {
-	EXIT,
-	WRITE_TO_DOWNSTREAM,
-	READ_FROM_DOWNSTREAM,
-	CONNECT_TO_UPSTREAM,
-	READ_INIT_FROM_UPSTREAM,
-	WRITE_TO_UPSTREAM,
-	READ_FROM_UPSTREAM
-} proxy_session_states;
-
-static char* proxy_session_state_names[] = {
-  "EXIT",
-  "WRITE_TO_DOWNSTREAM",
-  "READ_FROM_DOWNSTREAM",
-  "CONNECT_TO_UPSTREAM",
-  "READ_INIT_FROM_UPSTREAM",
-  "WRITE_TO_UPSTREAM",
-  "READ_FROM_UPSTREAM"
-};
-
-static inline int proxy_state_upstream( int state )
+static inline void proxy_set_upstream_state( struct proxy_upstream* up, int state )
 {
-	return state == CONNECT_TO_UPSTREAM || state == READ_INIT_FROM_UPSTREAM ||
-	       state == WRITE_TO_UPSTREAM   || state == READ_FROM_UPSTREAM;
+	if ( state != up->state ) {
+		debug(
+			"Upstream %d state transition from %s to %s",
+			up->index,
+			proxy_upstream_state_names[up->state],
+			proxy_upstream_state_names[state]
+		);
+	}
+
+	up->state = state;
+	up->state_started = monotonic_time_ms();
 }
 
-int proxy_prefetch_for_request( struct proxier* proxy, int state )
+/* Find a free entry in the handle table. The caller makes sure there is one */
+static struct proxy_request* proxy_request_alloc( struct proxy_session* session )
 {
-	NULLCHECK( proxy );
-	struct nbd_request* req = &proxy->req_hdr;
-	struct nbd_reply* rsp = &proxy->rsp_hdr;
-
-	struct nbd_request_raw* req_raw = (struct nbd_request_raw*) proxy->req.buf;
-	struct nbd_reply_raw *rsp_raw = (struct nbd_reply_raw*) proxy->rsp.buf;
-
-	int is_read = ( req->type & REQUEST_MASK ) == REQUEST_READ;
-
-	if ( is_read ) {
-		/* See if we can respond with what's in our prefetch
-		 * cache */
-		if ( prefetch_is_full( proxy->prefetch ) &&
-			prefetch_contains( proxy->prefetch, req->from, req->len ) ) {
-			/* HUZZAH!  A match! */
-			debug( "Prefetch hit!" );
-
-			/* First build a reply header */
-			rsp->magic = REPLY_MAGIC;
-			rsp->error = 0;
-			memcpy( &rsp->handle, &req->handle, 8 );
-
-			/* now copy it into the response */
-			nbd_h2r_reply( rsp, rsp_raw );
-
-			/* and the data */
-			memcpy(
-				proxy->rsp.buf + NBD_REPLY_SIZE,
-				prefetch_offset( proxy->prefetch, req->from ),
-				req->len
-			);
+	int i;
 
-			proxy->rsp.size = NBD_REPLY_SIZE + req->len;
-			proxy->rsp.needle = 0;
+	for ( i = 0; i < PROXY_MAX_INFLIGHT; i++ ) {
+		struct proxy_request* r = &session->inflight[i];
 
-			/* return early, our work here is done */
-			return WRITE_TO_DOWNSTREAM;
+		if ( r->state == PROXY_REQUEST_FREE ) {
+			memset( r, 0, sizeof( struct proxy_request ) );
+			r->seq = session->next_seq++;
+			r->upstream = -1;
+			session->inflight_count++;
+			return r;
 		}
 	}
-	else {
-		/* Safety catch.  If we're sending a write request, we
-		 * blow away the cache.  This is very pessimistic, but
-		 * it's simpler (and therefore safer) than working out
-		 * whether we can keep it or not.
-		 */
-		debug( "Blowing away prefetch cache on type %d request.", req->type );
-		prefetch_set_is_empty( proxy->prefetch );
-	}
 
-	debug( "Prefetch cache MISS!");
-
-	uint64_t prefetch_start = req->from;
-	/* We prefetch what we expect to be the next request. */
-	uint64_t prefetch_end = req->from + ( req->len * 2 );
-
-	/* We only want to consider prefetching if we know we're not
-	 * getting too much data back, if it's a read request, and if
-	 * the prefetch won't try to read past the end of the file.
-	 */
-	int prefetching = 
-		req->len <= prefetch_size( proxy->prefetch ) && 
-		is_read &&
-		prefetch_start < prefetch_end && 
-		prefetch_end <= proxy->upstream_size; 
-
-	/* We pull the request out of the proxy struct, rewrite the
-	 * request size, and write it back.
-	 */
-	if ( prefetching ) {
-		proxy->is_prefetch_req = 1;
-		proxy->prefetch_req_orig_len = req->len;
+	fatal( "No room in the handle table" );
+	return NULL;
+}
 
-		req->len *= 2;
+static void proxy_written_back( struct proxy_session* session, struct proxy_request* r );
 
-		debug( "Prefetching additional %"PRIu32" bytes", 
-				req->len - proxy->prefetch_req_orig_len );
-		nbd_h2r_request( req, req_raw );
+static void proxy_request_free( struct proxy_session* session, struct proxy_request* r )
+{
+	if ( r->is_readahead ) {
+		session->readahead_count--;
+	}
+	if ( r->is_writeback ) {
+		session->writeback_count--;
+		proxy_written_back( session, r );
 	}
 
-	return state;
+	free( r->req.buf );
+	free( r->rsp.buf );
+	memset( r, 0, sizeof( struct proxy_request ) );
+	session->inflight_count--;
 }
 
-int proxy_prefetch_for_reply( struct proxier* proxy, int state )
+/* The entry in the given state that arrived from downstream first, if any.
+ * If handle isn't NULL, only entries with that handle are considered. A
+ * client that reuses handles before we've replied to them still gets its
+ * replies in order, so long as upstream sends them in order. */
+static struct proxy_request* proxy_request_oldest(
+	struct proxy_session* session,
+	int state,
+	char* handle )
 {
-	size_t prefetched_bytes;
-
-	if ( !proxy->is_prefetch_req ) {
-		return state;
-	}
+	struct proxy_request* found = NULL;
+	int i;
 
-	prefetched_bytes = proxy->req_hdr.len - proxy->prefetch_req_orig_len;
+	for ( i = 0; i < PROXY_MAX_INFLIGHT; i++ ) {
+		struct proxy_request* r = &session->inflight[i];
 
-	debug( "Prefetched additional %d bytes", prefetched_bytes );
-	memcpy(
-		proxy->prefetch->buffer,
-		proxy->rsp.buf + proxy->prefetch_req_orig_len + NBD_REPLY_SIZE,
-		prefetched_bytes
-	);
+		if ( r->state != state ) {
+			continue;
+		}
+		if ( handle != NULL && memcmp( r->hdr.handle, handle, 8 ) != 0 ) {
+			continue;
+		}
+		if ( found == NULL || r->seq < found->seq ) {
+			found = r;
+		}
+	}
 
-	proxy->prefetch->from = proxy->req_hdr.from + proxy->prefetch_req_orig_len;
-	proxy->prefetch->len = prefetched_bytes;
+	return found;
+}
 
-	/* We've finished with proxy->req by now, so don't need to alter it to make
-	 * it look like the request was before prefetch */
+/* The request sent on this connection that a reply with this handle is for,
+ * if any. As above, the oldest goes first if a handle's been reused */
+static struct proxy_request* proxy_request_sent_on( struct proxy_upstream* up, char* handle )
+{
+	struct proxy_request* found = NULL;
+	int i;
 
-	/* Truncate the bytes we'll write downstream */
-	proxy->req_hdr.len = proxy->prefetch_req_orig_len;
-	proxy->rsp.size -= prefetched_bytes;
+	for ( i = 0; i < PROXY_MAX_INFLIGHT; i++ ) {
+		struct proxy_request* r = &up->session->inflight[i];
 
-	/* And we need to reset these */
-	prefetch_set_is_full( proxy->prefetch );
-	proxy->is_prefetch_req = 0;
+		if ( r->state != PROXY_REQUEST_SENT || r->upstream != up->index ) {
+			continue;
+		}
+		if ( memcmp( r->hdr.handle, handle, 8 ) != 0 ) {
+			continue;
+		}
+		if ( found == NULL || r->seq < found->seq ) {
+			found = r;
+		}
+	}
 
-	return state;
+	return found;
 }
 
-
-
-int proxy_read_from_downstream( struct proxier *proxy, int state )
+/* True if we made this entry up ourselves, rather than downstream asking */
+static inline int proxy_request_ours( struct proxy_request* r )
 {
-	ssize_t count;
-
-	struct nbd_request_raw* request_raw = (struct nbd_request_raw*) proxy->req.buf;
-	struct nbd_request*     request = &(proxy->req_hdr);
+	return r->is_readahead || r->is_writeback;
+}
 
-//	assert( state == READ_FROM_DOWNSTREAM );
+/* The entry that should go up this connection next. Reads ahead and writes
+ * back wait until everything downstream asked for has gone, so they never
+ * hold up a miss */
+static struct proxy_request* proxy_request_next_to_send( struct proxy_upstream* up )
+{
+	struct proxy_request* found = NULL;
+	int i;
 
-	count = iobuf_read( proxy->downstream_fd, &proxy->req, NBD_REQUEST_SIZE );
+	for ( i = 0; i < PROXY_MAX_INFLIGHT; i++ ) {
+		struct proxy_request* r = &up->session->inflight[i];
 
-	if ( count == -1 ) {
-		warn( SHOW_ERRNO( "Couldn't read request from downstream" ) );
-		return EXIT;
+		if ( r->state != PROXY_REQUEST_QUEUED || r->upstream != up->index ) {
+			continue;
+		}
+		if ( found == NULL || proxy_request_ours( r ) < proxy_request_ours( found ) ||
+				( proxy_request_ours( r ) == proxy_request_ours( found ) && r->seq < found->seq ) ) {
+			found = r;
+		}
 	}
 
-	if ( proxy->req.needle == NBD_REQUEST_SIZE ) {
-		nbd_r2h_request( request_raw, request );
+	return found;
+}
 
-		if ( ( request->type & REQUEST_MASK ) == REQUEST_DISCONNECT ) {
-			info( "Received disconnect request from client" );
-			return EXIT;
-		}
+/* True if this connection owes us a reply, or we have something to send it */
+static int proxy_upstream_busy( struct proxy_upstream* up )
+{
+	int i;
 
-		/* Simple validations */
-		if ( ( request->type & REQUEST_MASK ) == REQUEST_READ ) {
-			if (request->len > ( NBD_MAX_SIZE - NBD_REPLY_SIZE ) ) {
-				warn( "NBD read request size %"PRIu32" too large", request->len );
-				return EXIT;
-			}
-		}
-		if ( (request->type & REQUEST_MASK ) == REQUEST_WRITE ) {
-			if (request->len > ( NBD_MAX_SIZE - NBD_REQUEST_SIZE ) ) {
-				warn( "NBD write request size %"PRIu32" too large", request->len );
-				return EXIT;
-			}
+	for ( i = 0; i < PROXY_MAX_INFLIGHT; i++ ) {
+		struct proxy_request* r = &up->session->inflight[i];
 
-			proxy->req.size += request->len;
+		if ( r->upstream == up->index &&
+				( r->state == PROXY_REQUEST_QUEUED || r->state == PROXY_REQUEST_SENT ) ) {
+			return 1;
 		}
 	}
 
-	if ( proxy->req.needle == proxy->req.size ) {
-		debug(
-			"Received NBD request from downstream. type=%"PRIu32" from=%"PRIu64" len=%"PRIu32,
-			request->type, request->from, request->len
-		);
+	return 0;
+}
+
+/* A write from downstream that didn't go in the write-back file has to wait
+ * until none of what it touches is being written back, so the two can't
+ * land upstream the wrong way round, and unless we're writing back in image
+ * order, until everything written before it has been. When it goes, what we
+ * have of it is out of date */
+static int proxy_writeback_holds( struct proxy_session* session, struct proxy_request* r )
+{
+	struct writeback* wb = session->proxy->writeback;
 
-		/* Finished reading, so advance state. Leave size untouched so the next
-		 * state knows how many bytes to write */
-		proxy->req.needle = 0;
-		return WRITE_TO_UPSTREAM;
+	if ( wb == NULL || r->is_writeback || ( r->hdr.type & REQUEST_MASK ) == REQUEST_READ ) {
+		return 0;
+	}
+	if ( writeback_busy( wb, r->hdr.from, r->hdr.len ) ||
+			writeback_waiting( wb, r->writeback_after ) ) {
+		return 1;
 	}
 
-	return state;
+	writeback_forget( wb, r->hdr.from, r->hdr.len );
+	return 0;
 }
 
-int proxy_continue_connecting_to_upstream( struct proxier* proxy, int state )
+/* True if this request could go upstream as part of a bigger one */
+static int proxy_request_coalescable( struct proxy_session* session, struct proxy_request* r )
 {
-	int error, result;
-	socklen_t len = sizeof( error );
-
-//	assert( state == CONNECT_TO_UPSTREAM );
+	uint32_t type = r->hdr.type & REQUEST_MASK;
+
+	return
+		r->state == PROXY_REQUEST_QUEUED &&
+		r->upstream == -1 &&
+		!proxy_request_ours( r ) &&
+		!r->is_coalesced &&
+		r != session->splicing &&
+		( type == REQUEST_READ || type == REQUEST_WRITE ) &&
+		r->hdr.len > 0 &&
+		r->hdr.len < PROXY_COALESCE_MAX;
+}
 
-	result = getsockopt(
-		proxy->upstream_fd, SOL_SOCKET, SO_ERROR,  &error, &len
-	);
+/* Orders requests by type, then by where they start, then by arrival */
+static int proxy_request_cmp_range( const void* a, const void* b )
+{
+	const struct proxy_request* ra = *(struct proxy_request* const*) a;
+	const struct proxy_request* rb = *(struct proxy_request* const*) b;
 
-	if ( result == -1 ) {
-		warn( SHOW_ERRNO( "Failed to tell if connected to upstream" ) );
-		return state;
+	if ( ra->hdr.type != rb->hdr.type ) {
+		return ra->hdr.type < rb->hdr.type ? -1 : 1;
+	}
+	if ( ra->hdr.from != rb->hdr.from ) {
+		return ra->hdr.from < rb->hdr.from ? -1 : 1;
 	}
+	if ( ra->seq != rb->seq ) {
+		return ra->seq < rb->seq ? -1 : 1;
+	}
+	return 0;
+}
 
-	if ( error != 0 ) {
-		errno = error;
-		warn( SHOW_ERRNO( "Failed to connect to upstream" ) );
-		return state;
+/* Put a request of our own in the handle table that does the work of the
+ * count contiguous ones in run, and leave them waiting on it. It goes
+ * upstream in the place of the first of them to arrive */
+static void proxy_coalesce_run(
+	struct proxy_session* session,
+	struct proxy_request** run,
+	int count )
+{
+	struct proxy_request* r = proxy_request_alloc( session );
+	uint64_t seq = r->seq;
+	uint32_t len = 0, payload;
+	char* data;
+	int i;
+
+	for ( i = 0; i < count; i++ ) {
+		len += run[i]->hdr.len;
 	}
+	payload = ( run[0]->hdr.type & REQUEST_MASK ) == REQUEST_WRITE ? len : 0;
 
-	/* Data may have changed while we were disconnected */
-	prefetch_set_is_empty( proxy->prefetch );
+	debug( "Coalescing %d requests into %"PRIu32" bytes from %"PRIu64, count, len, run[0]->hdr.from );
 
-	info( "Connected to upstream on fd %i", proxy->upstream_fd );
-	return READ_INIT_FROM_UPSTREAM;
-}
+	r->is_coalesced = 1;
 
-int proxy_read_init_from_upstream( struct proxier* proxy, int state )
-{
-	ssize_t count;
+	r->hdr.magic = REQUEST_MAGIC;
+	r->hdr.type = run[0]->hdr.type;
+	r->hdr.from = run[0]->hdr.from;
+	r->hdr.len = len;
 
-//	assert( state == READ_INIT_FROM_UPSTREAM );
+	memcpy( r->hdr.handle, "co", 2 );
+	memcpy( r->hdr.handle + 2, &seq, 6 );
 
-	count = iobuf_read( proxy->upstream_fd, &proxy->init, sizeof( struct nbd_init_raw ) );
+	r->req.buf = xmalloc( NBD_REQUEST_SIZE + payload );
+	nbd_h2r_request( &r->hdr, (struct nbd_request_raw*) r->req.buf );
+	r->req.size = NBD_REQUEST_SIZE + payload;
+	r->req.needle = 0;
 
-	if ( count == -1 ) {
-		warn( SHOW_ERRNO( "Failed to read init from upstream" ) );
-		goto disconnect;
-	}
+	data = (char*) r->req.buf + NBD_REQUEST_SIZE;
+	r->seq = run[0]->seq;
+	r->cache_epoch = run[0]->cache_epoch;
 
-	if ( proxy->init.needle == proxy->init.size ) {
-		uint64_t upstream_size;
-		if ( !nbd_check_hello( (struct nbd_init_raw*) proxy->init.buf, &upstream_size ) ) {
-			warn( "Upstream sent invalid init" );
-			goto disconnect;
+	for ( i = 0; i < count; i++ ) {
+		if ( payload > 0 ) {
+			memcpy( data, (char*) run[i]->req.buf + NBD_REQUEST_SIZE, run[i]->hdr.len );
+			data += run[i]->hdr.len;
+		}
+		if ( run[i]->seq < r->seq ) {
+			r->seq = run[i]->seq;
+		}
+		if ( run[i]->cache_epoch < r->cache_epoch ) {
+			r->cache_epoch = run[i]->cache_epoch;
+		}
+		if ( run[i]->writeback_after > r->writeback_after ) {
+			r->writeback_after = run[i]->writeback_after;
 		}
 
-		/* Currently, we only get disconnected from upstream (so needing to come
-		 * here) when we have an outstanding request. If that becomes false,
-		 * we'll need to choose the right state to return to here */
-		proxy->init.needle = 0;
-		return WRITE_TO_UPSTREAM;
+		free( run[i]->req.buf );
+		run[i]->req.buf = NULL;
+		run[i]->state = PROXY_REQUEST_COALESCED;
+		run[i]->coalesced_into = r;
 	}
 
-	return state;
-
-disconnect:
-	proxy->init.needle = 0;
-	proxy->init.size = 0;
-	return CONNECT_TO_UPSTREAM;
+	r->state = PROXY_REQUEST_QUEUED;
 }
 
-int proxy_write_to_upstream( struct proxier* proxy, int state )
+/* True if adding r to the count contiguous requests in run would let part of
+ * it go upstream ahead of, or behind, some other request that arrived in
+ * between and touches the same part of the image. Reads can pass reads, but
+ * nothing else can be reordered */
+static int proxy_coalesce_reorders(
+	struct proxy_session* session,
+	struct proxy_request** run,
+	int count,
+	struct proxy_request* r )
 {
-	ssize_t count;
+	uint64_t from = run[0]->hdr.from;
+	uint64_t to = r->hdr.from + r->hdr.len;
+	uint64_t first = r->seq, last = r->seq;
+	int is_read = ( r->hdr.type & REQUEST_MASK ) == REQUEST_READ;
+	int i, j;
+
+	for ( i = 0; i < count; i++ ) {
+		if ( run[i]->seq < first ) {
+			first = run[i]->seq;
+		}
+		if ( run[i]->seq > last ) {
+			last = run[i]->seq;
+		}
+	}
 
-//	assert( state == WRITE_TO_UPSTREAM );
+	for ( i = 0; i < PROXY_MAX_INFLIGHT; i++ ) {
+		struct proxy_request* other = &session->inflight[i];
 
-	/* FIXME: We may set cork=1 multiple times as a result of this idiom.
-	 * Not a serious problem, but we could do better
-	 */
-	if ( proxy->req.needle == 0 && AF_UNIX != proxy->connect_to.family ) {
-		if ( sock_set_tcp_cork( proxy->upstream_fd, 1 ) == -1 ) {
-			warn( SHOW_ERRNO( "Failed to set TCP_CORK" ) );
+		if ( other->state == PROXY_REQUEST_FREE || other->state == PROXY_REQUEST_REPLIED ||
+				proxy_request_ours( other ) || other->is_coalesced || other == r ) {
+			continue;
+		}
+		if ( other->seq <= first || other->seq >= last ) {
+			continue;
+		}
+		if ( other->hdr.from >= to || other->hdr.from + other->hdr.len <= from ) {
+			continue;
+		}
+		if ( is_read && ( other->hdr.type & REQUEST_MASK ) == REQUEST_READ ) {
+			continue;
+		}
+		for ( j = 0; j < count; j++ ) {
+			if ( run[j] == other ) {
+				break;
+			}
+		}
+		if ( j == count ) {
+			return 1;
 		}
 	}
 
-	count = iobuf_write( proxy->upstream_fd, &proxy->req );
+	return 0;
+}
 
-	if ( count == -1 ) {
-		warn( SHOW_ERRNO( "Failed to send request to upstream" ) );
-		proxy->req.needle = 0;
-		// We're throwing the socket away so no need to uncork
-		return CONNECT_TO_UPSTREAM;
+/* Downstream often asks for a run of small reads or writes, one after the
+ * other, all at once. Rather than sending upstream a request for each, send
+ * one for as many of them as fit in PROXY_COALESCE_MAX, so long as that
+ * doesn't reorder them against anything else that touches the same data */
+static void proxy_coalesce( struct proxy_session* session )
+{
+	struct proxy_request* waiting[PROXY_MAX_INFLIGHT];
+	int i, start, count = 0;
+	uint32_t len;
+
+	for ( i = 0; i < PROXY_MAX_INFLIGHT; i++ ) {
+		if ( proxy_request_coalescable( session, &session->inflight[i] ) ) {
+			waiting[count++] = &session->inflight[i];
+		}
+	}
+	if ( count < 2 ) {
+		return;
 	}
 
-	if ( proxy->req.needle == proxy->req.size ) {
-		/* Request sent. Advance to reading the response from upstream. We might
-		 * still need req.size if reading the reply fails - we disconnect
-		 * and resend the reply in that case - so keep it around for now. */
-		proxy->req.needle = 0;
+	qsort( waiting, count, sizeof( struct proxy_request* ), proxy_request_cmp_range );
+
+	for ( start = 0; start < count; start = i ) {
+		len = waiting[start]->hdr.len;
 
-		if ( AF_UNIX != proxy->connect_to.family ) {
-			if ( sock_set_tcp_cork( proxy->upstream_fd, 0 ) == -1 ) {
-				warn( SHOW_ERRNO( "Failed to unset TCP_CORK" ) );
-				// TODO: should we return to CONNECT_TO_UPSTREAM in this instance?
+		for ( i = start + 1; i < count; i++ ) {
+			struct proxy_request* prev = waiting[i - 1];
+			struct proxy_request* r = waiting[i];
+
+			if ( r->hdr.type != prev->hdr.type ||
+					r->hdr.from != prev->hdr.from + prev->hdr.len ||
+					len + r->hdr.len > PROXY_COALESCE_MAX ||
+					proxy_coalesce_reorders( session, &waiting[start], i - start, r ) ) {
+				break;
 			}
+			len += r->hdr.len;
 		}
 
-		return READ_FROM_UPSTREAM;
+		if ( i - start > 1 && session->inflight_count < PROXY_MAX_INFLIGHT ) {
+			proxy_coalesce_run( session, &waiting[start], i - start );
+		}
 	}
-
-	return state;
 }
 
-int proxy_read_from_upstream( struct proxier* proxy, int state )
+/* Give everything that's queued but not on a connection yet to whichever
+ * connected one has the fewest requests outstanding, once any that can be
+ * have been coalesced. If none are connected, it waits until one is */
+static void proxy_dispatch( struct proxy_session* session )
 {
-	ssize_t count;
+	int outstanding[PROXY_CONNECTIONS_MAX] = { 0 };
+	int i, j;
 
-	struct nbd_reply*     reply     = &(proxy->rsp_hdr);
-	struct nbd_reply_raw* reply_raw = (struct nbd_reply_raw*) proxy->rsp.buf;
+	proxy_coalesce( session );
 
-	/* We can't assume the NBD_REPLY_SIZE + req->len is what we'll get back */
-	count = iobuf_read( proxy->upstream_fd, &proxy->rsp, NBD_REPLY_SIZE );
+	for ( i = 0; i < PROXY_MAX_INFLIGHT; i++ ) {
+		struct proxy_request* r = &session->inflight[i];
 
-	if ( count == -1 ) {
-		warn( SHOW_ERRNO( "Failed to get reply from upstream" ) );
-		goto disconnect;
+		if ( r->upstream != -1 &&
+				( r->state == PROXY_REQUEST_QUEUED || r->state == PROXY_REQUEST_SENT ) ) {
+			outstanding[r->upstream]++;
+		}
 	}
 
-	if ( proxy->rsp.needle == NBD_REPLY_SIZE ) {
-		nbd_r2h_reply( reply_raw, reply );
+	for ( i = 0; i < PROXY_MAX_INFLIGHT; i++ ) {
+		struct proxy_request* r = &session->inflight[i];
+		struct proxy_upstream* up = NULL;
 
-		if ( reply->magic != REPLY_MAGIC ) {
-			warn( "Reply magic is incorrect" );
-			goto disconnect;
+		if ( r->state != PROXY_REQUEST_QUEUED || r->upstream != -1 ) {
+			continue;
 		}
 
-		if ( reply->error != 0 ) {
-			warn( "NBD error returned from upstream: %"PRIu32, reply->error );
-			goto disconnect;
+		for ( j = 0; j < session->upstream_count; j++ ) {
+			if ( session->upstreams[j].state == UPSTREAM_CONNECTED &&
+					( up == NULL || outstanding[j] < outstanding[up->index] ) ) {
+				up = &session->upstreams[j];
+			}
+		}
+		if ( up == NULL ) {
+			return;
+		}
+		if ( proxy_writeback_holds( session, r ) ) {
+			continue;
 		}
 
-		if ( ( proxy->req_hdr.type & REQUEST_MASK ) == REQUEST_READ ) {
-			/* Get the read reply data too. */
-			proxy->rsp.size += proxy->req_hdr.len;
+		/* Its timeout starts now if it had nothing else to do */
+		if ( outstanding[up->index] == 0 ) {
+			up->progress = monotonic_time_ms();
 		}
+
+		r->upstream = up->index;
+		outstanding[up->index]++;
 	}
+}
 
-	if ( proxy->rsp.size == proxy->rsp.needle ) {
-		debug( "NBD reply received from upstream." );
-		proxy->rsp.needle = 0;
-		return WRITE_TO_DOWNSTREAM;
+/* How long to wait before trying to connect to upstream again, after this
+ * many attempts in a row have failed. Where in the range we land is picked by
+ * jitter, which is usually rand() */
+uint64_t proxy_reconnect_delay( int attempts, unsigned int jitter )
+{
+	uint64_t delay = UPSTREAM_RECONNECT_MIN;
+
+	if ( attempts == 0 ) {
+		return 0;
 	}
 
-	return state;
+	while ( --attempts > 0 && delay < UPSTREAM_RECONNECT_MAX ) {
+		delay *= 2;
+	}
+	if ( delay > UPSTREAM_RECONNECT_MAX ) {
+		delay = UPSTREAM_RECONNECT_MAX;
+	}
 
-disconnect:
-	proxy->rsp.needle = 0;
-	proxy->rsp.size = 0;
-	return CONNECT_TO_UPSTREAM;
+	return delay / 2 + jitter % ( delay / 2 + 1 );
 }
 
-
-int proxy_write_to_downstream( struct proxier* proxy, int state )
+/* Throw away this connection to upstream. Everything we'd sent it, or started
+ * to send it, goes back on the queue to be sent again - in the order it first
+ * arrived - on whichever connection is next free. Requests on the session's
+ * other connections carry on as they were. Any reply we'd half-read is
+ * discarded. Reads ahead are dropped, since the cache is cleared when we
+ * reconnect.
+ *
+ * If the connection had been working, we try again straight away. If we were
+ * still trying to connect, we back off. */
+static void proxy_upstream_failed( struct proxy_upstream* up )
 {
-	ssize_t count;
-
-//	assert( state == WRITE_TO_DOWNSTREAM );
+	struct proxy_session* session = up->session;
+	struct proxier* proxy = session->proxy;
+	uint64_t now = monotonic_time_ms();
+	int i;
+
+	if ( up->state == UPSTREAM_CONNECTED ) {
+		up->lost_at = now;
+		up->attempts = 0;
+	} else {
+		up->attempts++;
+	}
 
-	if ( !proxy->hello_sent ) {
-		info( "Writing init to downstream" );
+	/* If we couldn't get through to this address, try the next. Some other
+	 * connection may have moved us on already */
+	if ( ( up->state == UPSTREAM_CONNECTING || up->state == UPSTREAM_READ_INIT ) &&
+			proxy->addresses > 1 && proxy->address == up->address ) {
+		proxy->address = ( up->address + 1 ) % proxy->addresses;
+		info( "Trying upstream address %d next", proxy->address );
 	}
 
-	count = iobuf_write( proxy->downstream_fd, &proxy->rsp );
+	proxy_disconnect_from_upstream( up );
 
-	if ( count == -1 ) {
-		warn( SHOW_ERRNO( "Failed to write to downstream" ) );
-		return EXIT;
-	}
+	for ( i = 0; i < PROXY_MAX_INFLIGHT; i++ ) {
+		struct proxy_request* r = &session->inflight[i];
 
-	if ( proxy->rsp.needle == proxy->rsp.size ) {
-		if ( !proxy->hello_sent ) {
-			info( "Hello message sent to client" );
-			proxy->hello_sent = 1;
-		} else {
-			debug( "Reply sent" );
-			proxy->req_count++;
+		if ( r->upstream != up->index ) {
+			continue;
+		}
+
+		if ( r->is_readahead && r->state != PROXY_REQUEST_FREE ) {
+			proxy_request_free( session, r );
+			continue;
 		}
 
-		/* We're done with the request & response buffers now */
-		proxy->req.size = 0;
-		proxy->req.needle = 0;
-		proxy->rsp.size = 0;
-		proxy->rsp.needle = 0;
-		return READ_FROM_DOWNSTREAM;
+		if ( r->state == PROXY_REQUEST_QUEUED || r->state == PROXY_REQUEST_SENT ) {
+			r->state = PROXY_REQUEST_QUEUED;
+			r->upstream = -1;
+			r->req.needle = 0;
+
+			/* A reply we'd started passing downstream keeps its header */
+			if ( r == session->splicing ) {
+				r->spliced_conn_in = 0;
+				continue;
+			}
+
+			free( r->rsp.buf );
+			r->rsp.buf = NULL;
+			r->rsp.size = 0;
+			r->rsp.needle = 0;
+		}
 	}
 
-	return state;
-}
+	up->writing = NULL;
+	up->reading = NULL;
 
-/* Non-blocking proxy session. Simple(ish) state machine. We read from d/s until
- * we have a full request, then try to write that request u/s. If writing fails,
- * we reconnect to upstream and retry. Once we've successfully written, we
- * attempt to read the reply. If that fails or times out (we give it 30 seconds)
- * then we disconnect from u/s and go back to trying to reconnect and resend.
- *
- * This is the second-simplest NBD proxy I can think of. The first version was
- * non-blocking I/O, but it was getting impossible to manage exceptional stuff
- */
-void proxy_session( struct proxier* proxy )
-{
-	uint64_t state_started = monotonic_time_ms();
-	int old_state = EXIT;
-	int state;
-	int connect_to_upstream_cooldown = 0;
+	if ( session->readahead ) {
+		readahead_reset( session->readahead );
+	}
 
+	up->init.size = 0;
+	up->init.needle = 0;
+	up->rsp.size = 0;
+	up->rsp.needle = 0;
+	up->redirect_state = PROXY_REDIRECT_NONE;
 
-	/* First action: Write hello to downstream */
-	nbd_hello_to_buf( (struct nbd_init_raw *) proxy->rsp.buf, proxy->upstream_size );
-	proxy->rsp.size = sizeof( struct nbd_init_raw );
-	proxy->rsp.needle = 0;
-	state = WRITE_TO_DOWNSTREAM;
+	up->retry_at = now + proxy_reconnect_delay( up->attempts, rand() );
 
+	proxy_set_upstream_state( up, UPSTREAM_DISCONNECTED );
+}
 
-	info( "Beginning proxy session on fd %i", proxy->downstream_fd );
+/* Put a read of our own in the handle table, to fill the cache ahead of a
+ * stream of reads from downstream */
+static void proxy_readahead( struct proxy_session* session, uint64_t from, uint32_t len )
+{
+	struct proxy_request* r = proxy_request_alloc( session );
+	uint64_t seq = r->seq;
 
-	while( state != EXIT ) {
+	debug( "Reading ahead %"PRIu32" bytes from %"PRIu64, len, from );
 
-		struct timeval select_timeout = {
-			.tv_sec = 0,
-			.tv_usec = 0
-		};
+	r->is_readahead = 1;
+	session->readahead_count++;
 
-		struct timeval *select_timeout_ptr = NULL;
+	r->hdr.magic = REQUEST_MAGIC;
+	r->hdr.type = REQUEST_READ;
+	r->hdr.from = from;
+	r->hdr.len = len;
 
-		int result; /* used by select() */
+	/* Something downstream is unlikely to use itself */
+	memcpy( r->hdr.handle, "ra", 2 );
+	memcpy( r->hdr.handle + 2, &seq, 6 );
 
-		fd_set rfds;
-		fd_set wfds;
+	r->req.buf = xmalloc( NBD_REQUEST_SIZE );
+	nbd_h2r_request( &r->hdr, (struct nbd_request_raw*) r->req.buf );
+	r->req.size = NBD_REQUEST_SIZE;
+	r->req.needle = 0;
 
-		FD_ZERO( &rfds );
-		FD_ZERO( &wfds );
+	r->cache_epoch = cache_epoch( session->proxy->cache );
+	r->state = PROXY_REQUEST_QUEUED;
+}
 
-		if ( state != old_state ) {
-			state_started = monotonic_time_ms();
+/* Downstream has read this, so keep the stream it's part of, if any, topped
+ * up with as much as we can read ahead of it */
+static void proxy_read_ahead_of( struct proxy_session* session, uint64_t from, uint32_t len )
+{
+	struct readahead_stream* stream;
+	uint64_t ahead_from;
+	uint32_t ahead_len;
+
+	stream = readahead_note_read( session->readahead, from, len );
+
+	while ( !session->downstream_closing &&
+			session->readahead_count < PROXY_MAX_READAHEAD &&
+			session->inflight_count < PROXY_MAX_INFLIGHT &&
+			readahead_next_chunk(
+				session->readahead, stream, session->proxy->upstream_size,
+				&ahead_from, &ahead_len
+			) ) {
+		proxy_readahead( session, ahead_from, ahead_len );
+	}
+}
 
-			debug(
-				"State transitition from %s to %s",
-				proxy_session_state_names[old_state],
-				proxy_session_state_names[state]
-			);
-		} else {
-			debug( "Proxy is in state %s", proxy_session_state_names[state], state );
-		}
+/* Put a write or flush of our own in the handle table, to get what's dirty
+ * in the write-back file upstream */
+static void proxy_writeback_request(
+	struct proxy_session* session,
+	uint32_t type,
+	uint64_t from,
+	uint32_t len )
+{
+	struct proxy_request* r = proxy_request_alloc( session );
+	uint64_t seq = r->seq;
+	uint32_t payload = type == REQUEST_WRITE ? len : 0;
+
+	debug( "Writing back %"PRIu32" bytes from %"PRIu64, len, from );
+
+	r->is_writeback = 1;
+	session->writeback_count++;
+
+	r->hdr.magic = REQUEST_MAGIC;
+	r->hdr.type = type;
+	r->hdr.from = from;
+	r->hdr.len = len;
+
+	memcpy( r->hdr.handle, "wb", 2 );
+	memcpy( r->hdr.handle + 2, &seq, 6 );
+
+	r->req.buf = xmalloc( NBD_REQUEST_SIZE + payload );
+	nbd_h2r_request( &r->hdr, (struct nbd_request_raw*) r->req.buf );
+	r->req.size = NBD_REQUEST_SIZE + payload;
+	r->req.needle = 0;
+	r->state = PROXY_REQUEST_QUEUED;
+
+	if ( payload > 0 &&
+			writeback_read( session->proxy->writeback, from, len,
+				(char*) r->req.buf + NBD_REQUEST_SIZE ) == -1 ) {
+		warn( SHOW_ERRNO( "Couldn't read from the write-back file" ) );
+		proxy_request_free( session, r );
+	}
+}
 
-		old_state = state;
+/* One of our writes back, or a flush after them, is done with. It worked if
+ * upstream replied */
+static void proxy_written_back( struct proxy_session* session, struct proxy_request* r )
+{
+	struct writeback* wb = session->proxy->writeback;
+	int ok = r->state == PROXY_REQUEST_REPLIED;
 
-		switch( state ) {
-			case READ_FROM_DOWNSTREAM:
-				FD_SET( proxy->downstream_fd, &rfds );
-				break;
-			case WRITE_TO_DOWNSTREAM:
-				FD_SET( proxy->downstream_fd, &wfds );
-				break;
-			case WRITE_TO_UPSTREAM:
-				select_timeout.tv_sec = 15;
-				FD_SET(proxy->upstream_fd, &wfds );
-				break;
-			case CONNECT_TO_UPSTREAM:
-				/* upstream_fd is now -1 */
-				proxy_disconnect_from_upstream( proxy );
-
-				if ( connect_to_upstream_cooldown ) {
-					connect_to_upstream_cooldown = 0;
-					select_timeout.tv_sec = 3;
-				} else {
-					proxy_start_connect_to_upstream( proxy );
-
-					if ( proxy->upstream_fd == -1 ) {
-						warn( SHOW_ERRNO( "Error acquiring socket to upstream" ) );
-						continue;
-					}
-					FD_SET( proxy->upstream_fd, &wfds );
-					select_timeout.tv_sec = 15;
-				}
-				break;
-			case READ_INIT_FROM_UPSTREAM:
-			case READ_FROM_UPSTREAM:
-				select_timeout.tv_sec = 15;
-				FD_SET( proxy->upstream_fd, &rfds );
-				break;
-		};
+	if ( r->hdr.type == REQUEST_FLUSH ) {
+		writeback_flushed( wb, ok );
+	} else {
+		writeback_sent( wb, r->hdr.from, ok );
+	}
+}
 
-		if ( select_timeout.tv_sec > 0 ) {
-			select_timeout_ptr = &select_timeout;
-		}
+/* Keep the handle table topped up with writes back from the write-back file,
+ * and a flush once they've been written, while we're connected to upstream.
+ * If our client is going, we leave it to another session once nothing it
+ * asked for could be waiting on us */
+static void proxy_write_back( struct proxy_session* session )
+{
+	struct writeback* wb = session->proxy->writeback;
+	uint64_t from;
+	uint32_t len;
+	int i, connected = 0;
 
-		result = sock_try_select( FD_SETSIZE, &rfds, &wfds, NULL, select_timeout_ptr );
+	if ( wb == NULL || ( session->downstream_closing && session->downstream_fd != -1 &&
+				session->inflight_count == session->writeback_count ) ) {
+		return;
+	}
 
-		if ( result == -1 ) {
-			warn( SHOW_ERRNO( "select() failed: " ) );
-			break;
+	for ( i = 0; i < session->upstream_count; i++ ) {
+		if ( session->upstreams[i].state == UPSTREAM_CONNECTED ) {
+			connected = 1;
 		}
+	}
+	if ( !connected ) {
+		return;
+	}
 
-		/* Happens after failed reconnect. Avoid SIGBUS on FD_ISSET() */
-		if ( proxy->upstream_fd == -1 ) {
-			continue;
+	while ( session->writeback_count < PROXY_MAX_WRITEBACK &&
+			session->inflight_count < PROXY_MAX_INFLIGHT ) {
+		if ( writeback_flush_due( wb ) ) {
+			writeback_flush_sent( wb );
+			proxy_writeback_request( session, REQUEST_FLUSH, 0, 0 );
+		} else if ( writeback_next_chunk( wb, &from, &len ) ) {
+			proxy_writeback_request( session, REQUEST_WRITE, from, len );
+		} else {
+			break;
 		}
+	}
+}
 
-		switch( state ) {
-			case READ_FROM_DOWNSTREAM:
-				if ( FD_ISSET( proxy->downstream_fd, &rfds ) ) {
-					state = proxy_read_from_downstream( proxy, state );
-					/* Check if we can fulfil the request from prefetch, or
-					 * rewrite the request to fill the prefetch buffer if needed
-					 */
-					if ( proxy_prefetches( proxy ) && state == WRITE_TO_UPSTREAM ) {
-						state = proxy_prefetch_for_request( proxy, state );
-					}
-				}
+/* Answer a request ourselves, with room for len bytes of data after the
+ * reply's header. Returns where the data goes */
+static char* proxy_reply_here( struct proxy_request* r, uint32_t error, uint32_t len )
+{
+	struct nbd_reply rsp;
+
+	r->rsp.buf = xmalloc( NBD_REPLY_SIZE + len );
+
+	rsp.magic = REPLY_MAGIC;
+	rsp.error = error;
+	memcpy( &rsp.handle, &r->hdr.handle, 8 );
+	nbd_h2r_reply( &rsp, (struct nbd_reply_raw*) r->rsp.buf );
+
+	r->rsp.size = NBD_REPLY_SIZE + len;
+	r->rsp.needle = 0;
+	r->state = PROXY_REQUEST_REPLIED;
+
+	return (char*) r->rsp.buf + NBD_REPLY_SIZE;
+}
+
+/* Answer a read from the cache if we can. If not, note when it was sent, so
+ * we know whether we can cache the reply. Either way, read ahead of it if
+ * it looks like part of a stream. Writes update the cache. */
+void proxy_cache_for_request( struct proxy_session* session, struct proxy_request* r )
+{
+	NULLCHECK( session );
+	struct nbd_request* req = &r->hdr;
+
+	switch( req->type & REQUEST_MASK ) {
+		case REQUEST_READ:
+			break;
+		case REQUEST_WRITE:
+			cache_write( session->proxy->cache, req->from, req->len, (char*) r->req.buf + NBD_REQUEST_SIZE );
+			return;
+		case REQUEST_WRITE_ZEROES:
+			cache_invalidate( session->proxy->cache, req->from, req->len );
+			return;
+		default:
+			/* Safety catch. We don't know what anything else does to the
+			 * data, so blow away the whole cache. */
+			debug( "Blowing away cache on type %d request.", req->type );
+			cache_clear( session->proxy->cache );
+			return;
+	}
+
+	if ( cache_contains( session->proxy->cache, req->from, req->len ) ) {
+		/* HUZZAH!  A match! */
+		debug( "Cache hit!" );
+		cache_read( session->proxy->cache, req->from, req->len, proxy_reply_here( r, 0, req->len ) );
+	} else {
+		debug( "Cache MISS!");
+		session->proxy->cache->misses++;
+		r->cache_epoch = cache_epoch( session->proxy->cache );
+	}
+
+	proxy_read_ahead_of( session, req->from, req->len );
+}
+
+/* Cache what we've read */
+void proxy_cache_for_reply( struct proxy_session* session, struct proxy_request* r )
+{
+	if ( ( r->hdr.type & REQUEST_MASK ) != REQUEST_READ ) {
+		return;
+	}
+
+	cache_insert(
+		session->proxy->cache, r->cache_epoch,
+		r->hdr.from, r->hdr.len, (char*) r->rsp.buf + NBD_REPLY_SIZE
+	);
+}
+
+
+/* Answer a read from the write-back file if all of it is there, and put a
+ * write in it if we can. Writes are answered once it's been synced. Anything
+ * else goes upstream */
+static void proxy_writeback_for_request( struct proxy_session* session, struct proxy_request* r )
+{
+	struct writeback* wb = session->proxy->writeback;
+	struct nbd_request* req = &r->hdr;
+
+	r->writeback_after = writeback_logged( wb );
+
+	switch( req->type & REQUEST_MASK ) {
+		case REQUEST_READ:
+			if ( !writeback_contains( wb, req->from, req->len ) ) {
 				break;
-			case CONNECT_TO_UPSTREAM:
-				if ( FD_ISSET( proxy->upstream_fd, &wfds ) ) {
-					state = proxy_continue_connecting_to_upstream( proxy, state );
-				}
-				/* Leaving state untouched will retry connecting to upstream -
-				 * so introduce a bit of sleep  */
-				if ( state == CONNECT_TO_UPSTREAM ) {
-					connect_to_upstream_cooldown = 1;
+			}
+			if ( writeback_read( wb, req->from, req->len, proxy_reply_here( r, 0, req->len ) ) == -1 ) {
+				warn( SHOW_ERRNO( "Couldn't read from the write-back file" ) );
+				free( r->rsp.buf );
+				proxy_reply_here( r, EIO, 0 );
+			}
+			break;
+		case REQUEST_WRITE:
+			if ( !writeback_covers( wb, req->from, req->len ) ) {
+				break;
+			}
+			if ( writeback_write( wb, req->from, req->len, (char*) r->req.buf + NBD_REQUEST_SIZE,
+						&r->writeback_sync ) == -1 ) {
+				warn( SHOW_ERRNO( "Couldn't write to the write-back file" ) );
+				proxy_reply_here( r, EIO, 0 );
+			} else {
+				r->state = PROXY_REQUEST_SYNCING;
+			}
+			break;
+	}
+}
+
+/* Answer the writes we've put in the write-back file that are durable, with
+ * error if the sync they were waiting for failed, or if it's 0, only those
+ * whose sync has finished */
+static void proxy_writeback_synced( struct proxy_session* session, uint32_t error )
+{
+	struct writeback* wb = session->proxy->writeback;
+	int i;
+
+	for ( i = 0; i < PROXY_MAX_INFLIGHT; i++ ) {
+		struct proxy_request* r = &session->inflight[i];
+
+		if ( r->state == PROXY_REQUEST_SYNCING &&
+				( error || writeback_synced( wb, r->writeback_sync ) ) ) {
+			free( r->req.buf );
+			r->req.buf = NULL;
+			proxy_reply_here( r, error, 0 );
+		}
+	}
+}
+
+/* Answer whichever writes in the write-back file are durable now, and start
+ * syncing whatever has been written since the last sync started. Syncs run
+ * on their own thread, one at a time, so everything written while one is
+ * going is synced together by the next */
+static void proxy_writeback_sync( struct proxy_session* session )
+{
+	proxy_writeback_synced( session, 0 );
+	writeback_sync_start( session->proxy->writeback );
+}
+
+/* We have the whole of a request from downstream. Answer it from the cache
+ * or the write-back file if we can, otherwise queue it up to go upstream */
+static void proxy_request_received( struct proxy_session* session, struct proxy_request* r )
+{
+	debug(
+		"Received NBD request from downstream. type=%"PRIu32" from=%"PRIu64" len=%"PRIu32,
+		r->hdr.type, r->hdr.from, r->hdr.len
+	);
+
+	r->req.needle = 0;
+	r->state = PROXY_REQUEST_QUEUED;
+
+	if ( proxy_caches( session->proxy ) ) {
+		proxy_cache_for_request( session, r );
+	}
+
+	if ( session->proxy->writeback && r->state == PROXY_REQUEST_QUEUED ) {
+		proxy_writeback_for_request( session, r );
+	}
+}
+
+/* Called with a complete request header in session->req. Returns 0 if the
+ * session should end, 1 otherwise */
+static int proxy_request_header_received( struct proxy_session* session )
+{
+	struct nbd_request_raw* request_raw = (struct nbd_request_raw*) session->req.buf;
+	struct nbd_request      request;
+	struct proxy_request*   r;
+	uint32_t                payload = 0;
+
+	nbd_r2h_request( request_raw, &request );
+
+	if ( ( request.type & REQUEST_MASK ) == REQUEST_DISCONNECT ) {
+		info( "Received disconnect request from client" );
+		session->downstream_closing = 1;
+		return 1;
+	}
+
+	/* Simple validations */
+	if ( ( request.type & REQUEST_MASK ) == REQUEST_READ ) {
+		if (request.len > ( NBD_MAX_SIZE - NBD_REPLY_SIZE ) ) {
+			warn( "NBD read request size %"PRIu32" too large", request.len );
+			return 0;
+		}
+	}
+	if ( (request.type & REQUEST_MASK ) == REQUEST_WRITE ) {
+		if (request.len > ( NBD_MAX_SIZE - NBD_REQUEST_SIZE ) ) {
+			warn( "NBD write request size %"PRIu32" too large", request.len );
+			return 0;
+		}
+
+		payload = request.len;
+	}
+
+	r = proxy_request_alloc( session );
+	r->hdr = request;
+	r->req.buf = xmalloc( NBD_REQUEST_SIZE + payload );
+	memcpy( r->req.buf, request_raw, NBD_REQUEST_SIZE );
+	r->req.size = NBD_REQUEST_SIZE + payload;
+	r->req.needle = NBD_REQUEST_SIZE;
+
+	if ( payload > 0 ) {
+		r->state = PROXY_REQUEST_READING;
+		session->downstream_reading = r;
+	} else {
+		proxy_request_received( session, r );
+	}
+
+	return 1;
+}
+
+/* Read as many requests from downstream as we can without blocking, or until
+ * the handle table is full. Returns 0 if the session should end */
+int proxy_read_from_downstream( struct proxy_session *session )
+{
+	ssize_t count;
+	struct proxy_request* r;
+
+	while ( !session->downstream_closing ) {
+		r = session->downstream_reading;
+
+		if ( r == NULL ) {
+			if ( session->inflight_count == PROXY_MAX_INFLIGHT ) {
+				break;
+			}
+
+			count = iobuf_read( session->downstream_fd, &session->req, NBD_REQUEST_SIZE );
+
+			if ( count == -1 ) {
+				warn( SHOW_ERRNO( "Couldn't read request from downstream" ) );
+				return 0;
+			}
+			if ( count == 0 ) {
+				break;
+			}
+
+			if ( session->req.needle == NBD_REQUEST_SIZE ) {
+				session->req.needle = 0;
+				if ( !proxy_request_header_received( session ) ) {
+					return 0;
 				}
+			}
+		} else {
+			count = iobuf_read( session->downstream_fd, &r->req, 0 );
+
+			if ( count == -1 ) {
+				warn( SHOW_ERRNO( "Couldn't read write data from downstream" ) );
+				return 0;
+			}
+			if ( count == 0 ) {
+				break;
+			}
+
+			if ( r->req.needle == r->req.size ) {
+				session->downstream_reading = NULL;
+				proxy_request_received( session, r );
+			}
+		}
+	}
+
+	return 1;
+}
+
+int proxy_continue_connecting_to_upstream( struct proxy_upstream* up )
+{
+	int error, result;
+	socklen_t len = sizeof( error );
+
+	result = getsockopt(
+		up->fd, SOL_SOCKET, SO_ERROR,  &error, &len
+	);
+
+	if ( result == -1 ) {
+		warn( SHOW_ERRNO( "Failed to tell if connected to upstream" ) );
+		return UPSTREAM_DISCONNECTED;
+	}
+
+	if ( error != 0 ) {
+		errno = error;
+		warn( SHOW_ERRNO( "Failed to connect to upstream" ) );
+		return UPSTREAM_DISCONNECTED;
+	}
+
+	/* Data may have changed while we were disconnected */
+	if ( proxy_caches( up->session->proxy ) ) {
+		cache_clear( up->session->proxy->cache );
+	}
+
+	info( "Connected to upstream on fd %i", up->fd );
+	proxy_set_upstream_sockopts( up->session->proxy, up->address, up->fd );
+	up->init.needle = 0;
+	return UPSTREAM_READ_INIT;
+}
+
+/* Get ready to ask upstream, on a new connection, where the image goes if
+ * it's ever moved. state says whether we can, or already have */
+static void proxy_redirect_prepare( struct proxy_upstream* up, int state )
+{
+	struct nbd_request request = { .magic = REQUEST_MAGIC, .type = REQUEST_REDIRECT };
+
+	memcpy( request.handle, PROXY_REDIRECT_HANDLE, 8 );
+	nbd_h2r_request( &request, (struct nbd_request_raw*) up->redirect.buf );
+	up->redirect.size = NBD_REQUEST_SIZE;
+	up->redirect.needle = 0;
+	up->redirect_state = state;
+}
+
+static int proxy_same_address( union mysockaddr* a, union mysockaddr* b )
+{
+	if ( a->family != b->family || a->v4.sin_port != b->v4.sin_port ) {
+		return 0;
+	}
+	if ( a->family == AF_INET ) {
+		return a->v4.sin_addr.s_addr == b->v4.sin_addr.s_addr;
+	}
+	return memcmp( &a->v6.sin6_addr, &b->v6.sin6_addr, sizeof( a->v6.sin6_addr ) ) == 0;
+}
+
+/* Upstream has handed the image on to another server, which is where we
+ * connect from now on. It's already in control, so there's no need to wait
+ * before connecting to it. If we have no room for another address, the new
+ * one takes the place of the one we were redirected from */
+static void proxy_redirected( struct proxy_upstream* up )
+{
+	struct proxier* proxy = up->session->proxy;
+	struct nbd_redirect_raw* raw = (struct nbd_redirect_raw*) up->redirect.buf;
+	union mysockaddr to;
+	int i;
+
+	raw->address[sizeof( raw->address ) - 1] = '\0';
+	memset( &to, 0, sizeof( to ) );
+	if ( !parse_ip_to_sockaddr( &to.generic, raw->address ) ) {
+		warn( "Upstream redirected us to '%s', which we couldn't parse", raw->address );
+		return;
+	}
+	to.v4.sin_port = raw->port;
+
+	for ( i = 0; i < proxy->addresses; i++ ) {
+		if ( proxy_same_address( &proxy->connect_to[i], &to ) ) {
+			break;
+		}
+	}
+	if ( i == proxy->addresses ) {
+		if ( proxy->addresses < PROXY_ADDRESSES_MAX ) {
+			proxy->addresses++;
+		} else {
+			i = up->address;
+		}
+		proxy->connect_to[i] = to;
+	}
+
+	if ( proxy->address != i ) {
+		info( "Upstream has moved to %s port %d", raw->address, ntohs( raw->port ) );
+		proxy->address = i;
+	}
+	up->attempts = 0;
+}
+
+/* Keep count of how long it takes to get a connection to upstream back */
+static void proxy_reconnected( struct proxier* proxy, uint64_t took )
+{
+	info( "Reconnected to upstream after %"PRIu64"ms", took );
+
+	proxy->reconnects++;
+	proxy->reconnect_ms += took;
+	if ( took > proxy->reconnect_ms_max ) {
+		proxy->reconnect_ms_max = took;
+	}
+}
+
+int proxy_read_init_from_upstream( struct proxy_upstream* up, int state )
+{
+	ssize_t count;
+
+//	assert( state == UPSTREAM_READ_INIT );
+
+	count = iobuf_read( up->fd, &up->init, sizeof( struct nbd_init_raw ) );
+
+	if ( count == -1 ) {
+		warn( SHOW_ERRNO( "Failed to read init from upstream" ) );
+		goto disconnect;
+	}
+
+	if ( up->init.needle == up->init.size ) {
+		uint64_t upstream_size;
+		uint32_t flags;
+		if ( !nbd_check_hello( (struct nbd_init_raw*) up->init.buf, &upstream_size, &flags ) ) {
+			warn( "Upstream sent invalid init" );
+			goto disconnect;
+		}
+
+		proxy_redirect_prepare( up,
+			flags & INIT_FLAG_REDIRECT ? PROXY_REDIRECT_UNSENT : PROXY_REDIRECT_NONE );
+
+		/* Anything in the handle table that was on this connection and
+		 * hadn't been replied to is queued again by now, and goes out on
+		 * whichever connection is free next */
+		up->init.needle = 0;
+		up->progress = monotonic_time_ms();
+		up->attempts = 0;
+
+		if ( up->lost_at ) {
+			proxy_reconnected( up->session->proxy, up->progress - up->lost_at );
+			up->lost_at = 0;
+		}
+
+		return UPSTREAM_CONNECTED;
+	}
+
+	return state;
+
+disconnect:
+	up->init.needle = 0;
+	up->init.size = 0;
+	return UPSTREAM_DISCONNECTED;
+}
+
+/* Send everything that's queued on this connection, in the order it arrived,
+ * until we'd block. Reads ahead go last */
+int proxy_write_to_upstream( struct proxy_upstream* up, int state )
+{
+	ssize_t count;
+	struct proxy_request* r;
+
+//	assert( state == UPSTREAM_CONNECTED );
+
+	/* We ask where the image goes before anything else */
+	if ( up->redirect_state == PROXY_REDIRECT_UNSENT ) {
+		count = iobuf_write( up->fd, &up->redirect );
+
+		if ( count == -1 ) {
+			warn( SHOW_ERRNO( "Failed to send redirect request to upstream" ) );
+			return UPSTREAM_DISCONNECTED;
+		}
+		if ( up->redirect.needle < up->redirect.size ) {
+			return state;
+		}
+		up->redirect_state = PROXY_REDIRECT_SENT;
+	}
+
+	while ( 1 ) {
+		if ( up->writing == NULL ) {
+			up->writing = proxy_request_next_to_send( up );
+		}
+
+		r = up->writing;
+		if ( r == NULL ) {
+			break;
+		}
+
+		/* FIXME: We may set cork=1 multiple times as a result of this idiom.
+		 * Not a serious problem, but we could do better
+		 */
+		if ( r->req.needle == 0 && AF_UNIX != up->session->proxy->connect_to[up->address].family ) {
+			if ( sock_set_tcp_cork( up->fd, 1 ) == -1 ) {
+				warn( SHOW_ERRNO( "Failed to set TCP_CORK" ) );
+			}
+		}
+
+		count = iobuf_write( up->fd, &r->req );
+
+		if ( count == -1 ) {
+			warn( SHOW_ERRNO( "Failed to send request to upstream" ) );
+			// We're throwing the socket away so no need to uncork
+			return UPSTREAM_DISCONNECTED;
+		}
+		if ( count == 0 ) {
+			return state;
+		}
+
+		up->progress = monotonic_time_ms();
+
+		if ( r->req.needle == r->req.size ) {
+			/* Request sent. We keep req around until the reply arrives, since
+			 * we disconnect and resend it if that fails */
+			r->state = PROXY_REQUEST_SENT;
+			up->writing = NULL;
+		}
+	}
+
+	/* The queue is empty, so let what we've written go */
+	if ( AF_UNIX != up->session->proxy->connect_to[up->address].family ) {
+		if ( sock_set_tcp_cork( up->fd, 0 ) == -1 ) {
+			warn( SHOW_ERRNO( "Failed to unset TCP_CORK" ) );
+			// TODO: should we return to UPSTREAM_DISCONNECTED in this instance?
+		}
+	}
+
+	return state;
+}
+
+/* Upstream has replied to a request we coalesced, so each of the requests it
+ * was made of gets its share of the reply, or the error */
+static void proxy_coalesced_replied(
+	struct proxy_session* session,
+	struct proxy_request* r,
+	uint32_t error )
+{
+	int is_read = ( r->hdr.type & REQUEST_MASK ) == REQUEST_READ;
+	char* data;
+	int i;
+
+	for ( i = 0; i < PROXY_MAX_INFLIGHT; i++ ) {
+		struct proxy_request* part = &session->inflight[i];
+
+		if ( part->state != PROXY_REQUEST_COALESCED || part->coalesced_into != r ) {
+			continue;
+		}
+
+		if ( error != 0 || !is_read ) {
+			proxy_reply_here( part, error, 0 );
+			continue;
+		}
+
+		data = proxy_reply_here( part, 0, part->hdr.len );
+		memcpy(
+			data,
+			(char*) r->rsp.buf + NBD_REPLY_SIZE + ( part->hdr.from - r->hdr.from ),
+			part->hdr.len
+		);
+	}
+
+	r->state = PROXY_REQUEST_REPLIED;
+	proxy_request_free( session, r );
+}
+
+/* We have the whole of a reply from upstream, so it can go downstream, or
+ * just into the cache if it's a read ahead. If it's a write back, we're done
+ * with it, and if it's coalesced, it's shared out */
+static void proxy_reply_received( struct proxy_session* session, struct proxy_request* r )
+{
+	struct writeback* wb = session->proxy->writeback;
+
+	debug( "NBD reply received from upstream." );
+
+	/* We won't need to resend it now */
+	free( r->req.buf );
+	r->req.buf = NULL;
+
+	/* Whatever the write-back file has of a read is newer than upstream's */
+	if ( wb && ( r->hdr.type & REQUEST_MASK ) == REQUEST_READ &&
+			writeback_overlay( wb, r->hdr.from, r->hdr.len, (char*) r->rsp.buf + NBD_REPLY_SIZE ) == -1 ) {
+		warn( SHOW_ERRNO( "Couldn't read from the write-back file" ) );
+		if ( r->is_readahead ) {
+			proxy_request_free( session, r );
+			return;
+		}
+		if ( r->is_coalesced ) {
+			proxy_coalesced_replied( session, r, EIO );
+			return;
+		}
+		free( r->rsp.buf );
+		proxy_reply_here( r, EIO, 0 );
+		return;
+	}
+
+	/* Fill the cache, if needed */
+	if ( proxy_caches( session->proxy ) ) {
+		proxy_cache_for_reply( session, r );
+	}
+
+	if ( r->is_readahead || r->is_writeback ) {
+		r->state = PROXY_REQUEST_REPLIED;
+		proxy_request_free( session, r );
+		return;
+	}
+
+	if ( r->is_coalesced ) {
+		proxy_coalesced_replied( session, r, 0 );
+		return;
+	}
+
+	r->rsp.needle = 0;
+	r->state = PROXY_REQUEST_REPLIED;
+}
+
+/* We can pass a read's data straight from upstream to downstream, rather than
+ * through our memory, if the cache doesn't want to see it, none of it has to
+ * come from the write-back file, it doesn't have to be split up, and nothing
+ * else is waiting to be written downstream */
+static int proxy_can_splice( struct proxy_session* session, struct proxy_request* r )
+{
+	struct writeback* wb = session->proxy->writeback;
+
+	return
+		session->pipe[0] != -1 &&
+		( r->hdr.type & REQUEST_MASK ) == REQUEST_READ &&
+		r->hdr.len >= PROXY_SPLICE_MIN &&
+		!r->is_coalesced &&
+		( wb == NULL || !writeback_overlaps( wb, r->hdr.from, r->hdr.len ) ) &&
+		session->downstream_writing == NULL &&
+		proxy_request_oldest( session, PROXY_REQUEST_REPLIED, NULL ) == NULL;
+}
+
+/* Upstream has started replying to a read whose data we'll splice. If it's
+ * the one we were already splicing, it's been resent after a reconnect */
+static void proxy_splice_start(
+	struct proxy_session* session,
+	struct proxy_request* r,
+	struct nbd_reply_raw* reply_raw )
+{
+	r->spliced_conn_in = 0;
+
+	if ( r == session->splicing ) {
+		debug( "Resuming splice of reply after %"PRIu32" bytes", r->spliced_in );
+		return;
+	}
+
+	r->rsp.buf = xmalloc( NBD_REPLY_SIZE );
+	memcpy( r->rsp.buf, reply_raw, NBD_REPLY_SIZE );
+	r->rsp.size = NBD_REPLY_SIZE;
+	r->rsp.needle = 0;
+	r->spliced_in = 0;
+
+	session->splicing = r;
+	session->downstream_writing = r;
+}
+
+/* Take as much of the spliced read's data from upstream as the pipe will hold,
+ * once it's empty. If we've reconnected, what we'd already taken is thrown
+ * away first. Returns as iobuf_read() does */
+static ssize_t proxy_splice_from_upstream( struct proxy_upstream* up, struct proxy_request* r )
+{
+	struct proxy_session* session = up->session;
+	static unsigned char discard[65536];
+	struct iobuf scratch = { discard, 0, 0 };
+	size_t len;
+	ssize_t count;
+
+	if ( r->spliced_conn_in < r->spliced_in ) {
+		len = r->spliced_in - r->spliced_conn_in;
+		count = iobuf_read(
+			up->fd, &scratch,
+			len < sizeof( discard ) ? len : sizeof( discard )
+		);
+		if ( count > 0 ) {
+			r->spliced_conn_in += count;
+		}
+		return count;
+	}
+
+	if ( session->pipe_bytes > 0 ) {
+		return 0;
+	}
+
+	count = splice_nonblock(
+		up->fd, session->pipe[1], r->hdr.len - r->spliced_conn_in
+	);
+	if ( count > 0 ) {
+		r->spliced_conn_in += count;
+		r->spliced_in += count;
+		session->pipe_bytes += count;
+	}
+
+	return count;
+}
+
+/* Send the spliced read's reply header, then whatever of its data is in the
+ * pipe. Returns 0 if the session should end */
+static int proxy_splice_to_downstream( struct proxy_session* session, struct proxy_request* r )
+{
+	ssize_t count;
+
+	while ( r->rsp.needle < r->rsp.size ) {
+		count = iobuf_write( session->downstream_fd, &r->rsp );
+		if ( count == -1 ) {
+			warn( SHOW_ERRNO( "Failed to write to downstream" ) );
+			return 0;
+		}
+		if ( count == 0 ) {
+			return 1;
+		}
+	}
+
+	while ( session->pipe_bytes > 0 ) {
+		count = splice_nonblock( session->pipe[0], session->downstream_fd, session->pipe_bytes );
+		if ( count == -1 ) {
+			warn( SHOW_ERRNO( "Failed to splice to downstream" ) );
+			return 0;
+		}
+		if ( count == 0 ) {
+			return 1;
+		}
+
+		/* Upstream can't be expected to get anywhere while the pipe's full */
+		session->pipe_bytes -= count;
+		if ( r->upstream != -1 ) {
+			session->upstreams[r->upstream].progress = monotonic_time_ms();
+		}
+	}
+
+	if ( r->state == PROXY_REQUEST_REPLIED ) {
+		debug( "Reply sent" );
+		session->req_count++;
+		session->splicing = NULL;
+		session->downstream_writing = NULL;
+		proxy_request_free( session, r );
+	}
+
+	return 1;
+}
+
+/* Read as many replies from this connection as we can without blocking,
+ * matching each to the request it's for by handle */
+int proxy_read_from_upstream( struct proxy_upstream* up, int state )
+{
+	ssize_t count;
+
+	struct proxy_session* session = up->session;
+	struct nbd_reply      reply;
+	struct nbd_reply_raw* reply_raw = (struct nbd_reply_raw*) up->rsp.buf;
+	struct proxy_request* r;
+
+	while ( 1 ) {
+		r = up->reading;
+
+		if ( up->redirect_state == PROXY_REDIRECT_READING ) {
+			count = iobuf_read( up->fd, &up->redirect, sizeof( struct nbd_redirect_raw ) );
+
+			if ( count == -1 ) {
+				warn( SHOW_ERRNO( "Failed to get redirect from upstream" ) );
+				return UPSTREAM_DISCONNECTED;
+			}
+			if ( count == 0 ) {
+				break;
+			}
+			if ( up->redirect.needle < up->redirect.size ) {
+				continue;
+			}
+
+			/* Upstream hangs up on us next. Whatever it hadn't replied to
+			 * goes to wherever we've been sent */
+			proxy_redirected( up );
+			return UPSTREAM_DISCONNECTED;
+		} else if ( r == NULL ) {
+			count = iobuf_read( up->fd, &up->rsp, NBD_REPLY_SIZE );
+
+			if ( count == -1 ) {
+				warn( SHOW_ERRNO( "Failed to get reply from upstream" ) );
+				return UPSTREAM_DISCONNECTED;
+			}
+			if ( count == 0 ) {
+				break;
+			}
+
+			up->progress = monotonic_time_ms();
+
+			if ( up->rsp.needle < NBD_REPLY_SIZE ) {
+				continue;
+			}
+			up->rsp.needle = 0;
+
+			nbd_r2h_reply( reply_raw, &reply );
+
+			if ( reply.magic != REPLY_MAGIC ) {
+				warn( "Reply magic is incorrect" );
+				return UPSTREAM_DISCONNECTED;
+			}
+
+			if ( reply.error != 0 ) {
+				warn( "NBD error returned from upstream: %"PRIu32, reply.error );
+				return UPSTREAM_DISCONNECTED;
+			}
+
+			r = proxy_request_sent_on( up, reply.handle );
+			if ( r == NULL && up->redirect_state == PROXY_REDIRECT_SENT &&
+					memcmp( reply.handle, PROXY_REDIRECT_HANDLE, 8 ) == 0 ) {
+				up->redirect.needle = 0;
+				up->redirect_state = PROXY_REDIRECT_READING;
+				continue;
+			}
+			if ( r == NULL ) {
+				warn( "Upstream replied to a request we didn't send it" );
+				return UPSTREAM_DISCONNECTED;
+			}
+
+			if ( r == session->splicing || proxy_can_splice( session, r ) ) {
+				proxy_splice_start( session, r, reply_raw );
+				up->reading = r;
+				continue;
+			}
+
+			/* We can't assume the NBD_REPLY_SIZE + req->len is what we'll get
+			 * back, so only expect data for reads */
+			r->rsp.size = NBD_REPLY_SIZE;
+			if ( ( r->hdr.type & REQUEST_MASK ) == REQUEST_READ ) {
+				r->rsp.size += r->hdr.len;
+			}
+			r->rsp.buf = xmalloc( r->rsp.size );
+			memcpy( r->rsp.buf, reply_raw, NBD_REPLY_SIZE );
+			r->rsp.needle = NBD_REPLY_SIZE;
+
+			up->reading = r;
+		} else if ( r == session->splicing ) {
+			count = proxy_splice_from_upstream( up, r );
+
+			if ( count == -1 ) {
+				warn( SHOW_ERRNO( "Failed to splice reply data from upstream" ) );
+				return UPSTREAM_DISCONNECTED;
+			}
+			if ( count == 0 ) {
+				break;
+			}
+
+			up->progress = monotonic_time_ms();
+
+			/* Upstream's done with it. The rest is up to downstream */
+			if ( r->spliced_conn_in == r->hdr.len ) {
+				up->reading = NULL;
+				free( r->req.buf );
+				r->req.buf = NULL;
+				r->state = PROXY_REQUEST_REPLIED;
+			}
+			continue;
+		} else {
+			count = iobuf_read( up->fd, &r->rsp, 0 );
+
+			if ( count == -1 ) {
+				warn( SHOW_ERRNO( "Failed to get reply data from upstream" ) );
+				return UPSTREAM_DISCONNECTED;
+			}
+			if ( count == 0 ) {
+				break;
+			}
+
+			up->progress = monotonic_time_ms();
+		}
 
-				break;
-			case READ_INIT_FROM_UPSTREAM:
-				state = proxy_read_init_from_upstream( proxy, state );
+		if ( r->rsp.needle == r->rsp.size ) {
+			up->reading = NULL;
+			proxy_reply_received( session, r );
+		}
+	}
 
-				if ( state == CONNECT_TO_UPSTREAM ) {
-					connect_to_upstream_cooldown = 1;
-				}
+	return state;
+}
 
+
+/* Send the hello, then as many replies as we can without blocking, in the
+ * order their requests arrived. Returns 0 if the session should end */
+int proxy_write_to_downstream( struct proxy_session* session )
+{
+	ssize_t count;
+	struct proxy_request* r;
+
+	if ( !session->hello_sent ) {
+		info( "Writing init to downstream" );
+
+		count = iobuf_write( session->downstream_fd, &session->req );
+
+		if ( count == -1 ) {
+			warn( SHOW_ERRNO( "Failed to write to downstream" ) );
+			return 0;
+		}
+
+		if ( session->req.needle == session->req.size ) {
+			info( "Hello message sent to client" );
+			session->hello_sent = 1;
+			session->req.size = 0;
+			session->req.needle = 0;
+		}
+
+		return 1;
+	}
+
+	while ( 1 ) {
+		if ( session->downstream_writing == NULL ) {
+			session->downstream_writing =
+				proxy_request_oldest( session, PROXY_REQUEST_REPLIED, NULL );
+		}
+
+		r = session->downstream_writing;
+		if ( r == NULL ) {
+			break;
+		}
+
+		if ( r == session->splicing ) {
+			if ( !proxy_splice_to_downstream( session, r ) ) {
+				return 0;
+			}
+			if ( session->splicing ) {
 				break;
-			case WRITE_TO_UPSTREAM:
-				if ( FD_ISSET( proxy->upstream_fd, &wfds ) ) {
-					state = proxy_write_to_upstream( proxy, state );
-				}
-				break;
-			case READ_FROM_UPSTREAM:
-				if ( FD_ISSET( proxy->upstream_fd, &rfds ) ) {
-					state = proxy_read_from_upstream( proxy, state );
-				}
-				/* Fill the prefetch buffer and rewrite the reply, if needed */
-				if ( proxy_prefetches( proxy ) && state == WRITE_TO_DOWNSTREAM ) {
-					state = proxy_prefetch_for_reply( proxy, state );
-				}
-				break;
-			case WRITE_TO_DOWNSTREAM:
-				if ( FD_ISSET( proxy->downstream_fd, &wfds ) ) {
-					state = proxy_write_to_downstream( proxy, state );
-				}
-				break;
+			}
+			continue;
 		}
 
-		/* In these states, we're interested in restarting after a timeout.
-		 */
-		if ( old_state == state && proxy_state_upstream( state ) ) {
-			if ( ( monotonic_time_ms() ) - state_started > UPSTREAM_TIMEOUT ) {
-				warn(
-					"Timed out in state %s while communicating with upstream",
-					proxy_session_state_names[state]
-				);
-				state = CONNECT_TO_UPSTREAM;
+		count = iobuf_write( session->downstream_fd, &r->rsp );
+
+		if ( count == -1 ) {
+			warn( SHOW_ERRNO( "Failed to write to downstream" ) );
+			return 0;
+		}
+		if ( count == 0 ) {
+			break;
+		}
+
+		if ( r->rsp.needle == r->rsp.size ) {
+			debug( "Reply sent" );
+			session->req_count++;
+			session->downstream_writing = NULL;
+
+			/* We're done with the request & response buffers now */
+			proxy_request_free( session, r );
+		}
+	}
+
+	return 1;
+}
+
+/* Start a non-blocking connect() to upstream, or put it off for a while if
+ * we can't even get that far */
+static void proxy_start_reconnect( struct proxy_upstream* up )
+{
+	proxy_start_connect_to_upstream( up );
+
+	if ( up->fd == -1 ) {
+		warn( SHOW_ERRNO( "Error acquiring socket to upstream" ) );
+		up->attempts++;
+		up->retry_at = monotonic_time_ms() + proxy_reconnect_delay( up->attempts, rand() );
+		return;
+	}
+
+	proxy_set_upstream_state( up, UPSTREAM_CONNECTING );
+}
+
+/* Watch an fd for the given events, if any, leaving the watcher alone if
+ * that's what it's doing already */
+static void proxy_watch( struct ev_loop *loop, ev_io *w, int fd, int events )
+{
+	if ( fd == -1 ) {
+		events = 0;
+	}
+
+	if ( ev_is_active( w ) && w->fd == fd &&
+			( w->events & ( EV_READ | EV_WRITE ) ) == events ) {
+		return;
+	}
 
-				/* Since we've timed out, we won't have gone through the timeout logic
-				 * in the various state handlers that resets these appropriately... */
-				proxy->init.size = 0;
-				proxy->init.needle = 0;
-				proxy->rsp.size = 0;
-				proxy->rsp.needle = 0;
+	ev_io_stop( loop, w );
+
+	if ( events ) {
+		ev_io_set( w, fd, events );
+		ev_io_start( loop, w );
+	}
+}
+
+/* Set a connection's watcher up for whatever it's waiting on next, and say
+ * when it's due to have done something by, if ever */
+static uint64_t proxy_upstream_arm( struct proxy_upstream* up )
+{
+	struct proxy_session* session = up->session;
+	uint64_t deadline = 0;
+	int events = 0;
+
+	switch( up->state ) {
+		case UPSTREAM_DISCONNECTED:
+			deadline = up->retry_at;
+			break;
+		case UPSTREAM_CONNECTING:
+			events |= EV_WRITE;
+			deadline = up->state_started + UPSTREAM_CONNECT_TIMEOUT;
+			break;
+		case UPSTREAM_READ_INIT:
+			events |= EV_READ;
+			deadline = up->state_started + UPSTREAM_CONNECT_TIMEOUT;
+			break;
+		case UPSTREAM_CONNECTED:
+			/* Always reading, so we notice upstream going away early, unless
+			 * we're waiting for downstream to make room in the pipe */
+			if ( up->reading == NULL ||
+					up->reading != session->splicing ||
+					session->pipe_bytes == 0 ) {
+				events |= EV_READ;
+			}
+			if ( up->redirect_state == PROXY_REDIRECT_UNSENT ||
+					up->writing || proxy_request_next_to_send( up ) ) {
+				events |= EV_WRITE;
 			}
+			if ( proxy_upstream_busy( up ) ) {
+				deadline = up->progress + UPSTREAM_TIMEOUT;
+			}
+			break;
+	};
+
+	proxy_watch( session->proxy->ev_loop, &up->watcher, up->fd, events );
+
+	return deadline;
+}
+
+/* Set the session's watchers up for whatever it's waiting on next */
+static void proxy_session_arm( struct proxy_session* session )
+{
+	struct ev_loop *loop = session->proxy->ev_loop;
+	uint64_t now = monotonic_time_ms();
+	uint64_t deadline = 0;
+	int downstream_events = 0;
+	int i;
+
+	if ( session->splicing ) {
+		/* Nothing else can go downstream until its data has, and we may be
+		 * waiting for that from upstream */
+		if ( session->splicing->rsp.needle < session->splicing->rsp.size ||
+				session->pipe_bytes > 0 ) {
+			downstream_events |= EV_WRITE;
 		}
+	} else if ( !session->hello_sent || session->downstream_writing ||
+			proxy_request_oldest( session, PROXY_REQUEST_REPLIED, NULL ) ) {
+		downstream_events |= EV_WRITE;
 	}
 
-	info(
-		"Finished proxy session on fd %i after %"PRIu64" successful request(s)",
-		proxy->downstream_fd, proxy->req_count
-	);
+	if ( session->hello_sent && !session->downstream_closing &&
+			( session->downstream_reading ||
+			  session->inflight_count < PROXY_MAX_INFLIGHT ) ) {
+		downstream_events |= EV_READ;
+	}
 
-	/* Reset these two for the next session */
-	proxy->req_count = 0;
-	proxy->hello_sent = 0;
+	proxy_watch( loop, &session->downstream_watcher, session->downstream_fd, downstream_events );
 
-	return;
+	for ( i = 0; i < session->upstream_count; i++ ) {
+		uint64_t due = proxy_upstream_arm( &session->upstreams[i] );
+		if ( due > 0 && ( deadline == 0 || due < deadline ) ) {
+			deadline = due;
+		}
+	}
+
+	ev_timer_stop( loop, &session->timeout_watcher );
+	if ( deadline > 0 ) {
+		uint64_t wait = deadline > now ? deadline - now : 0;
+		ev_timer_set( &session->timeout_watcher, wait / 1000.0, 0. );
+		ev_timer_start( loop, &session->timeout_watcher );
+	}
 }
 
-/** Accept an NBD socket connection, dispatch appropriately */
-int proxy_accept( struct proxier* params )
+/* Do whatever the events that just fired on this connection to upstream let
+ * us, short of writing to it, and give up on it if it's failed or taken too
+ * long. Writing waits until we know which requests are going where */
+static void proxy_upstream_step( struct proxy_upstream* up, int events )
 {
-	NULLCHECK( params );
+	uint64_t now;
+	int state = up->state;
 
-	int              client_fd;
-	fd_set           fds;
+	switch( state ) {
+		case UPSTREAM_CONNECTING:
+			if ( events & EV_WRITE ) {
+				state = proxy_continue_connecting_to_upstream( up );
+			}
+			/* Leave a bit of time before we try connecting again */
+			if ( state == UPSTREAM_DISCONNECTED ) {
+				proxy_upstream_failed( up );
+			}
+			break;
+		case UPSTREAM_READ_INIT:
+			if ( events & EV_READ ) {
+				state = proxy_read_init_from_upstream( up, state );
+			}
+			if ( state == UPSTREAM_DISCONNECTED ) {
+				proxy_upstream_failed( up );
+			}
+			break;
+		case UPSTREAM_CONNECTED:
+			if ( events & EV_READ ) {
+				state = proxy_read_from_upstream( up, state );
+			}
+			if ( state == UPSTREAM_DISCONNECTED ) {
+				proxy_upstream_failed( up );
+			}
+			break;
+	}
 
-	union mysockaddr client_address;
-	socklen_t        socklen = sizeof( client_address );
+	if ( state != up->state && up->state != UPSTREAM_DISCONNECTED ) {
+		proxy_set_upstream_state( up, state );
+	}
 
-	info( "Waiting for client connection" );
+	/* If upstream hasn't got anywhere in too long, start again */
+	now = monotonic_time_ms();
+	state = up->state;
 
-	FD_ZERO(&fds);
-	FD_SET(params->listen_fd, &fds);
+	if ( ( state == UPSTREAM_CONNECTING &&
+			now - up->state_started >= UPSTREAM_CONNECT_TIMEOUT ) ||
+		( state == UPSTREAM_READ_INIT &&
+			now - up->state_started >= UPSTREAM_CONNECT_TIMEOUT ) ||
+		( state == UPSTREAM_CONNECTED && proxy_upstream_busy( up ) &&
+			now - up->progress >= UPSTREAM_TIMEOUT ) ) {
+		warn(
+			"Timed out in state %s while communicating with upstream",
+			proxy_upstream_state_names[state]
+		);
+		proxy_upstream_failed( up );
+	}
+}
 
-	FATAL_IF_NEGATIVE(
-		sock_try_select(FD_SETSIZE, &fds, NULL, NULL, NULL),
-		SHOW_ERRNO( "select() failed" )
-	);
+static void proxy_session_finish( struct proxy_session* session );
+
+/* Do whatever the events that just fired on downstream_fd and one of the
+ * connections to upstream let us, then wait for the next ones. We read
+ * requests from downstream into the handle table for as long as there's room
+ * in it, give each to whichever connection to upstream has the least to do,
+ * and write them up it in the order they arrived without waiting for
+ * replies. Replies are matched to their requests by handle, and each is sent
+ * downstream as soon as it's complete.
+ *
+ * If writing or reading fails, or a connection takes longer than
+ * UPSTREAM_TIMEOUT to make any progress on what it owes us, we reconnect it,
+ * and resend everything it hasn't replied to, in the original order, on
+ * whichever connections are free. Downstream never knows.
+ */
+static void proxy_session_step(
+	struct proxy_session* session,
+	int downstream_events,
+	struct proxy_upstream* fired,
+	int upstream_events )
+{
+	struct proxy_upstream* up;
+	uint64_t now;
+	int i, failed;
+
+	if ( downstream_events & EV_READ ) {
+		if ( !proxy_read_from_downstream( session ) ) {
+			goto finished;
+		}
+	}
+
+	if ( session->proxy->writeback ) {
+		proxy_writeback_sync( session );
+	}
+
+	for ( i = 0; i < session->upstream_count; i++ ) {
+		up = &session->upstreams[i];
+		proxy_upstream_step( up, up == fired ? upstream_events : 0 );
+	}
+
+	proxy_write_back( session );
 
-	if ( FD_ISSET( params->listen_fd, &fds ) ) {
-		client_fd = accept( params->listen_fd, &client_address.generic, &socklen );
+	/* We may have just read new requests, or had some handed back by a
+	 * connection that failed, so don't wait to be told we can write them */
+	do {
+		failed = 0;
+		proxy_dispatch( session );
 
-		if ( client_address.family != AF_UNIX ) {
-			if ( sock_set_tcp_nodelay(client_fd, 1) == -1 ) {
-				warn( SHOW_ERRNO( "Failed to set TCP_NODELAY" ) );
+		for ( i = 0; i < session->upstream_count; i++ ) {
+			up = &session->upstreams[i];
+			if ( up->state != UPSTREAM_CONNECTED ) {
+				continue;
+			}
+			if ( proxy_write_to_upstream( up, up->state ) == UPSTREAM_DISCONNECTED ) {
+				proxy_upstream_failed( up );
+				failed = 1;
 			}
 		}
+	} while ( failed );
+
+	/* Likewise for any replies that just arrived */
+	if ( !proxy_write_to_downstream( session ) ) {
+		goto finished;
+	}
 
-		info( "Accepted nbd client socket fd %d", client_fd );
-		sock_set_nonblock( client_fd, 1 );
-		params->downstream_fd = client_fd;
-		proxy_session( params );
+	/* A session with no client lasts until there's nothing left to write
+	 * back */
+	if ( session->downstream_closing && session->inflight_count == 0 &&
+			!( session->downstream_fd == -1 && writeback_pending( session->proxy->writeback ) ) ) {
+		goto finished;
+	}
 
-		WARN_IF_NEGATIVE(
-			sock_try_close( params->downstream_fd ),
-			"Couldn't close() downstram fd %i after proxy session",
-			params->downstream_fd
+	/* The first connection is made straight away. The rest wait until the
+	 * client has asked for something, so one that connects and goes away
+	 * again doesn't cost upstream a pile of connections */
+	now = monotonic_time_ms();
+	for ( i = 0; i < session->upstream_count; i++ ) {
+		up = &session->upstreams[i];
+		if ( i > 0 && session->next_seq == 0 ) {
+			break;
+		}
+		if ( up->state == UPSTREAM_DISCONNECTED && now >= up->retry_at ) {
+			proxy_start_reconnect( up );
+		}
+	}
+
+	proxy_session_arm( session );
+	return;
+
+finished:
+	proxy_session_finish( session );
+}
+
+static void proxy_downstream_cb( struct ev_loop *loop __attribute__((unused)), ev_io *w, int revents )
+{
+	proxy_session_step( (struct proxy_session*) w->data, revents, NULL, 0 );
+}
+
+static void proxy_upstream_cb( struct ev_loop *loop __attribute__((unused)), ev_io *w, int revents )
+{
+	struct proxy_upstream* up = (struct proxy_upstream*) w->data;
+	proxy_session_step( up->session, 0, up, revents );
+}
+
+static void proxy_timeout_cb( struct ev_loop *loop __attribute__((unused)), ev_timer *w, int revents )
+{
+	if ( !( revents & EV_TIMER ) ) {
+		warn( "Proxy timeout called but no timer event signalled" );
+		return;
+	}
+
+	proxy_session_step( (struct proxy_session*) w->data, 0, NULL, 0 );
+}
+
+/* The write-back file's sync thread has finished a sync. Every session may
+ * have writes that can now be answered, or that failed */
+static void proxy_synced_cb( struct ev_loop *loop __attribute__((unused)), ev_async *w, int revents )
+{
+	struct proxier* proxy = (struct proxier*) w->data;
+	struct proxy_session *session, *next;
+	int synced;
+
+	if ( !( revents & EV_ASYNC ) ) {
+		warn( "Proxy sync callback called but no async event signalled" );
+		return;
+	}
+
+	synced = writeback_sync_finished( proxy->writeback );
+	if ( synced == 0 ) {
+		return;
+	}
+
+	if ( synced == -1 ) {
+		warn( SHOW_ERRNO( "Couldn't sync the write-back file" ) );
+		for ( session = proxy->sessions; session != NULL; session = session->next ) {
+			proxy_writeback_synced( session, EIO );
+		}
+	}
+
+	for ( session = proxy->sessions; session != NULL; session = next ) {
+		next = session->next;
+		proxy_session_step( session, 0, NULL, 0 );
+	}
+}
+
+/* Start serving a client that's just connected to us on fd. If fd is -1,
+ * there's no client, and the session just writes back what's in the
+ * write-back file */
+static void proxy_session_start( struct proxier* proxy, int fd )
+{
+	struct proxy_session* session = xmalloc( sizeof( struct proxy_session ) );
+	int i;
+
+	session->proxy = proxy;
+	session->downstream_fd = fd;
+
+	/* req doubles as the buffer for our hello to downstream */
+	session->req.buf = xmalloc( sizeof( struct nbd_init_raw ) );
+
+	/* First action: Write hello to downstream */
+	if ( fd == -1 ) {
+		session->hello_sent = 1;
+		session->downstream_closing = 1;
+	} else {
+		nbd_hello_to_buf( (struct nbd_init_raw *) session->req.buf, proxy->upstream_size );
+		session->req.size = sizeof( struct nbd_init_raw );
+		session->req.needle = 0;
+	}
+
+	/* We only splice what the cache doesn't need to see */
+	session->pipe[0] = session->pipe[1] = -1;
+	if ( proxy_caches( proxy ) ) {
+		session->readahead = readahead_create( proxy->readahead_window );
+	} else if ( pipe2( session->pipe, O_NONBLOCK ) == -1 ) {
+		warn( SHOW_ERRNO( "Couldn't create pipe, so not splicing" ) );
+		session->pipe[0] = session->pipe[1] = -1;
+	} else if ( fcntl( session->pipe[1], F_SETPIPE_SZ, NBD_MAX_SIZE ) == -1 ) {
+		debug( SHOW_ERRNO( "Couldn't make the pipe bigger" ) );
+	}
+
+	session->upstream_count = proxy->connections;
+	for ( i = 0; i < session->upstream_count; i++ ) {
+		struct proxy_upstream* up = &session->upstreams[i];
+
+		up->session = session;
+		up->index = i;
+		up->init.buf = xmalloc( sizeof( struct nbd_init_raw ) );
+		up->rsp.buf  = xmalloc( NBD_REPLY_SIZE );
+		/* Big enough for the request, and the address we get back */
+		up->redirect.buf = xmalloc( sizeof( struct nbd_redirect_raw ) );
+
+		/* Use the connection an earlier session left behind, if there is
+		 * one. The rest we connect afresh */
+		up->fd = -1;
+		if ( i == 0 && proxy->upstream_fd != -1 ) {
+			up->fd = proxy->upstream_fd;
+			up->address = proxy->upstream_address;
+			proxy_redirect_prepare( up, proxy->upstream_redirect );
+			proxy->upstream_fd = -1;
+		}
+
+		if ( up->fd == -1 ) {
+			up->retry_at = 0;
+			proxy_set_upstream_state( up, UPSTREAM_DISCONNECTED );
+		} else {
+			proxy_set_upstream_state( up, UPSTREAM_CONNECTED );
+		}
+
+		ev_init( &up->watcher, proxy_upstream_cb );
+		up->watcher.data = up;
+	}
+
+	ev_init( &session->downstream_watcher, proxy_downstream_cb );
+	session->downstream_watcher.data = session;
+	ev_init( &session->timeout_watcher, proxy_timeout_cb );
+	session->timeout_watcher.data = session;
+
+	session->next = proxy->sessions;
+	if ( session->next ) {
+		session->next->prev = session;
+	}
+	proxy->sessions = session;
+	proxy->session_count++;
+
+	if ( fd == -1 ) {
+		info(
+			"Writing back %"PRIu64" bytes from %s",
+			writeback_dirty_bytes( proxy->writeback ), proxy->writeback_file
+		);
+	} else {
+		info(
+			"Beginning proxy session on fd %i, %d in progress",
+			fd, proxy->session_count
 		);
-		params->downstream_fd = -1;
 	}
 
-	return 1; /* We actually expect to be interrupted by signal handlers */
+	proxy_session_step( session, 0, NULL, 0 );
 }
 
+static void proxy_session_finish( struct proxy_session* session )
+{
+	struct proxier* proxy = session->proxy;
+	struct ev_loop* loop = proxy->ev_loop;
+	int i;
+
+	if ( session->downstream_fd == -1 ) {
+		info( "Finished writing back from %s", proxy->writeback_file );
+	} else {
+		info(
+			"Finished proxy session on fd %i after %"PRIu64" successful request(s)",
+			session->downstream_fd, session->req_count
+		);
+	}
+
+	if ( proxy_caches( proxy ) ) {
+		info(
+			"Cache has had %"PRIu64" hit(s) and %"PRIu64" miss(es)",
+			proxy->cache->hits, proxy->cache->misses
+		);
+	}
+
+	if ( proxy->reconnects > 0 ) {
+		info(
+			"Reconnected to upstream %"PRIu64" time(s), taking %"PRIu64"ms "
+			"on average and %"PRIu64"ms at most",
+			proxy->reconnects, proxy->reconnect_ms / proxy->reconnects,
+			proxy->reconnect_ms_max
+		);
+	}
+
+	ev_io_stop( loop, &session->downstream_watcher );
+	ev_timer_stop( loop, &session->timeout_watcher );
 
-void proxy_accept_loop( struct proxier* params )
+	/* If upstream still owes us replies on a connection, or we were part-way
+	 * through talking to it, it's no use to the next session. Otherwise we
+	 * keep one around for it */
+	for ( i = 0; i < session->upstream_count; i++ ) {
+		struct proxy_upstream* up = &session->upstreams[i];
+
+		ev_io_stop( loop, &up->watcher );
+
+		if ( up->state != UPSTREAM_CONNECTED ||
+				proxy_upstream_busy( up ) || proxy->upstream_fd != -1 ||
+				up->rsp.needle > 0 || up->redirect_state == PROXY_REDIRECT_READING ||
+				( up->redirect_state == PROXY_REDIRECT_UNSENT && up->redirect.needle > 0 ) ) {
+			proxy_upstream_failed( up );
+		} else {
+			proxy->upstream_fd = up->fd;
+			proxy->upstream_address = up->address;
+			proxy->upstream_redirect = up->redirect_state;
+			up->fd = -1;
+		}
+
+		free( up->init.buf );
+		free( up->rsp.buf );
+		free( up->redirect.buf );
+	}
+
+	for ( i = 0; i < PROXY_MAX_INFLIGHT; i++ ) {
+		if ( session->inflight[i].state != PROXY_REQUEST_FREE ) {
+			proxy_request_free( session, &session->inflight[i] );
+		}
+	}
+
+	if ( session->downstream_fd != -1 ) {
+		WARN_IF_NEGATIVE(
+			sock_try_close( session->downstream_fd ),
+			"Couldn't close() downstream fd %i after proxy session",
+			session->downstream_fd
+		);
+	}
+
+	if ( session->pipe[0] != -1 ) {
+		close( session->pipe[0] );
+		close( session->pipe[1] );
+	}
+
+	if ( session->readahead ) {
+		readahead_destroy( session->readahead );
+	}
+	free( session->req.buf );
+
+	if ( session->prev ) {
+		session->prev->next = session->next;
+	} else {
+		proxy->sessions = session->next;
+	}
+	if ( session->next ) {
+		session->next->prev = session->prev;
+	}
+	proxy->session_count--;
+
+	/* Anything the last client left in the write-back file still has to get
+	 * upstream */
+	if ( session->downstream_fd != -1 && proxy->session_count == 0 &&
+			proxy->writeback && writeback_pending( proxy->writeback ) ) {
+		free( session );
+		proxy_session_start( proxy, -1 );
+		return;
+	}
+
+	free( session );
+}
+
+/** Accept an NBD socket connection, and start a session for it */
+static void proxy_accept_cb( struct ev_loop *loop __attribute__((unused)), ev_io *w, int revents )
 {
+	struct proxier* params = (struct proxier*) w->data;
 	NULLCHECK( params );
-	while( proxy_accept( params ) );
+
+	int              client_fd;
+	union mysockaddr client_address;
+	socklen_t        socklen = sizeof( client_address );
+
+	if ( !( revents & EV_READ ) ) {
+		warn( "Proxy accept called but no read event signalled" );
+		return;
+	}
+
+	client_fd = accept( params->listen_fd, &client_address.generic, &socklen );
+
+	if ( client_fd == -1 ) {
+		if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) {
+			warn( SHOW_ERRNO( "Failed to accept client connection" ) );
+		}
+		return;
+	}
+
+	if ( client_address.family != AF_UNIX ) {
+		if ( sock_set_tcp_nodelay(client_fd, 1) == -1 ) {
+			warn( SHOW_ERRNO( "Failed to set TCP_NODELAY" ) );
+		}
+	}
+
+	info( "Accepted nbd client socket fd %d", client_fd );
+	sock_set_nonblock( client_fd, 1 );
+	proxy_session_start( params, client_fd );
 }
 
+
 /** Closes sockets */
 void proxy_cleanup( struct proxier* proxy )
 {
 	NULLCHECK( proxy );
 
+	struct proxy_session* session;
+	int i;
+
 	info( "Cleaning up" );
 
 	if ( -1 != proxy->listen_fd ) {
@@ -930,14 +2516,28 @@ void proxy_cleanup( struct proxier* proxy )
 		proxy->listen_fd = -1;
 	}
 
-	if ( -1 != proxy->downstream_fd ) {
-		WARN_IF_NEGATIVE(
-			sock_try_close( proxy->downstream_fd ),
-			SHOW_ERRNO(
-				"Failed to close() downstream fd %i", proxy->downstream_fd
-			)
-		);
-		proxy->downstream_fd = -1;
+	for ( session = proxy->sessions; session != NULL; session = session->next ) {
+		if ( -1 != session->downstream_fd ) {
+			WARN_IF_NEGATIVE(
+				sock_try_close( session->downstream_fd ),
+				SHOW_ERRNO(
+					"Failed to close() downstream fd %i", session->downstream_fd
+				)
+			);
+			session->downstream_fd = -1;
+		}
+
+		for ( i = 0; i < session->upstream_count; i++ ) {
+			struct proxy_upstream* up = &session->upstreams[i];
+
+			if ( -1 != up->fd ) {
+				WARN_IF_NEGATIVE(
+					sock_try_close( up->fd ),
+					SHOW_ERRNO( "Failed to close() upstream fd %i", up->fd )
+				);
+				up->fd = -1;
+			}
+		}
 	}
 
 	if ( -1 != proxy->upstream_fd ) {
@@ -966,8 +2566,35 @@ int do_proxy( struct proxier* params )
 		return 1;
 	};
 
+	if ( params->writeback_file ) {
+		params->writeback = writeback_open(
+			params->writeback_file, params->upstream_size, !params->writeback_unordered
+		);
+		ev_async_init( &params->sync_watcher, proxy_synced_cb );
+		params->sync_watcher.data = (void*) params;
+		ev_async_start( params->ev_loop, &params->sync_watcher );
+		writeback_notify( params->writeback, params->ev_loop, &params->sync_watcher );
+		info(
+			"Keeping writes in %s, with %"PRIu64" bytes still to write back",
+			params->writeback_file, writeback_dirty_bytes( params->writeback )
+		);
+	}
+
 	proxy_open_listen_socket( params );
-	proxy_accept_loop( params );
+	sock_set_nonblock( params->listen_fd, 1 );
+
+	ev_io_init( &params->listen_watcher, proxy_accept_cb, params->listen_fd, EV_READ );
+	params->listen_watcher.data = (void*) params;
+	ev_io_start( params->ev_loop, &params->listen_watcher );
+
+	if ( params->writeback && writeback_pending( params->writeback ) ) {
+		proxy_session_start( params, -1 );
+	}
+
+	info( "Waiting for client connections" );
+
+	/* We expect to be interrupted by signal handlers */
+	ev_run( params->ev_loop, 0 );
 	proxy_cleanup( params );
 
 	return 0;
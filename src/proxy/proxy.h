@@ -9,9 +9,11 @@
 #include "nbdtypes.h"
 #include "self_pipe.h"
 
-#ifdef PREFETCH
-  #include "prefetch.h"
-#endif
+#include <ev.h>
+
+struct cache;
+struct readahead;
+struct writeback;
 
 /** UPSTREAM_TIMEOUT
  * How long ( in ms ) to allow for upstream to respond. If it takes longer
@@ -19,12 +21,279 @@
  */
 #define UPSTREAM_TIMEOUT 30 * 1000
 
+/** UPSTREAM_CONNECT_TIMEOUT
+ * How long ( in ms ) to wait for a connect() to upstream to complete, and
+ * then for its hello, before giving up on it.
+ */
+#define UPSTREAM_CONNECT_TIMEOUT 5 * 1000
+
+/** UPSTREAM_RECONNECT_MIN, UPSTREAM_RECONNECT_MAX
+ * When a working connection to upstream goes away, we try to connect again
+ * straight away. If that fails, we wait around UPSTREAM_RECONNECT_MIN ms
+ * before the next attempt, doubling each time another fails, up to
+ * UPSTREAM_RECONNECT_MAX. Each wait is picked at random from the top half of
+ * that range, so lots of proxies don't all come back at once.
+ */
+#define UPSTREAM_RECONNECT_MIN 50
+#define UPSTREAM_RECONNECT_MAX 2 * 1000
+
+/** UPSTREAM_KEEPALIVE_IDLE, UPSTREAM_KEEPALIVE_INTERVAL,
+ * UPSTREAM_KEEPALIVE_COUNT, UPSTREAM_USER_TIMEOUT
+ * So we notice an upstream that's gone away without telling us well before
+ * UPSTREAM_TIMEOUT, we send TCP keepalives after this many seconds without
+ * hearing from it, and give up after this many go unanswered. We also give up
+ * if anything we send goes unacknowledged for UPSTREAM_USER_TIMEOUT ms.
+ */
+#define UPSTREAM_KEEPALIVE_IDLE 2
+#define UPSTREAM_KEEPALIVE_INTERVAL 1
+#define UPSTREAM_KEEPALIVE_COUNT 3
+#define UPSTREAM_USER_TIMEOUT 5 * 1000
+
+/** PROXY_MAX_INFLIGHT
+ * How many requests we'll read from a client before any of them have been
+ * replied to. Once this many are outstanding, we stop reading from downstream
+ * until one of them completes.
+ */
+#define PROXY_MAX_INFLIGHT 64
+
+/** PROXY_MAX_READAHEAD
+ * How many of those entries may be reads ahead of our own, rather than
+ * requests from downstream.
+ */
+#define PROXY_MAX_READAHEAD 8
+
+/** PROXY_MAX_WRITEBACK
+ * How many of them may be writes back from the write-back file, if we have
+ * one, and the flushes that follow them.
+ */
+#define PROXY_MAX_WRITEBACK 8
+
+/** PROXY_SPLICE_MIN
+ * Reads at least this big are passed from upstream to downstream with
+ * splice(), through a pipe, rather than copied through our memory, if we
+ * don't need to cache what's read.
+ */
+#define PROXY_SPLICE_MIN 4096
+
+/** PROXY_COALESCE_MAX
+ * Contiguous reads, or writes, from downstream that are waiting to go
+ * upstream at the same time are sent as one request of up to this many
+ * bytes, and the reply is split between them.
+ */
+#define PROXY_COALESCE_MAX ( 256 * 1024 )
+
+/** PROXY_CONNECTIONS
+ * How many connections to upstream each session spreads its requests over,
+ * unless FLEXNBD_PROXY_CONNECTIONS says otherwise, up to
+ * PROXY_CONNECTIONS_MAX. Each request goes to whichever connection has the
+ * fewest outstanding, so one slow reply doesn't hold up the rest.
+ */
+#define PROXY_CONNECTIONS 1
+#define PROXY_CONNECTIONS_MAX 16
+
+/** PROXY_ADDRESSES_MAX
+ * How many addresses we'll keep for upstream: those given on the command
+ * line, and any we're redirected to.
+ */
+#define PROXY_ADDRESSES_MAX 8
+
+/** PROXY_REDIRECT_HANDLE
+ * The handle we give the REQUEST_REDIRECT we send on each connection to
+ * upstream that can take one.
+ */
+#define PROXY_REDIRECT_HANDLE "redirect"
+
+/* What's happening to an entry in the handle table */
+enum {
+	PROXY_REQUEST_FREE = 0,
+	PROXY_REQUEST_READING,   /* Still receiving write data from downstream */
+	PROXY_REQUEST_QUEUED,    /* Waiting to be ( re- )sent upstream */
+	PROXY_REQUEST_SENT,      /* Sent upstream, waiting for the reply */
+	PROXY_REQUEST_COALESCED, /* Going upstream as part of a bigger request */
+	PROXY_REQUEST_SYNCING,   /* In the write-back file, waiting to be synced */
+	PROXY_REQUEST_REPLIED    /* Reply waiting to be sent downstream */
+};
+
+struct proxy_request {
+	int state;
+
+	/* Order of arrival from downstream. Requests are sent upstream in this
+	 * order, and resent in it after a reconnect */
+	uint64_t seq;
+
+	/* Which of the session's connections to upstream it's been given to, or
+	 * -1 if it's waiting for one */
+	int upstream;
+
+	/* The request as we'll send it upstream, in host format */
+	struct nbd_request hdr;
+
+	/* The raw request, followed by any write data. We keep it until upstream
+	 * replies, in case we have to reconnect and send it again */
+	struct iobuf req;
+
+	/* The raw reply, followed by any read data */
+	struct iobuf rsp;
+
+	/* Set if we made this read up ourselves to read ahead. Its reply goes in
+	 * the cache rather than downstream */
+	int is_readahead;
+
+	/* Set if we made this write or flush up ourselves, to get what's dirty
+	 * in the write-back file upstream. There's no reply for downstream */
+	int is_writeback;
+
+	/* Set if we made this request up ourselves out of several contiguous
+	 * ones from downstream, which are left waiting on it. Its reply is split
+	 * between them */
+	int is_coalesced;
+
+	/* If this request is going upstream as part of a coalesced one, that
+	 * one */
+	struct proxy_request* coalesced_into;
+
+	/* What cache_epoch() was when a read was sent, so we don't cache any of
+	 * the reply that a later write may have changed */
+	uint64_t cache_epoch;
+
+	/* If this write is in the write-back file, the sync of it that has to
+	 * finish before we answer it. If it's going straight upstream instead,
+	 * how many writes the write-back file had taken when it arrived, which
+	 * have to get there first */
+	uint64_t writeback_sync;
+	uint64_t writeback_after;
+
+	/* If this read's data is being spliced, how much of it we've taken from
+	 * upstream in all, and since we last connected. After a reconnect, the
+	 * resent read's data is thrown away until we get to where we were */
+	uint32_t spliced_in;
+	uint32_t spliced_conn_in;
+};
+
+/* Where a connection is with asking upstream where the image goes, if it
+ * ever moves */
+enum {
+	PROXY_REDIRECT_NONE = 0, /* Upstream can't tell us */
+	PROXY_REDIRECT_UNSENT,   /* Waiting to ( finish ) sending the request */
+	PROXY_REDIRECT_SENT,     /* Sent, waiting for the reply */
+	PROXY_REDIRECT_READING   /* Receiving the new address */
+};
+
+/* One of a session's connections to upstream */
+struct proxy_upstream {
+	struct proxy_session* session;
+	int index;
+
+	/* Which of the proxier's addresses we're connected, or connecting, to */
+	int address;
+
+	/* The socket returned by connect() that we send requests to and receive
+	 * responses from
+	 */
+	int               fd;
+
+	/* One of the UPSTREAM_* states in proxy.c, when it changed, and when we
+	 * last managed to send or receive anything on fd */
+	int               state;
+	uint64_t          state_started;
+	uint64_t          progress;
+
+	/* While we're disconnected, when we should next try to connect, how many
+	 * attempts have failed in a row, and when we lost the last connection
+	 * that worked. lost_at is 0 once we're connected again */
+	uint64_t          retry_at;
+	int               attempts;
+	uint64_t          lost_at;
+
+	/* Used for our non-blocking negotiation with upstream. */
+	struct iobuf init;
+
+	/* The header of the next NBD reply from upstream */
+	struct iobuf rsp;
+
+	/* One of the PROXY_REDIRECT_* states, and the REQUEST_REDIRECT we send
+	 * upstream, which is also where the reply's new address goes */
+	int          redirect_state;
+	struct iobuf redirect;
+
+	/* The entries that are part-way through being written to and read from
+	 * this connection, if any */
+	struct proxy_request* writing;
+	struct proxy_request* reading;
+
+	/* Watch fd for whatever we're waiting to do with it */
+	ev_io watcher;
+};
+
+/* One client connected to us, with its own connections to upstream */
+struct proxy_session {
+	struct proxier*       proxy;
+	struct proxy_session* prev;
+	struct proxy_session* next;
+
+	/* The socket returned by accept() that we receive requests from and send
+	 * responses to
+	 */
+	int               downstream_fd;
+
+	/* Where we send requests, and how many of them there are */
+	struct proxy_upstream upstreams[PROXY_CONNECTIONS_MAX];
+	int                   upstream_count;
+
+	/* The header of the next NBD request from downstream. We also send our
+	 * hello to downstream from here, since nothing is read until it's gone */
+	struct iobuf req;
+
+	/* The handle table: every request we've read from downstream and not yet
+	 * finished replying to, and how many of the entries are in use. */
+	struct proxy_request inflight[PROXY_MAX_INFLIGHT];
+	int inflight_count;
+	uint64_t next_seq;
+
+	/* The entries that are part-way through being read from and written to
+	 * downstream, if any. Only one of each can be in progress at a time */
+	struct proxy_request* downstream_reading;
+	struct proxy_request* downstream_writing;
+
+	/* Set once downstream has asked to disconnect. We finish the requests
+	 * we have, then end the session */
+	int downstream_closing;
+
+	/* How many requests we've replied to so far, and whether the NBD_INIT
+	 * code has been sent to the client yet. */
+	uint64_t req_count;
+	int hello_sent;
+
+	/* The read whose data is going through the pipe, if any, and how much
+	 * of its data is in there. Nothing else is written downstream until it's
+	 * all gone. pipe[0] is -1 if we're not splicing */
+	struct proxy_request* splicing;
+	int    pipe[2];
+	size_t pipe_bytes;
+
+	/* Where downstream is reading sequentially, and how many reads ahead of
+	 * it are in the handle table. Only used if we're caching */
+	struct readahead *readahead;
+	int readahead_count;
+
+	/* How many writes back, and flushes after them, are in the handle table */
+	int writeback_count;
+
+	/* Watch downstream_fd for whatever we're waiting to do with it, and fire
+	 * when upstream is next due to have done something */
+	ev_io    downstream_watcher;
+	ev_timer timeout_watcher;
+};
+
 struct proxier {
 	/** address/port to bind to */
 	union mysockaddr  listen_on;
 
-	/** address/port to connect to */
-	union mysockaddr  connect_to;
+	/** addresses/ports to connect to, how many there are, and which we
+	 * connect to next. If one can't be reached, we move on to the next */
+	union mysockaddr  connect_to[PROXY_ADDRESSES_MAX];
+	int               addresses;
+	int               address;
 
 	/** address to bind to when making outgoing connections */
 	union mysockaddr  connect_from;
@@ -33,51 +302,60 @@ struct proxier {
 	/* The socket we listen() on and accept() against */
 	int               listen_fd;
 
-	/* The socket returned by accept() that we receive requests from and send
-	 * responses to
-	 */
-	int               downstream_fd;
-
-	/* The socket returned by connect() that we send requests to and receive
-	 * responses from
-	 */
+	/* A connection to upstream that no session is using, if we have one.
+	 * The next session to start takes it, rather than connecting afresh.
+	 * We keep which address it's to, and its PROXY_REDIRECT_* state */
 	int               upstream_fd;
+	int               upstream_address;
+	int               upstream_redirect;
+
+	/* How many connections to upstream each session makes */
+	int               connections;
+
+	/* How many times a session has got a connection to upstream back after
+	 * losing it, and how long that took in all, and at most, in ms */
+	uint64_t          reconnects;
+	uint64_t          reconnect_ms;
+	uint64_t          reconnect_ms_max;
 
 	/* This is the size we advertise to the downstream server */
 	uint64_t          upstream_size;
 
-	/* We transform the raw request header into here */
-	struct nbd_request req_hdr;
+	/* Every session runs on this loop, started by listen_watcher accepting
+	 * a new client */
+	struct ev_loop   *ev_loop;
+	ev_io             listen_watcher;
 
-    /* We transform the raw reply header into here */
-	struct nbd_reply   rsp_hdr;
+	/* The sessions in progress */
+	struct proxy_session* sessions;
+	int                   session_count;
 
-	/* Used for our non-blocking negotiation with upstream. TODO: maybe use
-	 * for downstream as well ( we currently overload rsp ) */
-	struct iobuf init;
+	/** These are only used if we pass --cache on the command line */
 
-	/* The current NBD request from downstream */
-	struct iobuf req;
+	/* Blocks we've read, including any we read ahead. Shared by all the
+	 * sessions, so a write through one updates what the others read */
+	struct cache *cache;
 
-	/* The current NBD reply from upstream */
-	struct iobuf rsp;
+	/* How far ahead of a stream each session may read */
+	uint32_t readahead_window;
 
-	/* It's starting to feel like we need an object for a single proxy session.
-	 * These two track how many requests we've sent so far, and whether the
-	 * NBD_INIT code has been sent to the client yet.
-	 */
-	uint64_t req_count;
-	int hello_sent;
+	/** */
 
-	/** These are only used if we pass --cache on the command line */
+	/** Only used if we pass --writeback on the command line */
+
+	/* Where writes are kept until they've reached upstream. Shared by all
+	 * the sessions, and written back by whichever have room. If there's
+	 * something to write back and no client, a session with no downstream
+	 * is started to do it */
+	char             *writeback_file;
+	struct writeback *writeback;
 
-	/* While the in-flight request has been munged by prefetch, these two are
-	 * set to true, and the original length of the request, respectively */
-	int is_prefetch_req;
-	uint32_t prefetch_req_orig_len;
+	/* Set if we were asked to write back in image order, rather than the
+	 * order the writes were made in */
+	int               writeback_unordered;
 
-	/* And here, we actually store the prefetched data once it's returned */
-	struct prefetch *prefetch;
+	/* Poked by the write-back file's sync thread when a sync finishes */
+	ev_async          sync_watcher;
 
 	/** */
 };
@@ -88,8 +366,11 @@ struct proxier* proxy_create(
 	char* s_upstream_address,
 	char* s_upstream_port,
 	char* s_upstream_bind,
-	char* s_cache_bytes);
+	char* s_cache_bytes,
+	char* s_writeback_file,
+	int writeback_unordered);
 int do_proxy( struct proxier* proxy );
+uint64_t proxy_reconnect_delay( int attempts, unsigned int jitter );
 void proxy_cleanup( struct proxier* proxy );
 void proxy_destroy( struct proxier* proxy );
 
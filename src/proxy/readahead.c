@@ -0,0 +1,137 @@
+#include "readahead.h"
+#include "cache.h"
+#include "util.h"
+
+#include <string.h>
+
+struct readahead* readahead_create( uint32_t max_window )
+{
+	struct readahead *ra = xmalloc( sizeof( struct readahead ) );
+	ra->max_window = max_window;
+	return ra;
+}
+
+void readahead_destroy( struct readahead *ra )
+{
+	free( ra );
+}
+
+/* Forget every stream, eg. because the data we read ahead has gone */
+void readahead_reset( struct readahead *ra )
+{
+	memset( ra->streams, 0, sizeof( ra->streams ) );
+}
+
+
+static struct readahead_stream* readahead_find( struct readahead *ra, uint64_t from )
+{
+	int i;
+
+	for ( i = 0; i < READAHEAD_STREAMS; i++ ) {
+		struct readahead_stream *stream = &ra->streams[i];
+		if ( stream->last_used && from >= stream->from && from <= stream->next ) {
+			return stream;
+		}
+	}
+
+	return NULL;
+}
+
+/* Reuse whichever stream was read from longest ago */
+static struct readahead_stream* readahead_oldest( struct readahead *ra )
+{
+	struct readahead_stream *oldest = &ra->streams[0];
+	int i;
+
+	for ( i = 1; i < READAHEAD_STREAMS; i++ ) {
+		if ( ra->streams[i].last_used < oldest->last_used ) {
+			oldest = &ra->streams[i];
+		}
+	}
+
+	return oldest;
+}
+
+
+/* Tell us about a read from downstream, whether or not we had it cached.
+ * A read that starts where a stream left off makes its window bigger, and
+ * one that goes back over what the stream has already read makes it smaller.
+ * Anything else starts a new stream, which doesn't read ahead until it's
+ * read from in sequence. */
+struct readahead_stream* readahead_note_read( struct readahead *ra, uint64_t from, uint32_t len )
+{
+	struct readahead_stream *stream = readahead_find( ra, from );
+
+	if ( stream == NULL ) {
+		stream = readahead_oldest( ra );
+		stream->from = from;
+		stream->next = from + len;
+		stream->ahead = 0;
+		stream->window = 0;
+	} else if ( from == stream->next ) {
+		if ( stream->window == 0 ) {
+			stream->window = len * 2 > READAHEAD_MIN_WINDOW ? len * 2 : READAHEAD_MIN_WINDOW;
+		} else {
+			stream->window *= 2;
+		}
+		if ( stream->window > ra->max_window ) {
+			stream->window = ra->max_window;
+		}
+	} else {
+		stream->window /= 2;
+	}
+
+	if ( from + len > stream->next ) {
+		stream->next = from + len;
+	}
+	stream->from = from;
+	stream->last_used = ++ra->clock;
+
+	return stream;
+}
+
+
+/* If the stream wants more read ahead of it, say what to read next and
+ * return 1. We only read in whole cache blocks, and don't bother with bits
+ * smaller than half the window unless that's all there is left before the
+ * end of the disc. */
+int readahead_next_chunk(
+	struct readahead *ra,
+	struct readahead_stream *stream,
+	uint64_t size,
+	uint64_t *from,
+	uint32_t *len )
+{
+	uint64_t target = stream->next + stream->window;
+	uint64_t want;
+	uint32_t chunk = READAHEAD_CHUNK;
+
+	if ( stream->window == 0 ) {
+		return 0;
+	}
+
+	if ( stream->ahead < stream->next ) {
+		stream->ahead = stream->next - ( stream->next % CACHE_BLOCK_SIZE );
+	}
+	if ( target > size ) {
+		target = size;
+	}
+	if ( stream->ahead >= target ) {
+		return 0;
+	}
+
+	want = target - stream->ahead;
+	if ( chunk > ra->max_window ) {
+		chunk = ra->max_window;
+	}
+	if ( want < chunk && want < stream->window / 2 && target < size ) {
+		return 0;
+	}
+
+	*from = stream->ahead;
+	*len = want < chunk ? want : chunk;
+	stream->ahead += *len;
+
+	return 1;
+}
+
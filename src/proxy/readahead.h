@@ -0,0 +1,50 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <stdint.h>
+
+/* How many sequential readers we keep track of at once */
+#define READAHEAD_STREAMS 8
+
+/* A stream's readahead window starts at this size, or twice the size of the
+ * read that established it, doubles every time it's read from in sequence,
+ * and halves every time it's read out of sequence. */
+#define READAHEAD_MIN_WINDOW ( 128 * 1024 )
+#define READAHEAD_MAX_WINDOW ( 4 * 1024 * 1024 )
+
+/* We read ahead in requests of up to this size */
+#define READAHEAD_CHUNK ( 512 * 1024 )
+
+struct readahead_stream {
+	/* Zero if this stream isn't in use */
+	uint64_t last_used;
+
+	/* The last read, and where we expect the next one to start */
+	uint64_t from;
+	uint64_t next;
+
+	/* How far we've read ahead so far, and how far we should */
+	uint64_t ahead;
+	uint32_t window;
+};
+
+struct readahead {
+	struct readahead_stream streams[READAHEAD_STREAMS];
+	uint32_t max_window;
+	uint64_t clock;
+};
+
+struct readahead* readahead_create( uint32_t max_window );
+void readahead_destroy( struct readahead *ra );
+void readahead_reset( struct readahead *ra );
+
+struct readahead_stream* readahead_note_read( struct readahead *ra, uint64_t from, uint32_t len );
+int readahead_next_chunk(
+	struct readahead *ra,
+	struct readahead_stream *stream,
+	uint64_t size,
+	uint64_t *from,
+	uint32_t *len );
+
+#endif
+
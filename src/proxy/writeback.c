@@ -0,0 +1,859 @@
+#include "writeback.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* The dirty bits start this far into the map, after the header */
+#define WRITEBACK_MAP_BITS 64
+
+static inline uint64_t writeback_first( uint64_t from )
+{
+	return from / WRITEBACK_BLOCK_SIZE;
+}
+
+static inline uint64_t writeback_last( uint64_t from, uint32_t len )
+{
+	return ( from + len - 1 ) / WRITEBACK_BLOCK_SIZE;
+}
+
+static inline uint64_t writeback_range_blocks( struct writeback_range *range )
+{
+	return ( range->len + WRITEBACK_BLOCK_SIZE - 1 ) / WRITEBACK_BLOCK_SIZE;
+}
+
+static int writeback_in_image( struct writeback *wb, uint64_t from, uint32_t len )
+{
+	return len > 0 && from < wb->size && len <= wb->size - from;
+}
+
+/* The map goes on the first page after the data */
+static off_t writeback_map_offset( uint64_t size )
+{
+	uint64_t page = sysconf( _SC_PAGESIZE );
+	return ( ( size + page - 1 ) / page ) * page;
+}
+
+
+static int writeback_pread( int fd, char *buf, size_t len, uint64_t from )
+{
+	ssize_t count;
+
+	while ( len > 0 ) {
+		count = pread( fd, buf, len, from );
+		if ( count == -1 && errno == EINTR ) {
+			continue;
+		}
+		if ( count <= 0 ) {
+			return -1;
+		}
+		buf += count;
+		from += count;
+		len -= count;
+	}
+
+	return 0;
+}
+
+static int writeback_pwrite( int fd, char *buf, size_t len, uint64_t from )
+{
+	ssize_t count;
+
+	while ( len > 0 ) {
+		count = pwrite( fd, buf, len, from );
+		if ( count == -1 && errno == EINTR ) {
+			continue;
+		}
+		if ( count <= 0 ) {
+			return -1;
+		}
+		buf += count;
+		from += count;
+		len -= count;
+	}
+
+	return 0;
+}
+
+
+/* Sync the file whenever we're asked to, and say how it went */
+static void* writeback_syncer( void *wb_uncast )
+{
+	struct writeback *wb = (struct writeback*) wb_uncast;
+	int error;
+
+	pthread_mutex_lock( &wb->sync_lock );
+	while ( !wb->sync_stop ) {
+		if ( !wb->sync_requested ) {
+			pthread_cond_wait( &wb->sync_cond, &wb->sync_lock );
+			continue;
+		}
+		wb->sync_requested = 0;
+		pthread_mutex_unlock( &wb->sync_lock );
+
+		error = fdatasync( wb->fd ) == -1 ? errno : 0;
+
+		pthread_mutex_lock( &wb->sync_lock );
+		wb->sync_error = error;
+		wb->sync_done = 1;
+		pthread_cond_broadcast( &wb->sync_cond );
+		if ( wb->async ) {
+			ev_async_send( wb->ev_loop, wb->async );
+		}
+	}
+	pthread_mutex_unlock( &wb->sync_lock );
+
+	return NULL;
+}
+
+
+/* Open the write-back file for an image of the given size, making it if it
+ * isn't there. Anything that was dirty when we last had it open still is,
+ * and is written back to upstream before long. If ordered, writes taken
+ * after that are written back in the order we take them */
+struct writeback* writeback_open( const char *filename, uint64_t size, int ordered )
+{
+	NULLCHECK( filename );
+
+	struct writeback *wb = xmalloc( sizeof( struct writeback ) );
+	struct writeback_header *header;
+	struct stat st;
+	off_t map_offset = writeback_map_offset( size );
+	uint64_t block, run;
+	int fresh, is_set;
+
+	wb->size = size;
+	wb->blocks = ( size + WRITEBACK_BLOCK_SIZE - 1 ) / WRITEBACK_BLOCK_SIZE;
+	wb->map_size = WRITEBACK_MAP_BITS +
+		BIT_WORDS_FOR_SIZE( ( wb->blocks + 7 ) / 8 ) * sizeof( bitfield_word_t );
+
+	wb->fd = open( filename, O_RDWR | O_CREAT, 0600 );
+	FATAL_IF_NEGATIVE( wb->fd, SHOW_ERRNO( "Couldn't open write-back file %s", filename ) );
+	FATAL_IF_NEGATIVE( fstat( wb->fd, &st ), SHOW_ERRNO( "Couldn't stat %s", filename ) );
+
+	fresh = st.st_size == 0;
+	if ( fresh ) {
+		FATAL_IF_NEGATIVE(
+			ftruncate( wb->fd, map_offset + wb->map_size ),
+			SHOW_ERRNO( "Couldn't size write-back file %s", filename )
+		);
+	} else {
+		FATAL_UNLESS(
+			(uint64_t) st.st_size == map_offset + wb->map_size,
+			"%s isn't a write-back file for an image of %"PRIu64" bytes",
+			filename, size
+		);
+	}
+
+	wb->map = mmap( NULL, wb->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, wb->fd, map_offset );
+	FATAL_IF( wb->map == MAP_FAILED, SHOW_ERRNO( "Couldn't map write-back file %s", filename ) );
+	header = (struct writeback_header*) wb->map;
+	wb->dirty = (bitfield_p) ( wb->map + WRITEBACK_MAP_BITS );
+
+	if ( fresh ) {
+		memcpy( header->magic, WRITEBACK_MAGIC, sizeof( header->magic ) );
+		header->size = size;
+		header->block_size = WRITEBACK_BLOCK_SIZE;
+		FATAL_IF_NEGATIVE( fsync( wb->fd ), SHOW_ERRNO( "Couldn't sync %s", filename ) );
+	} else {
+		FATAL_UNLESS(
+			memcmp( header->magic, WRITEBACK_MAGIC, sizeof( header->magic ) ) == 0 &&
+			header->size == size && header->block_size == WRITEBACK_BLOCK_SIZE,
+			"%s isn't a write-back file for an image of %"PRIu64" bytes",
+			filename, size
+		);
+	}
+
+	/* What's dirty is all we can be sure is newer here than upstream */
+	wb->present = bitset_alloc( size, WRITEBACK_BLOCK_SIZE );
+	for ( block = 0; block < wb->blocks; block += run ) {
+		run = bit_run_count( wb->dirty, block, wb->blocks - block, &is_set );
+		if ( is_set ) {
+			bitset_set_range( wb->present, block * WRITEBACK_BLOCK_SIZE, run * WRITEBACK_BLOCK_SIZE );
+			wb->dirty_count += run;
+		}
+	}
+
+	wb->pending_size = WRITEBACK_PENDING;
+	wb->pending = xmalloc( wb->pending_size * sizeof( struct writeback_range ) );
+
+	/* We don't know what order whatever's left was written in */
+	wb->ordered = ordered;
+	if ( ordered ) {
+		wb->log_size = WRITEBACK_PENDING;
+		wb->log = xmalloc( wb->log_size * sizeof( struct writeback_logged ) );
+		if ( wb->dirty_count > 0 ) {
+			wb->log[0].from = 0;
+			wb->log[0].len = size;
+			wb->log[0].seq = ++wb->logged;
+			wb->log_count = 1;
+		}
+	}
+
+	FATAL_UNLESS( 0 == pthread_mutex_init( &wb->sync_lock, NULL ),
+			"Failed to initialise a mutex" );
+	FATAL_UNLESS( 0 == pthread_cond_init( &wb->sync_cond, NULL ),
+			"Failed to initialise a condition variable" );
+	FATAL_UNLESS( 0 == pthread_create( &wb->syncer, NULL, writeback_syncer, wb ),
+			"Failed to create the write-back sync thread" );
+
+	return wb;
+}
+
+void writeback_close( struct writeback *wb )
+{
+	if ( wb ) {
+		pthread_mutex_lock( &wb->sync_lock );
+		wb->sync_stop = 1;
+		pthread_cond_broadcast( &wb->sync_cond );
+		pthread_mutex_unlock( &wb->sync_lock );
+		pthread_join( wb->syncer, NULL );
+		pthread_cond_destroy( &wb->sync_cond );
+		pthread_mutex_destroy( &wb->sync_lock );
+
+		free( wb->pending );
+		free( wb->log );
+		munmap( wb->map, wb->map_size );
+		close( wb->fd );
+		bitset_free( wb->present );
+		free( wb );
+	}
+}
+
+
+/* True if every block of the range is here, so it can be read from us */
+int writeback_contains( struct writeback *wb, uint64_t from, uint32_t len )
+{
+	NULLCHECK( wb );
+	uint64_t blocks;
+
+	if ( !writeback_in_image( wb, from, len ) ) {
+		return 0;
+	}
+
+	blocks = writeback_last( from, len ) - writeback_first( from ) + 1;
+	return bitset_count_set( wb->present, from, len ) == blocks * WRITEBACK_BLOCK_SIZE;
+}
+
+/* True if any block of the range is here, so a read of it from upstream
+ * needs those blocks laid over it */
+int writeback_overlaps( struct writeback *wb, uint64_t from, uint32_t len )
+{
+	NULLCHECK( wb );
+
+	if ( !writeback_in_image( wb, from, len ) ) {
+		return 0;
+	}
+
+	return bitset_count_set( wb->present, from, len ) > 0;
+}
+
+/* True if a write of the range can be taken here: every block it only
+ * partly covers must be here already, or we'd have to fetch the rest of it
+ * from upstream first. The last block of the image may be short. */
+int writeback_covers( struct writeback *wb, uint64_t from, uint32_t len )
+{
+	NULLCHECK( wb );
+	uint64_t end = from + len;
+
+	if ( !writeback_in_image( wb, from, len ) ) {
+		return 0;
+	}
+
+	if ( from % WRITEBACK_BLOCK_SIZE && !bitset_is_set_at( wb->present, from ) ) {
+		return 0;
+	}
+	if ( end % WRITEBACK_BLOCK_SIZE && end != wb->size &&
+			!bitset_is_set_at( wb->present, end - 1 ) ) {
+		return 0;
+	}
+
+	return 1;
+}
+
+/* True if a write of the range straight to upstream would race with us
+ * writing back blocks it touches, so it must wait until they're clean */
+int writeback_busy( struct writeback *wb, uint64_t from, uint32_t len )
+{
+	NULLCHECK( wb );
+	uint64_t first, last;
+	int i;
+
+	if ( !writeback_in_image( wb, from, len ) ) {
+		return 0;
+	}
+
+	first = writeback_first( from );
+	last = writeback_last( from, len );
+	if ( bit_count_set( wb->dirty, first, last - first + 1 ) > 0 ) {
+		return 1;
+	}
+
+	for ( i = 0; i < wb->pending_count; i++ ) {
+		struct writeback_range *p = &wb->pending[i];
+		if ( writeback_first( p->from ) <= last && writeback_last( p->from, p->len ) >= first ) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* How many writes we've taken so far */
+uint64_t writeback_logged( struct writeback *wb )
+{
+	NULLCHECK( wb );
+	return wb->logged;
+}
+
+/* True if any of the first logged writes we took has yet to be written back.
+ * A write straight to upstream that arrived after them has to wait until
+ * they have been, or it would land upstream ahead of them */
+int writeback_waiting( struct writeback *wb, uint64_t logged )
+{
+	NULLCHECK( wb );
+	return wb->log_count > 0 && wb->log[0].seq <= logged;
+}
+
+uint64_t writeback_dirty_bytes( struct writeback *wb )
+{
+	NULLCHECK( wb );
+	return wb->dirty_count * WRITEBACK_BLOCK_SIZE;
+}
+
+/* True if anything here has yet to reach upstream */
+int writeback_pending( struct writeback *wb )
+{
+	NULLCHECK( wb );
+	return wb->dirty_count > 0 || wb->pending_count > 0;
+}
+
+
+/* Read the range from the file, whether or not it's here. Returns -1 and
+ * sets errno if that fails */
+int writeback_read( struct writeback *wb, uint64_t from, uint32_t len, char *buf )
+{
+	NULLCHECK( wb );
+	return writeback_pread( wb->fd, buf, len, from );
+}
+
+/* Copy whichever blocks of the range are here over what upstream sent us for
+ * it. Returns -1 and sets errno if that fails */
+int writeback_overlay( struct writeback *wb, uint64_t from, uint32_t len, char *buf )
+{
+	NULLCHECK( wb );
+	uint64_t at, end, run;
+	int is_set = 0;
+
+	if ( !writeback_in_image( wb, from, len ) ) {
+		return 0;
+	}
+
+	end = from + len;
+	for ( at = from; at < end; at += run ) {
+		run = bitset_run_count_ex( wb->present, at, end - at, &is_set );
+		if ( run > end - at ) {
+			run = end - at;
+		}
+		if ( is_set && writeback_pread( wb->fd, buf + ( at - from ), run, at ) == -1 ) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Note a write we've just taken, in the newest batch, which goes back after
+ * everything taken before it. If any of its blocks were waiting to go back
+ * already, whatever we send for them now is its data, so the batches since
+ * have to go with it. If we're keeping track of too many writes, they all go
+ * back together */
+static void writeback_log( struct writeback *wb, uint64_t from, uint32_t len, uint64_t batch )
+{
+	uint64_t first = writeback_first( from );
+	uint64_t last = writeback_last( from, len );
+	struct writeback_logged *entry;
+	int i;
+
+	wb->batch_sent = 0;
+	wb->logged++;
+
+	if ( writeback_busy( wb, from, len ) ) {
+		for ( i = 0; i < wb->log_count; i++ ) {
+			entry = &wb->log[i];
+			if ( writeback_first( entry->from ) <= last &&
+					writeback_last( entry->from, entry->len ) >= first ) {
+				break;
+			}
+		}
+		for ( ; i < wb->log_count; i++ ) {
+			wb->log[i].batch = batch;
+		}
+	}
+
+	if ( wb->log_count == WRITEBACK_LOG_MAX ) {
+		wb->log[0].from = 0;
+		wb->log[0].len = wb->size;
+		wb->log[0].batch = batch;
+		wb->log_count = 1;
+	}
+
+	entry = wb->log_count > 0 ? &wb->log[wb->log_count - 1] : NULL;
+	if ( entry && entry->batch == batch && entry->from + entry->len == from ) {
+		entry->len += len;
+		return;
+	}
+
+	if ( wb->log_count == wb->log_size ) {
+		wb->log_size *= 2;
+		wb->log = xrealloc( wb->log, wb->log_size * sizeof( struct writeback_logged ) );
+	}
+
+	entry = &wb->log[wb->log_count++];
+	entry->from = from;
+	entry->len = len;
+	entry->batch = batch;
+	entry->seq = wb->logged;
+}
+
+/* Take a write that writeback_covers(). Its blocks are dirty once it's been
+ * synced, and anything of them on its way upstream has to go again. *sync is
+ * set to the sync that has to finish before the write can be acknowledged.
+ * Returns -1 and sets errno if that fails */
+int writeback_write( struct writeback *wb, uint64_t from, uint32_t len, char *buf, uint64_t *sync )
+{
+	NULLCHECK( wb );
+	uint64_t first = writeback_first( from );
+	uint64_t last = writeback_last( from, len );
+	struct writeback_range *p;
+	int i;
+
+	if ( writeback_pwrite( wb->fd, buf, len, from ) == -1 ) {
+		return -1;
+	}
+	wb->unsynced = 1;
+	bitset_set_range( wb->present, from, len );
+
+	for ( i = 0; i < WRITEBACK_RANGES; i++ ) {
+		struct writeback_range *range = &wb->ranges[i];
+		if ( range->state != WRITEBACK_FREE &&
+				writeback_first( range->from ) <= last &&
+				writeback_last( range->from, range->len ) >= first ) {
+			range->rewritten = 1;
+		}
+	}
+
+	if ( wb->ordered ) {
+		writeback_log( wb, from, len, wb->sync_started + 1 );
+	}
+
+	/* A sync that's already started may have missed what we just wrote */
+	if ( bit_count_set( wb->dirty, first, last - first + 1 ) == last - first + 1 ) {
+		*sync = wb->sync_started + 1;
+		return 0;
+	}
+
+	if ( wb->pending_count == wb->pending_size ) {
+		wb->pending_size *= 2;
+		wb->pending = xrealloc( wb->pending, wb->pending_size * sizeof( struct writeback_range ) );
+	}
+
+	/* Its blocks are marked dirty once its data has been synced, and that
+	 * has to be synced in turn */
+	p = &wb->pending[wb->pending_count++];
+	p->from = from;
+	p->len = len;
+	p->sync = wb->sync_started + 1;
+	*sync = wb->sync_started + 2;
+
+	return 0;
+}
+
+/* Poke async on loop whenever a sync finishes, so writeback_sync_finished()
+ * can be called there */
+void writeback_notify( struct writeback *wb, struct ev_loop *loop, ev_async *async )
+{
+	NULLCHECK( wb );
+
+	pthread_mutex_lock( &wb->sync_lock );
+	wb->ev_loop = loop;
+	wb->async = async;
+	pthread_mutex_unlock( &wb->sync_lock );
+}
+
+/* Start a sync of everything written, and marked dirty, so far, unless one is
+ * going already or there's nothing to sync. Returns 1 if we started one */
+int writeback_sync_start( struct writeback *wb )
+{
+	NULLCHECK( wb );
+
+	if ( wb->syncing || !wb->unsynced ) {
+		return 0;
+	}
+
+	wb->unsynced = 0;
+	wb->syncing = 1;
+	wb->sync_started++;
+
+	pthread_mutex_lock( &wb->sync_lock );
+	wb->sync_requested = 1;
+	pthread_cond_broadcast( &wb->sync_cond );
+	pthread_mutex_unlock( &wb->sync_lock );
+
+	return 1;
+}
+
+/* If the sync we started has finished, mark the blocks whose data it made
+ * durable as dirty, which the next sync makes durable in turn. Returns 1 if
+ * it worked, 0 if it hasn't finished, or -1 with errno set if it failed */
+int writeback_sync_finished( struct writeback *wb )
+{
+	NULLCHECK( wb );
+	uint64_t first, blocks;
+	int i, kept = 0, error;
+
+	pthread_mutex_lock( &wb->sync_lock );
+	if ( !wb->sync_done ) {
+		pthread_mutex_unlock( &wb->sync_lock );
+		return 0;
+	}
+	wb->sync_done = 0;
+	error = wb->sync_error;
+	pthread_mutex_unlock( &wb->sync_lock );
+
+	wb->syncing = 0;
+	if ( error ) {
+		errno = error;
+		return -1;
+	}
+	wb->synced = wb->sync_started;
+
+	for ( i = 0; i < wb->pending_count; i++ ) {
+		struct writeback_range *p = &wb->pending[i];
+
+		if ( p->sync > wb->synced ) {
+			wb->pending[kept++] = *p;
+			continue;
+		}
+
+		first = writeback_first( p->from );
+		blocks = writeback_last( p->from, p->len ) - first + 1;
+		wb->dirty_count += blocks - bit_count_set( wb->dirty, first, blocks );
+		bit_set_range( wb->dirty, first, blocks );
+		wb->unsynced = 1;
+		wb->batch_sent = 0;
+	}
+	wb->pending_count = kept;
+
+	return 1;
+}
+
+/* True once the given sync has finished, and worked */
+int writeback_synced( struct writeback *wb, uint64_t sync )
+{
+	NULLCHECK( wb );
+	return sync <= wb->synced;
+}
+
+/* Make everything written so far durable, along with which blocks are dirty,
+ * waiting for as many syncs as that takes. Returns -1 and sets errno if one
+ * fails */
+int writeback_sync( struct writeback *wb )
+{
+	NULLCHECK( wb );
+
+	do {
+		if ( wb->syncing ) {
+			pthread_mutex_lock( &wb->sync_lock );
+			while ( !wb->sync_done ) {
+				pthread_cond_wait( &wb->sync_cond, &wb->sync_lock );
+			}
+			pthread_mutex_unlock( &wb->sync_lock );
+
+			if ( writeback_sync_finished( wb ) == -1 ) {
+				return -1;
+			}
+		}
+	} while ( writeback_sync_start( wb ) );
+
+	return 0;
+}
+
+/* A write of the range has gone straight to upstream, so what we have of it
+ * is out of date. None of it can be dirty, since the write waited until
+ * writeback_busy() said it wasn't */
+void writeback_forget( struct writeback *wb, uint64_t from, uint32_t len )
+{
+	NULLCHECK( wb );
+
+	if ( writeback_in_image( wb, from, len ) ) {
+		bitset_clear_range( wb->present, from, len );
+	}
+}
+
+
+/* The run on its way upstream that this block is in, if any */
+static struct writeback_range* writeback_queued( struct writeback *wb, uint64_t block )
+{
+	int i;
+
+	for ( i = 0; i < WRITEBACK_RANGES; i++ ) {
+		struct writeback_range *range = &wb->ranges[i];
+		if ( range->state != WRITEBACK_FREE &&
+				writeback_first( range->from ) <= block &&
+				writeback_last( range->from, range->len ) >= block ) {
+			return range;
+		}
+	}
+
+	return NULL;
+}
+
+static struct writeback_range* writeback_find( struct writeback *wb, int state, uint64_t from )
+{
+	int i;
+
+	for ( i = 0; i < WRITEBACK_RANGES; i++ ) {
+		struct writeback_range *range = &wb->ranges[i];
+		if ( range->state == state && range->from == from ) {
+			return range;
+		}
+	}
+
+	return NULL;
+}
+
+static int writeback_count( struct writeback *wb, int state )
+{
+	int i, count = 0;
+
+	for ( i = 0; i < WRITEBACK_RANGES; i++ ) {
+		if ( wb->ranges[i].state == state ) {
+			count++;
+		}
+	}
+
+	return count;
+}
+
+static void writeback_release( struct writeback *wb, struct writeback_range *range )
+{
+	/* Some of its blocks may still be dirty */
+	wb->batch_sent = 0;
+	wb->queued -= writeback_range_blocks( range );
+	memset( range, 0, sizeof( struct writeback_range ) );
+}
+
+
+/* Look for dirty blocks that aren't on their way upstream yet from block lo
+ * up to hi, starting at block and going round. If there are any, put a run of
+ * up to WRITEBACK_CHUNK bytes of them in range and return 1 */
+static int writeback_next_run(
+	struct writeback *wb,
+	struct writeback_range *range,
+	uint64_t block,
+	uint64_t lo,
+	uint64_t hi )
+{
+	struct writeback_range *queued;
+	uint64_t looked, run, start, end, count, stop;
+	int is_set;
+
+	for ( looked = 0; looked < hi - lo; looked += run, block += run ) {
+		if ( block >= hi ) {
+			block = lo;
+		}
+
+		run = bit_run_count( wb->dirty, block, hi - block, &is_set );
+		if ( !is_set ) {
+			continue;
+		}
+
+		end = block + run;
+		start = block;
+		while ( start < end && ( queued = writeback_queued( wb, start ) ) != NULL ) {
+			start = writeback_last( queued->from, queued->len ) + 1;
+		}
+		if ( start >= end ) {
+			continue;
+		}
+
+		count = 1;
+		while ( start + count < end &&
+				count < WRITEBACK_CHUNK / WRITEBACK_BLOCK_SIZE &&
+				writeback_queued( wb, start + count ) == NULL ) {
+			count++;
+		}
+
+		stop = ( start + count ) * WRITEBACK_BLOCK_SIZE;
+		if ( stop > wb->size ) {
+			stop = wb->size;
+		}
+
+		range->state = WRITEBACK_SENDING;
+		range->from = start * WRITEBACK_BLOCK_SIZE;
+		range->len = stop - range->from;
+		range->rewritten = 0;
+		wb->queued += count;
+		wb->next = start + count;
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Find the next run to write back from the oldest batch. Once all of it has
+ * been sent, we wait for it to be flushed, and for the sync it's numbered
+ * after, which marks the last of its blocks dirty, before moving on to the
+ * next */
+static int writeback_next_logged( struct writeback *wb, struct writeback_range *range )
+{
+	struct writeback_logged *entry;
+	uint64_t batch;
+	int i;
+
+	while ( wb->log_count > 0 ) {
+		batch = wb->log[0].batch;
+		for ( i = 0; i < wb->log_count && wb->log[i].batch == batch; i++ ) {
+			entry = &wb->log[i];
+			if ( !wb->batch_sent &&
+					writeback_next_run( wb, range, writeback_first( entry->from ),
+						writeback_first( entry->from ),
+						writeback_last( entry->from, entry->len ) + 1 ) ) {
+				return 1;
+			}
+		}
+		wb->batch_sent = 1;
+
+		if ( wb->queued > 0 || batch > wb->synced ) {
+			return 0;
+		}
+
+		wb->log_count -= i;
+		memmove( wb->log, wb->log + i, wb->log_count * sizeof( struct writeback_logged ) );
+		wb->batch_sent = 0;
+	}
+
+	return 0;
+}
+
+/* If there are dirty blocks that aren't on their way upstream yet, say which
+ * to write back next and return 1. Unless we're keeping the order they were
+ * written in, we carry on through the map from where we left off. Either
+ * way, we take a run of up to WRITEBACK_CHUNK bytes */
+int writeback_next_chunk( struct writeback *wb, uint64_t *from, uint32_t *len )
+{
+	NULLCHECK( wb );
+	struct writeback_range *range;
+	int found;
+
+	range = writeback_find( wb, WRITEBACK_FREE, 0 );
+	if ( range == NULL ) {
+		return 0;
+	}
+
+	if ( wb->dirty_count == wb->queued ) {
+		/* Nothing to send, but the oldest batch may be done with */
+		wb->batch_sent = 1;
+		if ( wb->ordered ) {
+			writeback_next_logged( wb, range );
+		}
+		return 0;
+	}
+
+	if ( wb->ordered ) {
+		found = writeback_next_logged( wb, range );
+	} else {
+		found = writeback_next_run( wb, range, wb->next, 0, wb->blocks );
+	}
+	if ( !found ) {
+		return 0;
+	}
+
+	*from = range->from;
+	*len = range->len;
+	return 1;
+}
+
+/* The write back of the run from here has finished, for better ( ok ) or
+ * worse. If it worked, its blocks are clean once a flush after it has */
+void writeback_sent( struct writeback *wb, uint64_t from, int ok )
+{
+	NULLCHECK( wb );
+	struct writeback_range *range = writeback_find( wb, WRITEBACK_SENDING, from );
+
+	if ( range == NULL ) {
+		return;
+	}
+
+	if ( ok && !range->rewritten ) {
+		range->state = WRITEBACK_WRITTEN;
+	} else {
+		writeback_release( wb, range );
+	}
+}
+
+/* True if we should ask upstream to flush now: there's something written
+ * that needs it, and either nothing else is on its way or there's no room for
+ * more. Only one flush is out at a time */
+int writeback_flush_due( struct writeback *wb )
+{
+	NULLCHECK( wb );
+
+	if ( wb->flushing || writeback_count( wb, WRITEBACK_WRITTEN ) == 0 ) {
+		return 0;
+	}
+
+	return writeback_count( wb, WRITEBACK_SENDING ) == 0 ||
+		writeback_count( wb, WRITEBACK_FREE ) == 0;
+}
+
+void writeback_flush_sent( struct writeback *wb )
+{
+	NULLCHECK( wb );
+	int i;
+
+	for ( i = 0; i < WRITEBACK_RANGES; i++ ) {
+		if ( wb->ranges[i].state == WRITEBACK_WRITTEN ) {
+			wb->ranges[i].state = WRITEBACK_FLUSHING;
+		}
+	}
+	wb->flushing = 1;
+}
+
+/* The flush has finished. If it worked, everything written before it that
+ * hasn't been written again since is clean. If not, it waits for the next */
+void writeback_flushed( struct writeback *wb, int ok )
+{
+	NULLCHECK( wb );
+	int i;
+
+	for ( i = 0; i < WRITEBACK_RANGES; i++ ) {
+		struct writeback_range *range = &wb->ranges[i];
+		uint64_t first, blocks;
+
+		if ( range->state != WRITEBACK_FLUSHING ) {
+			continue;
+		}
+
+		if ( !ok ) {
+			range->state = WRITEBACK_WRITTEN;
+			continue;
+		}
+
+		if ( !range->rewritten ) {
+			first = writeback_first( range->from );
+			blocks = writeback_range_blocks( range );
+			wb->dirty_count -= bit_count_set( wb->dirty, first, blocks );
+			bit_clear_range( wb->dirty, first, blocks );
+		}
+		writeback_release( wb, range );
+	}
+
+	wb->flushing = 0;
+}
@@ -0,0 +1,172 @@
+#ifndef WRITEBACK_H
+#define WRITEBACK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include <ev.h>
+
+#include "bitset.h"
+
+/* The write-back file keeps whole, aligned blocks of this many bytes */
+#define WRITEBACK_BLOCK_SIZE 4096
+
+/* We write back to upstream in requests of up to this size */
+#define WRITEBACK_CHUNK ( 256 * 1024 )
+
+/* How many runs of blocks can be on their way upstream at once, and how many
+ * writes' worth of newly dirty blocks we have room for to start with */
+#define WRITEBACK_RANGES 64
+#define WRITEBACK_PENDING 64
+
+/* How many writes we keep in order, to write back in it. Past that, all of
+ * them go back as one batch */
+#define WRITEBACK_LOG_MAX 65536
+
+/* Written at the start of the map, so we know the file is ours and was made
+ * for this image */
+#define WRITEBACK_MAGIC "FLEXNBWB"
+
+/* Where a run of dirty blocks is with getting upstream. Only once upstream has
+ * acknowledged a flush after a run's write can its blocks be marked clean */
+enum {
+	WRITEBACK_FREE = 0,
+	WRITEBACK_SENDING,  /* Write sent, waiting for the reply */
+	WRITEBACK_WRITTEN,  /* Written, waiting for a flush to be sent */
+	WRITEBACK_FLUSHING  /* Flush sent, waiting for the reply */
+};
+
+struct writeback_range {
+	int      state;
+	uint64_t from;
+	uint32_t len;
+
+	/* Set if a block in the run is written again before we're done, so we
+	 * don't mark it clean when it isn't */
+	int      rewritten;
+
+	/* For a write whose blocks weren't dirty yet, the sync that makes its
+	 * data durable */
+	uint64_t sync;
+};
+
+/* A write in the order we took it. seq counts every write we've taken; a
+ * run of contiguous writes in the same batch shares the first one's entry */
+struct writeback_logged {
+	uint64_t from;
+	uint64_t len;
+	uint64_t batch;
+	uint64_t seq;
+};
+
+struct writeback_header {
+	char     magic[8];
+	uint64_t size;
+	uint32_t block_size;
+};
+
+struct writeback {
+	int      fd;
+
+	/* The size of the image, which is the size of the data at the start of
+	 * the file, and how many blocks that is */
+	uint64_t size;
+	uint64_t blocks;
+
+	/* The header, then a bit for every block that's newer here than
+	 * upstream. It's mapped from the end of the file, so it survives us.
+	 * dirty_count is how many of those bits are set */
+	char      *map;
+	size_t     map_size;
+	bitfield_p dirty;
+	uint64_t   dirty_count;
+
+	/* Blocks whose newest data is here: every dirty one, and any we've
+	 * written back since we started */
+	struct bitset *present;
+
+	/* Writes whose blocks weren't dirty yet. Their bits are set once their
+	 * data has been synced, so a crash can't leave a block marked dirty
+	 * with nothing written to it. unsynced is set if anything has been
+	 * written, or marked dirty, since the last sync started */
+	struct writeback_range *pending;
+	int pending_count;
+	int pending_size;
+	int unsynced;
+
+	/* Syncs happen on their own thread, so they don't hold up the event
+	 * loop, and are numbered: sync_started is the last we asked for and
+	 * synced the last that worked. The thread sets sync_done, and
+	 * sync_error if it failed, under sync_lock, then pokes async on ev_loop
+	 * if we've been given one */
+	pthread_t       syncer;
+	pthread_mutex_t sync_lock;
+	pthread_cond_t  sync_cond;
+	uint64_t        sync_started;
+	uint64_t        synced;
+	int             syncing;
+	int             sync_requested;
+	int             sync_done;
+	int             sync_error;
+	int             sync_stop;
+	struct ev_loop *ev_loop;
+	ev_async       *async;
+
+	/* Runs of dirty blocks on their way upstream, how many blocks they
+	 * cover, and whether a flush is out */
+	struct writeback_range ranges[WRITEBACK_RANGES];
+	uint64_t queued;
+	int      flushing;
+
+	/* Which block we look for dirty ones from next, so we work through the
+	 * map in order rather than writing the same blocks back over and over */
+	uint64_t next;
+
+	/* Unless we were asked not to, we write back in the order we took the
+	 * writes, a batch at a time, with a flush after each, so upstream is
+	 * always as it was once some batch had been written. A batch is every
+	 * write acknowledged by the same sync, and is numbered after it. We
+	 * only have the newest data for each block, so a block written again
+	 * before it's clean takes everything since its last write into the
+	 * newest batch. log holds the writes still to go back, oldest first;
+	 * we don't keep it in the file, so whatever's left when we open it is
+	 * one batch. batch_sent is set once nothing in the oldest batch is
+	 * left to send, until something changes that */
+	int      ordered;
+	struct writeback_logged *log;
+	int      log_count;
+	int      log_size;
+	uint64_t logged;
+	int      batch_sent;
+};
+
+struct writeback* writeback_open( const char *filename, uint64_t size, int ordered );
+void writeback_close( struct writeback *wb );
+
+int writeback_contains( struct writeback *wb, uint64_t from, uint32_t len );
+int writeback_overlaps( struct writeback *wb, uint64_t from, uint32_t len );
+int writeback_covers( struct writeback *wb, uint64_t from, uint32_t len );
+int writeback_busy( struct writeback *wb, uint64_t from, uint32_t len );
+uint64_t writeback_logged( struct writeback *wb );
+int writeback_waiting( struct writeback *wb, uint64_t logged );
+uint64_t writeback_dirty_bytes( struct writeback *wb );
+int writeback_pending( struct writeback *wb );
+
+int writeback_read( struct writeback *wb, uint64_t from, uint32_t len, char *buf );
+int writeback_overlay( struct writeback *wb, uint64_t from, uint32_t len, char *buf );
+int writeback_write( struct writeback *wb, uint64_t from, uint32_t len, char *buf, uint64_t *sync );
+void writeback_notify( struct writeback *wb, struct ev_loop *loop, ev_async *async );
+int writeback_sync_start( struct writeback *wb );
+int writeback_sync_finished( struct writeback *wb );
+int writeback_synced( struct writeback *wb, uint64_t sync );
+int writeback_sync( struct writeback *wb );
+void writeback_forget( struct writeback *wb, uint64_t from, uint32_t len );
+
+int writeback_next_chunk( struct writeback *wb, uint64_t *from, uint32_t *len );
+void writeback_sent( struct writeback *wb, uint64_t from, int ok );
+int writeback_flush_due( struct writeback *wb );
+void writeback_flush_sent( struct writeback *wb );
+void writeback_flushed( struct writeback *wb, int ok );
+
+#endif
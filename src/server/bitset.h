@@ -124,12 +124,37 @@ static inline uint64_t bit_run_count(bitfield_p b, uint64_t from, uint64_t len,
 	for ( ; len > 0; len-- ) {
 		if ( bit_has_value(b, from + count, first_value) ) {
 			count++;
+		} else {
+			break;
 		}
 	}
 
 	return count;
 }
 
+/** Counts the number of bits that are set in array ''b'', starting at
+  * ''from'' and looking at ''len'' bits.
+  */
+static inline uint64_t bit_count_set(bitfield_p b, uint64_t from, uint64_t len)
+{
+	uint64_t count = 0;
+
+	for ( ; (from % BITS_PER_WORD) != 0 && len > 0 ; len-- ) {
+		count += bit_get( b, from++ );
+	}
+
+	for ( ; len >= BITS_PER_WORD ; len -= BITS_PER_WORD ) {
+		count += __builtin_popcountll( BIT_WORD( b, from ) );
+		from += BITS_PER_WORD;
+	}
+
+	for ( ; len > 0 ; len-- ) {
+		count += bit_get( b, from++ );
+	}
+
+	return count;
+}
+
 enum bitset_stream_events {
   BITSET_STREAM_UNSET = 0,
   BITSET_STREAM_SET = 1,
@@ -174,6 +199,7 @@ struct bitset {
 	int resolution;
 	struct bitset_stream *stream;
 	int stream_enabled;
+	struct bitset *track;
 	bitfield_word_t bits[];
 };
 
@@ -185,8 +211,8 @@ static inline struct bitset *bitset_alloc( uint64_t size, int resolution )
 	// calculate a size to allocate that is a multiple of the size of the
 	// bitfield word
 	size_t bitfield_size =
-			BIT_WORDS_FOR_SIZE((( size + resolution - 1 ) / resolution)) * sizeof( bitfield_word_t );
-	struct bitset *bitset = xmalloc(sizeof( struct bitset ) + ( bitfield_size / 8 ) );
+			BIT_WORDS_FOR_SIZE((( size + resolution - 1 ) / resolution + 7) / 8) * sizeof( bitfield_word_t );
+	struct bitset *bitset = xmalloc(sizeof( struct bitset ) + bitfield_size );
 
 	bitset->size = size;
 	bitset->resolution = resolution;
@@ -344,6 +370,29 @@ static inline void bitset_set_range(
 		bitset_stream_enqueue( set, BITSET_STREAM_SET, from, len );
 	}
 
+	if ( set->track ) {
+		bitset_set_range( set->track, from, len );
+	}
+
+	BITSET_UNLOCK;
+}
+
+/** Until bitset_untrack is called, set the bits in track for every range
+  * that's set or cleared in set. This is for noting changes at times when
+  * nothing is reading the stream. track must cover the same size at the
+  * same resolution, and not be tracking anything itself.
+  */
+static inline void bitset_track( struct bitset * set, struct bitset * track )
+{
+	BITSET_LOCK;
+	set->track = track;
+	BITSET_UNLOCK;
+}
+
+static inline void bitset_untrack( struct bitset * set )
+{
+	BITSET_LOCK;
+	set->track = NULL;
 	BITSET_UNLOCK;
 }
 
@@ -370,6 +419,10 @@ static inline void bitset_clear_range(
 		bitset_stream_enqueue( set, BITSET_STREAM_UNSET, from, len );
 	}
 
+	if ( set->track ) {
+		bitset_set_range( set->track, from, len );
+	}
+
 	BITSET_UNLOCK;
 }
 
@@ -408,6 +461,32 @@ static inline uint64_t bitset_run_count_ex(
 	return run;
 }
 
+/** Counts the number of bytes in the given range that are represented by set
+  * bits. As with runs, this is a multiple of the resolution, so partial chunks
+  * at either end count in full.
+  */
+static inline uint64_t bitset_count_set(
+	struct bitset * set,
+	uint64_t from,
+	uint64_t len
+)
+{
+	uint64_t count;
+
+	if ( from >= set->size || len == 0 ) {
+		return 0;
+	}
+	len = ( len + from ) > set->size ? ( set->size - from ) : len;
+
+	INT_FIRST_AND_LAST;
+
+	BITSET_LOCK;
+	count = bit_count_set( set->bits, first, bitlen ) * set->resolution;
+	BITSET_UNLOCK;
+
+	return count;
+}
+
 /** Counts the number of contiguous bytes that are represented as a run in
   * the bit field.
   */
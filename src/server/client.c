@@ -6,10 +6,12 @@
 #include "bitset.h"
 #include "nbdtypes.h"
 #include "self_pipe.h"
+#include "hash.h"
 
 #include <sys/mman.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <lz4.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -50,6 +52,7 @@ struct client *client_create( struct server *serve, int socket )
 	c->stopped = 0;
 	c->socket = socket;
 	c->serve = serve;
+	c->sink_fd = -1;
 
 	c->stop_signal = self_pipe_create();
 
@@ -83,6 +86,7 @@ void client_destroy( struct client *client )
 	debug( "Destroying stop signal for client %p", client );
 	self_pipe_destroy( client->stop_signal );
 	debug( "Freeing client %p", client );
+	free( client->sink_buf );
 	free( client );
 }
 
@@ -249,6 +253,31 @@ int client_read_request( struct client * client , struct nbd_request *out_reques
 	}
 
 	nbd_r2h_request( &request_raw, out_request );
+
+	/* A mirror's writes during a post-copy migration only fill in what we
+	 * don't have yet. Otherwise, they're handled as any other write */
+	client->fill = 1;
+	switch ( out_request->type ) {
+	case REQUEST_WRITE_FILL:
+		out_request->type = REQUEST_WRITE;
+		break;
+	case REQUEST_WRITE_ZEROES_FILL:
+		out_request->type = REQUEST_WRITE_ZEROES;
+		break;
+	case REQUEST_WRITE_LZ4_FILL:
+		out_request->type = REQUEST_WRITE_LZ4;
+		break;
+	default:
+		client->fill = 0;
+		break;
+	}
+
+	/* Flags in the top of a write zeroes type, like NBD_CMD_FLAG_NO_HOLE,
+	 * are hints we're free to ignore. */
+	if ( ( out_request->type & REQUEST_MASK ) == REQUEST_WRITE_ZEROES ) {
+		out_request->type = REQUEST_WRITE_ZEROES;
+	}
+
 	return 1;
 }
 
@@ -303,7 +332,14 @@ void client_write_init( struct client * client, uint64_t size )
 	memcpy( init.passwd, INIT_PASSWD, sizeof( init.passwd ) );
 	init.magic = INIT_MAGIC;
 	init.size = size;
-	memset( init.reserved, 0, 128 );
+	init.flags = INIT_FLAG_HAS_FLAGS | INIT_FLAG_SEND_FLUSH | INIT_FLAG_SEND_WRITE_ZEROES |
+		INIT_FLAG_HASH | INIT_FLAG_LZ4 | INIT_FLAG_GENERATION | INIT_FLAG_REDIRECT;
+
+	/* Only something waiting for a migration can take one post-copy */
+	if ( !client->serve->success || client->serve->postcopy ) {
+		init.flags |= INIT_FLAG_POSTCOPY;
+	}
+	memset( init.reserved, 0, sizeof( init.reserved ) );
 
 	nbd_h2r_init( &init, &init_raw );
 
@@ -358,6 +394,27 @@ void client_flush( struct client * client, size_t len )
 }
 
 
+/* Read the length prefix of a compressed write's data, and check it's a
+ * sensible size for len bytes of data once decompressed. If it isn't, we
+ * can't find the next request, so have to drop the client.
+ */
+static uint32_t client_read_compressed_len( struct client * client, uint32_t len )
+{
+	uint32_t clen_raw, clen;
+
+	ERROR_IF_NEGATIVE(
+		readloop( client->socket, &clen_raw, sizeof( clen_raw ) ),
+		"reading compressed length failed"
+	);
+
+	clen = be32toh( clen_raw );
+	ERROR_IF( len > NBD_LZ4_MAX_SIZE || clen > (uint32_t) LZ4_compressBound( len ),
+		"compressed write of %"PRIu32" bytes to %"PRIu32" is too big", clen, len );
+
+	return clen;
+}
+
+
 /* Check to see if the client's request needs a reply constructing.
  * Returns 1 if we do, 0 otherwise.
  * request_err is set to 0 if the client sent a bad request, in which
@@ -388,9 +445,12 @@ int client_request_needs_reply( struct client * client,
 		warn("write request %"PRIu64"+%"PRIu32" out of range",
 		  request.from, request.len
 		);
-		if ( request.type == REQUEST_WRITE ) {
+		if ( request.type == REQUEST_WRITE || request.type == REQUEST_GENERATION ) {
 			client_flush( client, request.len );
 		}
+		if ( request.type == REQUEST_WRITE_LZ4 ) {
+			client_flush( client, client_read_compressed_len( client, request.len ) );
+		}
 		client_write_reply( client, &request, EPERM ); /* TODO: Change to ERANGE ? */
 		client->disconnect = 0;
 		return 0;
@@ -403,6 +463,46 @@ int client_request_needs_reply( struct client * client,
 		break;
 	case REQUEST_WRITE:
 		break;
+	case REQUEST_WRITE_ZEROES:
+		break;
+	case REQUEST_WRITE_LZ4:
+		break;
+	case REQUEST_FLUSH:
+		break;
+	case REQUEST_HASH:
+		if ( request.len > NBD_HASH_MAX_SIZE ) {
+			warn( "hash request of %"PRIu32" bytes is too big", request.len );
+			client_write_reply( client, &request, EINVAL );
+			client->disconnect = 0;
+			return 0;
+		}
+		break;
+	case REQUEST_GENERATION:
+		if ( request.from != 0 || request.len != sizeof( uint64_t ) ) {
+			warn( "generation request %"PRIu64"+%"PRIu32" is malformed", request.from, request.len );
+			client_flush( client, request.len );
+			client_write_reply( client, &request, EINVAL );
+			client->disconnect = 0;
+			return 0;
+		}
+		break;
+	case REQUEST_POSTCOPY:
+		if ( request.from != 0 || request.len != 0 ||
+				( client->serve->success && !client->serve->postcopy ) ) {
+			warn( "post-copy request refused, we already have control" );
+			client_write_reply( client, &request, EINVAL );
+			client->disconnect = 0;
+			return 0;
+		}
+		break;
+	case REQUEST_REDIRECT:
+		if ( request.from != 0 || request.len != 0 ) {
+			warn( "redirect request %"PRIu64"+%"PRIu32" is malformed", request.from, request.len );
+			client_write_reply( client, &request, EINVAL );
+			client->disconnect = 0;
+			return 0;
+		}
+		break;
 	case REQUEST_DISCONNECT:
 		debug("request disconnect");
 		client->disconnect = 1;
@@ -415,11 +515,163 @@ int client_request_needs_reply( struct client * client,
 }
 
 
+/* Fetch the blocks of the range we don't have yet from the mirror, straight
+ * into the mapping. Must be called with the postcopy lock held, which is
+ * dropped while we wait for the mirror. If someone else is already fetching
+ * some of them, we wait for them rather than fetch them twice. Returns 0 if
+ * they're all here now, or -1 if we couldn't fetch them.
+ */
+static int client_postcopy_fetch( struct client* client, uint64_t from, uint64_t len )
+{
+	struct postcopy * pc = client->serve->postcopy;
+	uint64_t end = from + len;
+	uint64_t run;
+	int missing, fetching, result;
+
+	/* Whole blocks, so they count as ours once they're here */
+	from -= from % POSTCOPY_BLOCK_SIZE;
+	end += POSTCOPY_BLOCK_SIZE - 1;
+	end -= end % POSTCOPY_BLOCK_SIZE;
+	if ( end > pc->size ) {
+		end = pc->size;
+	}
+
+	while ( from < end ) {
+		run = postcopy_run( pc, from, end - from, &missing );
+		if ( run > POSTCOPY_PULL_MAX_SIZE ) {
+			run = POSTCOPY_PULL_MAX_SIZE;
+		}
+		if ( !missing ) {
+			from += run;
+			continue;
+		}
+
+		run = postcopy_fetching_run( pc, from, run, &fetching );
+		if ( fetching ) {
+			/* They may fail, in which case we look again */
+			postcopy_wait_for_fetches( pc );
+			continue;
+		}
+
+		postcopy_fetch_start( pc, from, run );
+		result = postcopy_pull( pc, from, run, client->mapped + from );
+		if ( result == 0 ) {
+			bitset_set_range( client->serve->allocation_map, from, run );
+		}
+		postcopy_fetch_done( pc, from, run, result == 0 );
+
+		if ( result < 0 ) {
+			return -1;
+		}
+		from += run;
+	}
+
+	return 0;
+}
+
+
+/* Wait until nobody is fetching any of the range, so what they fetch can't
+ * land on top of what we're about to write. Called with the lock held */
+static void client_postcopy_wait_for_fetches( struct postcopy * pc, uint64_t from, uint64_t len )
+{
+	uint64_t run;
+	int fetching;
+
+	while ( len > 0 ) {
+		run = postcopy_fetching_run( pc, from, len, &fetching );
+		if ( fetching ) {
+			postcopy_wait_for_fetches( pc );
+			continue;
+		}
+		from += run;
+		len  -= run;
+	}
+}
+
+
+/* During a post-copy migration, the blocks a read covers have to be here
+ * before we can answer it. A write replaces the blocks it covers, so only
+ * partial ones at either end need fetching. The rest are ours once its data
+ * has landed, when client_postcopy_written() is called; until then, they're
+ * marked as being fetched, so nobody fetches, fills or writes them under us.
+ * Blocks that are already here only need the lock long enough to see that
+ * they are. Returns 0 once the range is ready, or -1 if we couldn't fetch
+ * what we needed.
+ */
+static int client_postcopy_prepare( struct client* client, uint64_t from, uint64_t len, int writing )
+{
+	struct postcopy * pc = client->serve->postcopy;
+	uint64_t start = from - ( from % POSTCOPY_BLOCK_SIZE );
+	uint64_t end = from + len;
+	int result = 0;
+	int missing;
+
+	if ( pc == NULL || pc->complete || len == 0 ) {
+		return 0;
+	}
+
+	/* Blocks never go missing again, and only count as here once their data
+	 * is, so if they all are, there's nothing to wait for */
+	if ( postcopy_run( pc, from, len, &missing ) == len && !missing ) {
+		return 0;
+	}
+
+	postcopy_lock( pc );
+	if ( !writing ) {
+		result = client_postcopy_fetch( client, from, len );
+	} else {
+		if ( from % POSTCOPY_BLOCK_SIZE ) {
+			result = client_postcopy_fetch( client, from, 1 );
+		}
+		if ( result == 0 && end % POSTCOPY_BLOCK_SIZE && end != pc->size ) {
+			result = client_postcopy_fetch( client, end - 1, 1 );
+		}
+
+		if ( result == 0 ) {
+			end += POSTCOPY_BLOCK_SIZE - 1;
+			end -= end % POSTCOPY_BLOCK_SIZE;
+			if ( end > pc->size ) {
+				end = pc->size;
+			}
+			client_postcopy_wait_for_fetches( pc, start, end - start );
+			postcopy_fetch_start( pc, start, end - start );
+			client->postcopy_from = start;
+			client->postcopy_len = end - start;
+		}
+	}
+	postcopy_unlock( pc );
+
+	return result;
+}
+
+
+/* The write that client_postcopy_prepare() kept blocks for is over. If its
+ * data landed, they're ours; if not, they're as they were */
+static void client_postcopy_written( struct client* client, int written )
+{
+	struct postcopy * pc = client->serve->postcopy;
+
+	if ( client->postcopy_len == 0 ) {
+		return;
+	}
+
+	postcopy_lock( pc );
+	postcopy_fetch_done( pc, client->postcopy_from, client->postcopy_len, written );
+	postcopy_unlock( pc );
+	client->postcopy_len = 0;
+}
+
+
 void client_reply_to_read( struct client* client, struct nbd_request request )
 {
 	off64_t offset;
 
 	debug("request read %ld+%d", request.from, request.len);
+
+	if ( client_postcopy_prepare( client, request.from, request.len, 0 ) < 0 ) {
+		client_write_reply( client, &request, EIO );
+		return;
+	}
 	sock_set_tcp_cork( client->socket, 1 );
 	client_write_reply( client, &request, 0 );
 
@@ -442,10 +694,284 @@ void client_reply_to_read( struct client* client, struct nbd_request request )
 }
 
 
+/* Copy len bytes of buf to the file at from, in the same way as
+ * write_not_zeroes does from the socket: blocks which are unallocated and
+ * would only be written with zeroes are left alone.
+ */
+static void write_buffer_not_zeroes( struct client* client, uint64_t from, char *buf, uint64_t len )
+{
+	struct bitset * map = client->serve->allocation_map;
+	uint64_t blockrun;
+
+	if ( !client->serve->allocation_map_built ) {
+		memcpy( client->mapped + from, buf, len );
+		bitset_set_range( map, from, len );
+		return;
+	}
+
+	while ( len > 0 ) {
+		blockrun = block_allocation_resolution - ( from % block_allocation_resolution );
+		if ( blockrun > len ) {
+			blockrun = len;
+		}
+
+		if ( bitset_is_set_at( map, from ) ||
+				buf[0] != 0 || 0 != memcmp( buf, buf + 1, blockrun - 1 ) ) {
+			memcpy( client->mapped + from, buf, blockrun );
+			bitset_set_range( map, from, blockrun );
+		}
+
+		buf  += blockrun;
+		from += blockrun;
+		len  -= blockrun;
+	}
+}
+
+
+/* Until a listener has control, its only clients are mirrors sending it the
+ * image, and nothing reads what they write until control arrives. So we
+ * don't make each write durable before acknowledging it: the mirror asks us
+ * to flush once it has sent everything. That leaves the receiving end free
+ * to take each write in large pieces and hand them to the kernel with
+ * pwrite(), which is far cheaper than faulting in the mapping a page at a
+ * time and syncing it.
+ */
+static int client_is_sink( struct client * client )
+{
+	return client->sink_fd >= 0 && !client->serve->success;
+}
+
+
+/* Make a write to the range durable before we acknowledge it, unless we're a
+ * sink */
+static void client_sync_range( struct client* client, uint64_t from, uint64_t len )
+{
+	uint64_t from_rounded = from - ( from % block_allocation_resolution );
+
+	if ( client_is_sink( client ) ) {
+		return;
+	}
+
+	FATAL_IF_NEGATIVE(
+		msync( client->mapped + from_rounded,
+			len + ( from - from_rounded ),
+			MS_SYNC | MS_INVALIDATE ),
+		"msync failed %ld %ld", from, len
+	);
+}
+
+
+static void client_sink_pwrite( struct client* client, uint64_t from, char *buf, uint64_t len )
+{
+	ssize_t written;
+	uint64_t done = 0;
+
+	while ( done < len ) {
+		written = pwrite( client->sink_fd, buf + done, len - done, from + done );
+		if ( written < 0 && errno == EINTR ) {
+			continue;
+		}
+		FATAL_IF_NEGATIVE( written,
+			SHOW_ERRNO( "pwrite failed %"PRIu64"+%"PRIu64, from + done, len - done ) );
+		done += written;
+	}
+
+	bitset_set_range( client->serve->allocation_map, from, len );
+}
+
+
+/* As write_buffer_not_zeroes, for a sink. Each run of blocks we do write
+ * goes out in one pwrite() */
+static void client_sink_buffer( struct client* client, uint64_t from, char *buf, uint64_t len )
+{
+	struct bitset * map = client->serve->allocation_map;
+	int sparse = client->serve->allocation_map_built;
+	uint64_t start = from;
+	char *start_buf = buf;
+	uint64_t blockrun;
+
+	while ( len > 0 ) {
+		blockrun = block_allocation_resolution - ( from % block_allocation_resolution );
+		if ( blockrun > len ) {
+			blockrun = len;
+		}
+
+		if ( sparse && !bitset_is_set_at( map, from ) &&
+				buf[0] == 0 && 0 == memcmp( buf, buf + 1, blockrun - 1 ) ) {
+			client_sink_pwrite( client, start, start_buf, from - start );
+			start = from + blockrun;
+			start_buf = buf + blockrun;
+		}
+
+		buf  += blockrun;
+		from += blockrun;
+		len  -= blockrun;
+	}
+
+	client_sink_pwrite( client, start, start_buf, from - start );
+}
+
+
+/* A sink reads a write's data CLIENT_SINK_BUFFER_SIZE at a time into a
+ * page-aligned buffer, rather than a block at a time as write_not_zeroes does
+ */
+static void client_sink_from_socket( struct client* client, struct nbd_request request )
+{
+	uint64_t from = request.from;
+	uint32_t len = request.len;
+	uint32_t chunk;
+
+	if ( client->sink_buf == NULL ) {
+		FATAL_UNLESS( 0 == posix_memalign( (void **) &client->sink_buf,
+					block_allocation_resolution, CLIENT_SINK_BUFFER_SIZE ),
+			"Couldn't allocate a receive buffer" );
+	}
+
+	while ( len > 0 ) {
+		chunk = len < CLIENT_SINK_BUFFER_SIZE ? len : CLIENT_SINK_BUFFER_SIZE;
+
+		ERROR_IF_NEGATIVE(
+			readloop( client->socket, client->sink_buf, chunk ),
+			"reading write data failed from=%ld, len=%d",
+			request.from,
+			request.len
+		);
+		client_sink_buffer( client, from, client->sink_buf, chunk );
+
+		from += chunk;
+		len  -= chunk;
+	}
+}
+
+
+/* The run of blocks from from, up to len, that a mirror's write should fill
+ * in: those we don't have, and nobody is fetching. Sets *fill if it's those,
+ * rather than a run that it shouldn't. Called with the lock held */
+static uint64_t client_postcopy_fill_run( struct postcopy * pc, uint64_t from, uint64_t len, int *fill )
+{
+	uint64_t run = postcopy_run( pc, from, len, fill );
+	int fetching;
+
+	if ( *fill ) {
+		run = postcopy_fetching_run( pc, from, run, &fetching );
+		*fill = !fetching;
+	}
+
+	return run;
+}
+
+
+/* A mirror's write during a post-copy migration only fills in the blocks we
+ * don't have yet. The rest have been fetched, or written by our clients,
+ * since the mirror stopped taking writes, so its copy of them is out of date.
+ * Blocks being fetched will be here soon enough, so are left alone too.
+ */
+static void client_fill_buffer( struct client* client, uint64_t from, char *buf, uint64_t len )
+{
+	struct postcopy * pc = client->serve->postcopy;
+	uint64_t run;
+	int fill;
+
+	postcopy_lock( pc );
+	while ( len > 0 ) {
+		run = client_postcopy_fill_run( pc, from, len, &fill );
+		if ( fill ) {
+			write_buffer_not_zeroes( client, from, buf, run );
+			postcopy_mark( pc, from, run );
+		}
+
+		buf  += run;
+		from += run;
+		len  -= run;
+	}
+	postcopy_unlock( pc );
+}
+
+
+/* The data of a compressed write is decompressed into a buffer, then
+ * written as any other would be */
+void client_reply_to_write_lz4( struct client* client, struct nbd_request request )
+{
+	uint32_t clen = client_read_compressed_len( client, request.len );
+	char *compressed = xmalloc( clen );
+	char *buf = xmalloc( request.len );
+	ssize_t got;
+	int decompressed;
+
+	debug("request compressed write from=%"PRIu64", len=%"PRIu32", compressed=%"PRIu32,
+			request.from, request.len, clen );
+
+	got = readloop( client->socket, compressed, clen );
+	if ( got < 0 ) {
+		free( compressed );
+		free( buf );
+		error( "reading compressed write data failed from=%ld, len=%d",
+				request.from, request.len );
+	}
+
+	decompressed = LZ4_decompress_safe( compressed, buf, clen, request.len );
+	free( compressed );
+
+	if ( decompressed != (int) request.len ) {
+		warn( "compressed write from=%"PRIu64" decompressed to %d bytes, not %"PRIu32,
+				request.from, decompressed, request.len );
+		free( buf );
+		client_write_reply( client, &request, EINVAL );
+		return;
+	}
+
+	if ( client->fill && client->serve->postcopy ) {
+		client_fill_buffer( client, request.from, buf, request.len );
+	} else if ( client_postcopy_prepare( client, request.from, request.len, 1 ) < 0 ) {
+		free( buf );
+		client_write_reply( client, &request, EIO );
+		return;
+	} else if ( client_is_sink( client ) ) {
+		client_sink_buffer( client, request.from, buf, request.len );
+	} else {
+		write_buffer_not_zeroes( client, request.from, buf, request.len );
+	}
+	free( buf );
+
+	client_sync_range( client, request.from, request.len );
+	client_postcopy_written( client, 1 );
+	client_write_reply( client, &request, 0 );
+}
+
+
+/* The data of a mirror's write during a post-copy migration is read into a
+ * buffer, as only some of it may be wanted */
+static void client_fill_from_socket( struct client* client, struct nbd_request request )
+{
+	char *buf = xmalloc( request.len );
+
+	if ( readloop( client->socket, buf, request.len ) < 0 ) {
+		free( buf );
+		error( "reading write data failed from=%ld, len=%d",
+				request.from, request.len );
+	}
+
+	client_fill_buffer( client, request.from, buf, request.len );
+	free( buf );
+}
+
+
 void client_reply_to_write( struct client* client, struct nbd_request request )
 {
 	debug("request write from=%"PRIu64", len=%"PRIu32", handle=0x%08X", request.from, request.len, request.handle);
-	if (client->serve->allocation_map_built) {
+
+	if ( client->fill && client->serve->postcopy ) {
+		client_fill_from_socket( client, request );
+	}
+	else if ( client_postcopy_prepare( client, request.from, request.len, 1 ) < 0 ) {
+		client_flush( client, request.len );
+		client_write_reply( client, &request, EIO );
+		return;
+	}
+	else if ( client_is_sink( client ) ) {
+		client_sink_from_socket( client, request );
+	}
+	else if (client->serve->allocation_map_built) {
 		write_not_zeroes( client, request.from, request.len );
 	}
 	else {
@@ -468,25 +994,281 @@ void client_reply_to_write( struct client* client, struct nbd_request request )
 		bitset_set_range(client->serve->allocation_map, request.from, request.len);
 	}
 
-	if (1) /* not sure whether this is necessary... */
-	{
-		/* multiple of 4K page size */
-		uint64_t from_rounded = request.from & (!0xfff);
-		uint64_t len_rounded = request.len + (request.from - from_rounded);
-
-		FATAL_IF_NEGATIVE(
-			msync( client->mapped + from_rounded,
-				len_rounded,
-				MS_SYNC | MS_INVALIDATE),
-			"msync failed %ld %ld", request.from, request.len
-		);
-	}
+	client_sync_range( client, request.from, request.len );
+	client_postcopy_written( client, 1 );
 	client_write_reply( client, &request, 0);
 }
 
 
+/* Zero len bytes at from, which must lie within a single block. There's
+ * nothing to do unless the block is allocated, since holes read as zeroes.
+ */
+static void client_zero_partial_block( struct client* client, uint64_t from, uint64_t len )
+{
+	struct bitset * map = client->serve->allocation_map;
+
+	if ( len == 0 ) {
+		return;
+	}
+
+	if ( !client->serve->allocation_map_built || bitset_is_set_at( map, from ) ) {
+		memset( client->mapped + from, 0, len );
+		client_sync_range( client, from, len );
+		/* The bytes have changed, so the event stream needs to hear about it */
+		bitset_set_range( map, from, len );
+	}
+}
+
+
+/* A write zeroes request carries no data. We punch out the whole blocks it
+ * covers, which leaves the file as sparse as we can make it, and zero any
+ * partial blocks at either end. If the filesystem can't punch holes, we
+ * write the zeroes out instead.
+ */
+static void client_write_zeroes( struct client* client, uint64_t from, uint64_t len )
+{
+	struct bitset * map = client->serve->allocation_map;
+	uint64_t to = from + len;
+	uint64_t start, end;
+
+	start = from + block_allocation_resolution - 1;
+	start -= start % block_allocation_resolution;
+	end = to - ( to % block_allocation_resolution );
+
+	if ( start >= end ) {
+		/* Doesn't cover a whole block, so at most two partial ones */
+		start = end = ( start < to ? start : to );
+	}
+
+	client_zero_partial_block( client, from, start - from );
+
+	if ( end > start ) {
+		if ( 0 == fallocate( client->fileno,
+					FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+					start, end - start ) ) {
+			/* This puts an UNSET event on the stream, which tells a mirror
+			 * the blocks have changed. */
+			bitset_clear_range( map, start, end - start );
+		} else {
+			debug( SHOW_ERRNO( "Couldn't punch hole, writing zeroes instead" ) );
+			memset( client->mapped + start, 0, end - start );
+			client_sync_range( client, start, end - start );
+			bitset_set_range( map, start, end - start );
+		}
+	}
+
+	client_zero_partial_block( client, end, to - end );
+}
+
+
+void client_reply_to_write_zeroes( struct client* client, struct nbd_request request )
+{
+	struct postcopy * pc = client->serve->postcopy;
+	uint64_t from = request.from;
+	uint64_t len = request.len;
+	uint64_t run;
+	int fill;
+
+	debug("request write zeroes from=%"PRIu64", len=%"PRIu32, request.from, request.len);
+
+	if ( client->fill && pc ) {
+		/* As for client_fill_buffer */
+		postcopy_lock( pc );
+		while ( len > 0 ) {
+			run = client_postcopy_fill_run( pc, from, len, &fill );
+			if ( fill ) {
+				client_write_zeroes( client, from, run );
+				postcopy_mark( pc, from, run );
+			}
+			from += run;
+			len  -= run;
+		}
+		postcopy_unlock( pc );
+	}
+	else if ( client_postcopy_prepare( client, from, len, 1 ) < 0 ) {
+		client_write_reply( client, &request, EIO );
+		return;
+	}
+	else {
+		client_write_zeroes( client, from, len );
+		client_postcopy_written( client, 1 );
+	}
+
+	client_write_reply( client, &request, 0 );
+}
+
+
+/* Everything we've acknowledged goes to disc before we acknowledge this.
+ * Only a sink has anything to do, but fdatasync() is cheap when there's
+ * nothing to write, and covers whatever other clients wrote too.
+ */
+void client_reply_to_flush( struct client* client, struct nbd_request request )
+{
+	int error = 0;
+
+	debug( "request flush" );
+
+	if ( 0 > fdatasync( client->fileno ) ) {
+		warn( SHOW_ERRNO( "fdatasync failed" ) );
+		error = EIO;
+	}
+
+	client_write_reply( client, &request, error );
+}
+
+
+/* Send back the hash of each NBD_HASH_BLOCK_SIZE block of the range, so a
+ * mirror can tell which parts of our copy it needs to send. Blocks that the
+ * allocation map says are holes all hash the same, so we only read one.
+ */
+void client_reply_to_hash( struct client* client, struct nbd_request request )
+{
+	struct bitset * map = client->serve->allocation_map;
+	uint64_t count = ( request.len + NBD_HASH_BLOCK_SIZE - 1 ) / NBD_HASH_BLOCK_SIZE;
+	uint64_t * hashes = xmalloc( count * sizeof( uint64_t ) );
+	uint64_t i, from, len, hash;
+	uint64_t hole_hash = 0;
+	int have_hole_hash = 0;
+	ssize_t written;
+
+	debug("request hash from=%"PRIu64", len=%"PRIu32, request.from, request.len);
+
+	for ( i = 0; i < count; i++ ) {
+		from = request.from + i * NBD_HASH_BLOCK_SIZE;
+		len = request.from + request.len - from;
+		if ( len > NBD_HASH_BLOCK_SIZE ) {
+			len = NBD_HASH_BLOCK_SIZE;
+		}
+
+		if ( len == NBD_HASH_BLOCK_SIZE && client->serve->allocation_map_built &&
+				0 == bitset_count_set( map, from, len ) ) {
+			if ( !have_hole_hash ) {
+				hole_hash = hash64( client->mapped + from, len, 0 );
+				have_hole_hash = 1;
+			}
+			hash = hole_hash;
+		} else {
+			hash = hash64( client->mapped + from, len, 0 );
+		}
+
+		hashes[i] = htobe64( hash );
+	}
+
+	sock_set_tcp_cork( client->socket, 1 );
+	client_write_reply( client, &request, 0 );
+	written = writeloop( client->socket, hashes, count * sizeof( uint64_t ) );
+	sock_set_tcp_cork( client->socket, 0 );
+	free( hashes );
+
+	ERROR_IF_NEGATIVE( written, "writing hashes failed from=%ld, len=%d",
+			request.from, request.len );
+}
+
+
+/* While the mirror is throttling writes, we sleep for throttle percent of the
+ * time, counting from the end of the last pause. Pauses too short to bother
+ * with are saved up until they're worth taking.
+ */
+void client_throttle_write( struct client* client )
+{
+	int throttle = client->serve->write_throttle;
+	uint64_t now = monotonic_time_ms();
+	uint64_t pause;
+
+	if ( throttle <= 0 || throttle >= 100 || client->throttled_at == 0 ) {
+		client->throttled_at = now;
+		return;
+	}
+
+	pause = ( now - client->throttled_at ) * throttle / ( 100 - throttle );
+	if ( pause == 0 ) {
+		return;
+	}
+	if ( pause > CLIENT_THROTTLE_MAX_PAUSE_MS ) {
+		pause = CLIENT_THROTTLE_MAX_PAUSE_MS;
+	}
+
+	debug( "Throttling write by %"PRIu64"ms", pause );
+	usleep( pause * 1000 );
+	client->throttled_at = monotonic_time_ms();
+}
+
+
+/* A mirror tells us the generation ID of the migration it's sending, and we
+ * tell it the one we had. If they match, we're the listener it was sending
+ * to before, with everything it sent still in place.
+ */
+void client_reply_to_generation( struct client* client, struct nbd_request request )
+{
+	uint64_t generation_raw, previous_raw;
+	ssize_t written;
+
+	ERROR_IF_NEGATIVE(
+		readloop( client->socket, &generation_raw, sizeof( generation_raw ) ),
+		"reading generation failed"
+	);
+
+	previous_raw = htobe64( client->serve->mirror_generation );
+	client->serve->mirror_generation = be64toh( generation_raw );
+	debug( "request generation %"PRIx64", had %"PRIx64,
+			client->serve->mirror_generation, be64toh( previous_raw ) );
+
+	sock_set_tcp_cork( client->socket, 1 );
+	client_write_reply( client, &request, 0 );
+	written = writeloop( client->socket, &previous_raw, sizeof( previous_raw ) );
+	sock_set_tcp_cork( client->socket, 0 );
+
+	ERROR_IF_NEGATIVE( written, "writing generation failed" );
+}
+
+
+/* A mirror hands us control of the image before sending it, and turns the
+ * connection round so we can fetch the blocks we need before it gets round
+ * to them. If it loses the connection and comes back, we carry on with the
+ * blocks we already have.
+ */
+void client_reply_to_postcopy( struct client* client, struct nbd_request request )
+{
+	struct postcopy * pc = server_start_postcopy( client->serve );
+	int fd;
+
+	if ( pc == NULL ) {
+		warn( "post-copy request refused, we already have control" );
+		client_write_reply( client, &request, EINVAL );
+		return;
+	}
+
+	client_write_reply( client, &request, 0 );
+
+	/* The client thread closes its socket when it finishes, so the
+	 * connection we fetch over needs one of its own */
+	client->turned_round = 1;
+	fd = dup( client->socket );
+	ERROR_IF_NEGATIVE( fd, SHOW_ERRNO( "Couldn't dup() the post-copy connection" ) );
+
+	if ( postcopy_open_channel( pc, fd ) ) {
+		info( "Fetching blocks we don't have yet from the mirror" );
+	}
+}
+
+
+/* The reply to this only comes if a mirror hands the image over, once our
+ * thread has been stopped for it. See server_park_redirect().
+ */
+void client_reply_to_redirect( struct client* client, struct nbd_request request )
+{
+	client->redirect_wanted = 1;
+	memcpy( client->redirect_handle, request.handle, 8 );
+}
+
+
 void client_reply( struct client* client, struct nbd_request request )
 {
+	if ( request.type == REQUEST_WRITE || request.type == REQUEST_WRITE_ZEROES ||
+			request.type == REQUEST_WRITE_LZ4 ) {
+		client_throttle_write( client );
+	}
+
 	switch (request.type) {
 	case REQUEST_READ:
 		client_reply_to_read( client, request );
@@ -494,6 +1276,27 @@ void client_reply( struct client* client, struct nbd_request request )
 	case REQUEST_WRITE:
 		client_reply_to_write( client, request );
 		break;
+	case REQUEST_WRITE_ZEROES:
+		client_reply_to_write_zeroes( client, request );
+		break;
+	case REQUEST_WRITE_LZ4:
+		client_reply_to_write_lz4( client, request );
+		break;
+	case REQUEST_FLUSH:
+		client_reply_to_flush( client, request );
+		break;
+	case REQUEST_HASH:
+		client_reply_to_hash( client, request );
+		break;
+	case REQUEST_GENERATION:
+		client_reply_to_generation( client, request );
+		break;
+	case REQUEST_POSTCOPY:
+		client_reply_to_postcopy( client, request );
+		break;
+	case REQUEST_REDIRECT:
+		client_reply_to_redirect( client, request );
+		break;
 	}
 }
 
@@ -617,7 +1420,7 @@ int client_serve_request(struct client* client)
 	{
 		if ( !server_is_closed( client->serve ) ) {
 			client_reply( client, request );
-			stop = 0;
+			stop = client->turned_round;
 		}
 	}
 
@@ -639,6 +1442,9 @@ void client_cleanup(struct client* client,
 	/* If the thread hits an error, we need to ensure this is off */
 	client_disarm_killswitch( client );
 
+	/* Nor can a write we didn't finish keep blocks from anyone else */
+	client_postcopy_written( client, 0 );
+
 	if (client->socket) {
 		FATAL_IF_NEGATIVE( close(client->socket),
 			"Error closing client socket %d",
@@ -656,6 +1462,12 @@ void client_cleanup(struct client* client,
 		debug("Closed client file fd %d", client->fileno );
 		client->fileno = -1;
 	}
+	if ( client->sink_fd >= 0 ) {
+		FATAL_IF_NEGATIVE( close( client->sink_fd ),
+			"Error closing file %d",
+			client->sink_fd );
+		client->sink_fd = -1;
+	}
 
 	if ( server_acl_locked( client->serve ) ) { server_unlock_acl( client->serve ); }
 
@@ -683,6 +1495,13 @@ void* client_serve(void* client_uncast)
 		SHOW_ERRNO( "Failed to madvise() %s", client->serve->filename )
 	);
 
+	/* See client_is_sink() */
+	if ( !client->serve->success ) {
+		client->sink_fd = open( client->serve->filename, O_RDWR );
+		FATAL_IF_NEGATIVE( client->sink_fd,
+			SHOW_ERRNO( "Couldn't open %s", client->serve->filename ) );
+	}
+
 	debug( "Opened client file fd %d", client->fileno);
 	debug("client: sending hello");
 	client_send_hello(client);
@@ -695,7 +1514,16 @@ void* client_serve(void* client_uncast)
 
 	if ( client->disconnect ){
 		debug("client: control arrived" );
+		/* A mirror will have flushed what it sent already, but one that
+		 * doesn't know how leaves it to us */
+		if ( client_is_sink( client ) ) {
+			FATAL_IF_NEGATIVE( fdatasync( client->sink_fd ),
+				SHOW_ERRNO( "fdatasync failed" ) );
+		}
 		server_control_arrived( client->serve );
+	} else if ( client->redirect_wanted && !client->serve->allow_new_clients ) {
+		/* We've been stopped so a mirror can finish */
+		server_park_redirect( client->serve, dup( client->socket ), client->redirect_handle );
 	}
 
 	debug("Cleaning client %p up normally in thread %p", client, pthread_self());
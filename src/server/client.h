@@ -3,6 +3,7 @@
 
 #include <signal.h>
 #include <time.h>
+#include <stdint.h>
 
 /** CLIENT_HANDLER_TIMEOUT
  * This is the length of time (in seconds) any request can be outstanding for.
@@ -10,6 +11,18 @@
  */
 #define CLIENT_HANDLER_TIMEOUT 120
 
+/** CLIENT_THROTTLE_MAX_PAUSE_MS
+ * The longest we'll hold up a single write while writes are being throttled,
+ * however long it's been since the last one.
+ */
+#define CLIENT_THROTTLE_MAX_PAUSE_MS 1000
+
+/** CLIENT_SINK_BUFFER_SIZE
+ * The most of a mirror's write a listener reads from the socket before
+ * writing it out. See client_is_sink().
+ */
+#define CLIENT_SINK_BUFFER_SIZE ( 4 << 20 )
+
 /** CLIENT_KILLSWITCH_SIGNAL
  * The signal number we use to kill the server when *any* killswitch timer
  * fires. The handler gets the fd of the client socket to work with.
@@ -31,6 +44,11 @@ struct client {
 	int     fileno;
 	char*   mapped;
 
+	/* A listener's clients also get the file opened without O_SYNC, to
+	 * write a mirror's data out through, and a buffer to read it into */
+	int     sink_fd;
+	char*   sink_buf;
+
 	struct self_pipe * stop_signal;
 
 	struct server* serve; /* FIXME: remove above duplication */
@@ -43,6 +61,25 @@ struct client {
 	 */
 	timer_t killswitch;
 
+	/* When we last paused a write for throttling, from monotonic_time_ms() */
+	uint64_t throttled_at;
+
+	/* Set if the request we're handling was one of the REQUEST_*_FILL ones */
+	int     fill;
+
+	/* The blocks a write we're handling during a post-copy migration has
+	 * kept to itself until its data lands, if any */
+	uint64_t postcopy_from;
+	uint64_t postcopy_len;
+
+	/* Set once a mirror has turned this connection round for a post-copy
+	 * migration, after which it's no longer ours to read requests from */
+	int     turned_round;
+
+	/* Set once the client has asked where the image goes when a mirror
+	 * hands it over, with the handle to answer that with */
+	int     redirect_wanted;
+	char    redirect_handle[8];
 };
 
 void client_killswitch_hit(int signal, siginfo_t *info, void *ptr);
@@ -317,11 +317,15 @@ int control_mirror(struct control_client* client, int linesc, char** lines)
 	NULLCHECK( client );
 
 	struct flexnbd * flexnbd = client->flexnbd;
-	union mysockaddr *connect_to = xmalloc( sizeof( union mysockaddr ) );
+	union mysockaddr *connect_to[MS_DESTINATIONS_MAX];
 	union mysockaddr *connect_from = NULL;
 	uint64_t max_Bps = UINT64_MAX;
 	int action_at_finish;
-	int raw_port;
+	int raw_port = 0;
+	int destinations = 0;
+	int post_copy = 0;
+	int verify = 0;
+	char *addr, *port, *next;
 
 
 	if (linesc < 2) {
@@ -329,17 +333,65 @@ int control_mirror(struct control_client* client, int linesc, char** lines)
 		return -1;
 	}
 
-	if (parse_ip_to_sockaddr(&connect_to->generic, lines[0]) == 0) {
-		write_socket("1: bad IP address");
+	/* A post-copy migration, or a check of the listeners' copies at the
+	 * end, is asked for with trailing parameters of "postcopy" or "verify",
+	 * which can't be mistaken for any of the others */
+	while (linesc > 2) {
+		if (strcmp("postcopy", lines[linesc-1]) == 0) {
+			post_copy = 1;
+		} else if (strcmp("verify", lines[linesc-1]) == 0) {
+			verify = 1;
+		} else {
+			break;
+		}
+		linesc--;
+	}
+
+	if (post_copy && verify) {
+		write_socket("1: post-copy migration can't be verified");
+		return -1;
+	}
+
+	/* To mirror to several listeners at once, the address and port are
+	 * comma-separated lists. If there are fewer ports than addresses, the
+	 * last port is used for the rest. */
+	addr = lines[0];
+	port = lines[1];
+	while (addr != NULL) {
+		if (destinations == MS_DESTINATIONS_MAX) {
+			write_socket("1: too many destinations");
+			return -1;
+		}
+
+		if ((next = strchr(addr, ',')) != NULL) { *next++ = '\0'; }
+		connect_to[destinations] = xmalloc( sizeof( union mysockaddr ) );
+		if (parse_ip_to_sockaddr(&connect_to[destinations]->generic, addr) == 0) {
+			write_socket("1: bad IP address");
+			return -1;
+		}
+		addr = next;
+
+		if (port != NULL) {
+			if ((next = strchr(port, ',')) != NULL) { *next++ = '\0'; }
+			raw_port = atoi(port);
+			if (raw_port < 0 || raw_port > 65535) {
+				write_socket("1: bad IP port number");
+				return -1;
+			}
+			port = next;
+		}
+		connect_to[destinations++]->v4.sin_port = htobe16(raw_port);
+	}
+
+	if (port != NULL) {
+		write_socket("1: more ports than addresses");
 		return -1;
 	}
 
-	raw_port = atoi(lines[1]);
-	if (raw_port < 0 || raw_port > 65535) {
-		write_socket("1: bad IP port number");
+	if (post_copy && destinations > 1) {
+		write_socket("1: post-copy migration needs a single destination");
 		return -1;
 	}
-	connect_to->v4.sin_port = htobe16(raw_port);
 
 	action_at_finish = ACTION_EXIT;
 	if (linesc > 2) {
@@ -392,9 +444,12 @@ int control_mirror(struct control_client* client, int linesc, char** lines)
 			serve->mirror_super = mirror_super_create(
 					serve->filename,
 					connect_to,
+					destinations,
 					connect_from,
 					max_Bps ,
 					action_at_finish,
+					post_copy,
+					verify,
 					client->mirror_state_mbox );
 			serve->mirror = serve->mirror_super->mirror;
 			server_prevent_mirror_start( serve );
@@ -443,13 +498,14 @@ int control_mirror_max_bps( struct control_client* client, int linesc, char** li
 
 	struct server* serve = flexnbd_server( client->flexnbd );
 	uint64_t max_Bps;
+	uint64_t max_burst = 0;
 
 	if ( !serve->mirror_super ) {
 		write_socket( "1: Not currently mirroring" );
 		return -1;
 	}
 
-	if ( linesc != 1 ) {
+	if ( linesc != 1 && linesc != 2 ) {
 		write_socket( "1: Bad format" );
 		return -1;
 	}
@@ -464,6 +520,18 @@ int control_mirror_max_bps( struct control_client* client, int linesc, char** li
 		return -1;
 	}
 
+	if ( linesc == 2 ) {
+		max_burst = strtoull( lines[1], NULL, 10 );
+		if ( errno == ERANGE ) {
+			write_socket( "1: max_burst out of range" );
+			return -1;
+		} else if ( errno != 0 ) {
+			write_socket( "1: max_burst couldn't be parsed" );
+			return -1;
+		}
+	}
+
+	serve->mirror->max_burst_bytes = max_burst;
 	serve->mirror->max_bytes_per_second = max_Bps;
 	write_socket( "0: updated" );
 
@@ -516,7 +584,11 @@ int control_break(
 
 	server_lock_start_mirror( serve );
 	{
-		if ( server_is_mirroring( serve ) ) {
+		if ( server_is_mirroring( serve ) && serve->mirror->switched_over ) {
+			/* The listener has control, and needs the rest of our copy */
+			warn( "Can't abandon a post-copy migration once switched over" );
+			write( client->socket, "1: post-copy migration can't be stopped\n", 40 );
+		} else if ( server_is_mirroring( serve ) ) {
 
 			info( "Signaling to abandon mirror" );
 			server_abandon_mirror( serve );
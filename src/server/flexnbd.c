@@ -137,9 +137,12 @@ struct flexnbd * flexnbd_create_listening(
 			default_deny,
 			acl_entries,
 			s_acl_entries,
-			1, 0, 0);
+			MAX_NBD_CLIENTS, 0, 0);
 	flexnbd_create_shared( flexnbd, s_ctrl_sock );
 
+	// The sender may open several connections, each writing its own part of
+	// the image. Control passes when one of them sends a disconnect.
+
 	// listen can't use killswitch, as mirror may pause on sending things
 	// for a very long time.
 
@@ -25,13 +25,21 @@
 #include "bitset.h"
 #include "self_pipe.h"
 #include "status.h"
+#include "hash.h"
+#include "ratelimit.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <sys/un.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/sendfile.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
 #include <ev.h>
+#include <lz4.h>
 
 /* compat with older libev */
 #ifndef EVBREAK_ONE
@@ -47,21 +55,144 @@
 
 /* We use this to keep track of the socket request data we need to send */
 struct xfer {
-	/* Store the bytes we need to send before the data, or receive back */
-	union {
-		struct nbd_request_raw req_raw;
-		struct nbd_reply_raw rsp_raw;
-	} hdr;
+	/* Store the bytes we need to send before the data */
+	struct nbd_request_raw req_raw;
 
-	/* what in mirror->mapped we should write, and how much of it we've done */
+	/* what in mirror->mapped we should write */
 	uint64_t from;
 	uint64_t len;
+
+	/* Set from when the xfer is set up until every listener has replied */
+	int in_use;
+
+	/* Bits, by destination, for the links that have finished writing the
+	 * xfer, and the ones that have had a reply to it */
+	unsigned int sent_to;
+	unsigned int acked_by;
+
+	/* REQUEST_WRITE, or REQUEST_WRITE_ZEROES or REQUEST_HASH, which have no
+	 * data following the request */
+	uint32_t type;
+
+	/* The data to send after the request. For a plain write, this points
+	 * into mirror->mapped; once compressed, it's cbuf, which we own. */
+	char *payload;
+	uint64_t payload_len;
+	char *cbuf;
+
+	/* For a hash request, our own hashes of the range, if a worker has
+	 * worked them out for us */
+	uint64_t *hashes;
+
+	/* Set once the xfer can be sent, which for one we're compressing is
+	 * when a worker has finished with it */
+	int ready;
+
+	/* CPU time the compression took, and the next xfer on the compression
+	 * pool's lists */
+	double compress_secs;
+	struct mirror_conn *conn;
+	struct xfer *next;
+
+	/* When we started writing the request to the first listener, and
+	 * finished writing it to the last. These are ev_now() times, used to
+	 * measure throughput and round-trip time */
+	ev_tstamp started;
+	ev_tstamp sent;
+};
+
+/* Compression happens on a pool of worker threads, so it can't hold up the
+ * event loop. Workers take xfers from jobs, compress them, then put them on
+ * done and poke the loop's async watcher, which marks them ready to send.
+ * Hash requests go the same way, so we hash our copy of each range on
+ * several CPUs, while the listeners hash theirs.
+ */
+struct mirror_pool {
+	pthread_t threads[MS_COMPRESS_THREADS_MAX];
+	int thread_count;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct xfer *jobs;
+	struct xfer *jobs_tail;
+	struct xfer *done;
+	int stop;
+
+	struct ev_loop *ev_loop;
+	ev_async *async;
+};
+
+struct mirror_ctrl;
+struct mirror_conn;
+
+/* A connection has a link to each listener. Every link sends the same xfers
+ * in the same order, so they're only set up, read and compressed once. One
+ * link can run ahead of the others, but only as far as the window lets the
+ * connection as a whole, since an xfer stays in use until every listener
+ * has replied to it.
+ */
+struct mirror_link {
+	struct mirror_conn *conn;
+	int dest;
+	int fd;
+
+	ev_io read_watcher;
+	ev_io write_watcher;
+
+	/* How many of the connection's queued xfers we've started on, the one
+	 * we're part-way through writing, if any, and how much of it is done */
+	uint64_t dequeued;
+	struct xfer *sending;
 	uint64_t written;
 
-	/* number of bytes of response read */
-	uint64_t read;
+	/* The reply we're reading, and how many bytes of it we have */
+	struct nbd_reply_raw rsp_raw;
+	uint64_t rsp_read;
 
+	/* If the reply was to a hash request, we read the hashes following it
+	 * into here before comparing them with our own */
+	struct xfer *hashing;
+	uint64_t *hashes;
+	uint64_t hashes_read;
+};
 
+/* Each connection is responsible for one contiguous range of the image, both
+ * for the first pass and for any dirty blocks within it. As a block is only
+ * ever sent down one connection to each listener, and a listener handles
+ * each connection's requests in order, a later write to a block can't
+ * overtake an earlier one.
+ */
+struct mirror_conn {
+	struct mirror_ctrl *ctrl;
+	struct mirror_link links[MS_DESTINATIONS_MAX];
+
+	/* The range we're responsible for, and how far through it the first
+	 * pass has got */
+	uint64_t start;
+	uint64_t end;
+	uint64_t offset;
+
+	/* Where we're up to in sweeping dirty_map for runs to send, and how
+	 * many dirty bytes there are in our range */
+	uint64_t dirty_cursor;
+	uint64_t dirty_bytes;
+
+	/* The xfers we have outstanding. Each one's index in here is encoded in
+	 * the handle of its request, so we can match replies back to them. We
+	 * allow up to ctrl->window of them to be in use at once. */
+	struct xfer xfers[MS_WINDOW_MAX];
+	int in_flight;
+
+	/* xfers set up, in the order they have to go out in, and how many have
+	 * ever been queued. Each link takes them from here in turn. A later xfer
+	 * may cover the same blocks as an earlier one, so we mustn't let it
+	 * overtake, even if it's ready first. As xfers stay in use until every
+	 * link has sent them, the window stops this from overflowing. */
+	struct xfer *queue[MS_WINDOW_MAX];
+	uint64_t enqueued;
+
+	/* When we last finished with an xfer */
+	ev_tstamp last_reply;
 };
 
 struct mirror_ctrl {
@@ -71,39 +202,94 @@ struct mirror_ctrl {
 	/* libev stuff */
 	struct ev_loop *ev_loop;
 	ev_timer begin_watcher;
-	ev_io read_watcher;
-	ev_io write_watcher;
 	ev_timer timeout_watcher;
 	ev_timer limit_watcher;
+	ev_timer dirty_rate_watcher;
 	ev_io abandon_watcher;
 
-	/* We set this if the bitset stream is getting uncomfortably full, and unset
-	 * once it's emptier */
-	int clear_events;
+	/* Smoothed measurements of the link to the listener, and the transfer
+	 * size we've derived from them */
+	double rtt;
+	double bps;
+	uint64_t xfer_size;
+
+	/* The rate limiter's token bucket */
+	struct ratelimit limit;
+
+	/* The counts of dirtied and sent bytes at the last dirty rate check, and
+	 * the smoothed rate we've been sending at since */
+	uint64_t last_dirtied;
+	uint64_t last_sent;
+	double sent_bps;
 
 	/* This is set once all clients have been closed, to let the mirror know
 	 * it's safe to finish once the queue is empty */
 	int clients_closed;
 
-	/* Use this to keep track of what we're copying at any moment */
-	struct xfer xfer;
-
+	/* Maximum number of xfers each connection may have outstanding, and the
+	 * total outstanding across all of them */
+	int window;
+	int in_flight;
+
+	/* Set if the listener can hash its copy for us, in which case the first
+	 * pass only asks for hashes, and sends the blocks that differ */
+	int hash;
+
+	/* Set once we've started going over the image again to check the
+	 * listeners' copies, and while we're doing so, with how much of it
+	 * turned out to differ */
+	int verified;
+	int verifying;
+	uint64_t verify_differ;
+
+	/* Cleared if the filesystem won't sendfile() from the image, in which
+	 * case we write plain writes' data from the mapping instead */
+	int sendfile;
+
+	/* Set if the listener takes compressed writes. We keep smoothed figures
+	 * for how well and how fast our data compresses, and how fast the link
+	 * sends what we give it, to decide whether compressing is paying off */
+	int compress;
+	struct mirror_pool pool;
+	ev_async compress_watcher;
+	double compress_ratio;
+	double compress_spb;
+	double wire_bps;
+	uint64_t compress_skipped;
+
+	struct mirror_conn conns[MS_CONNECTIONS_MAX];
+	int connections;
+
+	/* How many listeners each connection has a link to, and the bits for
+	 * all of them together */
+	int destinations;
+	unsigned int all_links;
 };
 
 struct mirror * mirror_alloc(
-		union mysockaddr * connect_to,
+		union mysockaddr ** connect_to,
+		int destinations,
 		union mysockaddr * connect_from,
 		uint64_t max_Bps,
 		enum mirror_finish_action action_at_finish,
+		int post_copy,
+		int verify,
 		struct mbox * commit_signal)
 {
 	struct mirror * mirror;
 
+	FATAL_IF( destinations < 1 || destinations > MS_DESTINATIONS_MAX,
+			"Can't mirror to %d destinations", destinations );
+
 	mirror = xmalloc(sizeof(struct mirror));
-	mirror->connect_to = connect_to;
+	memcpy( mirror->connect_to, connect_to, destinations * sizeof( *connect_to ) );
+	mirror->destinations = destinations;
 	mirror->connect_from = connect_from;
 	mirror->max_bytes_per_second = max_Bps;
 	mirror->action_at_finish = action_at_finish;
+	mirror->post_copy = post_copy;
+	mirror->verify = verify;
+	mirror->pull_fd = -1;
 	mirror->commit_signal = commit_signal;
 	mirror->commit_state = MS_UNKNOWN;
 	mirror->abandon_signal = self_pipe_create();
@@ -138,7 +324,6 @@ enum mirror_state mirror_get_state( struct mirror * mirror )
 
 void mirror_init( struct mirror * mirror, const char * filename )
 {
-	int map_fd;
 	uint64_t size;
 
 	NULLCHECK( mirror );
@@ -147,7 +332,7 @@ void mirror_init( struct mirror * mirror, const char * filename )
 	FATAL_IF_NEGATIVE(
 		open_and_mmap(
 			filename,
-			&map_fd,
+			&mirror->map_fd,
 			&size,
 			(void**) &mirror->mapped
 		),
@@ -159,18 +344,36 @@ void mirror_init( struct mirror * mirror, const char * filename )
 		madvise( mirror->mapped, size, MADV_SEQUENTIAL ),
 		SHOW_ERRNO( "Failed to madvise() %s", filename )
 	);
+
+	mirror->dirty_map = bitset_alloc( size, block_allocation_resolution );
+}
+
+
+/* Throw away what we know the listener has, so the next attempt starts
+ * from the beginning. */
+void mirror_forget_progress( struct mirror * mirror )
+{
+	NULLCHECK( mirror );
+
+	mirror->offset = 0;
+	mirror->ranges = 0;
+
+	bitset_clear( mirror->dirty_map );
+	mirror->dirty_bytes = 0;
 }
 
 
-/* Call this before a mirror attempt. */
+/* Call this before a mirror attempt. What the listener has is kept, in case
+ * the attempt turns out to be able to carry on from the last one. */
 void mirror_reset( struct mirror * mirror )
 {
 	NULLCHECK( mirror );
 	mirror_set_state( mirror, MS_INIT );
 
 	mirror->all_dirty = 0;
+	mirror->dirtied = 0;
+	mirror->dirty_bps = 0;
 	mirror->migration_started = 0;
-	mirror->offset = 0;
 
 	return;
 }
@@ -178,23 +381,37 @@ void mirror_reset( struct mirror * mirror )
 
 struct mirror * mirror_create(
 		const char * filename,
-		union mysockaddr * connect_to,
+		union mysockaddr ** connect_to,
+		int destinations,
 		union mysockaddr * connect_from,
 		uint64_t max_Bps,
 		int action_at_finish,
+		int post_copy,
+		int verify,
 		struct mbox * commit_signal)
 {
-	/* FIXME: shouldn't map_fd get closed? */
 	struct mirror * mirror;
 
 	mirror = mirror_alloc( connect_to,
+			destinations,
 			connect_from,
 			max_Bps,
 			action_at_finish,
+			post_copy,
+			verify,
 			commit_signal);
 
 	mirror_init( mirror, filename );
 	mirror_reset( mirror );
+	mirror_forget_progress( mirror );
+
+	while ( mirror->generation == 0 ) {
+		FATAL_UNLESS(
+			sizeof( mirror->generation ) ==
+				getrandom( &mirror->generation, sizeof( mirror->generation ), 0 ),
+			SHOW_ERRNO( "Couldn't make a generation ID" )
+		);
+	}
 
 
 	return mirror;
@@ -203,17 +420,23 @@ struct mirror * mirror_create(
 
 void mirror_destroy( struct mirror *mirror )
 {
+	int i;
+
 	NULLCHECK( mirror );
 	self_pipe_destroy( mirror->abandon_signal );
-	free(mirror->connect_to);
+	if ( mirror->mapped ) {
+		munmap( mirror->mapped, mirror->dirty_map->size );
+	}
+	close( mirror->map_fd );
+	bitset_free( mirror->dirty_map );
+	for ( i = 0; i < mirror->destinations; i++ ) {
+		free( mirror->connect_to[i] );
+	}
 	free(mirror->connect_from);
 	free(mirror);
 }
 
 
-/** The mirror code will split NBD writes, making them this long as a maximum */
-static const int mirror_longest_write = 8<<20;
-
 /* This must not be called if there's any chance of further I/O. Methods to
  * ensure this include:
  *   - Ensure image size is 0
@@ -222,6 +445,9 @@ static const int mirror_longest_write = 8<<20;
  */
 void mirror_on_exit( struct server * serve )
 {
+	struct mirror * mirror = serve->mirror;
+	int i, j;
+
 	/* If we're still here, we can shut the server down.
 	 *
 	 *
@@ -244,12 +470,100 @@ void mirror_on_exit( struct server * serve )
 		server_unlink( serve );
 	}
 
-	debug("Sending disconnect");
-	socket_nbd_disconnect( serve->mirror->client );
+	/* Everything sent down the other connections has been acknowledged by
+	 * now, so we just close them. The disconnect on the first one to each
+	 * listener is what hands control to it.
+	 */
+	for ( i = 0; i < mirror->destinations; i++ ) {
+		for ( j = 1; j < mirror->connections; j++ ) {
+			sock_try_close( mirror->clients[i][j] );
+			mirror->clients[i][j] = -1;
+		}
+
+		debug("Sending disconnect");
+		socket_nbd_disconnect( mirror->clients[i][0] );
+	}
+	server_release_redirects( serve, mirror->connect_to[0] );
 	info("Mirror sent.");
 }
 
 
+/* During a post-copy migration, the listener fetches the blocks it needs
+ * before we've sent them over a connection we've turned round for it, which
+ * this thread answers. Our copy is frozen by then, so it can read it as it
+ * likes. Any request other than a read means we've lost track of what the
+ * listener is saying, so we drop the connection, and it waits for the next.
+ */
+static void * mirror_pull_runner( void * mirror_uncast )
+{
+	struct mirror * mirror = (struct mirror *) mirror_uncast;
+	uint64_t size = mirror->dirty_map->size;
+	struct nbd_request_raw request_raw;
+	struct nbd_request request;
+	struct nbd_reply_raw reply_raw;
+	struct nbd_reply reply = { .magic = REPLY_MAGIC };
+
+	while ( 0 == readloop( mirror->pull_fd, &request_raw, sizeof( request_raw ) ) ) {
+		nbd_r2h_request( &request_raw, &request );
+
+		if ( request.magic != REQUEST_MAGIC || request.type != REQUEST_READ ) {
+			warn( "Listener sent a request we can't answer (type 0x%08X)", request.type );
+			break;
+		}
+
+		debug( "Listener fetching %"PRIu64"+%"PRIu32, request.from, request.len );
+		reply.error = request.from + request.len > size ? EPERM : 0;
+		memcpy( reply.handle, request.handle, sizeof( reply.handle ) );
+		nbd_h2r_reply( &reply, &reply_raw );
+
+		if ( 0 > writeloop( mirror->pull_fd, &reply_raw, sizeof( reply_raw ) ) ||
+				( reply.error == 0 &&
+				  0 > writeloop( mirror->pull_fd, mirror->mapped + request.from, request.len ) ) ) {
+			warn( SHOW_ERRNO( "Couldn't answer the listener's fetch" ) );
+			break;
+		}
+	}
+
+	debug( "Stopped answering the listener's fetches" );
+	shutdown( mirror->pull_fd, SHUT_RDWR );
+	return NULL;
+}
+
+
+static void mirror_stop_pull( struct mirror * mirror )
+{
+	if ( mirror->pull_fd < 0 ) {
+		return;
+	}
+
+	shutdown( mirror->pull_fd, SHUT_RDWR );
+	if ( mirror->pull_thread != 0 ) {
+		pthread_join( mirror->pull_thread, NULL );
+		mirror->pull_thread = 0;
+	}
+	close( mirror->pull_fd );
+	mirror->pull_fd = -1;
+}
+
+
+void mirror_close_connections( struct mirror * mirror )
+{
+	int i, j;
+
+	mirror_stop_pull( mirror );
+
+	for ( i = 0; i < mirror->destinations; i++ ) {
+		for ( j = 0; j < mirror->connections; j++ ) {
+			if ( mirror->clients[i][j] > 0 ) {
+				close( mirror->clients[i][j] );
+			}
+			mirror->clients[i][j] = -1;
+		}
+	}
+	mirror->connections = 0;
+}
+
+
 void mirror_cleanup( struct server * serve,
 		int fatal __attribute__((unused)))
 {
@@ -258,226 +572,1119 @@ void mirror_cleanup( struct server * serve,
 	NULLCHECK( mirror );
 	info( "Cleaning up mirror thread");
 
-	if ( mirror->mapped ) {
-		munmap( mirror->mapped, serve->size );
-	}
-	mirror->mapped = NULL;
-
-	if( mirror->client && mirror->client > 0 ){
-		close( mirror->client );
-	}
-	mirror->client = -1;
+	/* The mapping belongs to the mirror, not the thread, since a retry needs
+	 * it too. mirror_destroy unmaps it. */
+	mirror_close_connections( mirror );
 }
 
 
-int mirror_connect( struct mirror * mirror, uint64_t local_size )
+/* Connect to the given listener and check its hello. Returns MS_GO with the
+ * socket in *out_fd, and the hello's flags in *out_flags if that isn't NULL,
+ * if all is well, or the state describing the failure.
+ */
+enum mirror_state mirror_open_connection(
+		struct mirror * mirror,
+		int dest,
+		uint64_t local_size,
+		int *out_fd,
+		uint32_t *out_flags )
 {
 	struct sockaddr * connect_from = NULL;
-	int connected =  0;
+	enum mirror_state state;
+	int fd;
 
 	if ( mirror->connect_from ) {
 		connect_from = &mirror->connect_from->generic;
 	}
 
-	NULLCHECK( mirror->connect_to );
+	NULLCHECK( mirror->connect_to[dest] );
 
-	mirror->client = socket_connect(&mirror->connect_to->generic, connect_from);
-	if ( 0 < mirror->client ) {
+	fd = socket_connect(&mirror->connect_to[dest]->generic, connect_from);
+	if ( 0 < fd ) {
 		fd_set fds;
 		struct timeval tv = { MS_HELLO_TIME_SECS, 0};
 		FD_ZERO( &fds );
-		FD_SET( mirror->client, &fds );
+		FD_SET( fd, &fds );
 
 		FATAL_UNLESS( 0 <= select( FD_SETSIZE, &fds, NULL, NULL, &tv ),
 				"Select failed." );
 
-		if( FD_ISSET( mirror->client, &fds ) ){
+		if( FD_ISSET( fd, &fds ) ){
 			uint64_t remote_size;
-			if ( socket_nbd_read_hello( mirror->client, &remote_size ) ) {
+			if ( socket_nbd_read_hello( fd, &remote_size, out_flags ) ) {
 				if( remote_size == local_size ){
-					connected = 1;
-					mirror_set_state( mirror, MS_GO );
+					state = MS_GO;
 				}
 				else {
 					warn("Remote size (%d) doesn't match local (%d)",
 							remote_size, local_size );
-					mirror_set_state( mirror, MS_FAIL_SIZE_MISMATCH );
+					state = MS_FAIL_SIZE_MISMATCH;
 				}
 			}
 			else {
 				warn( "Mirror attempt rejected." );
-				mirror_set_state( mirror, MS_FAIL_REJECTED );
+				state = MS_FAIL_REJECTED;
 			}
 		}
 		else {
 			warn( "No NBD Hello received." );
-			mirror_set_state( mirror, MS_FAIL_NO_HELLO );
+			state = MS_FAIL_NO_HELLO;
 		}
 
-		if ( !connected ) { close( mirror->client ); }
+		if ( state != MS_GO ) { close( fd ); }
 	}
 	else {
 		warn( "Mirror failed to connect.");
-		mirror_set_state( mirror, MS_FAIL_CONNECT );
+		state = MS_FAIL_CONNECT;
+	}
+
+	*out_fd = fd;
+	return state;
+}
+
+
+/* How many connections we'd like to the listener. There's no point in more
+ * connections than the image has MS_XFER_MIN_SIZE chunks. */
+int mirror_connections_wanted( uint64_t local_size )
+{
+	int wanted = MS_CONNECTIONS;
+	uint64_t chunks = ( local_size + MS_XFER_MIN_SIZE - 1 ) / MS_XFER_MIN_SIZE;
+
+	char * env_connections = getenv( "FLEXNBD_MS_CONNECTIONS" );
+	if ( NULL != env_connections ) {
+		int connections = atoi( env_connections );
+		if ( connections > 0 && connections <= MS_CONNECTIONS_MAX ) {
+			wanted = connections;
+		} else {
+			warn( "Ignoring FLEXNBD_MS_CONNECTIONS=%s, must be 1-%d",
+					env_connections, MS_CONNECTIONS_MAX );
+		}
+	}
+
+	if ( (uint64_t) wanted > chunks ) {
+		wanted = chunks > 0 ? chunks : 1;
+	}
+
+	return wanted;
+}
+
+
+/* The first connection to each listener decides whether the mirror can go
+ * ahead. We then try to open the rest; if a listener won't take them (an
+ * older flexnbd listen only accepts one client) we make do with as many as
+ * they'll all take.
+ */
+int mirror_connect( struct mirror * mirror, uint64_t local_size )
+{
+	enum mirror_state state = MS_GO;
+	uint32_t flags;
+	int wanted, i, j;
+
+	mirror->connections = 0;
+	mirror->listener_flags = ~0;
+
+	for ( i = 0; i < mirror->destinations; i++ ) {
+		state = mirror_open_connection( mirror, i, local_size,
+				&mirror->clients[i][0], &flags );
+		if ( state != MS_GO ) {
+			break;
+		}
+		mirror->listener_flags &= flags;
+	}
+
+	if ( state == MS_GO && mirror->post_copy &&
+			!( mirror->listener_flags & INIT_FLAG_POSTCOPY ) ) {
+		warn( "Listener can't take a post-copy migration" );
+		state = MS_FAIL_REJECTED;
+	}
+
+	mirror_set_state_f( mirror, state );
+	if ( state != MS_GO ) {
+		for ( j = 0; j < i; j++ ) {
+			close( mirror->clients[j][0] );
+		}
+		for ( j = 0; j < mirror->destinations; j++ ) {
+			mirror->clients[j][0] = -1;
+		}
+		return 0;
+	}
+	mirror->connections = 1;
+
+	wanted = mirror_connections_wanted( local_size );
+	while ( mirror->connections < wanted ) {
+		for ( i = 0; i < mirror->destinations; i++ ) {
+			if ( MS_GO != mirror_open_connection( mirror, i, local_size,
+						&mirror->clients[i][mirror->connections], NULL ) ) {
+				break;
+			}
+		}
+
+		if ( i < mirror->destinations ) {
+			warn( "Listener %d refused connection %d, mirroring over %d",
+					i, mirror->connections + 1, mirror->connections );
+			for ( j = 0; j < i; j++ ) {
+				close( mirror->clients[j][mirror->connections] );
+			}
+			break;
+		}
+		mirror->connections++;
+	}
+
+	info( "Mirroring to %d listener(s) over %d connection(s) each",
+			mirror->destinations, mirror->connections );
+	return 1;
+}
+
+
+int mirror_should_quit( struct mirror * mirror )
+{
+	switch( mirror->action_at_finish ) {
+		case ACTION_EXIT:
+		case ACTION_UNLINK:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/* Round the given size down to a whole number of blocks, within the limits */
+static uint64_t mirror_clamp_xfer_size( double size )
+{
+	if ( size < MS_XFER_MIN_SIZE ) {
+		return MS_XFER_MIN_SIZE;
+	}
+	if ( size > MS_XFER_MAX_SIZE ) {
+		return MS_XFER_MAX_SIZE;
+	}
+
+	return (uint64_t) size - ( (uint64_t) size % block_allocation_resolution );
+}
+
+/* The most we may send at once under the rate limit */
+static double mirror_burst( struct mirror *mirror )
+{
+	return ratelimit_burst( mirror->max_bytes_per_second, mirror->max_burst_bytes );
+}
+
+/* Bandwidth limiting is a token bucket, so however big the xfers are, we
+ * never send more than the burst at once. Events keep being drained into the
+ * dirty map while we wait, so the stream can't fill up.
+ *
+ * Returns how many seconds to wait before writing, or 0 to go ahead.
+ */
+static double mirror_limit_wait( struct mirror_ctrl *ctrl )
+{
+	struct mirror *mirror = ctrl->mirror;
+
+	return ratelimit_wait(
+		&ctrl->limit, mirror->max_bytes_per_second,
+		mirror_burst( mirror ), ev_now( ctrl->ev_loop )
+	);
+}
+
+/* Called once a transfer has been acknowledged. We take the time from the
+ * last byte written to the reply as the round-trip time, and the time for
+ * the whole transfer to give the throughput of one connection. From those we
+ * size the next transfers so that the window of them keeps the connection
+ * busy for many round trips, without more than doubling in size at a time.
+ */
+void mirror_update_xfer_size( struct mirror_conn *conn, struct xfer *xfer, ev_tstamp now )
+{
+	struct mirror_ctrl *ctrl = conn->ctrl;
+	double rtt = now - xfer->sent;
+	double duration;
+	double target;
+
+	/* With several xfers outstanding, they queue behind each other, so we
+	 * only count the time since the previous reply against this one */
+	duration = now - ( xfer->started > conn->last_reply ? xfer->started : conn->last_reply );
+	conn->last_reply = now;
+
+	if ( duration <= 0 ) {
+		/* Too quick for the clock to see. Just grow. */
+		ctrl->xfer_size = mirror_clamp_xfer_size( ctrl->xfer_size * 2 );
+		return;
+	}
+
+	if ( ctrl->bps == 0 ) {
+		ctrl->rtt = rtt;
+		ctrl->bps = xfer->len / duration;
+		ctrl->wire_bps = xfer->payload_len / duration;
+	} else {
+		ctrl->rtt = ( ctrl->rtt * 3 + rtt ) / 4;
+		ctrl->bps = ( ctrl->bps * 3 + ( xfer->len / duration ) ) / 4;
+		ctrl->wire_bps = ( ctrl->wire_bps * 3 + ( xfer->payload_len / duration ) ) / 4;
+	}
+
+	target = ctrl->rtt * MS_XFER_RTT_MULTIPLE / ctrl->window;
+	if ( target < MS_XFER_TARGET_SECS ) {
+		target = MS_XFER_TARGET_SECS;
+	}
+	target *= ctrl->bps;
+
+	if ( target > ctrl->xfer_size * 2 ) {
+		target = ctrl->xfer_size * 2;
+	}
+
+	ctrl->xfer_size = mirror_clamp_xfer_size( target );
+	debug( "rtt=%fs bps=%f, next xfer size %"PRIu64, ctrl->rtt, ctrl->bps, ctrl->xfer_size );
+}
+
+/* Merge the given bytes, which must lie within conn's range, into the dirty
+ * map, keeping the dirty byte counts up to date */
+static void mirror_mark_dirty( struct mirror_conn *conn, uint64_t from, uint64_t len )
+{
+	struct mirror *mirror = conn->ctrl->mirror;
+	uint64_t before = bitset_count_set( mirror->dirty_map, from, len );
+	uint64_t added;
+
+	bitset_set_range( mirror->dirty_map, from, len );
+	added = bitset_count_set( mirror->dirty_map, from, len ) - before;
+
+	conn->dirty_bytes += added;
+	mirror->dirty_bytes += added;
+}
+
+/* Work out how much of each connection's range is dirty from the dirty map
+ * alone, which is all we have when carrying on from a failed attempt. Bits
+ * at or beyond a connection's offset are dropped, as the first pass will get
+ * to those bytes anyway. */
+static void mirror_count_dirty( struct mirror_ctrl *ctrl )
+{
+	struct mirror *mirror = ctrl->mirror;
+	int i;
+
+	mirror->dirty_bytes = 0;
+
+	for ( i = 0; i < ctrl->connections; i++ ) {
+		struct mirror_conn *conn = &ctrl->conns[i];
+
+		if ( conn->end > conn->offset ) {
+			bitset_clear_range( mirror->dirty_map, conn->offset, conn->end - conn->offset );
+		}
+
+		conn->dirty_bytes = 0;
+		if ( conn->offset > conn->start ) {
+			conn->dirty_bytes = bitset_count_set( mirror->dirty_map,
+					conn->start, conn->offset - conn->start );
+		}
+		mirror->dirty_bytes += conn->dirty_bytes;
 	}
+}
 
-	return connected;
+/* Wake up all of conn's links, unless the limiter is holding us */
+static void mirror_conn_start_writing( struct mirror_conn *conn )
+{
+	struct mirror_ctrl *ctrl = conn->ctrl;
+	int i;
+
+	if ( ev_is_active( &ctrl->limit_watcher ) ) {
+		return;
+	}
+
+	for ( i = 0; i < ctrl->destinations; i++ ) {
+		ev_io_start( ctrl->ev_loop, &conn->links[i].write_watcher );
+	}
+}
+
+/*
+ * Empty the bitset stream of the serve allocation map into the dirty map. We
+ * can drop anything at or beyond the current offset of the connection whose
+ * range it falls in, since the first pass will read those bytes when it gets
+ * to them. Connections which were idle are woken up if they now have
+ * something to send.
+ */
+void mirror_drain_events( struct mirror_ctrl *ctrl )
+{
+	struct bitset* map = ctrl->serve->allocation_map;
+	struct bitset_stream_entry e;
+	int i;
+
+	while ( bitset_stream_size( map ) > 0 ) {
+		bitset_stream_dequeue( map, &e );
+		debug("Dequeued event %i, %zu, %zu", e.event, e.from, e.len);
+
+		/* UNSET events come from write zeroes requests punching holes. The
+		 * bytes have changed either way, so they're just as dirty.
+		 */
+		if ( e.event != BITSET_STREAM_SET && e.event != BITSET_STREAM_UNSET ) {
+			continue;
+		}
+
+		for ( i = 0; i < ctrl->connections; i++ ) {
+			struct mirror_conn *conn = &ctrl->conns[i];
+			uint64_t from = e.from > conn->start ? e.from : conn->start;
+			uint64_t to = e.from + e.len < conn->offset ? e.from + e.len : conn->offset;
+
+			if ( from >= to ) {
+				continue;
+			}
+
+			mirror_mark_dirty( conn, from, to - from );
+			ctrl->mirror->dirtied += to - from;
+			mirror_conn_start_writing( conn );
+		}
+	}
+}
+
+/*
+ * Find the next run of dirty blocks in conn's range, sweeping forward through
+ * the dirty map from where the last one ended, and take it out of the map.
+ * Returns 0 if there is nothing dirty.
+ *
+ * Runs separated by a clean gap no longer than MS_XFER_MIN_SIZE are sent
+ * together, since the extra bytes cost less than a second request would.
+ * Whatever is left, if it's tiny, is padded out to MS_XFER_MIN_SIZE. With a
+ * window of requests outstanding, a second request doesn't cost us a round
+ * trip, so it isn't worth sending any bigger a gap than that.
+ */
+int mirror_next_dirty( struct mirror_conn *conn, uint64_t *from, uint64_t *len )
+{
+	struct mirror_ctrl* ctrl = conn->ctrl;
+	struct mirror* mirror = ctrl->mirror;
+	uint64_t size = conn->end, run = 0, start, end, gap, removed;
+	uint64_t gap_limit = MS_XFER_MIN_SIZE;
+	int is_set = 0, wrapped = 0;
+
+	if ( conn->dirty_bytes == 0 ) {
+		return 0;
+	}
+
+	while ( !is_set ) {
+		if ( conn->dirty_cursor >= size ) {
+			if ( wrapped ) {
+				return 0;
+			}
+			conn->dirty_cursor = conn->start;
+			wrapped = 1;
+		}
+
+		run = bitset_run_count_ex( mirror->dirty_map, conn->dirty_cursor,
+				size - conn->dirty_cursor, &is_set );
+		if ( !is_set ) {
+			conn->dirty_cursor += run;
+		}
+	}
+
+	start = conn->dirty_cursor;
+	end = start + run;
+
+	while ( end < size && end - start < ctrl->xfer_size ) {
+		gap = bitset_run_count_ex( mirror->dirty_map, end, size - end, &is_set );
+		if ( is_set || gap > gap_limit || end + gap >= size ) {
+			break;
+		}
+		end += gap;
+		end += bitset_run_count( mirror->dirty_map, end, size - end );
+	}
+
+	if ( end > size ) {
+		end = size;
+	}
+	if ( end - start > ctrl->xfer_size ) {
+		end = start + ctrl->xfer_size;
+	}
+
+	if ( end - start < MS_XFER_MIN_SIZE ) {
+		end = start + MS_XFER_MIN_SIZE < size ? start + MS_XFER_MIN_SIZE : size;
+		start = end > conn->start + MS_XFER_MIN_SIZE ? end - MS_XFER_MIN_SIZE : conn->start;
+	}
+
+	*from = start;
+	*len = end - start;
+
+	removed = bitset_count_set( mirror->dirty_map, *from, *len );
+	conn->dirty_bytes -= removed;
+	mirror->dirty_bytes -= removed;
+	bitset_clear_range( mirror->dirty_map, *from, *len );
+	conn->dirty_cursor = end;
+
+	return 1;
+}
+
+/* Each xfer's request handle is ".MIR" followed by its index in conn->xfers
+ * in hex, so we can tell which one a reply is for. */
+static void mirror_xfer_handle( int index, char *handle )
+{
+	char buf[9];
+
+	snprintf( buf, sizeof( buf ), ".MIR%04x", index );
+	memcpy( handle, buf, 8 );
+}
+
+/* Returns the index of the xfer the given handle belongs to, or -1 if it
+ * isn't one of ours. */
+static int mirror_xfer_index( struct mirror_ctrl *ctrl, char *handle )
+{
+	char buf[9];
+	char *endptr = NULL;
+	long index;
+
+	memcpy( buf, handle, 8 );
+	buf[8] = '\0';
+
+	if ( memcmp( buf, ".MIR", 4 ) != 0 ) {
+		return -1;
+	}
+
+	index = strtol( buf + 4, &endptr, 16 );
+	if ( *endptr != '\0' || index < 0 || index >= ctrl->window ) {
+		return -1;
+	}
+
+	return index;
+}
+
+/*
+ * Work out how much of conn's range, up to max bytes, to cover next in the
+ * first pass, starting at its offset. If the listener understands write
+ * zeroes requests, we don't send the contents of unallocated runs of
+ * MS_XFER_MIN_SIZE or more, just a write zeroes for them; *zeroes is set
+ * when that's what we're to do. Other xfers stop short at the next such run,
+ * but take in any smaller holes on the way, since sending those costs less
+ * than another request would.
+ */
+static uint64_t mirror_first_pass_run( struct mirror_conn *conn, uint64_t max, int *zeroes )
+{
+	struct mirror_ctrl *ctrl = conn->ctrl;
+	struct bitset *map = ctrl->serve->allocation_map;
+	uint64_t current = conn->offset;
+	uint64_t left = conn->end - current;
+	uint64_t limit = left < max ? left : max;
+	uint64_t run, end;
+	int is_set;
+
+	*zeroes = 0;
+
+	if ( !( ctrl->mirror->listener_flags & INIT_FLAG_SEND_WRITE_ZEROES ) ||
+			!ctrl->serve->allocation_map_built ) {
+		return limit;
+	}
+
+	run = bitset_run_count_ex( map, current, left, &is_set );
+	if ( run > left ) {
+		run = left;
+	}
+
+	if ( !is_set && ( run >= MS_XFER_MIN_SIZE || run == left ) ) {
+		*zeroes = 1;
+		return run < MS_ZEROES_MAX_SIZE ? run : MS_ZEROES_MAX_SIZE;
+	}
+
+	end = current + run;
+	while ( end < current + limit ) {
+		run = bitset_run_count_ex( map, end, conn->end - end, &is_set );
+		if ( !is_set && run >= MS_XFER_MIN_SIZE ) {
+			break;
+		}
+		end += run;
+	}
+
+	return end - current < limit ? end - current : limit;
+}
+
+/*
+ * Until the first pass over its range is done, a connection takes the next
+ * xfer_size bytes from its offset, less any holes (see above). If the
+ * listener can hash its copy, we instead ask it for the hashes of the next
+ * NBD_HASH_MAX_SIZE bytes; blocks that turn out to differ from ours go into
+ * the dirty map. After that, a connection takes runs from the dirty map, so
+ * writes that have landed behind the first pass are sent once per run of
+ * blocks rather than once per event.
+ *
+ * Returns the xfer, ready for sending, or NULL if there's nothing to send or
+ * no room in the window.
+ */
+struct xfer * mirror_setup_next_xfer( struct mirror_conn *conn )
+{
+	struct mirror_ctrl* ctrl = conn->ctrl;
+	struct mirror* mirror = ctrl->mirror;
+	uint64_t current = conn->offset, run = 0;
+	struct xfer *xfer = NULL;
+	uint32_t type = REQUEST_WRITE;
+	int i, zeroes = 0;
+
+	for ( i = 0; i < ctrl->window; i++ ) {
+		if ( !conn->xfers[i].in_use ) {
+			xfer = &conn->xfers[i];
+			break;
+		}
+	}
+
+	if ( xfer == NULL ) {
+		return NULL;
+	}
+
+	mirror_drain_events( ctrl );
+
+	if ( current < conn->end ) {
+		run = mirror_first_pass_run( conn,
+				ctrl->hash ? NBD_HASH_MAX_SIZE : ctrl->xfer_size, &zeroes );
+		if ( zeroes ) {
+			type = REQUEST_WRITE_ZEROES;
+		} else if ( ctrl->hash ) {
+			type = REQUEST_HASH;
+		}
+		conn->offset += run;
+		mirror->offset += run;
+	} else if ( !mirror_next_dirty( conn, &current, &run ) ) {
+		return NULL;
+	}
+
+	debug( "Next transfer: slot=%d current=%"PRIu64", run=%"PRIu64", type=%"PRIu32,
+			i, current, run, type );
+	struct nbd_request req = {
+		.magic = REQUEST_MAGIC,
+		.type = type,
+		.from = current,
+		.len = run
+	};
+	if ( mirror->switched_over && type == REQUEST_WRITE ) {
+		req.type = REQUEST_WRITE_FILL;
+	} else if ( mirror->switched_over && type == REQUEST_WRITE_ZEROES ) {
+		req.type = REQUEST_WRITE_ZEROES_FILL;
+	}
+	mirror_xfer_handle( i, req.handle );
+	nbd_h2r_request( &req, &xfer->req_raw );
+
+	xfer->from = current;
+	xfer->len  = run;
+	xfer->in_use = 1;
+	xfer->sent_to = 0;
+	xfer->acked_by = 0;
+	xfer->started = 0;
+	xfer->type = type;
+	xfer->conn = conn;
+	xfer->cbuf = NULL;
+	xfer->hashes = NULL;
+	xfer->ready = 0;
+	if ( type == REQUEST_WRITE ) {
+		xfer->payload = mirror->mapped + current;
+		xfer->payload_len = run;
+	} else {
+		xfer->payload = NULL;
+		xfer->payload_len = 0;
+	}
+	conn->in_flight++;
+	ctrl->in_flight++;
+
+	return xfer;
+}
+
+/* Compress the xfer's payload into cbuf, prefixed with its length, and turn
+ * it into a compressed write. If it won't compress, we leave it as it is.
+ * This runs on a worker thread, so mustn't touch anything but the xfer. */
+static void mirror_compress_xfer( struct xfer *xfer )
+{
+	int bound = LZ4_compressBound( xfer->len );
+	struct timespec start, end;
+	uint32_t clen_raw;
+	int clen;
+
+	clock_gettime( CLOCK_THREAD_CPUTIME_ID, &start );
+
+	xfer->cbuf = xmalloc( bound + sizeof( clen_raw ) );
+	clen = LZ4_compress_default( xfer->payload, xfer->cbuf + sizeof( clen_raw ),
+			xfer->len, bound );
+
+	clock_gettime( CLOCK_THREAD_CPUTIME_ID, &end );
+	xfer->compress_secs = ( end.tv_sec - start.tv_sec ) +
+		( end.tv_nsec - start.tv_nsec ) / 1000000000.0;
+
+	if ( clen <= 0 || clen + sizeof( clen_raw ) >= xfer->len ) {
+		free( xfer->cbuf );
+		xfer->cbuf = NULL;
+		return;
+	}
+
+	clen_raw = htobe32( clen );
+	memcpy( xfer->cbuf, &clen_raw, sizeof( clen_raw ) );
+	xfer->payload = xfer->cbuf;
+	xfer->payload_len = clen + sizeof( clen_raw );
+	xfer->req_raw.type = htobe32(
+			be32toh( xfer->req_raw.type ) == REQUEST_WRITE_FILL ?
+			REQUEST_WRITE_LZ4_FILL : REQUEST_WRITE_LZ4 );
+}
+
+/* Work out our own hashes for a hash xfer, as the listeners will. This runs
+ * on a worker thread, so mustn't touch anything but the xfer. */
+static void mirror_hash_xfer( struct xfer *xfer )
+{
+	uint64_t count = ( xfer->len + NBD_HASH_BLOCK_SIZE - 1 ) / NBD_HASH_BLOCK_SIZE;
+	uint64_t from, len, i;
+
+	xfer->hashes = xmalloc( count * sizeof( uint64_t ) );
+	for ( i = 0; i < count; i++ ) {
+		from = xfer->from + i * NBD_HASH_BLOCK_SIZE;
+		len = xfer->from + xfer->len - from;
+		if ( len > NBD_HASH_BLOCK_SIZE ) {
+			len = NBD_HASH_BLOCK_SIZE;
+		}
+		xfer->hashes[i] = hash64( xfer->conn->ctrl->mirror->mapped + from, len, 0 );
+	}
+}
+
+static void * mirror_compress_worker( void * pool_uncast )
+{
+	struct mirror_pool *pool = (struct mirror_pool *) pool_uncast;
+	struct xfer *xfer;
+
+	pthread_mutex_lock( &pool->lock );
+	while ( !pool->stop ) {
+		if ( pool->jobs == NULL ) {
+			pthread_cond_wait( &pool->cond, &pool->lock );
+			continue;
+		}
+
+		xfer = pool->jobs;
+		pool->jobs = xfer->next;
+		pthread_mutex_unlock( &pool->lock );
+
+		if ( xfer->type == REQUEST_HASH ) {
+			mirror_hash_xfer( xfer );
+		} else {
+			mirror_compress_xfer( xfer );
+		}
+
+		pthread_mutex_lock( &pool->lock );
+		xfer->next = pool->done;
+		pool->done = xfer;
+		ev_async_send( pool->ev_loop, pool->async );
+	}
+	pthread_mutex_unlock( &pool->lock );
+
+	return NULL;
+}
+
+static void mirror_pool_start( struct mirror_pool *pool, struct ev_loop *loop, ev_async *async )
+{
+	long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+	int i;
+
+	pthread_mutex_init( &pool->lock, NULL );
+	pthread_cond_init( &pool->cond, NULL );
+	pool->ev_loop = loop;
+	pool->async = async;
+
+	pool->thread_count = cpus < 1 ? 1 : ( cpus > MS_COMPRESS_THREADS_MAX ? MS_COMPRESS_THREADS_MAX : cpus );
+	for ( i = 0; i < pool->thread_count; i++ ) {
+		FATAL_IF_NEGATIVE(
+			pthread_create( &pool->threads[i], NULL, mirror_compress_worker, pool ),
+			"Failed to create compression thread"
+		);
+	}
+}
+
+/* Stop the workers once they've finished what they're doing. Anything still
+ * waiting to be compressed is dropped; the caller requeues it. */
+static void mirror_pool_stop( struct mirror_pool *pool )
+{
+	int i;
+
+	pthread_mutex_lock( &pool->lock );
+	pool->stop = 1;
+	pthread_cond_broadcast( &pool->cond );
+	pthread_mutex_unlock( &pool->lock );
+
+	for ( i = 0; i < pool->thread_count; i++ ) {
+		pthread_join( pool->threads[i], NULL );
+	}
+
+	pthread_cond_destroy( &pool->cond );
+	pthread_mutex_destroy( &pool->lock );
+}
+
+static void mirror_pool_submit( struct mirror_pool *pool, struct xfer *xfer )
+{
+	pthread_mutex_lock( &pool->lock );
+	xfer->next = NULL;
+	if ( pool->jobs == NULL ) {
+		pool->jobs = xfer;
+	} else {
+		pool->jobs_tail->next = xfer;
+	}
+	pool->jobs_tail = xfer;
+	pthread_cond_signal( &pool->cond );
+	pthread_mutex_unlock( &pool->lock );
+}
+
+/* Compressing pays off while the pool can compress data faster than the link
+ * could have sent it, and what it produces is quicker to send than the raw
+ * data. Rates are per connection, so we scale them up to the whole link.
+ */
+static int mirror_should_compress( struct mirror_ctrl *ctrl )
+{
+	double raw_spb, compressed_spb;
+
+	if ( !ctrl->compress ) {
+		return 0;
+	}
+
+	if ( ctrl->wire_bps == 0 || ctrl->compress_spb == 0 ) {
+		/* No figures yet, so find out */
+		return 1;
+	}
+
+	raw_spb = 1.0 / ( ctrl->wire_bps * ctrl->connections );
+	compressed_spb = ctrl->compress_ratio * raw_spb;
+	if ( ctrl->pool.thread_count == 1 ) {
+		/* Compressing takes the only CPU away from sending */
+		compressed_spb += ctrl->compress_spb;
+	} else if ( ctrl->compress_spb / ctrl->pool.thread_count > compressed_spb ) {
+		compressed_spb = ctrl->compress_spb / ctrl->pool.thread_count;
+	}
+
+	if ( compressed_spb < raw_spb ) {
+		return 1;
+	}
+
+	return ++ctrl->compress_skipped % MS_COMPRESS_PROBE_INTERVAL == 0;
+}
+
+/* Called on the event loop when workers have finished compressing xfers */
+static void mirror_compress_cb( struct ev_loop *loop __attribute__((unused)), ev_async *w, int revents )
+{
+	struct mirror_ctrl* ctrl = (struct mirror_ctrl*) w->data;
+	NULLCHECK( ctrl );
+
+	struct xfer *xfer, *done;
+	double ratio;
+
+	if ( !( revents & EV_ASYNC ) ) {
+		warn( "Mirror compress callback executed but no async event signalled" );
+		return;
+	}
+
+	pthread_mutex_lock( &ctrl->pool.lock );
+	done = ctrl->pool.done;
+	ctrl->pool.done = NULL;
+	pthread_mutex_unlock( &ctrl->pool.lock );
+
+	for ( xfer = done; xfer != NULL; xfer = xfer->next ) {
+		xfer->ready = 1;
+		if ( xfer->type == REQUEST_HASH ) {
+			mirror_conn_start_writing( xfer->conn );
+			continue;
+		}
+
+		ratio = (double) xfer->payload_len / xfer->len;
+		if ( ctrl->compress_spb == 0 ) {
+			ctrl->compress_ratio = ratio;
+			ctrl->compress_spb = xfer->compress_secs / xfer->len;
+		} else {
+			ctrl->compress_ratio = ( ctrl->compress_ratio * 3 + ratio ) / 4;
+			ctrl->compress_spb = ( ctrl->compress_spb * 3 + xfer->compress_secs / xfer->len ) / 4;
+		}
+
+		mirror_conn_start_writing( xfer->conn );
+	}
+}
+
+/* Put a freshly set up xfer at the back of conn's queue, and get it
+ * compressed if that's worth doing, or hashed */
+static void mirror_queue_xfer( struct mirror_conn *conn, struct xfer *xfer )
+{
+	struct mirror_ctrl *ctrl = conn->ctrl;
+
+	conn->queue[conn->enqueued % MS_WINDOW_MAX] = xfer;
+	conn->enqueued++;
+
+	if ( ( xfer->type == REQUEST_WRITE && mirror_should_compress( ctrl ) ) ||
+			( xfer->type == REQUEST_HASH && ctrl->pool.thread_count > 0 ) ) {
+		mirror_pool_submit( &ctrl->pool, xfer );
+	} else {
+		xfer->ready = 1;
+	}
+}
+
+/* If the event loop stops before the listener has acknowledged everything
+ * we sent, we can't know what made it. Put it all back in the dirty map so
+ * that it's sent again. The compression pool must be stopped first. */
+void mirror_requeue_in_flight( struct mirror_ctrl *ctrl )
+{
+	int i, j;
+	struct mirror_link *link;
+
+	for ( i = 0; i < ctrl->connections; i++ ) {
+		struct mirror_conn *conn = &ctrl->conns[i];
+
+		for ( j = 0; j < ctrl->window; j++ ) {
+			struct xfer *xfer = &conn->xfers[j];
+
+			if ( xfer->in_use ) {
+				mirror_mark_dirty( conn, xfer->from, xfer->len );
+				xfer->in_use = 0;
+			}
+			free( xfer->cbuf );
+			xfer->cbuf = NULL;
+			free( xfer->hashes );
+			xfer->hashes = NULL;
+		}
+
+		conn->in_flight = 0;
+		conn->enqueued = 0;
+		for ( j = 0; j < ctrl->destinations; j++ ) {
+			link = &conn->links[j];
+			link->dequeued = 0;
+			link->sending = NULL;
+			link->hashing = NULL;
+		}
+	}
+
+	ctrl->in_flight = 0;
+}
+
+// ONLY CALL THIS AFTER CLOSING CLIENTS
+void mirror_complete( struct server *serve )
+{
+	/* FIXME: Pretty sure this is broken, if action != !QUIT. Just moving code
+	 * around for now, can fix it later. Action is always quit in production */
+	int i;
+
+	if ( mirror_should_quit( serve->mirror ) ) {
+		debug("exit!");
+		/* FIXME: This depends on blocking I/O right now, so make sure we are */
+		for ( i = 0; i < serve->mirror->destinations; i++ ) {
+			sock_set_nonblock( serve->mirror->clients[i][0], 0 );
+		}
+		mirror_on_exit( serve );
+		info("Server closed, quitting after successful migration");
+	}
+
+	mirror_set_state( serve->mirror, MS_DONE );
+	return;
 }
 
+static void mirror_close_clients( struct mirror_ctrl *ctrl )
+{
+	info( "Closing clients to allow mirroring to converge" );
+	ctrl->serve->write_throttle = 0;
+	server_forbid_new_clients( ctrl->serve );
+	server_close_clients( ctrl->serve );
+	server_join_clients( ctrl->serve );
+	ctrl->clients_closed = 1;
+}
 
-int mirror_should_quit( struct mirror * mirror )
+/* True once the first pass is done, nothing is dirty, and everything we've
+ * sent has been acknowledged */
+static int mirror_all_sent( struct mirror_ctrl *ctrl )
 {
-	switch( mirror->action_at_finish ) {
-		case ACTION_EXIT:
-		case ACTION_UNLINK:
-			return 1;
-		default:
-			return 0;
-	}
+	return ctrl->mirror->offset == ctrl->serve->size &&
+		ctrl->mirror->dirty_bytes == 0 &&
+		ctrl->in_flight == 0;
 }
 
-/* Bandwidth limiting - we hang around if bps is too high, unless we need to
- * empty out the bitset stream a bit */
-int mirror_should_wait( struct mirror_ctrl *ctrl )
+/* Once everything is sent and our clients are closed, a mirror asked to
+ * verify goes over the image again, asking for hashes as the first pass
+ * does, and sends whatever differs again. Nothing can change our copy by
+ * now, so after that the listeners' copies match it. Returns 1 if we've
+ * started, in which case the connections are already at it.
+ */
+static int mirror_start_verify( struct mirror_ctrl *ctrl )
 {
-	int bps_over = server_mirror_bps( ctrl->serve ) >
-		ctrl->serve->mirror->max_bytes_per_second;
+	struct mirror *m = ctrl->mirror;
+	int i;
+
+	if ( !m->verify || ctrl->verified ) {
+		return 0;
+	}
+	ctrl->verified = 1;
+
+	if ( !ctrl->hash ) {
+		warn( "Listeners can't hash their copies, so can't be verified" );
+		return 0;
+	}
 
-	int stream_full = bitset_stream_size( ctrl->serve->allocation_map ) >
-		( BITSET_STREAM_SIZE / 2 );
+	info( "Verifying the listeners' copies" );
+	ctrl->verifying = 1;
+	ctrl->verify_differ = 0;
+	m->offset = 0;
+	for ( i = 0; i < ctrl->connections; i++ ) {
+		ctrl->conns[i].offset = ctrl->conns[i].start;
+	}
+	for ( i = 0; i < ctrl->connections; i++ ) {
+		mirror_conn_start_writing( &ctrl->conns[i] );
+	}
 
-	return bps_over && !stream_full;
+	return 1;
 }
 
-/*
- * If there's an event in the bitset stream of the serve allocation map, we
- * use it to construct the next transfer request, covering precisely the area
- * that has changed. If there are no events, we take the next
- * TODO: should we detect short events and lengthen them to reduce overhead?
- *
- * iterates through the bitmap, finding a dirty run to form the basis of the
- * next transfer, then puts it together. */
-int mirror_setup_next_xfer( struct mirror_ctrl *ctrl )
+/* A listener acknowledges our writes before they're on its disc, so once
+ * it's had everything, and before we unlink our copy or hand over control,
+ * we ask it to flush. Returns 0 if any of them couldn't. */
+static int mirror_flush_listeners( struct mirror_ctrl *ctrl )
 {
-	struct mirror* mirror = ctrl->mirror;
-	struct server* serve = ctrl->serve;
-	struct bitset_stream_entry e = { .event = BITSET_STREAM_UNSET };
-	uint64_t current = mirror->offset, run = 0, size = serve->size;
+	struct mirror *m = ctrl->mirror;
+	int i, flushed = 1;
 
-	/* Technically, we'd be interested in UNSET events too, but they are never
-	 * generated. TODO if that changes.
-	 *
-	 * We use ctrl->clear_events to start emptying the stream when it's half
-	 * full, and stop when it's a quarter full. This stops a busy client from
-	 * stalling a migration forever. FIXME: made-up numbers.
-	 */
-	if ( mirror->offset < serve->size && bitset_stream_size( serve->allocation_map ) > BITSET_STREAM_SIZE / 2 ) {
-		ctrl->clear_events = 1;
+	if ( !( m->listener_flags & INIT_FLAG_SEND_FLUSH ) ) {
+		return 1;
 	}
 
+	for ( i = 0; i < m->destinations && flushed; i++ ) {
+		sock_set_nonblock( m->clients[i][0], 0 );
+		flushed = socket_nbd_flush( m->clients[i][0], MS_REQUEST_LIMIT_SECS );
+		sock_set_nonblock( m->clients[i][0], 1 );
+	}
 
-	while ( ( mirror->offset == serve->size || ctrl->clear_events ) && e.event != BITSET_STREAM_SET ) {
-		uint64_t events =  bitset_stream_size( serve->allocation_map );
+	return flushed;
+}
 
-		if ( events == 0 ) {
+/* Find the next xfer for link to write to its listener. New xfers are set up
+ * for the connection while there's room in the window for them. When we're
+ * compressing, we set up as many as we can at once, so the pool can work on
+ * them while we send. Once there's nothing left to send on any connection and
+ * nothing outstanding, close the clients down so no more writes can arrive,
+ * and finish off the migration once we're sure everything is sent.
+ *
+ * Returns 1 if link->sending has been set up. Otherwise, the write watcher is
+ * stopped; the read, limit or compress callbacks, or new dirty data, will
+ * start it again.
+ */
+static int mirror_start_next_xfer( struct mirror_link *link )
+{
+	struct mirror_conn *conn = link->conn;
+	struct mirror_ctrl *ctrl = conn->ctrl;
+	struct ev_loop *loop = ctrl->ev_loop;
+	struct xfer *xfer;
+
+	while ( conn->in_flight < ctrl->window &&
+			( ctrl->compress || ( ctrl->hash && conn->offset < conn->end ) ||
+			  conn->enqueued == link->dequeued ) ) {
+		xfer = mirror_setup_next_xfer( conn );
+		if ( xfer == NULL ) {
 			break;
 		}
+		mirror_queue_xfer( conn, xfer );
+	}
 
-		debug("Dequeueing event");
-		bitset_stream_dequeue( ctrl->serve->allocation_map, &e );
-		debug("Dequeued event %i, %zu, %zu", e.event, e.from, e.len);
-
-		if ( events < ( BITSET_STREAM_SIZE / 4 ) ) {
-			ctrl->clear_events = 0;
+	if ( conn->enqueued > link->dequeued ) {
+		xfer = conn->queue[link->dequeued % MS_WINDOW_MAX];
+		if ( !xfer->ready ) {
+			/* mirror_compress_cb starts us again once it is */
+			ev_io_stop( loop, &link->write_watcher );
+			return 0;
 		}
+
+		link->dequeued++;
+		link->sending = xfer;
+		link->written = 0;
+		ev_timer_again( loop, &ctrl->timeout_watcher );
+		return 1;
 	}
 
-	if ( e.event == BITSET_STREAM_SET ) {
-		current = e.from;
-		run = e.len;
-	} else if ( current < serve->size ) {
-		current = mirror->offset;
-		run = mirror_longest_write;
+	ev_io_stop( loop, &link->write_watcher );
 
-		/* Adjust final block if necessary */
-		if ( current + run > serve->size ) {
-			run = size - current;
-		}
-		mirror->offset += run;
-	} else {
+	if ( !mirror_all_sent( ctrl ) ) {
+		/* Some other connection still has work to do */
 		return 0;
 	}
 
-	debug( "Next transfer: current=%"PRIu64", run=%"PRIu64, current, run );
-	struct nbd_request req = {
-		.magic = REQUEST_MAGIC,
-		.type = REQUEST_WRITE,
-		.handle = ".MIRROR.",
-		.from = current,
-		.len = run
-	};
-	nbd_h2r_request( &req, &ctrl->xfer.hdr.req_raw );
-
-	ctrl->xfer.from = current;
-	ctrl->xfer.len  = run;
+	/* Regardless of time estimates, if there's nothing waiting to be sent
+	 * and nothing in flight, we can start closing clients down. */
+	if ( !ctrl->clients_closed ) {
+		mirror_close_clients( ctrl );
 
-	ctrl->xfer.written = 0;
-	ctrl->xfer.read = 0;
+		/* One more check - a new event may have been pushed since our last
+		 * one, in which case the connection it belongs to is woken up */
+		mirror_drain_events( ctrl );
+		if ( !mirror_all_sent( ctrl ) ) {
+			return 0;
+		}
+	}
 
-	return 1;
-}
+	if ( ctrl->verifying ) {
+		info( "Verified the listeners' copies, %"PRIu64" bytes differed and were sent again",
+				ctrl->verify_differ );
+		ctrl->verifying = 0;
+	} else if ( mirror_start_verify( ctrl ) ) {
+		return 0;
+	}
 
-// ONLY CALL THIS AFTER CLOSING CLIENTS
-void mirror_complete( struct server *serve )
-{
-	/* FIXME: Pretty sure this is broken, if action != !QUIT. Just moving code
-	 * around for now, can fix it later. Action is always quit in production */
-	if ( mirror_should_quit( serve->mirror ) ) {
-		debug("exit!");
-		/* FIXME: This depends on blocking I/O right now, so make sure we are */
-		sock_set_nonblock( serve->mirror->client, 0 );
-		mirror_on_exit( serve );
-		info("Server closed, quitting after successful migration");
+	if ( !mirror_flush_listeners( ctrl ) ) {
+		/* Leaves the state short of MS_DONE, so we try again */
+		ev_break( loop, EVBREAK_ONE );
+		return 0;
 	}
 
-	mirror_set_state( serve->mirror, MS_DONE );
-	return;
+	mirror_complete( ctrl->serve );
+	ev_break( loop, EVBREAK_ONE );
+	return 0;
 }
 
 static void mirror_write_cb( struct ev_loop *loop, ev_io *w, int revents )
 {
-	struct mirror_ctrl* ctrl = (struct mirror_ctrl*) w->data;
-	NULLCHECK( ctrl );
+	struct mirror_link* link = (struct mirror_link*) w->data;
+	NULLCHECK( link );
 
-	struct xfer *xfer = &ctrl->xfer;
+	struct mirror_ctrl* ctrl = link->conn->ctrl;
+	struct xfer *xfer;
 
 	size_t to_write, hdr_size = sizeof( struct nbd_request_raw );
 	char *data_loc;
+	off64_t offset;
 	ssize_t count;
+	double wait;
 
 	if ( !( revents & EV_WRITE ) ) {
 		warn( "No write event signalled in mirror write callback" );
 		return;
 	}
 
-	debug( "Mirror write callback invoked with events %d. fd: %i", revents, ctrl->mirror->client );
+	debug( "Mirror write callback invoked with events %d. fd: %i", revents, link->fd );
+
+	/* FIXME: Should we ignore the bwlimit after server_close_clients has been called? */
+	wait = mirror_limit_wait( ctrl );
+	if ( wait > 0 ) {
+		/* We're over the bandwidth limit, so don't write any more yet. Our
+		 * limit_watcher will start us again once we're OK. */
+		debug( "max_bps exceeded, waiting %fs", wait );
+		ev_io_stop( loop, &link->write_watcher );
+		if ( !ev_is_active( &ctrl->limit_watcher ) ) {
+			ev_timer_set( &ctrl->limit_watcher, wait, 0. );
+			ev_timer_start( loop, &ctrl->limit_watcher );
+		}
+		return;
+	}
+
+	if ( link->sending == NULL && !mirror_start_next_xfer( link ) ) {
+		return;
+	}
+	xfer = link->sending;
 
 	/* FIXME: We can end up corking multiple times in unusual circumstances; this
 	 * is annoying, but harmless */
-	if ( xfer->written == 0 ) {
-		sock_set_tcp_cork( ctrl->mirror->client, 1 );
+	if ( link->written == 0 ) {
+		sock_set_tcp_cork( link->fd, 1 );
+		if ( xfer->started == 0 ) {
+			xfer->started = ev_now( loop );
+		}
 	}
 
-	if ( xfer->written < hdr_size ) {
-		data_loc = ( (char*) &xfer->hdr.req_raw ) + ctrl->xfer.written;
-		to_write = hdr_size - xfer->written;
+	if ( link->written < hdr_size ) {
+		data_loc = ( (char*) &xfer->req_raw ) + link->written;
+		to_write = hdr_size - link->written;
 	} else {
-		data_loc = ctrl->mirror->mapped  + xfer->from + ( xfer->written - hdr_size );
-		to_write = xfer->len - ( ctrl->xfer.written - hdr_size );
+		data_loc = xfer->payload + ( link->written - hdr_size );
+		to_write = xfer->payload_len - ( link->written - hdr_size );
+	}
+	to_write = ratelimit_allow( &ctrl->limit, to_write );
+
+	// Actually write some bytes. A plain write's data comes straight from
+	// the file, which saves copying it and faulting the mapping in.
+	if ( link->written >= hdr_size && xfer->cbuf == NULL && ctrl->sendfile ) {
+		offset = xfer->from + ( link->written - hdr_size );
+		count = sendfile64( link->fd, ctrl->mirror->map_fd, &offset, to_write );
+		if ( count < 0 && ( errno == EINVAL || errno == ENOSYS ) ) {
+			warn( SHOW_ERRNO( "Can't sendfile() from the image, writing it instead" ) );
+			ctrl->sendfile = 0;
+			return;
+		}
+	} else {
+		count = write( link->fd, data_loc, to_write );
 	}
 
-	// Actually write some bytes
-	if ( ( count = write( ctrl->mirror->client, data_loc, to_write ) ) < 0 ) {
+	if ( count < 0 ) {
 		if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) {
 			warn( SHOW_ERRNO( "Couldn't write to listener" ) );
 			ev_break( loop, EVBREAK_ONE );
@@ -485,34 +1692,158 @@ static void mirror_write_cb( struct ev_loop *loop, ev_io *w, int revents )
 		return;
 	}
 	debug( "Wrote %"PRIu64" bytes", count );
-	debug( "to_write was %"PRIu64", xfer->written was %"PRIu64, to_write, xfer->written );
+	debug( "to_write was %"PRIu64", link->written was %"PRIu64, to_write, link->written );
 
 	// We wrote some bytes, so reset the timer and keep track for the next pass
 	if ( count > 0 ) {
-		ctrl->xfer.written += count;
+		link->written += count;
+		ratelimit_spend( &ctrl->limit, count );
 		ev_timer_again( ctrl->ev_loop, &ctrl->timeout_watcher );
 	}
 
-	// All bytes written, so now we need to read the NBD reply back.
-	if ( ctrl->xfer.written == ctrl->xfer.len + hdr_size ) {
-	  sock_set_tcp_cork( ctrl->mirror->client, 0 ) ;
-		ev_io_start( loop, &ctrl->read_watcher  );
-		ev_io_stop(  loop, &ctrl->write_watcher );
+	// All bytes written, so we can move on to the next xfer while we wait
+	// for the NBD reply to this one.
+	if ( link->written == hdr_size + xfer->payload_len ) {
+		sock_set_tcp_cork( link->fd, 0 ) ;
+		xfer->sent = ev_now( loop );
+		xfer->sent_to |= 1 << link->dest;
+		link->sending = NULL;
+	}
+
+	return;
+}
+
+/* Called once link's listener has acknowledged an xfer. We're done with it
+ * once they all have */
+static void mirror_xfer_done( struct mirror_link *link, struct xfer *xfer )
+{
+	struct mirror_conn* conn = link->conn;
+	struct mirror_ctrl* ctrl = conn->ctrl;
+	struct ev_loop *loop = ctrl->ev_loop;
+
+	xfer->acked_by |= 1 << link->dest;
+	if ( xfer->acked_by != ctrl->all_links ) {
+		return;
+	}
+
+	/* transfer was completed, so free up its place in the window */
+	xfer->in_use = 0;
+	conn->in_flight--;
+	ctrl->in_flight--;
+	free( xfer->cbuf );
+	xfer->cbuf = NULL;
+	free( xfer->hashes );
+	xfer->hashes = NULL;
+
+	/* Write zeroes and hash requests are just a header, so tell us nothing
+	 * about the link */
+	if ( xfer->type == REQUEST_WRITE ) {
+		ctrl->mirror->all_dirty += xfer->len;
+		mirror_update_xfer_size( conn, xfer, ev_now( loop ) );
+	}
+
+	if ( ctrl->in_flight == 0 ) {
+		/* Nothing outstanding, so nothing to time out on until we send more */
+		ev_timer_stop( ctrl->ev_loop, &ctrl->timeout_watcher );
+	}
+
+	/* Once our estimate of time left reaches a sensible number, we stop new
+	 * clients from connecting and disconnect existing ones, then carry on
+	 * emptying the dirty map. mirror_start_next_xfer does the same if there's
+	 * nothing left to send, and finishes the migration once everything sent
+	 * has been acknowledged.
+	 */
+	if ( !ctrl->clients_closed && server_mirror_eta( ctrl->serve ) < MS_CONVERGE_TIME_SECS ) {
+		mirror_close_clients( ctrl );
 	}
 
+	/* There's room for another xfer now, unless the limiter is holding us */
+	mirror_conn_start_writing( conn );
+
 	return;
 }
 
+/* Compare a listener's hashes for a hash xfer with our own, and mark the
+ * blocks that differ as dirty, so they get sent. A write to one of these
+ * blocks after the hash request was sent lands behind conn->offset, so is
+ * marked dirty by mirror_drain_events anyway. With several listeners, a
+ * block that differs on any of them is sent to them all.
+ */
+static void mirror_compare_hashes( struct mirror_link *link, struct xfer *xfer )
+{
+	struct mirror_conn *conn = link->conn;
+	uint64_t from, len, i, ours;
+	uint64_t differ = 0;
+
+	for ( i = 0; i * NBD_HASH_BLOCK_SIZE < xfer->len; i++ ) {
+		from = xfer->from + i * NBD_HASH_BLOCK_SIZE;
+		len = xfer->from + xfer->len - from;
+		if ( len > NBD_HASH_BLOCK_SIZE ) {
+			len = NBD_HASH_BLOCK_SIZE;
+		}
+
+		ours = xfer->hashes ? xfer->hashes[i] : hash64( conn->ctrl->mirror->mapped + from, len, 0 );
+		if ( be64toh( link->hashes[i] ) != ours ) {
+			mirror_mark_dirty( conn, from, len );
+			differ += len;
+		}
+	}
+
+	if ( conn->ctrl->verifying ) {
+		conn->ctrl->verify_differ += differ;
+	}
+
+	debug( "%"PRIu64" of %"PRIu64" bytes at %"PRIu64" differ from the listener's",
+			differ, xfer->len, xfer->from );
+}
+
+/* Read the hashes following the reply to link->hashing, and compare them
+ * with ours once we have them all */
+static void mirror_read_hashes( struct mirror_link *link )
+{
+	struct mirror_ctrl* ctrl = link->conn->ctrl;
+	struct xfer *xfer = link->hashing;
+	uint64_t size = ( ( xfer->len + NBD_HASH_BLOCK_SIZE - 1 ) / NBD_HASH_BLOCK_SIZE ) * sizeof( uint64_t );
+	ssize_t count;
+
+	count = read( link->fd, ( (char*) link->hashes ) + link->hashes_read, size - link->hashes_read );
+	if ( count < 0 ) {
+		if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) {
+			warn( SHOW_ERRNO( "Couldn't read hashes from listener" ) );
+			ev_break( ctrl->ev_loop, EVBREAK_ONE );
+		}
+		return;
+	}
+
+	if ( count == 0 ) {
+		warn( "EOF reading hashes from server!" );
+		ev_break( ctrl->ev_loop, EVBREAK_ONE );
+		return;
+	}
+
+	ev_timer_again( ctrl->ev_loop, &ctrl->timeout_watcher );
+	link->hashes_read += count;
+
+	if ( link->hashes_read < size ) {
+		return;
+	}
+
+	link->hashing = NULL;
+	mirror_compare_hashes( link, xfer );
+	mirror_xfer_done( link, xfer );
+}
+
 static void mirror_read_cb( struct ev_loop *loop, ev_io *w, int revents )
 {
-	struct mirror_ctrl* ctrl = (struct mirror_ctrl*) w->data;
-	NULLCHECK( ctrl );
+	struct mirror_link* link = (struct mirror_link*) w->data;
+	NULLCHECK( link );
 
+	struct mirror_conn* conn = link->conn;
+	struct mirror_ctrl* ctrl = conn->ctrl;
 	struct mirror *m = ctrl->mirror;
 	NULLCHECK( m );
 
-	struct xfer *xfer = &ctrl->xfer;
-	NULLCHECK( xfer );
+	struct xfer *xfer;
 
 	if ( !( revents & EV_READ ) ) {
 		warn( "No read event signalled in mirror read callback" );
@@ -521,12 +1852,18 @@ static void mirror_read_cb( struct ev_loop *loop, ev_io *w, int revents )
 
 	struct nbd_reply rsp;
 	ssize_t count;
-	uint64_t left = sizeof( struct nbd_reply_raw ) - xfer->read;
+	int index;
+	uint64_t left = sizeof( struct nbd_reply_raw ) - link->rsp_read;
+
+	debug( "Mirror read callback invoked with events %d. fd:%i", revents, link->fd );
 
-	debug( "Mirror read callback invoked with events %d. fd:%i", revents, m->client );
+	if ( link->hashing != NULL ) {
+		mirror_read_hashes( link );
+		return;
+	}
 
 	/* Start / continue reading the NBD response from the mirror. */
-	if ( ( count = read( m->client, ((void*) &xfer->hdr.rsp_raw) + xfer->read, left ) ) < 0 ) {
+	if ( ( count = read( link->fd, ((void*) &link->rsp_raw) + link->rsp_read, left ) ) < 0 ) {
 		if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) {
 			warn( SHOW_ERRNO( "Couldn't read from listener" ) );
 			ev_break( loop, EVBREAK_ONE );
@@ -545,15 +1882,16 @@ static void mirror_read_cb( struct ev_loop *loop, ev_io *w, int revents )
 	ev_timer_again( ctrl->ev_loop, &ctrl->timeout_watcher );
 
 	debug( "Read %i bytes", count );
-	debug( "left was %"PRIu64", xfer->read was %"PRIu64, left, xfer->read );
-	xfer->read += count;
+	debug( "left was %"PRIu64", rsp_read was %"PRIu64, left, link->rsp_read );
+	link->rsp_read += count;
 
-	if ( xfer->read < sizeof( struct nbd_reply_raw ) ) {
+	if ( link->rsp_read < sizeof( struct nbd_reply_raw ) ) {
 		// Haven't read the whole response yet
 		return;
 	}
 
-	nbd_r2h_reply( &xfer->hdr.rsp_raw, &rsp );
+	nbd_r2h_reply( &link->rsp_raw, &rsp );
+	link->rsp_read = 0;
 
 	// validate reply, break event loop if bad
 	if ( rsp.magic != REPLY_MAGIC ) {
@@ -568,78 +1906,27 @@ static void mirror_read_cb( struct ev_loop *loop, ev_io *w, int revents )
 		return;
 	}
 
-	if ( memcmp( ".MIRROR.", &rsp.handle[0], 8 ) != 0 ) {
+	/* The reply must be to an xfer this link has sent, and not had a reply
+	 * to already */
+	index = mirror_xfer_index( ctrl, &rsp.handle[0] );
+	if ( index < 0 || !conn->xfers[index].in_use ||
+			!( conn->xfers[index].sent_to & ( 1 << link->dest ) ) ||
+			( conn->xfers[index].acked_by & ( 1 << link->dest ) ) ) {
 		warn( "Bad handle returned from listener" );
 		ev_break( loop, EVBREAK_ONE );
 		return;
 	}
 
-	/* transfer was completed, so now we need to either set up the next
-	 * transfer of this pass, set up the first transfer of the next pass, or
-	 * complete the migration */
-	xfer->read = 0;
-	xfer->written = 0;
-
-	/* We don't account for bytes written in this mode, to stop high-throughput
-	 * discs getting stuck in "drain the event queue!" mode forever
-	 */
-	if ( !ctrl->clear_events ) {
-		m->all_dirty += xfer->len;
-	}
-
-
-	/* This next bit could take a little while, which is fine */
-	ev_timer_stop( ctrl->ev_loop, &ctrl->timeout_watcher );
-
-	/* Set up the next transfer, which may be offset + mirror_longest_write
-	 * or an event from the bitset stream. When offset hits serve->size,
-	 * xfers will be constructed solely from the event stream. Once our estimate
-	 * of time left reaches a sensible number (or the event stream empties),
-	 * we stop new clients from connecting, disconnect existing ones, then
-	 * continue emptying the bitstream. Once it's empty again, we're finished.
-	 */
-	int next_xfer = mirror_setup_next_xfer( ctrl );
-	debug( "next_xfer: %d", next_xfer );
-
-	/* Regardless of time estimates, if there's no waiting transfer, we can start closing clients down. */
-	if ( !ctrl->clients_closed && ( !next_xfer || server_mirror_eta( ctrl->serve ) < MS_CONVERGE_TIME_SECS ) ) {
-		info( "Closing clients to allow mirroring to converge" );
-		server_forbid_new_clients( ctrl->serve );
-		server_close_clients( ctrl->serve );
-		server_join_clients( ctrl->serve );
-		ctrl->clients_closed = 1;
-
-		/* One more try - a new event may have been pushed since our last check  */
-		if ( !next_xfer ) {
-			next_xfer = mirror_setup_next_xfer( ctrl );
-		}
-	}
+	xfer = &conn->xfers[index];
 
-	if ( ctrl->clients_closed && !next_xfer ) {
-		mirror_complete( ctrl->serve );
-		ev_break( loop, EVBREAK_ONE );
+	if ( xfer->type == REQUEST_HASH ) {
+		/* The hashes follow on behind the reply */
+		link->hashing = xfer;
+		link->hashes_read = 0;
 		return;
 	}
 
-	/* This is a guard Just In Case */
-	ERROR_IF( !next_xfer, "Unknown problem - no next transfer to do!" );
-
-	ev_io_stop( loop, &ctrl->read_watcher );
-
-	/* FIXME: Should we ignore the bwlimit after server_close_clients has been called? */
-
-	if ( mirror_should_wait( ctrl ) ) {
-		/* We're over the bandwidth limit, so don't move onto the next transfer
-		 * yet. Our limit_watcher will move us on once we're OK. timeout_watcher
-		 * was disabled further up, so don't need to stop it here too */
-		debug( "max_bps exceeded, waiting" );
-		ev_timer_again( loop, &ctrl->limit_watcher );
-	} else {
-		/* We're waiting for the socket to become writable again, so re-enable */
-		ev_timer_again( loop, &ctrl->timeout_watcher );
-		ev_io_start( loop, &ctrl->write_watcher );
-	}
-
+	mirror_xfer_done( link, xfer );
 	return;
 }
 
@@ -672,10 +1959,21 @@ static void mirror_abandon_cb( struct ev_loop *loop, ev_io *w, int revents )
 	return;
 }
 
+/* Start every connection writing again */
+static void mirror_start_writing( struct mirror_ctrl *ctrl )
+{
+	int i;
+
+	for ( i = 0; i < ctrl->connections; i++ ) {
+		mirror_conn_start_writing( &ctrl->conns[i] );
+	}
+}
+
 
 static void mirror_limit_cb( struct ev_loop *loop, ev_timer *w, int revents )
 {
 	struct mirror_ctrl* ctrl = (struct mirror_ctrl*) w->data;
+	double wait;
 	NULLCHECK( ctrl );
 
 	if ( !(revents & EV_TIMER ) ) {
@@ -683,20 +1981,99 @@ static void mirror_limit_cb( struct ev_loop *loop, ev_timer *w, int revents )
 		return;
 	}
 
-	if ( mirror_should_wait( ctrl ) ) {
-		debug( "max_bps exceeded, waiting", ctrl->mirror->max_bytes_per_second );
-		ev_timer_again( loop, w );
+	mirror_drain_events( ctrl );
+
+	wait = mirror_limit_wait( ctrl );
+	if ( wait > 0 ) {
+		debug( "max_bps exceeded, waiting %fs", wait );
+		ev_timer_set( w, wait, 0. );
+		ev_timer_start( loop, w );
 	} else {
 		/* We're below the limit, so do the next request */
 		debug("max_bps not exceeded, performing next transfer" );
-		ev_io_start( loop, &ctrl->write_watcher );
 		ev_timer_stop( loop, &ctrl->limit_watcher );
-		ev_timer_again( loop, &ctrl->timeout_watcher );
+		mirror_start_writing( ctrl );
 	}
 
 	return;
 }
 
+/* Every MS_DIRTY_RATE_INTERVAL_SECS, we work out how fast clients are
+ * dirtying blocks we've already sent, and how fast we're sending. Until the
+ * first pass is done, what's left of it dominates, so we just watch. After
+ * that, if clients are keeping up with us, the migration may never converge,
+ * so we throttle their writes a step harder each time until it can.
+ */
+static void mirror_dirty_rate_cb( struct ev_loop *loop __attribute__((unused)), ev_timer *w, int revents )
+{
+	struct mirror_ctrl* ctrl = (struct mirror_ctrl*) w->data;
+	NULLCHECK( ctrl );
+
+	struct mirror *m = ctrl->mirror;
+	struct server *serve = ctrl->serve;
+	double dirty_bps, sent_bps;
+	int throttle = serve->write_throttle;
+
+	if ( !(revents & EV_TIMER ) ) {
+		warn( "Mirror dirty rate callback executed but no timer event signalled" );
+		return;
+	}
+
+	mirror_drain_events( ctrl );
+
+	dirty_bps = ( m->dirtied - ctrl->last_dirtied ) / w->repeat;
+	sent_bps = ( m->all_dirty - ctrl->last_sent ) / w->repeat;
+	ctrl->last_dirtied = m->dirtied;
+	ctrl->last_sent = m->all_dirty;
+
+	m->dirty_bps = ( m->dirty_bps * 3 + dirty_bps ) / 4;
+	ctrl->sent_bps = ( ctrl->sent_bps * 3 + sent_bps ) / 4;
+
+	if ( ctrl->clients_closed || m->offset < serve->size ) {
+		return;
+	}
+
+	if ( m->dirty_bps > ctrl->sent_bps * MS_DIRTY_RATE_FRACTION &&
+			server_mirror_eta( serve ) >= MS_CONVERGE_TIME_SECS ) {
+		throttle = throttle == 0 ? MS_THROTTLE_INITIAL : throttle + MS_THROTTLE_STEP;
+		if ( throttle > MS_THROTTLE_MAX ) {
+			throttle = MS_THROTTLE_MAX;
+		}
+	} else if ( m->dirty_bps < ctrl->sent_bps * MS_DIRTY_RATE_FRACTION / 2 ) {
+		throttle -= MS_THROTTLE_STEP;
+		if ( throttle < MS_THROTTLE_INITIAL ) {
+			throttle = 0;
+		}
+	}
+
+	if ( throttle != serve->write_throttle ) {
+		info( "Dirty rate %"PRIu64" bytes/s against %.0f sent, throttling client writes %d%%",
+				m->dirty_bps, ctrl->sent_bps, throttle );
+		serve->write_throttle = throttle;
+	}
+}
+
+/* Start reading replies on every connection, and writing the first xfers.
+ * The write callbacks set those up, and start the timeout. */
+static void mirror_start( struct mirror_ctrl *ctrl )
+{
+	int i, j;
+
+	/* We're now interested in events. Since the last attempt failed, writes
+	 * have been tracked in the dirty map; from here on, they come to us
+	 * through the stream, so we can count what's there. */
+	bitset_enable_stream( ctrl->serve->allocation_map );
+	bitset_untrack( ctrl->serve->allocation_map );
+	mirror_count_dirty( ctrl );
+
+	for ( i = 0; i < ctrl->connections; i++ ) {
+		for ( j = 0; j < ctrl->destinations; j++ ) {
+			ev_io_start( ctrl->ev_loop, &ctrl->conns[i].links[j].read_watcher );
+		}
+	}
+	mirror_start_writing( ctrl );
+}
+
 /* We use this to periodically check whether the allocation map has built, and
  * if it has, start migrating. If it's not finished, then enabling the bitset
  * stream does not go well for us.
@@ -714,12 +2091,7 @@ static void mirror_begin_cb( struct ev_loop *loop, ev_timer *w, int revents )
 	if ( ctrl->serve->allocation_map_built || ctrl->serve->allocation_map_not_built ) {
 		info( "allocation map builder is finished, beginning migration" );
 		ev_timer_stop( loop, w );
-		/* Start by writing xfer 0 to the listener */
-		ev_io_start( loop, &ctrl->write_watcher );
-		/* We want to timeout during the first write as well as subsequent ones */
-		ev_timer_again( loop, &ctrl->timeout_watcher );
-		/* We're now interested in events */
-		bitset_enable_stream( ctrl->serve->allocation_map );
+		mirror_start( ctrl );
 	} else {
 		/* not done yet, so wait another second */
 		ev_timer_again( loop, w );
@@ -728,12 +2100,107 @@ static void mirror_begin_cb( struct ev_loop *loop, ev_timer *w, int revents )
 	return;
 }
 
+/* Split the image between the connections we have. Ranges are a whole number
+ * of MS_XFER_MIN_SIZE chunks, so padding dirty runs rarely has to stop short
+ * at the edge of one. */
+static void mirror_init_conns( struct mirror_ctrl *ctrl )
+{
+	struct mirror *m = ctrl->mirror;
+	uint64_t size = ctrl->serve->size;
+	uint64_t range = ( size + m->connections - 1 ) / m->connections;
+	int i, j;
+
+	range += MS_XFER_MIN_SIZE - 1;
+	range -= range % MS_XFER_MIN_SIZE;
+
+	ctrl->connections = m->connections;
+
+	/* The ranges are only the same as last time with as many connections */
+	if ( m->ranges != 0 && m->ranges != ctrl->connections ) {
+		info( "Last attempt had %d connection(s), not %d, so starting again",
+				m->ranges, ctrl->connections );
+		mirror_forget_progress( m );
+	}
+	m->offset = 0;
+
+	for ( i = 0; i < ctrl->connections; i++ ) {
+		struct mirror_conn *conn = &ctrl->conns[i];
+
+		conn->ctrl = ctrl;
+		conn->start = i * range < size ? i * range : size;
+		conn->end = conn->start + range < size ? conn->start + range : size;
+		conn->offset = m->ranges ? m->range_offsets[i] : conn->start;
+		conn->dirty_cursor = conn->start;
+		m->offset += conn->offset - conn->start;
+
+		for ( j = 0; j < ctrl->destinations; j++ ) {
+			struct mirror_link *link = &conn->links[j];
+
+			link->conn = conn;
+			link->dest = j;
+			link->fd = m->clients[j][i];
+
+			if ( ctrl->hash ) {
+				link->hashes = xmalloc( ( NBD_HASH_MAX_SIZE / NBD_HASH_BLOCK_SIZE ) * sizeof( uint64_t ) );
+			}
+
+			/* gcc warns with -Wstrict-aliasing on -O2. clang doesn't
+			 * implement this warning. Seems to be the fault of ev.h */
+			ev_io_init( &link->read_watcher, mirror_read_cb, link->fd, EV_READ  );
+			link->read_watcher.data = (void*) link;
+
+			ev_io_init( &link->write_watcher, mirror_write_cb, link->fd, EV_WRITE );
+			link->write_watcher.data = (void*) link;
+		}
+	}
+}
+
+/* For a post-copy migration, the listener takes control as soon as we're
+ * connected. The first time, our clients have to go, so nothing more is
+ * written here that the listener wouldn't see. Then we turn an extra
+ * connection round for the listener to fetch blocks over, and send
+ * everything else as writes it only uses to fill in what it doesn't have.
+ */
+static void mirror_switch_over( struct mirror_ctrl *ctrl )
+{
+	struct mirror *m = ctrl->mirror;
+	struct server *serve = ctrl->serve;
+	enum mirror_state state;
+	int fd;
+
+	if ( !m->switched_over ) {
+		info( "Closing clients to switch over to the listener" );
+		server_forbid_new_clients( serve );
+		server_close_clients( serve );
+		server_join_clients( serve );
+	}
+	ctrl->clients_closed = 1;
+
+	state = mirror_open_connection( m, 0, serve->size, &fd, NULL );
+	ERROR_UNLESS( state == MS_GO, "Couldn't open a connection for the listener to fetch over" );
+
+	/* From here on, the listener may have control, whether or not we hear
+	 * back from it, so we can't let clients back in */
+	m->switched_over = 1;
+	m->pull_fd = fd;
+	socket_nbd_postcopy( fd, MS_HELLO_TIME_SECS );
+	ERROR_UNLESS( socket_nbd_write_hello( fd, serve->size ),
+			"Couldn't send the listener our hello" );
+
+	FATAL_IF( 0 != pthread_create( &m->pull_thread, NULL, mirror_pull_runner, m ),
+			"Failed to create the post-copy thread" );
+	info( "Switched over to the listener, sending the rest in the background" );
+	server_release_redirects( serve, m->connect_to[0] );
+}
+
+
 void mirror_run( struct server *serve )
 {
 	NULLCHECK( serve );
 	NULLCHECK( serve->mirror );
 
 	struct mirror *m = serve->mirror;
+	int i, j, resume;
 
 	m->migration_started = monotonic_time_ms();
 	info("Starting mirror" );
@@ -754,21 +2221,73 @@ void mirror_run( struct server *serve )
 
 	ctrl.serve  = serve;
 	ctrl.mirror = m;
+	ctrl.xfer_size = MS_XFER_INITIAL_SIZE;
+	ctrl.window = MS_WINDOW;
+
+	char * env_window = getenv( "FLEXNBD_MS_WINDOW" );
+	if ( NULL != env_window ) {
+		int window = atoi( env_window );
+		if ( window > 0 && window <= MS_WINDOW_MAX ) {
+			ctrl.window = window;
+		} else {
+			warn( "Ignoring FLEXNBD_MS_WINDOW=%s, must be 1-%d", env_window, MS_WINDOW_MAX );
+		}
+	}
 
 	ctrl.ev_loop = EV_DEFAULT;
+	ctrl.sendfile = 1;
+	ctrl.destinations = m->destinations;
+	ctrl.all_links = ( 1 << m->destinations ) - 1;
+	/* A listener we've switched over to has blocks that don't match ours
+	 * because they're newer, and blocks it hasn't fetched yet that would
+	 * hash as whatever was there before, so we send it everything */
+	ctrl.hash = !!( m->listener_flags & INIT_FLAG_HASH ) && !m->post_copy;
+	if ( ctrl.hash ) {
+		info( "Listeners can hash their copies, only sending blocks that differ" );
+	}
+
+	/* If the listeners are still the ones we were sending this migration to
+	 * last time, they have everything they acknowledged then, so we can
+	 * carry on from there. Every one of them is given the ID, whether or not
+	 * an earlier one has lost track, so they all know it next time. */
+	resume = !!( m->listener_flags & INIT_FLAG_GENERATION );
+	for ( i = 0; i < m->destinations && ( m->listener_flags & INIT_FLAG_GENERATION ); i++ ) {
+		if ( socket_nbd_generation( m->clients[i][0], m->generation, MS_HELLO_TIME_SECS ) != m->generation ) {
+			resume = 0;
+		}
+	}
+	if ( resume ) {
+		if ( m->ranges ) {
+			info( "Listeners have our last attempt, carrying on from there" );
+		}
+	} else {
+		mirror_forget_progress( m );
+	}
+
+	if ( m->post_copy ) {
+		mirror_switch_over( &ctrl );
+	}
+
+	char * env_compress = getenv( "FLEXNBD_MS_COMPRESS" );
+	ctrl.compress = !!( m->listener_flags & INIT_FLAG_LZ4 ) &&
+		( NULL == env_compress || 0 != atoi( env_compress ) );
+
+	mirror_init_conns( &ctrl );
+
+	if ( ctrl.compress || ctrl.hash ) {
+		ev_async_init( &ctrl.compress_watcher, mirror_compress_cb );
+		ctrl.compress_watcher.data = (void*) &ctrl;
+		ev_async_start( ctrl.ev_loop, &ctrl.compress_watcher );
+		mirror_pool_start( &ctrl.pool, ctrl.ev_loop, &ctrl.compress_watcher );
+		if ( ctrl.compress ) {
+			info( "Compressing over %d thread(s) while it pays off", ctrl.pool.thread_count );
+		}
+	}
 
-	/* gcc warns with -Wstrict-aliasing on -O2. clang doesn't
-	 * implement this warning. Seems to be the fault of ev.h */
 	ev_init( &ctrl.begin_watcher, mirror_begin_cb );
 	ctrl.begin_watcher.repeat = 1.0; // We check bps every second. seems sane.
 	ctrl.begin_watcher.data = (void*) &ctrl;
 
-	ev_io_init( &ctrl.read_watcher, mirror_read_cb, m->client, EV_READ  );
-	ctrl.read_watcher.data = (void*) &ctrl;
-
-	ev_io_init( &ctrl.write_watcher, mirror_write_cb, m->client, EV_WRITE );
-	ctrl.write_watcher.data = (void*) &ctrl;
-
 	ev_init( &ctrl.timeout_watcher, mirror_timeout_cb );
 
 	char * env_request_limit = getenv( "FLEXNBD_MS_REQUEST_LIMIT_SECS" );
@@ -788,26 +2307,21 @@ void mirror_run( struct server *serve )
 	ctrl.timeout_watcher.repeat = timeout_limit;
 
 	ev_init( &ctrl.limit_watcher, mirror_limit_cb );
-	ctrl.limit_watcher.repeat = 1.0; // We check bps every second. seems sane.
 	ctrl.limit_watcher.data = (void*) &ctrl;
+	ratelimit_start( &ctrl.limit, mirror_burst( m ), ev_now( ctrl.ev_loop ) );
+
+	ev_init( &ctrl.dirty_rate_watcher, mirror_dirty_rate_cb );
+	ctrl.dirty_rate_watcher.repeat = MS_DIRTY_RATE_INTERVAL_SECS;
+	ctrl.dirty_rate_watcher.data = (void*) &ctrl;
+	ev_timer_again( ctrl.ev_loop, &ctrl.dirty_rate_watcher );
 
 	ev_init( &ctrl.abandon_watcher, mirror_abandon_cb );
 	ev_io_set( &ctrl.abandon_watcher, m->abandon_signal->read_fd, EV_READ );
 	ctrl.abandon_watcher.data = (void*) &ctrl;
 	ev_io_start( ctrl.ev_loop, &ctrl.abandon_watcher );
 
-	ERROR_UNLESS(
-		mirror_setup_next_xfer( &ctrl ),
-		"Couldn't find first transfer for mirror!"
-	);
-
-
 	if ( serve->allocation_map_built ) {
-		/* Start by writing xfer 0 to the listener */
-		ev_io_start( ctrl.ev_loop, &ctrl.write_watcher );
-		/* We want to timeout during the first write as well as subsequent ones */
-		ev_timer_again( ctrl.ev_loop, &ctrl.timeout_watcher );
-		bitset_enable_stream( serve->allocation_map );
+		mirror_start( &ctrl );
 	} else {
 		debug( "Waiting for allocation map to be built" );
 		ev_timer_again( ctrl.ev_loop, &ctrl.begin_watcher );
@@ -816,21 +2330,58 @@ void mirror_run( struct server *serve )
 	/* Everything up to here is blocking. We switch to non-blocking so we
 	 * can handle rate-limiting and weird error conditions better. TODO: We
 	 * should expand the event loop upwards so we can do the same there too */
-	sock_set_nonblock( m->client, 1 );
+	for ( i = 0; i < ctrl.connections; i++ ) {
+		for ( j = 0; j < ctrl.destinations; j++ ) {
+			sock_set_nonblock( ctrl.conns[i].links[j].fd, 1 );
+		}
+	}
 
 	info( "Entering event loop" );
 	ev_run( ctrl.ev_loop, 0 );
 	info( "Exited event loop" );
 
 	/* Parent code might expect a non-blocking socket */
-	sock_set_nonblock( m->client, 0 );
+	for ( i = 0; i < m->destinations; i++ ) {
+		for ( j = 0; j < m->connections; j++ ) {
+			if ( m->clients[i][j] > 0 ) {
+				sock_set_nonblock( m->clients[i][j], 0 );
+			}
+		}
+	}
+
+	/* Stop all our watchers, so a retry starts with a clean loop */
+	for ( i = 0; i < ctrl.connections; i++ ) {
+		for ( j = 0; j < ctrl.destinations; j++ ) {
+			ev_io_stop( ctrl.ev_loop, &ctrl.conns[i].links[j].read_watcher );
+			ev_io_stop( ctrl.ev_loop, &ctrl.conns[i].links[j].write_watcher );
+		}
+	}
+	ev_timer_stop( ctrl.ev_loop, &ctrl.begin_watcher );
+	ev_timer_stop( ctrl.ev_loop, &ctrl.timeout_watcher );
+	ev_timer_stop( ctrl.ev_loop, &ctrl.limit_watcher );
+	ev_timer_stop( ctrl.ev_loop, &ctrl.dirty_rate_watcher );
+	ev_io_stop( ctrl.ev_loop, &ctrl.abandon_watcher );
+	serve->write_throttle = 0;
+
+	if ( ctrl.compress || ctrl.hash ) {
+		mirror_pool_stop( &ctrl.pool );
+		ev_async_stop( ctrl.ev_loop, &ctrl.compress_watcher );
+	}
+
+	for ( i = 0; i < ctrl.connections; i++ ) {
+		for ( j = 0; j < ctrl.destinations; j++ ) {
+			free( ctrl.conns[i].links[j].hashes );
+		}
+	}
 
 
 	/* Errors in the event loop don't track I/O lock state or try to restore
 	 * it to something sane - they just terminate the event loop with state !=
 	 * MS_DONE. We re-allow new clients here if necessary.
 	 */
-	if ( m->action_at_finish == ACTION_NOTHING || m->commit_state != MS_DONE ) {
+	if ( !m->switched_over &&
+			( m->action_at_finish == ACTION_NOTHING || m->commit_state != MS_DONE ) ) {
+		server_release_redirects( serve, NULL );
 		server_allow_new_clients( serve );
 	}
 
@@ -838,8 +2389,21 @@ void mirror_run( struct server *serve )
 	 * call retries the migration from scratch. */
 
 	if ( m->commit_state != MS_DONE ) {
-		/* mirror_reset will be called before a retry, so keeping hold of events
-		 * between now and our next mirroring attempt is not useful
+		mirror_requeue_in_flight( &ctrl );
+
+		/* Note where we got to, and track writes until the next attempt, so
+		 * it can carry on from here if it finds the same listener */
+		if ( m->commit_state != MS_ABANDONED ) {
+			for ( i = 0; i < ctrl.connections; i++ ) {
+				m->range_offsets[i] = ctrl.conns[i].offset;
+			}
+			m->ranges = ctrl.connections;
+			bitset_track( serve->allocation_map, m->dirty_map );
+		}
+
+		/* Nothing will read the stream until the next attempt, and the
+		 * writers would block once it filled up, so it's turned off. Writes
+		 * meanwhile go straight into the dirty map.
 		 */
 		bitset_disable_stream( serve->allocation_map );
 		error( "Event loop exited, but mirroring is not complete" );
@@ -920,12 +2484,9 @@ void* mirror_runner(void* serve_params_uncast)
 
 	/* On success, this is unnecessary, and harmless ( mirror_cleanup does it
 	 * for us ). But if we've failed and are going to retry on the next run, we
-	 * must close this socket here to have any chance of it succeeding.
+	 * must close these sockets here to have any chance of it succeeding.
 	 */
-	if ( !mirror->client < 0 ) {
-		sock_try_close( mirror->client );
-		mirror->client = -1;
-	}
+	mirror_close_connections( mirror );
 
 abandon_mirror:
 	return NULL;
@@ -934,19 +2495,25 @@ abandon_mirror:
 
 struct mirror_super * mirror_super_create(
 		const char * filename,
-		union mysockaddr * connect_to,
+		union mysockaddr ** connect_to,
+		int destinations,
 		union mysockaddr * connect_from,
 		uint64_t max_Bps,
 		enum mirror_finish_action action_at_finish,
+		int post_copy,
+		int verify,
 		struct mbox * state_mbox)
 {
 	struct mirror_super * super = xmalloc( sizeof( struct mirror_super) );
 	super->mirror = mirror_create(
 			filename,
 			connect_to,
+			destinations,
 			connect_from,
 			max_Bps,
 			action_at_finish,
+			post_copy,
+			verify,
 			mbox_create() ) ;
 	super->state_mbox = state_mbox;
 	return super;
@@ -1059,13 +2626,16 @@ void * mirror_super_runner( void * serve_uncast )
 			 * hard, so if this is a retry, insert a delay. */
 			sleep( MS_RETRY_DELAY_SECS );
 
-			/* We also have to reset the bitmap to be sure
-			 * we transfer everything */
+			/* The dirty map is kept; the next attempt throws it away
+			 * if it can't carry on from this one */
 			mirror_reset( mirror );
 		}
 
 	}
 	while ( should_retry && !success );
 
+	/* Nothing's going to come back for the writes we were tracking */
+	bitset_untrack( serve->allocation_map );
+
 	return NULL;
 }
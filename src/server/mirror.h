@@ -57,6 +57,108 @@ enum mirror_state;
 #define MS_REQUEST_LIMIT_SECS 60
 #define MS_REQUEST_LIMIT_SECS_F 60.0
 
+/* MS_WINDOW
+ * The number of write requests we'll have outstanding to the listener at
+ * once. Can be overridden by the environment variable FLEXNBD_MS_WINDOW, up
+ * to MS_WINDOW_MAX.
+ */
+#define MS_WINDOW 8
+#define MS_WINDOW_MAX 64
+
+/* MS_CONNECTIONS
+ * The number of connections we open to the listener, each responsible for
+ * one part of the image. Can be overridden by the environment variable
+ * FLEXNBD_MS_CONNECTIONS, up to MS_CONNECTIONS_MAX. If the listener won't
+ * accept that many, we use as many as it does.
+ */
+#define MS_CONNECTIONS 4
+#define MS_CONNECTIONS_MAX 16
+
+/* MS_DESTINATIONS_MAX
+ * The number of listeners we can mirror to at once. Each block is read and
+ * compressed once, and the same xfer sent to every one of them.
+ */
+#define MS_DESTINATIONS_MAX 4
+
+/* MS_XFER_INITIAL_SIZE
+ * The size of the first transfer of a mirror attempt. Subsequent transfers
+ * are sized from the throughput and round-trip time we measure, between
+ * MS_XFER_MIN_SIZE and MS_XFER_MAX_SIZE.
+ */
+#define MS_XFER_INITIAL_SIZE ( 1 << 20 )
+
+/* MS_XFER_MIN_SIZE
+ * Dirty runs smaller than this are padded out to it. Below this, the
+ * per-request overhead outweighs the cost of sending a few clean blocks.
+ */
+#define MS_XFER_MIN_SIZE ( 64 << 10 )
+
+/* MS_XFER_MAX_SIZE
+ * The largest transfer we'll ever make, however fat the link.
+ */
+#define MS_XFER_MAX_SIZE ( 64 << 20 )
+
+/* MS_BURST_SECS
+ * Unless a burst size is given, the rate limiter lets us send this many
+ * seconds' worth of data at once after being idle, so the traffic is smooth
+ * over any longer interval.
+ */
+#define MS_BURST_SECS 0.1
+
+/* MS_ZEROES_MAX_SIZE
+ * The longest unallocated run we'll cover with a single write zeroes request.
+ * These carry no data, so can be far bigger than MS_XFER_MAX_SIZE.
+ */
+#define MS_ZEROES_MAX_SIZE ( 1 << 30 )
+
+/* MS_XFER_TARGET_SECS
+ * We size transfers so each takes roughly this long at the measured
+ * throughput, and so that it is at least MS_XFER_RTT_MULTIPLE round trips
+ * long, which keeps the link busy for most of the time.
+ */
+#define MS_XFER_TARGET_SECS 0.25
+#define MS_XFER_RTT_MULTIPLE 8
+
+/* MS_COMPRESS_THREADS_MAX
+ * If the listener takes compressed writes, we compress on a pool of this many
+ * threads at most, or one per CPU if there are fewer. Setting the environment
+ * variable FLEXNBD_MS_COMPRESS=0 turns compression off.
+ */
+#define MS_COMPRESS_THREADS_MAX 8
+
+/* MS_COMPRESS_PROBE_INTERVAL
+ * We stop compressing when it's costing more time than it saves on the link,
+ * but still compress one in this many xfers so we notice when the data or
+ * the link change.
+ */
+#define MS_COMPRESS_PROBE_INTERVAL 16
+
+/* MS_DIRTY_RATE_INTERVAL_SECS
+ * How often we measure the rate clients are dirtying blocks we've already
+ * sent, and the rate we're sending them, to decide whether the migration can
+ * converge.
+ */
+#define MS_DIRTY_RATE_INTERVAL_SECS 1.0
+
+/* MS_DIRTY_RATE_FRACTION
+ * Once the first pass is done, if clients are dirtying blocks faster than
+ * this fraction of the rate we send them, and we're not yet within
+ * MS_CONVERGE_TIME_SECS of finishing, we start throttling client writes.
+ */
+#define MS_DIRTY_RATE_FRACTION 0.5
+
+/* MS_THROTTLE_INITIAL, MS_THROTTLE_STEP, MS_THROTTLE_MAX
+ * Client writes are throttled by keeping client threads asleep for a
+ * percentage of the time. We start at MS_THROTTLE_INITIAL percent, and go
+ * up by MS_THROTTLE_STEP every MS_DIRTY_RATE_INTERVAL_SECS for as long as
+ * the migration still can't converge, to at most MS_THROTTLE_MAX. We come
+ * back down a step at a time once clients are dirtying blocks at less than
+ * half the rate that triggered it.
+ */
+#define MS_THROTTLE_INITIAL 20
+#define MS_THROTTLE_STEP 10
+#define MS_THROTTLE_MAX 99
+
 enum mirror_finish_action {
 	ACTION_EXIT,
 	ACTION_UNLINK,
@@ -81,22 +183,80 @@ struct mirror {
 	/* Signal to this then join the thread if you want to abandon mirroring */
 	struct self_pipe *   abandon_signal;
 
-	union mysockaddr *   connect_to;
+	/* The listeners we're mirroring to. Everything goes to all of them */
+	union mysockaddr *   connect_to[MS_DESTINATIONS_MAX];
+	int                  destinations;
 	union mysockaddr *   connect_from;
-	int                  client;
+
+	/* Our connections to each listener. There are as many to each, and the
+	 * same connection to each carries the same range of the image. The
+	 * first to each is the one whose hello decides whether the mirror can
+	 * go ahead, and the one that hands control over at the end */
+	int                  clients[MS_DESTINATIONS_MAX][MS_CONNECTIONS_MAX];
+	int                  connections;
+
+	/* The flags all the listeners' hellos have in common, telling us what
+	 * requests they all understand besides reads and writes */
+	uint32_t             listener_flags;
 	const char *         filename;
 
-	/* Limiter, used to restrict migration speed Only dirty bytes (those going
-	 * over the network) are considered */
+	/* Limiter, used to restrict migration speed. Only bytes going over the
+	 * network are considered. max_burst_bytes is how much we may send at
+	 * once after being idle, or 0 for MS_BURST_SECS worth. Both can be
+	 * changed while the mirror runs. */
 	uint64_t              max_bytes_per_second;
+	uint64_t              max_burst_bytes;
 
 	enum mirror_finish_action action_at_finish;
 
+	/* Set for a post-copy migration, where the listener takes control
+	 * before we've sent anything, and fetches blocks it needs before we
+	 * get to them over a connection we turn round for it. switched_over is
+	 * set once our clients are gone and it has control; from then on, our
+	 * copy is frozen, and we mustn't give up until the listener has it all.
+	 */
+	int                  post_copy;
+	int                  switched_over;
+	int                  pull_fd;
+	pthread_t            pull_thread;
+
+	/* Set if, once everything has been sent and our clients are closed, we
+	 * should check the listeners' copies against ours before finishing */
+	int                  verify;
+
 	char                 *mapped;
 
+	/* The file behind mapped, which plain writes are sent from with
+	 * sendfile(), so the data isn't copied through userspace */
+	int                  map_fd;
+
 	/* We need to send every byte at least once; we do so by  */
 	uint64_t offset;
 
+	/* Blocks behind offset that have been written to since we sent them.
+	 * Events from the allocation map's stream are merged in here, so a
+	 * block that is rewritten many times is only sent once more, and
+	 * adjacent writes are sent together.
+	 */
+	struct bitset *      dirty_map;
+
+	/* Number of bytes represented by set bits in dirty_map */
+	uint64_t dirty_bytes;
+
+	/* A random ID for this migration, which we give the listeners on every
+	 * attempt. If they all give the same one back, they're the listeners we
+	 * were sending to before, and still have everything they acknowledged.
+	 */
+	uint64_t generation;
+
+	/* How far each connection's first pass had got when the last attempt
+	 * failed, so the next can carry on from there. Until it starts, writes
+	 * are tracked straight into dirty_map. ranges is the number of
+	 * connections the offsets are for, or 0 if there's nothing to resume.
+	 */
+	uint64_t range_offsets[MS_CONNECTIONS_MAX];
+	int ranges;
+
 	enum mirror_state    commit_state;
 
 	/* commit_signal is sent immediately after attempting to connect
@@ -110,6 +270,11 @@ struct mirror {
 
 	/* Running count of all bytes we've transferred */
 	uint64_t all_dirty;
+
+	/* Running count of bytes written by clients behind the point we'd got
+	 * to, which we have to send again, and the smoothed rate of that */
+	uint64_t dirtied;
+	uint64_t dirty_bps;
 };
 
 
@@ -129,10 +294,13 @@ struct flexnbd;
 
 struct mirror_super * mirror_super_create(
 		const char * filename,
-		union mysockaddr * connect_to,
+		union mysockaddr ** connect_to,
+		int destinations,
 		union mysockaddr * connect_from,
 		uint64_t max_Bps,
 		enum mirror_finish_action action_at_finish,
+		int post_copy,
+		int verify,
 		struct mbox * state_mbox
 		);
 void * mirror_super_runner( void * serve_uncast );
@@ -117,17 +117,19 @@ static struct option mirror_speed_options[] = {
 	GETOPT_HELP,
 	GETOPT_SOCK,
 	GETOPT_MAX_SPEED,
+	GETOPT_MAX_BURST,
 	GETOPT_QUIET,
 	GETOPT_VERBOSE,
 	{0}
 };
-static char mirror_speed_short_options[] = "hs:m:" SOPT_QUIET SOPT_VERBOSE;
+static char mirror_speed_short_options[] = "hs:m:B:" SOPT_QUIET SOPT_VERBOSE;
 static char mirror_speed_help_text[] =
 	"Usage: flexnbd " CMD_MIRROR_SPEED " <options>\n\n"
 	"Set the maximum speed of a migration from a mirring server listening on SOCK.\n\n"
 	HELP_LINE
 	SOCK_LINE
 	MAX_SPEED_LINE
+	MAX_BURST_LINE
 	VERBOSE_LINE
 	QUIET_LINE;
 
@@ -138,20 +140,24 @@ static struct option mirror_options[] = {
 	GETOPT_PORT,
 	GETOPT_UNLINK,
 	GETOPT_BIND,
+	GETOPT_POST_COPY,
+	GETOPT_VERIFY,
 	GETOPT_QUIET,
 	GETOPT_VERBOSE,
 	{0}
 };
-static char mirror_short_options[] = "hs:l:p:ub:" SOPT_QUIET SOPT_VERBOSE;
+static char mirror_short_options[] = "hs:l:p:ub:yV" SOPT_QUIET SOPT_VERBOSE;
 static char mirror_help_text[] =
 	"Usage: flexnbd " CMD_MIRROR " <options>\n\n"
 	"Start mirroring from the server with control socket SOCK to one at ADDR:PORT.\n\n"
 	HELP_LINE
-	"\t--" OPT_ADDR ",-l <ADDR>\tThe address to mirror to.\n"
-	"\t--" OPT_PORT ",-p <PORT>\tThe port to mirror to.\n"
+	"\t--" OPT_ADDR ",-l <ADDR>\tThe address to mirror to, or a comma-separated list.\n"
+	"\t--" OPT_PORT ",-p <PORT>\tThe port to mirror to, or one per address.\n"
 	SOCK_LINE
 	"\t--" OPT_UNLINK ",-u\tUnlink the local file when done.\n"
 	BIND_LINE
+	"\t--" OPT_POST_COPY ",-y\tHand over to the destination first, then send the file.\n"
+	"\t--" OPT_VERIFY ",-V\tCheck the destination's copy against ours before finishing.\n"
 	VERBOSE_LINE
 	QUIET_LINE;
 
@@ -351,7 +357,8 @@ void read_acl_param( int c, char **sock )
 void read_mirror_speed_param(
 		int c,
 		char **sock,
-		char **max_speed
+		char **max_speed,
+		char **max_burst
 )
 {
 	switch( c ) {
@@ -364,6 +371,9 @@ void read_mirror_speed_param(
 		case 'm':
 			*max_speed = optarg;
 			break;
+		case 'B':
+			*max_burst = optarg;
+			break;
 		case 'q':
 			log_level = QUIET_LOG_LEVEL;
 			break;
@@ -383,7 +393,9 @@ void read_mirror_param(
 		char **ip_addr,
 		char **ip_port,
 		int  *unlink,
-		char **bind_addr )
+		char **bind_addr,
+		int  *post_copy,
+		int  *verify )
 {
 	switch( c ){
 		case 'h':
@@ -404,6 +416,12 @@ void read_mirror_param(
 		case 'b':
 			*bind_addr = optarg;
 			break;
+		case 'y':
+			*post_copy = 1;
+			break;
+		case 'V':
+			*verify = 1;
+			break;
 		case 'q':
 			log_level = QUIET_LOG_LEVEL;
 			break;
@@ -705,12 +723,12 @@ int mode_mirror_speed( int argc, char *argv[] )
 {
 	int c;
 	char *sock = NULL;
-	char *speed = NULL;
+	char *args[2] = { NULL, NULL };
 
 	while( 1 ) {
 		c = getopt_long( argc, argv, mirror_speed_short_options, mirror_speed_options, NULL );
 		if ( -1 == c ) { break; }
-		read_mirror_speed_param( c, &sock, &speed );
+		read_mirror_speed_param( c, &sock, &args[0], &args[1] );
 	}
 
 	if ( NULL == sock ) {
@@ -718,12 +736,12 @@ int mode_mirror_speed( int argc, char *argv[] )
 		exit_err( mirror_speed_help_text );
 	}
 
-	if ( NULL == speed ) {
+	if ( NULL == args[0] ) {
 		fprintf( stderr, "--max-speed is required.\n");
 		exit_err( mirror_speed_help_text );
 	}
 
-	do_remote_command( "mirror_max_bps", sock, 1, &speed );
+	do_remote_command( "mirror_max_bps", sock, args[1] ? 2 : 1, args );
 	return 0;
 }
 
@@ -732,9 +750,12 @@ int mode_mirror( int argc, char *argv[] )
 {
 	int c;
 	char *sock = NULL;
-	char *remote_argv[4] = {0};
+	char *remote_argv[6] = {0};
+	int remote_argc = 3;
 	int err = 0;
 	int unlink = 0;
+	int post_copy = 0;
+	int verify = 0;
 
 	remote_argv[2] = "exit";
 
@@ -746,7 +767,9 @@ int mode_mirror( int argc, char *argv[] )
 				&remote_argv[0],
 				&remote_argv[1],
 				&unlink,
-				&remote_argv[3] );
+				&remote_argv[3],
+				&post_copy,
+				&verify );
 	}
 
 	if ( NULL == sock ){
@@ -760,13 +783,18 @@ int mode_mirror( int argc, char *argv[] )
 	if ( err ) { exit_err( mirror_help_text ); }
 	if ( unlink ) { remote_argv[2] = "unlink"; }
 
-	if (remote_argv[3] == NULL) {
-		do_remote_command( "mirror", sock, 3, remote_argv );
+	if (remote_argv[3] != NULL) {
+		remote_argc++;
 	}
-	else {
-		do_remote_command( "mirror", sock, 4, remote_argv );
+	if (post_copy) {
+		remote_argv[remote_argc++] = "postcopy";
+	}
+	if (verify) {
+		remote_argv[remote_argc++] = "verify";
 	}
 
+	do_remote_command( "mirror", sock, remote_argc, remote_argv );
+
 	return 0;
 }
 
@@ -0,0 +1,301 @@
+#include "postcopy.h"
+#include "nbdtypes.h"
+#include "readwrite.h"
+#include "ioutil.h"
+#include "sockutil.h"
+#include "util.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+struct postcopy * postcopy_create( uint64_t size )
+{
+	struct postcopy * pc = xmalloc( sizeof( struct postcopy ) );
+
+	FATAL_UNLESS( 0 == pthread_mutex_init( &pc->lock, NULL ),
+			"Failed to initialise a mutex" );
+	FATAL_UNLESS( 0 == pthread_cond_init( &pc->channel_cond, NULL ),
+			"Failed to initialise a condition variable" );
+	FATAL_UNLESS( 0 == pthread_cond_init( &pc->fetched_cond, NULL ),
+			"Failed to initialise a condition variable" );
+
+	pc->channel = -1;
+	pc->size = size;
+	pc->present = bitset_alloc( size, POSTCOPY_BLOCK_SIZE );
+	pc->fetching = bitset_alloc( size, POSTCOPY_BLOCK_SIZE );
+
+	return pc;
+}
+
+
+void postcopy_destroy( struct postcopy * pc )
+{
+	NULLCHECK( pc );
+
+	if ( pc->channel >= 0 ) {
+		close( pc->channel );
+	}
+	bitset_free( pc->present );
+	bitset_free( pc->fetching );
+	pthread_cond_destroy( &pc->fetched_cond );
+	pthread_cond_destroy( &pc->channel_cond );
+	pthread_mutex_destroy( &pc->lock );
+	free( pc );
+}
+
+
+void postcopy_lock( struct postcopy * pc )
+{
+	FATAL_IF( 0 != pthread_mutex_lock( &pc->lock ), "Error locking postcopy" );
+}
+
+
+void postcopy_unlock( struct postcopy * pc )
+{
+	FATAL_IF( 0 != pthread_mutex_unlock( &pc->lock ), "Error unlocking postcopy" );
+}
+
+
+static void postcopy_close_channel( struct postcopy * pc )
+{
+	if ( pc->channel >= 0 ) {
+		close( pc->channel );
+		pc->channel = -1;
+	}
+}
+
+
+/* Wait up to timeout_ms for fd to have something to read */
+static int postcopy_wait_for_data( int fd, uint64_t timeout_ms )
+{
+	fd_set fds;
+	struct timeval tv = { timeout_ms / 1000, ( timeout_ms % 1000 ) * 1000 };
+
+	FD_ZERO( &fds );
+	FD_SET( fd, &fds );
+
+	return sock_try_select( FD_SETSIZE, &fds, NULL, NULL, &tv ) > 0;
+}
+
+
+/* Read len bytes from fd into buf, giving up if they haven't all arrived by
+ * deadline, on the monotonic_time_ms() clock. Returns 0 on success, or -1 */
+static int postcopy_read_by( int fd, void * buf, size_t len, uint64_t deadline )
+{
+	char * at = buf;
+	ssize_t count;
+	uint64_t now;
+
+	while ( len > 0 ) {
+		now = monotonic_time_ms();
+		if ( now >= deadline || !postcopy_wait_for_data( fd, deadline - now ) ) {
+			warn( "Timed out waiting for the mirror" );
+			return -1;
+		}
+
+		count = read( fd, at, len );
+		if ( count == 0 ) {
+			warn( "Mirror closed the connection to fetch over" );
+			return -1;
+		}
+		if ( count < 0 ) {
+			if ( errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK ) {
+				continue;
+			}
+			warn( SHOW_ERRNO( "Couldn't read from the mirror" ) );
+			return -1;
+		}
+
+		at += count;
+		len -= count;
+	}
+
+	return 0;
+}
+
+
+int postcopy_open_channel( struct postcopy * pc, int fd )
+{
+	uint64_t size;
+
+	NULLCHECK( pc );
+
+	if ( !postcopy_wait_for_data( fd, POSTCOPY_PULL_TIMEOUT_SECS * 1000 ) ||
+			!socket_nbd_read_hello( fd, &size, NULL ) ) {
+		warn( "No hello on the connection to fetch blocks over" );
+		close( fd );
+		return 0;
+	}
+	if ( size != pc->size ) {
+		warn( "Mirror's size (%"PRIu64") doesn't match ours (%"PRIu64")", size, pc->size );
+		close( fd );
+		return 0;
+	}
+
+	postcopy_lock( pc );
+	postcopy_close_channel( pc );
+	if ( pc->complete ) {
+		close( fd );
+	} else {
+		pc->channel = fd;
+		pthread_cond_broadcast( &pc->channel_cond );
+	}
+	postcopy_unlock( pc );
+
+	return 1;
+}
+
+
+uint64_t postcopy_run( struct postcopy * pc, uint64_t from, uint64_t len, int *missing )
+{
+	int run_is_set = 0;
+	uint64_t run = bitset_run_count_ex( pc->present, from, len, &run_is_set );
+
+	*missing = !run_is_set;
+	return run > len ? len : run;
+}
+
+
+void postcopy_mark( struct postcopy * pc, uint64_t from, uint64_t len )
+{
+	uint64_t start = from + POSTCOPY_BLOCK_SIZE - 1;
+	uint64_t end = from + len;
+	uint64_t run;
+	int missing;
+
+	start -= start % POSTCOPY_BLOCK_SIZE;
+	if ( end != pc->size ) {
+		end -= end % POSTCOPY_BLOCK_SIZE;
+	}
+	if ( start >= end ) {
+		return;
+	}
+
+	for ( from = start; from < end; from += run ) {
+		run = postcopy_run( pc, from, end - from, &missing );
+		if ( missing ) {
+			pc->present_bytes += run;
+		}
+	}
+	bitset_set_range( pc->present, start, end - start );
+
+	if ( pc->present_bytes == pc->size && !pc->complete ) {
+		info( "Post-copy migration complete, all %"PRIu64" bytes are here", pc->size );
+		pc->complete = 1;
+		postcopy_close_channel( pc );
+	}
+}
+
+
+uint64_t postcopy_fetching_run( struct postcopy * pc, uint64_t from, uint64_t len, int *fetching )
+{
+	uint64_t run = bitset_run_count_ex( pc->fetching, from, len, fetching );
+
+	return run > len ? len : run;
+}
+
+
+void postcopy_fetch_start( struct postcopy * pc, uint64_t from, uint64_t len )
+{
+	bitset_set_range( pc->fetching, from, len );
+}
+
+
+void postcopy_fetch_done( struct postcopy * pc, uint64_t from, uint64_t len, int fetched )
+{
+	bitset_clear_range( pc->fetching, from, len );
+	if ( fetched ) {
+		postcopy_mark( pc, from, len );
+	}
+	pthread_cond_broadcast( &pc->fetched_cond );
+}
+
+
+void postcopy_wait_for_fetches( struct postcopy * pc )
+{
+	pthread_cond_wait( &pc->fetched_cond, &pc->lock );
+}
+
+
+/* We take the connection while we use it, so nobody else's request or reply
+ * can get mixed up with ours, and give it back when we're done, unless a new
+ * one has turned up or we don't need one any more. */
+int postcopy_pull( struct postcopy * pc, uint64_t from, uint32_t len, char * buf )
+{
+	struct nbd_request request = {
+		.magic = REQUEST_MAGIC,
+		.type = REQUEST_READ,
+		.from = from,
+		.len = len
+	};
+	struct nbd_request_raw request_raw;
+	struct nbd_reply_raw reply_raw;
+	struct nbd_reply reply;
+	struct timespec until;
+	uint64_t deadline;
+	int fd;
+
+	/* Someone else's fetch is bounded by its own timeout, so we only start
+	 * counting once there's no connection at all */
+	clock_gettime( CLOCK_REALTIME, &until );
+	until.tv_sec += POSTCOPY_PULL_TIMEOUT_SECS;
+	while ( pc->channel < 0 ) {
+		if ( pc->pulling ) {
+			pthread_cond_wait( &pc->channel_cond, &pc->lock );
+			clock_gettime( CLOCK_REALTIME, &until );
+			until.tv_sec += POSTCOPY_PULL_TIMEOUT_SECS;
+		} else if ( ETIMEDOUT == pthread_cond_timedwait( &pc->channel_cond, &pc->lock, &until ) ) {
+			warn( "No connection to fetch %"PRIu64"+%"PRIu32" over", from, len );
+			return -1;
+		}
+	}
+
+	debug( "Fetching %"PRIu64"+%"PRIu32, from, len );
+	fd = pc->channel;
+	pc->channel = -1;
+	pc->pulling = 1;
+	pc->pulls++;
+	memcpy( request.handle, &pc->pulls, sizeof( request.handle ) );
+	nbd_h2r_request( &request, &request_raw );
+
+	postcopy_unlock( pc );
+
+	deadline = monotonic_time_ms() + POSTCOPY_PULL_TIMEOUT_SECS * 1000;
+	if ( 0 > writeloop( fd, &request_raw, sizeof( request_raw ) ) ||
+			0 > postcopy_read_by( fd, &reply_raw, sizeof( reply_raw ), deadline ) ) {
+		goto fail;
+	}
+
+	nbd_r2h_reply( &reply_raw, &reply );
+	if ( reply.magic != REPLY_MAGIC || reply.error != 0 ||
+			0 != memcmp( reply.handle, request.handle, sizeof( request.handle ) ) ) {
+		warn( "Bad reply to fetch, error=%"PRIu32, reply.error );
+		goto fail;
+	}
+
+	if ( 0 > postcopy_read_by( fd, buf, len, deadline ) ) {
+		goto fail;
+	}
+
+	postcopy_lock( pc );
+	pc->pulling = 0;
+	if ( pc->channel < 0 && !pc->complete ) {
+		pc->channel = fd;
+	} else {
+		close( fd );
+	}
+	pthread_cond_broadcast( &pc->channel_cond );
+
+	return 0;
+
+fail:
+	warn( "Fetching %"PRIu64"+%"PRIu32" failed, dropping the connection", from, len );
+	close( fd );
+	postcopy_lock( pc );
+	pc->pulling = 0;
+	pthread_cond_broadcast( &pc->channel_cond );
+	return -1;
+}
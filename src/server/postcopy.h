@@ -0,0 +1,104 @@
+#ifndef POSTCOPY_H
+#define POSTCOPY_H
+
+/** postcopy
+ * The listener's end of a post-copy migration. The mirror hands us control
+ * of the image before it has sent it, so we keep track of which blocks we
+ * have. Blocks we're asked for before the mirror gets round to them are
+ * fetched from it over a connection it turns round for the purpose; the
+ * mirror's own writes only fill in the blocks we still don't have.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "bitset.h"
+
+/* POSTCOPY_BLOCK_SIZE
+ * The granularity we track the blocks we have at. A block is only ours once
+ * all of it is, so partial blocks are fetched before clients write to them.
+ */
+#define POSTCOPY_BLOCK_SIZE 4096
+
+/* POSTCOPY_PULL_MAX_SIZE
+ * The most we'll fetch from the mirror in one request.
+ */
+#define POSTCOPY_PULL_MAX_SIZE ( 1 << 20 )
+
+/* POSTCOPY_PULL_TIMEOUT_SECS
+ * How long we wait for the mirror to answer a fetch, or for it to turn a new
+ * connection round if the last one went away, before giving up on the
+ * request that needed it.
+ */
+#define POSTCOPY_PULL_TIMEOUT_SECS 30
+
+struct postcopy {
+	/* Held around everything below, but never while we wait for the
+	 * mirror, so clients can get at the blocks we have in the meantime */
+	pthread_mutex_t lock;
+
+	/* Signalled when a connection to fetch over is free */
+	pthread_cond_t channel_cond;
+
+	/* Signalled when a fetch is over, whether or not it worked */
+	pthread_cond_t fetched_cond;
+
+	/* The connection the mirror answers our fetches on, or -1 if we don't
+	 * have one at the moment, or someone's fetching over it, in which case
+	 * pulling is set */
+	int channel;
+	int pulling;
+	uint64_t pulls;
+
+	/* The blocks we have, and how many bytes that is. Once it's all of
+	 * them, the migration is complete and nothing needs to take the lock */
+	struct bitset * present;
+	uint64_t present_bytes;
+	uint64_t size;
+	volatile int complete;
+
+	/* The blocks someone is fetching. Nobody else may fetch or write them
+	 * until they're done */
+	struct bitset * fetching;
+};
+
+struct postcopy * postcopy_create( uint64_t size );
+void postcopy_destroy( struct postcopy * pc );
+
+/* Take the turned-round connection fd, which the mirror's hello is about to
+ * arrive on, as the one to fetch blocks over. Returns 1 if all is well, or 0
+ * if the hello was missing or wrong, in which case fd is closed. */
+int postcopy_open_channel( struct postcopy * pc, int fd );
+
+void postcopy_lock( struct postcopy * pc );
+void postcopy_unlock( struct postcopy * pc );
+
+/* The rest must be called with the lock held */
+
+/* Returns the length of the run of blocks we have, or don't, from from,
+ * clipped to len, and sets *missing if we don't. Blocks are never lost once
+ * we have them, so this can be called without the lock to see whether a
+ * range is all here */
+uint64_t postcopy_run( struct postcopy * pc, uint64_t from, uint64_t len, int *missing );
+
+/* Record that we have every whole block in the range */
+void postcopy_mark( struct postcopy * pc, uint64_t from, uint64_t len );
+
+/* As postcopy_run, for the blocks someone is fetching */
+uint64_t postcopy_fetching_run( struct postcopy * pc, uint64_t from, uint64_t len, int *fetching );
+
+/* Mark the blocks in the range as being fetched by us, and when we're done,
+ * as not, and as here if we managed it. Anyone waiting is woken */
+void postcopy_fetch_start( struct postcopy * pc, uint64_t from, uint64_t len );
+void postcopy_fetch_done( struct postcopy * pc, uint64_t from, uint64_t len, int fetched );
+
+/* Wait for someone else's fetch to finish */
+void postcopy_wait_for_fetches( struct postcopy * pc );
+
+/* Fetch len bytes at from into buf from the mirror. The lock is dropped
+ * while we wait for it, so the range should be marked as being fetched
+ * first. Returns 0 on success, or -1 if we couldn't, in which case the
+ * connection is dropped. */
+int postcopy_pull( struct postcopy * pc, uint64_t from, uint32_t len, char * buf );
+
+#endif
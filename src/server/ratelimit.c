@@ -0,0 +1,76 @@
+#include "ratelimit.h"
+#include "mirror.h"
+
+#include <math.h>
+
+/* The most we may send at once at this rate. Unless max_burst says
+ * otherwise, that's MS_BURST_SECS' worth, but never less than the smallest
+ * transfer */
+double ratelimit_burst( uint64_t rate, uint64_t max_burst )
+{
+	double burst = max_burst;
+
+	if ( burst == 0 ) {
+		burst = rate * MS_BURST_SECS;
+	}
+
+	return burst < MS_XFER_MIN_SIZE ? MS_XFER_MIN_SIZE : burst;
+}
+
+/* Start with a full bucket */
+void ratelimit_start( struct ratelimit *rl, double burst, double now )
+{
+	rl->tokens = burst;
+	rl->at = now;
+}
+
+/* Top the bucket up for the time since we last did. A rate of UINT64_MAX is
+ * no limit, so there are always tokens, and 0 is paused.
+ *
+ * Returns how many seconds to wait before writing, or 0 to go ahead.
+ */
+double ratelimit_wait( struct ratelimit *rl, uint64_t rate, double burst, double now )
+{
+	if ( rate == UINT64_MAX ) {
+		rl->tokens = HUGE_VAL;
+		rl->at = now;
+		return 0;
+	}
+
+	if ( rate == 0 ) {
+		/* See if that's changed in a second */
+		rl->at = now;
+		return 1.0;
+	}
+
+	rl->tokens += ( now - rl->at ) * rate;
+	if ( rl->tokens > burst ) {
+		rl->tokens = burst;
+	}
+	rl->at = now;
+
+	if ( rl->tokens >= 1 ) {
+		return 0;
+	}
+
+	/* The timer only needs to be as fine as a millisecond */
+	return ceil( ( 1 - rl->tokens ) * 1000 / rate ) / 1000;
+}
+
+/* How much of a write of len bytes we may make now */
+uint64_t ratelimit_allow( struct ratelimit *rl, uint64_t len )
+{
+	if ( rl->tokens < 1 ) {
+		return 0;
+	}
+	if ( len > rl->tokens ) {
+		return (uint64_t) rl->tokens;
+	}
+	return len;
+}
+
+/* We've written len bytes */
+void ratelimit_spend( struct ratelimit *rl, uint64_t len )
+{
+	rl->tokens -= len;
+}
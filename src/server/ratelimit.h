@@ -0,0 +1,21 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+
+/* The mirror's bandwidth limit is a token bucket. Tokens accrue at the limit,
+ * up to the burst size, and each write to the listener spends as many as it
+ * puts on the wire. tokens can go negative, and we wait until it isn't. at is
+ * when we last topped it up */
+struct ratelimit {
+	double tokens;
+	double at;
+};
+
+double ratelimit_burst( uint64_t rate, uint64_t max_burst );
+void ratelimit_start( struct ratelimit *rl, double burst, double now );
+double ratelimit_wait( struct ratelimit *rl, uint64_t rate, double burst, double now );
+uint64_t ratelimit_allow( struct ratelimit *rl, uint64_t len );
+void ratelimit_spend( struct ratelimit *rl, uint64_t len );
+
+#endif
@@ -20,6 +20,7 @@
 
 #include <sys/socket.h>
 #include <netinet/tcp.h>
+#include <arpa/inet.h>
 
 struct server * server_create (
 	struct flexnbd * flexnbd,
@@ -69,6 +70,9 @@ struct server * server_create (
 
 	out->l_acl = flexthread_mutex_create();
 	out->l_start_mirror = flexthread_mutex_create();
+	out->l_redirect = flexthread_mutex_create();
+	out->l_postcopy = flexthread_mutex_create();
+	out->redirects = xmalloc( max_nbd_clients * sizeof( struct server_redirect ) );
 
 	out->mirror_can_start = 1;
 
@@ -88,6 +92,10 @@ void server_destroy( struct server * serve )
 	self_pipe_destroy( serve->close_signal );
 	serve->close_signal = NULL;
 
+	server_release_redirects( serve, NULL );
+	free( serve->redirects );
+	flexthread_mutex_destroy( serve->l_postcopy );
+	flexthread_mutex_destroy( serve->l_redirect );
 	flexthread_mutex_destroy( serve->l_start_mirror );
 	flexthread_mutex_destroy( serve->l_acl );
 
@@ -96,6 +104,11 @@ void server_destroy( struct server * serve )
 		serve->acl = NULL;
 	}
 
+	if ( serve->postcopy ) {
+		postcopy_destroy( serve->postcopy );
+		serve->postcopy = NULL;
+	}
+
 	free( serve->nbd_client );
 	free( serve );
 }
@@ -733,6 +746,88 @@ void server_allow_new_clients( struct server * serve )
 	return;
 }
 
+/* A client that asked where the image goes, stopped so a mirror can finish,
+ * leaves its connection with us, to be answered when the mirror is done.
+ * We only keep as many as we'd have clients; there can't be more.
+ */
+void server_park_redirect( struct server * serve, int fd, char * handle )
+{
+	NULLCHECK( serve );
+
+	if ( fd < 0 ) {
+		warn( SHOW_ERRNO( "Couldn't keep a connection to redirect" ) );
+		return;
+	}
+
+	SERVER_LOCK( serve, l_redirect, "Problem with redirect lock" );
+	if ( serve->redirect_count < serve->max_nbd_clients ) {
+		serve->redirects[serve->redirect_count].fd = fd;
+		memcpy( serve->redirects[serve->redirect_count].handle, handle, 8 );
+		serve->redirect_count++;
+		fd = -1;
+	}
+	SERVER_UNLOCK( serve, l_redirect, "Problem with redirect unlock" );
+
+	if ( fd >= 0 ) {
+		sock_try_close( fd );
+	}
+}
+
+
+/* Once a mirror has handed the image over, tell the clients that asked
+ * where it's gone. If it didn't, they just lose their connection, and come
+ * back to us. The reply is small enough that we don't wait for a slow client
+ * to take it; if it won't fit, that client only misses out on the redirect.
+ */
+void server_release_redirects( struct server * serve, union mysockaddr * to )
+{
+	struct {
+		struct nbd_reply_raw reply;
+		struct nbd_redirect_raw redirect;
+	} raw;
+	struct nbd_reply reply;
+	int i;
+
+	NULLCHECK( serve );
+
+	memset( &raw, 0, sizeof( raw ) );
+	if ( to ) {
+		if ( to->family == AF_INET6 ) {
+			inet_ntop( AF_INET6, &to->v6.sin6_addr, raw.redirect.address,
+					sizeof( raw.redirect.address ) );
+		} else {
+			inet_ntop( AF_INET, &to->v4.sin_addr, raw.redirect.address,
+					sizeof( raw.redirect.address ) );
+		}
+		/* In the same place for both */
+		raw.redirect.port = to->v4.sin_port;
+	}
+
+	SERVER_LOCK( serve, l_redirect, "Problem with redirect lock" );
+	if ( to && serve->redirect_count > 0 ) {
+		info( "Redirecting %d client(s) to %s port %d", serve->redirect_count,
+				raw.redirect.address, ntohs( raw.redirect.port ) );
+	}
+	for ( i = 0; i < serve->redirect_count; i++ ) {
+		struct server_redirect *r = &serve->redirects[i];
+
+		if ( to ) {
+			reply.magic = REPLY_MAGIC;
+			reply.error = 0;
+			memcpy( reply.handle, r->handle, 8 );
+			nbd_h2r_reply( &reply, &raw.reply );
+
+			if ( send( r->fd, &raw, sizeof( raw ), MSG_DONTWAIT | MSG_NOSIGNAL ) != sizeof( raw ) ) {
+				warn( SHOW_ERRNO( "Couldn't redirect a client" ) );
+			}
+		}
+		sock_try_close( r->fd );
+	}
+	serve->redirect_count = 0;
+	SERVER_UNLOCK( serve, l_redirect, "Problem with redirect unlock" );
+}
+
+
 void server_join_clients( struct server * serve ) {
 	int i;
 	void* status;
@@ -780,10 +875,38 @@ void server_control_arrived( struct server *serve )
 	debug( "server_control_arrived" );
 	NULLCHECK( serve );
 
+	SERVER_LOCK( serve, l_postcopy, "Problem with post-copy lock" );
 	if ( !serve->success ) {
 		serve->success = 1;
 		serve_signal_close( serve );
 	}
+	SERVER_UNLOCK( serve, l_postcopy, "Problem with post-copy unlock" );
+}
+
+
+/* A mirror is handing us control before it has sent us the image. The first
+ * to do so sets up what we need to fetch blocks from it; any after that, like
+ * the same mirror coming back, carry on with what's there.
+ */
+struct postcopy * server_start_postcopy( struct server * serve )
+{
+	struct postcopy * pc;
+
+	NULLCHECK( serve );
+
+	SERVER_LOCK( serve, l_postcopy, "Problem with post-copy lock" );
+	pc = serve->postcopy;
+	if ( pc == NULL && !serve->success ) {
+		pc = postcopy_create( serve->size );
+		/* Client threads mustn't see the pointer before what it points at */
+		__sync_synchronize();
+		serve->postcopy = pc;
+		serve->success = 1;
+		info( "Post-copy migration started, we have control" );
+	}
+	SERVER_UNLOCK( serve, l_postcopy, "Problem with post-copy unlock" );
+
+	return pc;
 }
 
 
@@ -817,6 +940,7 @@ void serve_cleanup(struct server* params,
 	if ( need_mirror_lock ) { server_unlock_start_mirror( params ); }
 
 	server_join_clients( params );
+	server_release_redirects( params, NULL );
 
 	if (params->allocation_map) {
 		bitset_free( params->allocation_map );
@@ -860,6 +984,8 @@ uint64_t server_mirror_bytes_remaining( struct server * serve )
 	if ( server_is_mirroring( serve ) ) {
 		uint64_t bytes_to_xfer =
 			bitset_stream_queued_bytes( serve->allocation_map, BITSET_STREAM_SET ) +
+			bitset_stream_queued_bytes( serve->allocation_map, BITSET_STREAM_UNSET ) +
+			serve->mirror->dirty_bytes +
 			( serve->size - serve->mirror->offset );
 
 		return bytes_to_xfer;
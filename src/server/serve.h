@@ -8,6 +8,7 @@
 #include "flexnbd.h"
 #include "parse.h"
 #include "acl.h"
+#include "postcopy.h"
 
 
 static const int block_allocation_resolution = 4096;//128<<10;
@@ -20,6 +21,14 @@ struct client_tbl_entry {
 };
 
 
+/* A client's connection, kept open after its thread has gone, until we can
+ * tell it where the image has moved to */
+struct server_redirect {
+	int fd;
+	char handle[8];
+};
+
+
 #define MAX_NBD_CLIENTS 16
 struct server {
 	/* The flexnbd wrapper this server is attached to */
@@ -98,6 +107,37 @@ struct server {
 	 * listen process.
 	 */
 	int success;
+
+	/* While a migration is struggling to converge, the mirror sets this to
+	 * the percentage of the time client threads should spend asleep before
+	 * handling writes. 0 means writes aren't throttled.
+	 */
+	volatile sig_atomic_t write_throttle;
+
+	/* The generation ID of the last migration a mirror told us it was
+	 * sending us, or 0. A mirror that reconnects with the same one knows
+	 * we still have everything it sent before, so can carry on from where
+	 * it was.
+	 */
+	uint64_t mirror_generation;
+
+	/* Set up when a mirror hands us control before it has sent us the
+	 * image, as it does for a post-copy migration. Until it says the
+	 * migration is complete, blocks we don't have yet are fetched from the
+	 * mirror before we read them. It's set up, and success set, under
+	 * l_postcopy, and only published once it's ready, so client threads can
+	 * look at it without taking the lock.
+	 */
+	struct flexthread_mutex *   l_postcopy;
+	struct postcopy * volatile  postcopy;
+
+	/* The clients that asked to be told where the image goes, and whose
+	 * threads have been stopped so a mirror can finish. Once it has handed
+	 * the image over, they're told where to, and otherwise just closed.
+	 */
+	struct flexthread_mutex *   l_redirect;
+	struct server_redirect *    redirects;
+	int                         redirect_count;
 };
 
 struct server * server_create(
@@ -149,6 +189,16 @@ int server_count_clients( struct server *params );
 
 void server_unlink( struct server * serve );
 
+/* Keep a stopped client's connection for server_release_redirects() */
+void server_park_redirect( struct server * serve, int fd, char * handle );
+/* Take control for a post-copy migration, setting it up if nobody has yet.
+ * Returns the post-copy state, or NULL if we already had control some other
+ * way */
+struct postcopy * server_start_postcopy( struct server * serve );
+/* Tell parked clients the image is now at to, or just close them if to is
+ * NULL */
+void server_release_redirects( struct server * serve, union mysockaddr * to );
+
 int do_serve( struct server *, struct self_pipe * );
 
 struct mode_readwrite_params {
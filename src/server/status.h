@@ -64,6 +64,15 @@
  *   Our current best estimate of how many seconds are left before the migration
  *   migration is finished.
  *
+ * migration_dirty_rate:
+ *   The rate, in bytes/second, at which clients are writing to parts of the
+ *   file that have already been sent, and so have to be sent again.
+ *
+ * migration_throttle:
+ *   The percentage of the time client threads are being held up before
+ *   writes, so that a migration which is being outpaced by writes can
+ *   converge. 0 if writes aren't being throttled.
+ *
  */
 
 
@@ -84,6 +93,8 @@ struct status {
 	uint64_t migration_speed;
 	uint64_t migration_speed_limit;
 	uint64_t migration_seconds_left;
+	uint64_t migration_dirty_rate;
+	int migration_throttle;
 };
 
 /** Create a status object for the given server. */
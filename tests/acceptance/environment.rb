@@ -4,19 +4,23 @@ require 'flexnbd'
 require 'file_writer'
 
 class Environment
-  attr_reader( :blocksize, :filename1, :filename2, :ip,
-               :port1, :port2, :nbd1, :nbd2, :file1, :file2 )
+  attr_reader( :blocksize, :filename1, :filename2, :filename3, :ip,
+               :port1, :port2, :port3, :nbd1, :nbd2, :nbd3,
+               :file1, :file2, :file3 )
 
   def initialize
     @blocksize = 1024
     @filename1 = "/tmp/.flexnbd.test.#{$$}.#{Time.now.to_i}.1"
     @filename2 = "/tmp/.flexnbd.test.#{$$}.#{Time.now.to_i}.2"
+    @filename3 = "/tmp/.flexnbd.test.#{$$}.#{Time.now.to_i}.3"
     @ip = "127.0.0.1"
     @available_ports = [*40000..41000] - listening_ports
     @port1 = @available_ports.shift
     @port2 = @available_ports.shift
+    @port3 = @available_ports.shift
     @nbd1 = FlexNBD::FlexNBD.new("../../build/flexnbd", @ip, @port1)
     @nbd2 = FlexNBD::FlexNBD.new("../../build/flexnbd", @ip, @port2)
+    @nbd3 = FlexNBD::FlexNBD.new("../../build/flexnbd", @ip, @port3)
 
     @fake_pid = nil
   end
@@ -51,6 +55,10 @@ class Environment
     @nbd2.listen( @filename2, *acl )
   end
 
+  def listen3( *acl )
+    @nbd3.listen( @filename3, *acl )
+  end
+
 
   def break1
     @nbd1.break
@@ -79,6 +87,18 @@ class Environment
     @nbd1.mirror( @nbd2.ip, @nbd2.port )
   end
 
+  def mirror123
+    @nbd1.mirror( "#{@nbd2.ip},#{@nbd3.ip}", "#{@nbd2.port},#{@nbd3.port}" )
+  end
+
+  def mirror12_post_copy
+    @nbd1.mirror_post_copy( @nbd2.ip, @nbd2.port )
+  end
+
+  def mirror12_verify
+    @nbd1.mirror_verify( @nbd2.ip, @nbd2.port )
+  end
+
   def mirror12_unchecked
     @nbd1.mirror_unchecked( @nbd2.ip, @nbd2.port, nil, nil, 10 )
   end
@@ -100,6 +120,10 @@ class Environment
     @file2 = FileWriter.new(@filename2, @blocksize).write(data)
   end
 
+  def writefile3(data)
+    @file3 = FileWriter.new(@filename3, @blocksize).write(data)
+  end
+
 
   def truncate1( size )
     system "truncate -s #{size} #{@filename1}"
@@ -126,8 +150,9 @@ class Environment
     @nbd1.can_die(0)
     @nbd1.kill
     @nbd2.kill
+    @nbd3.kill
 
-    [@filename1, @filename2].each do |f|
+    [@filename1, @filename2, @filename3].each do |f|
       File.unlink(f) if File.exists?(f)
     end
   end
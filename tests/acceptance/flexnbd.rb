@@ -199,6 +199,8 @@ module FlexNBD
     end
 
     attr_accessor :prefetch_proxy
+    attr_accessor :writeback_file
+    attr_accessor :writeback_unordered
 
     def initialize( bin, ip, port )
       @bin  = bin
@@ -251,6 +253,8 @@ module FlexNBD
         "--conn-addr #{connect_ip} "\
         "--conn-port #{connect_port} "\
         "#{prefetch_proxy ? "--cache " : ""}"\
+        "#{writeback_file ? "--writeback #{writeback_file} " : ""}"\
+        "#{writeback_unordered ? "--unordered " : ""}"\
         "#{@debug}"
     end
 
@@ -286,6 +290,16 @@ module FlexNBD
         "--unlink "
     end
 
+    def post_copy_mirror_opts( dest_ip, dest_port )
+      "#{base_mirror_opts( dest_ip, dest_port )} "\
+        "--post-copy "
+    end
+
+    def verify_mirror_opts( dest_ip, dest_port )
+      "#{base_mirror_opts( dest_ip, dest_port )} "\
+        "--verify "
+    end
+
     def base_mirror_cmd( opts )
       "#{@bin} mirror "\
         "#{opts} "\
@@ -300,6 +314,14 @@ module FlexNBD
       base_mirror_cmd( unlink_mirror_opts( dest_ip, dest_port ) )
     end
 
+    def mirror_post_copy_cmd( dest_ip, dest_port )
+      base_mirror_cmd( post_copy_mirror_opts( dest_ip, dest_port ) )
+    end
+
+    def mirror_verify_cmd( dest_ip, dest_port )
+      base_mirror_cmd( verify_mirror_opts( dest_ip, dest_port ) )
+    end
+
     def break_cmd
       "#{@bin} break "\
         "--sock #{ctrl} "\
@@ -460,6 +482,28 @@ module FlexNBD
     end
 
 
+    def mirror_post_copy( dest_ip, dest_port )
+      cmd = mirror_post_copy_cmd( dest_ip, dest_port )
+      debug( cmd )
+
+      stdout, stderr, status = maybe_timeout( cmd )
+      raise IOError.new( "Migrate command failed\n" + stderr) unless status.success?
+
+      stdout
+    end
+
+
+    def mirror_verify( dest_ip, dest_port )
+      cmd = mirror_verify_cmd( dest_ip, dest_port )
+      debug( cmd )
+
+      stdout, stderr, status = maybe_timeout( cmd )
+      raise IOError.new( "Migrate command failed\n" + stderr) unless status.success?
+
+      stdout
+    end
+
+
     def maybe_timeout(cmd, timeout=nil )
       stdout, stderr = "",""
       stat = nil
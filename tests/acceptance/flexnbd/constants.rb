@@ -44,5 +44,10 @@ module FlexNBD
   REQUEST_MAGIC = binary("\x25\x60\x95\x13") unless defined?(REQUEST_MAGIC)
   REPLY_MAGIC = binary("\x67\x44\x66\x98") unless defined?(REPLY_MAGIC)
 
+  # Not in a form read_constants understands
+  REQUEST_REDIRECT = 0x0104 unless defined?(REQUEST_REDIRECT)
+  INIT_FLAG_HAS_FLAGS = 1 << 0 unless defined?(INIT_FLAG_HAS_FLAGS)
+  INIT_FLAG_REDIRECT = 1 << 20 unless defined?(INIT_FLAG_REDIRECT)
+
 end # module FlexNBD
 
@@ -25,11 +25,14 @@ module FlexNBD
 
         if opts[:size] == :wrong
           write_rand( @sock, 8 )
+        elsif opts[:size]
+          @sock.write( [opts[:size] >> 32, opts[:size] & 0xFFFFFFFF].pack("NN") )
         else
           @sock.write( "\x00\x00\x00\x00\x00\x00\x10\x00" )
         end
 
-        @sock.write( "\x00" * 128 )
+        @sock.write( [opts[:flags] || 0].pack("N") )
+        @sock.write( "\x00" * 124 )
       end
 
 
@@ -82,6 +85,12 @@ module FlexNBD
       end
 
 
+      # Follows the reply to a REQUEST_REDIRECT
+      def write_redirect( address, port )
+        @sock.write( [address, port].pack("a46n") )
+      end
+
+
       def close
         @sock.close
       end
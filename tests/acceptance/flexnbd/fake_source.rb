@@ -72,7 +72,7 @@ module FlexNBD
     end
 
     def write_read_request( from, len, handle="myhandle" )
-      send_request( 0, "myhandle", from, len )
+      send_request( 0, handle, from, len )
     end
 
 
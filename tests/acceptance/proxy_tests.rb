@@ -65,14 +65,14 @@ module ProxyTests
     end
   end
 
-  def make_fake_server
+  def make_fake_server( hello_opts = {} )
     server = FlexNBD::FakeDest.new(@env.ip, @env.port1)
     @server_up = true
 
     # We return a thread here because accept() and connect() both block for us
     Thread.new do
       sc = server.accept # just tell the supervisor we're up
-      sc.write_hello
+      sc.write_hello( hello_opts )
 
       [ server, sc ]
     end
@@ -124,6 +124,40 @@ module ProxyTests
 
   end
 
+  def test_read_reply_resumed_when_upstream_dies_partway_through_the_data
+    maker = make_fake_server
+
+    with_proxied_client(4096) do |client|
+      server, sc1 = maker.value
+
+      client.write_read_request( 0, 4096 )
+      req1 = sc1.read_request
+
+      # Die halfway through sending the data
+      sc1.write_reply( req1[:handle] )
+      sc1.write_data( "\x01" * 2048 )
+      sc1.close
+
+      sc2 = server.accept
+      sc2.write_hello
+      req2 = sc2.read_request
+      assert_equal req1, req2
+
+      sc2.write_reply( req2[:handle] )
+      sc2.write_data( ( "\x01" * 2048 ) + ( "\x02" * 2048 ) )
+
+      # The client only sees one, whole, reply
+      rsp = Timeout.timeout(15) { client.read_response }
+      assert_equal ::FlexNBD::REPLY_MAGIC, rsp[:magic]
+      assert_equal 0, rsp[:error]
+      assert_equal req1[:handle], rsp[:handle]
+      assert_equal( ( "\x01" * 2048 ) + ( "\x02" * 2048 ), client.read_raw( 4096 ) )
+
+      sc2.close
+      server.close
+    end
+  end
+
   def test_write_request_retried_when_upstream_dies_partway
     maker = make_fake_server
 
@@ -169,20 +203,355 @@ module ProxyTests
     end
   end
 
-  def test_only_one_client_can_connect_to_proxy_at_a_time
+  def test_requests_are_pipelined_and_replayed_in_order_after_reconnect
+    maker = make_fake_server
+
+    with_proxied_client(4096) do |client|
+      server, sc1 = maker.value
+
+      # Send several requests without waiting for any replies. The reads
+      # aren't sequential, so a caching proxy doesn't read ahead of them
+      client.write_read_request( 0, 1024, "handle-1" )
+      client.write_read_request( 3072, 1024, "handle-2" )
+      client.write( 2048, ( "\x03" * 1024 ) )
+
+      # They should all reach upstream before it has replied to any of them
+      req1 = sc1.read_request
+      req2 = sc1.read_request
+      req3 = sc1.read_request
+      assert_equal "handle-1", req1[:handle]
+      assert_equal "handle-2", req2[:handle]
+      assert_equal ::FlexNBD::REQUEST_WRITE, req3[:type]
+      data3 = sc1.read_data( 1024 )
+
+      # Reply to the second only, and die. The reply should come straight back.
+      # If the proxy is prefetching, it will have asked for more than 1024 bytes
+      sc1.write_reply( req2[:handle] )
+      sc1.write_data( "\x02" * req2[:len] )
+      sc1.close
+
+      rsp = Timeout.timeout(15) { client.read_response }
+      assert_equal 0, rsp[:error]
+      assert_equal "handle-2", rsp[:handle]
+      assert_equal( ( "\x02" * 1024 ), client.read_raw( 1024 ) )
+
+      # Once reconnected, the other two should be resent in their original order
+      sc2 = server.accept
+      sc2.write_hello
+
+      assert_equal req1, sc2.read_request
+      assert_equal req3, sc2.read_request
+      assert_equal data3, sc2.read_data( 1024 )
+
+      # Replies can come back in any order, and go straight to the client
+      sc2.write_reply( req3[:handle] )
+      rsp = Timeout.timeout(15) { client.read_response }
+      assert_equal 0, rsp[:error]
+      assert_equal req3[:handle], rsp[:handle]
+
+      sc2.write_reply( req1[:handle] )
+      sc2.write_data( "\x01" * req1[:len] )
+      rsp = Timeout.timeout(15) { client.read_response }
+      assert_equal 0, rsp[:error]
+      assert_equal "handle-1", rsp[:handle]
+      assert_equal( ( "\x01" * 1024 ), client.read_raw( 1024 ) )
+
+      sc2.close
+      server.close
+    end
+  end
+
+  def test_only_requests_on_the_failed_connection_are_replayed
+    ENV['FLEXNBD_PROXY_CONNECTIONS'] = '2'
+    maker = make_fake_server
+
+    with_proxied_client(4096) do |client|
+      server, sc1 = maker.value
+
+      # The first request goes up the connection we already have
+      client.write_read_request( 0, 1024, "handle-1" )
+      req1 = sc1.read_request
+      assert_equal "handle-1", req1[:handle]
+
+      # Having been asked for something, the proxy opens a second connection,
+      # and the next request goes up that, since it has nothing to do
+      sc2 = server.accept
+      sc2.write_hello
+      sleep 0.5
+
+      client.write_read_request( 3072, 1024, "handle-2" )
+      req2 = sc2.read_request
+      assert_equal "handle-2", req2[:handle]
+
+      # Losing the first connection resends the first request up the second,
+      # but not the second request, which is still waiting for its reply
+      sc1.close
+      assert_equal req1, sc2.read_request
+
+      sc2.write_reply( req2[:handle] )
+      sc2.write_data( "\x02" * 1024 )
+      rsp = Timeout.timeout(15) { client.read_response }
+      assert_equal "handle-2", rsp[:handle]
+      assert_equal( ( "\x02" * 1024 ), client.read_raw( 1024 ) )
+
+      sc2.write_reply( req1[:handle] )
+      sc2.write_data( "\x01" * 1024 )
+      rsp = Timeout.timeout(15) { client.read_response }
+      assert_equal "handle-1", rsp[:handle]
+      assert_equal( ( "\x01" * 1024 ), client.read_raw( 1024 ) )
+
+      sc2.close
+      server.close
+    end
+  ensure
+    ENV.delete( 'FLEXNBD_PROXY_CONNECTIONS' )
+  end
+
+  def test_proxy_goes_where_upstream_redirects_it
+    maker = make_fake_server(
+      :flags => ::FlexNBD::INIT_FLAG_HAS_FLAGS | ::FlexNBD::INIT_FLAG_REDIRECT
+    )
+
+    with_proxied_client(4096) do |client|
+      server, sc1 = maker.value
+
+      # Before anything else, the proxy asks where the image goes
+      redirect = sc1.read_request
+      assert_equal ::FlexNBD::REQUEST_REDIRECT, redirect[:type]
+      assert_equal 0, redirect[:from]
+      assert_equal 0, redirect[:len]
+
+      client.write_read_request( 0, 4096 )
+      req1 = sc1.read_request
+      assert_equal ::FlexNBD::REQUEST_READ, req1[:type]
+
+      # The image moves elsewhere before we've replied
+      server2 = FlexNBD::FakeDest.new( @env.ip, @env.port3 )
+      sc1.write_reply( redirect[:handle] )
+      sc1.write_redirect( @env.ip, @env.port3 )
+      sc1.close
+      server.close
+
+      # So the read is sent there instead
+      sc2 = server2.accept
+      sc2.write_hello
+      assert_equal req1, sc2.read_request
+
+      sc2.write_reply( req1[:handle] )
+      sc2.write_data( "\xFF" * 4096 )
+
+      rsp = Timeout.timeout(15) { client.read_response }
+      assert_equal 0, rsp[:error]
+      assert_equal req1[:handle], rsp[:handle]
+      assert_equal( ( "\xFF" * 4096 ), client.read_raw( 4096 ) )
+
+      sc2.close
+      server2.close
+    end
+  end
+
+  def test_proxy_connects_to_the_next_address_if_the_first_is_down
+    @env.serve1
+    @server_up = true
+    @env.nbd2.proxy( "#{@env.ip},#{@env.ip}", "#{@env.port3},#{@env.port1}" )
+    @proxy_up = true
+
     with_proxied_client do |client|
+      client.write_read_request( 0, 4096, "myhandle" )
+      rsp = client.read_response
+      assert_equal 0, rsp[:error]
+      assert_equal @env.file1.read( 0, 4096 ), client.read_raw( 4096 )
+    end
+  end
+
+  def test_contiguous_requests_go_upstream_as_one
+    maker = make_fake_server
+
+    with_proxied_client(4096) do |client|
+      server, sc1 = maker.value
+      sc1.close
+
+      # These queue up while upstream is away
+      client.write_write_request( 0, 1024, "handle-1" )
+      client.write_data( "\x01" * 1024 )
+      client.write_write_request( 1024, 1024, "handle-2" )
+      client.write_data( "\x02" * 1024 )
+
+      # Once it's back, it gets one write for both
+      sc2 = server.accept
+      sc2.write_hello
+
+      req = sc2.read_request
+      assert_equal ::FlexNBD::REQUEST_WRITE, req[:type]
+      assert_equal 0, req[:from]
+      assert_equal 2048, req[:len]
+      assert_equal( ( "\x01" * 1024 ) + ( "\x02" * 1024 ), sc2.read_data( 2048 ) )
+      sc2.write_reply( req[:handle] )
+
+      # And the client gets a reply to each
+      rsp = Timeout.timeout(15) { client.read_response }
+      assert_equal 0, rsp[:error]
+      assert_equal "handle-1", rsp[:handle]
+
+      rsp = Timeout.timeout(15) { client.read_response }
+      assert_equal 0, rsp[:error]
+      assert_equal "handle-2", rsp[:handle]
+
+      sc2.close
+      server.close
+    end
+  end
+
+  def test_requests_are_not_coalesced_past_one_they_would_overtake
+    maker = make_fake_server
+
+    with_proxied_client(4096) do |client|
+      server, sc1 = maker.value
+      sc1.close
+
+      # The second write is contiguous with the first, but the read between
+      # them has to see what was there before it
+      client.write_write_request( 0, 1024, "handle-1" )
+      client.write_data( "\x01" * 1024 )
+      client.write_read_request( 1024, 1024, "handle-2" )
+      client.write_write_request( 1024, 1024, "handle-3" )
+      client.write_data( "\x03" * 1024 )
+
+      sc2 = server.accept
+      sc2.write_hello
+
+      req1 = sc2.read_request
+      assert_equal "handle-1", req1[:handle]
+      assert_equal 1024, req1[:len]
+      assert_equal( ( "\x01" * 1024 ), sc2.read_data( 1024 ) )
+
+      req2 = sc2.read_request
+      assert_equal "handle-2", req2[:handle]
+
+      req3 = sc2.read_request
+      assert_equal "handle-3", req3[:handle]
+      assert_equal 1024, req3[:len]
+      assert_equal( ( "\x03" * 1024 ), sc2.read_data( 1024 ) )
+
+      sc2.close
+      server.close
+    end
+  end
+
+  def test_writes_are_kept_in_the_writeback_file_while_upstream_is_away
+    @env.nbd2.writeback_file = @env.filename3
+    maker = make_fake_server
+
+    with_proxied_client(4096) do |client|
+      server, sc1 = maker.value
+      sc1.close
+
+      # Upstream's gone, but the write is answered, and can be read back
+      client.write( 0, ( "\xFF" * 4096 ) )
+      rsp = Timeout.timeout(15) { client.read_response }
+      assert_equal 0, rsp[:error]
 
-      c2 = nil
-      assert_raises(Timeout::Error) do
-        timeout(1) do
-          c2 = FlexNBD::FakeSource.new(@env.ip, @env.port2, "Couldn't connect to proxy (2)")
-          c2.read_hello
-        end
+      client.write_read_request( 0, 4096, "readback" )
+      rsp = Timeout.timeout(15) { client.read_response }
+      assert_equal 0, rsp[:error]
+      assert_equal( ( "\xFF" * 4096 ), client.read_raw( 4096 ) )
+
+      # Once it's back, it gets the write, then a flush
+      sc2 = server.accept
+      sc2.write_hello
+
+      req = sc2.read_request
+      assert_equal ::FlexNBD::REQUEST_WRITE, req[:type]
+      assert_equal 0, req[:from]
+      assert_equal 4096, req[:len]
+      assert_equal( ( "\xFF" * 4096 ), sc2.read_data( 4096 ) )
+      sc2.write_reply( req[:handle] )
+
+      req = sc2.read_request
+      assert_equal ::FlexNBD::REQUEST_FLUSH, req[:type]
+      sc2.write_reply( req[:handle] )
+
+      sc2.close
+      server.close
+    end
+  end
+
+  # Write to 8192, then 0, while upstream is away, and see what order they
+  # come back in when it returns
+  def write_back_two_blocks
+    @env.nbd2.writeback_file = @env.filename3
+    maker = make_fake_server( :size => 12288 )
+
+    with_proxied_client(12288) do |client|
+      server, sc1 = maker.value
+      sc1.close
+
+      [8192, 0].each do |from|
+        client.write( from, ( "\xFF" * 4096 ) )
+        rsp = Timeout.timeout(15) { client.read_response }
+        assert_equal 0, rsp[:error]
       end
-      c2.close rescue nil if c2
+
+      sc2 = server.accept
+      sc2.write_hello( :size => 12288 )
+
+      requests = []
+      loop do
+        req = sc2.read_request
+        requests << [req[:type], req[:from]]
+        sc2.read_data( req[:len] ) if req[:type] == ::FlexNBD::REQUEST_WRITE
+        sc2.write_reply( req[:handle] )
+        break if requests.count { |type, _| type == ::FlexNBD::REQUEST_WRITE } == 2 &&
+          req[:type] == ::FlexNBD::REQUEST_FLUSH
+      end
+
+      sc2.close
+      server.close
+      requests
     end
+  end
+
+  def test_writes_are_written_back_in_the_order_they_were_made
+    assert_equal [
+      [::FlexNBD::REQUEST_WRITE, 8192],
+      [::FlexNBD::REQUEST_FLUSH, 0],
+      [::FlexNBD::REQUEST_WRITE, 0],
+      [::FlexNBD::REQUEST_FLUSH, 0]
+    ], write_back_two_blocks
+  end
 
+  def test_unordered_writes_are_written_back_in_image_order
+    @env.nbd2.writeback_unordered = true
+    assert_equal [
+      [::FlexNBD::REQUEST_WRITE, 0],
+      [::FlexNBD::REQUEST_WRITE, 8192],
+      [::FlexNBD::REQUEST_FLUSH, 0]
+    ], write_back_two_blocks
+  end
 
+  def test_many_clients_can_use_the_proxy_at_once
+    with_proxied_client do |client|
+      c2 = FlexNBD::FakeSource.new(@env.ip, @env.port2, "Couldn't connect to proxy (2)")
+      begin
+        assert_equal "NBDMAGIC", c2.read_hello[:magic]
+
+        # Both sessions have a request outstanding at the same time
+        client.write_read_request(0, 4096, "client-1")
+        c2.write(4096, "\x01" * 4096)
+        assert_equal 0, c2.read_response[:error]
+
+        rsp = client.read_response
+        assert_equal "client-1", rsp[:handle]
+        assert_equal @env.file1.read(0, 4096), client.read_raw(4096)
+
+        # What one client writes, the other reads
+        client.write_read_request(4096, 4096, "client-1")
+        assert_equal 0, client.read_response[:error]
+        assert_equal "\x01" * 4096, client.read_raw(4096)
+      ensure
+        c2.close rescue nil
+      end
+    end
   end
 
 end
@@ -3,6 +3,7 @@
 require 'test/unit'
 require 'environment'
 require 'flexnbd/constants'
+require 'flexnbd/fake_source'
 
 class TestHappyPath < Test::Unit::TestCase
   def setup
@@ -95,6 +96,91 @@ class TestHappyPath < Test::Unit::TestCase
   end
 
 
+  def test_mirror_to_two_listeners
+    @env.nbd1.can_die
+    @env.nbd2.can_die(0)
+    @env.nbd3.can_die(0)
+    setup_to_mirror()
+    @env.writefile3( "0"*4 )
+    @env.listen3
+
+    stdout, stderr = @env.mirror123
+
+    @env.nbd1.join
+    @env.nbd2.join
+    @env.nbd3.join
+
+    assert_equal(@env.file1.read_original( 0, @env.blocksize ),
+                 @env.file2.read( 0, @env.blocksize ) )
+    assert_equal(@env.file1.read_original( 0, @env.blocksize ),
+                 @env.file3.read( 0, @env.blocksize ) )
+  end
+
+
+  def test_client_is_told_where_the_image_went
+    @env.nbd1.can_die
+    @env.nbd2.can_die(0)
+    setup_to_mirror()
+
+    client = FlexNBD::FakeSource.new( @env.ip, @env.port1, "Couldn't connect to the source" )
+    client.read_hello
+    client.send_request( ::FlexNBD::REQUEST_REDIRECT, "redirect" )
+
+    # Requests are served in order, so the redirect request has been seen
+    # once this is answered
+    client.write_read_request( 0, 4 )
+    assert_equal 0, client.read_response[:error]
+    client.read_raw( 4 )
+
+    stdout, stderr = @env.mirror12
+
+    rsp = Timeout.timeout(10) { client.read_response }
+    assert_equal 0, rsp[:error]
+    assert_equal "redirect", rsp[:handle]
+
+    address, port = client.read_raw( 48 ).unpack( "Z46n" )
+    assert_equal @env.ip, address
+    assert_equal @env.port2, port
+
+    @env.nbd1.join
+    @env.nbd2.join
+  ensure
+    client.close rescue nil
+  end
+
+
+  def test_post_copy_mirror
+    @env.nbd1.can_die
+    setup_to_mirror()
+
+    stdout, stderr = @env.mirror12_post_copy
+
+    # The listener has control at once, and fetches what it doesn't have
+    assert_equal(@env.file1.read_original( 0, @env.blocksize ),
+                 bin( @env.nbd2.read( 0, @env.blocksize ) ) )
+
+    @env.nbd1.join
+
+    assert_equal(@env.file1.read_original( 0, @env.blocksize ),
+                 @env.file2.read( 0, @env.blocksize ) )
+  end
+
+
+  def test_verified_mirror
+    @env.nbd1.can_die
+    @env.nbd2.can_die(0)
+    setup_to_mirror()
+
+    stdout, stderr = @env.mirror12_verify
+
+    @env.nbd1.join
+    @env.nbd2.join
+
+    assert_equal(@env.file1.read_original( 0, @env.blocksize ),
+                 @env.file2.read( 0, @env.blocksize ) )
+  end
+
+
   def test_mirror_unlink
     @env.nbd1.can_die(0)
     @env.nbd2.can_die(0)
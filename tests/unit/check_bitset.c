@@ -111,6 +111,35 @@ START_TEST(test_bit_runs)
 }
 END_TEST
 
+START_TEST(test_bit_runs_stop_at_end_of_run)
+{
+	bitfield_word_t buffer[BIT_WORDS_FOR_SIZE(16)];
+
+	memset(buffer, 0, 16);
+	bit_set_range(buffer, 64, 3);
+	bit_set_range(buffer, 68, 2);
+
+	ck_assert_int_eq( 3, bit_run_count(buffer, 64, 10, NULL) );
+	ck_assert_int_eq( 1, bit_run_count(buffer, 67, 10, NULL) );
+}
+END_TEST
+
+START_TEST(test_bit_count_set)
+{
+	bitfield_word_t buffer[BIT_WORDS_FOR_SIZE(32)];
+
+	memset(buffer, 0, 32);
+	ck_assert_int_eq( 0, bit_count_set(buffer, 0, 256) );
+
+	bit_set_range(buffer, 60, 80);
+	ck_assert_int_eq( 80, bit_count_set(buffer, 0, 256) );
+	ck_assert_int_eq( 4, bit_count_set(buffer, 0, 64) );
+	ck_assert_int_eq( 10, bit_count_set(buffer, 130, 100) );
+	ck_assert_int_eq( 1, bit_count_set(buffer, 139, 1) );
+	ck_assert_int_eq( 0, bit_count_set(buffer, 140, 116) );
+}
+END_TEST
+
 START_TEST(test_bitset)
 {
 	struct bitset * map;
@@ -238,6 +267,22 @@ START_TEST( test_bitset_clear_range )
 }
 END_TEST
 
+START_TEST( test_bitset_count_set )
+{
+	struct bitset* map = bitset_alloc( 6400, 100 );
+
+	ck_assert_int_eq( 0, bitset_count_set( map, 0, 6400 ) );
+
+	bitset_set_range( map, 250, 100 );
+	ck_assert_int_eq( 200, bitset_count_set( map, 0, 6400 ) );
+	ck_assert_int_eq( 100, bitset_count_set( map, 299, 1 ) );
+	ck_assert_int_eq( 0, bitset_count_set( map, 400, 6400 ) );
+	ck_assert_int_eq( 0, bitset_count_set( map, 6400, 100 ) );
+
+	bitset_free( map );
+}
+END_TEST
+
 START_TEST( test_bitset_run_count )
 {
 	struct bitset* map = bitset_alloc( 64, 1 );
@@ -451,6 +496,29 @@ START_TEST(test_bitset_stream_queued_bytes)
 }
 END_TEST
 
+START_TEST(test_bitset_track)
+{
+	struct bitset *map = bitset_alloc( 64, 1 );
+	struct bitset *track = bitset_alloc( 64, 1 );
+
+	bitset_set_range( map, 0, 8 );
+	assert_bitset_is( track, 0x0000000000000000 );
+
+	bitset_track( map, track );
+	bitset_set_range( map, 8, 8 );
+	bitset_clear_range( map, 32, 8 );
+	assert_bitset_is( map, 0x000000000000ffff );
+	assert_bitset_is( track, 0x000000ff0000ff00 );
+
+	bitset_untrack( map );
+	bitset_set_range( map, 48, 8 );
+	assert_bitset_is( track, 0x000000ff0000ff00 );
+
+	bitset_free( track );
+	bitset_free( map );
+}
+END_TEST
+
 Suite* bitset_suite(void)
 {
 	Suite *s = suite_create("bitset");
@@ -461,6 +529,8 @@ Suite* bitset_suite(void)
 	tcase_add_test(tc_bit, test_bit_tests);
 	tcase_add_test(tc_bit, test_bit_ranges);
 	tcase_add_test(tc_bit, test_bit_runs);
+	tcase_add_test(tc_bit, test_bit_runs_stop_at_end_of_run);
+	tcase_add_test(tc_bit, test_bit_count_set);
 	suite_add_tcase(s, tc_bit);
 
 	TCase *tc_bitset = tcase_create("bitset");
@@ -468,10 +538,12 @@ Suite* bitset_suite(void)
 	tcase_add_test(tc_bitset, test_bitset_set);
 	tcase_add_test(tc_bitset, test_bitset_clear);
 	tcase_add_test(tc_bitset, test_bitset_run_count);
+	tcase_add_test(tc_bitset, test_bitset_count_set);
 	tcase_add_test(tc_bitset, test_bitset_set_range);
 	tcase_add_test(tc_bitset, test_bitset_clear_range);
 	tcase_add_test(tc_bitset, test_bitset_set_range_doesnt_push_to_stream);
 	tcase_add_test(tc_bitset, test_bitset_clear_range_doesnt_push_to_stream);
+	tcase_add_test(tc_bitset, test_bitset_track);
 	suite_add_tcase(s, tc_bitset);
 
 
@@ -0,0 +1,209 @@
+#include <check.h>
+
+#include "cache.h"
+
+#include <string.h>
+
+#define BS CACHE_BLOCK_SIZE
+
+static char data[BS * 4];
+static char out[BS * 4];
+
+static void fill( char *buf, size_t len, char c )
+{
+	memset( buf, c, len );
+}
+
+START_TEST( test_read_misses_when_empty )
+{
+	struct cache *cache = cache_create( BS * 4 );
+
+	fail_if( cache_read( cache, 0, BS, out ), "Read from an empty cache" );
+	fail_if( cache_contains( cache, 0, 1 ), "Empty cache contains a byte" );
+
+	cache_destroy( cache );
+}
+END_TEST
+
+START_TEST( test_size_is_rounded_up_to_whole_blocks )
+{
+	struct cache *cache = cache_create( BS + 1 );
+
+	ck_assert_int_eq( BS * 2, cache_size( cache ) );
+	ck_assert_int_eq( 0, cache_size( NULL ) );
+
+	cache_destroy( cache );
+}
+END_TEST
+
+START_TEST( test_inserted_blocks_can_be_read )
+{
+	struct cache *cache = cache_create( BS * 4 );
+
+	fill( data, BS * 2, 'a' );
+	data[BS + 1] = 'b';
+	cache_insert( cache, cache_epoch( cache ), BS, BS * 2, data );
+
+	fail_unless( cache_read( cache, BS, BS * 2, out ), "Inserted blocks missing" );
+	fail_unless( 0 == memcmp( data, out, BS * 2 ), "Wrong data returned" );
+
+	/* Reads needn't be aligned, so long as they're covered */
+	fail_unless( cache_read( cache, BS * 2 + 1, 1, out ), "Unaligned read missed" );
+	ck_assert_int_eq( 'b', out[0] );
+
+	fail_if( cache_read( cache, BS * 2, BS * 2, out ), "Read past the cached blocks" );
+
+	cache_destroy( cache );
+}
+END_TEST
+
+START_TEST( test_only_whole_blocks_are_inserted )
+{
+	struct cache *cache = cache_create( BS * 4 );
+
+	fill( data, BS * 2, 'a' );
+	cache_insert( cache, cache_epoch( cache ), 1, BS * 2, data );
+
+	fail_if( cache_contains( cache, 0, BS ), "Partial first block inserted" );
+	fail_unless( cache_contains( cache, BS, BS ), "Whole block not inserted" );
+	fail_if( cache_contains( cache, BS * 2, BS ), "Partial last block inserted" );
+
+	cache_destroy( cache );
+}
+END_TEST
+
+START_TEST( test_writes_update_cached_blocks )
+{
+	struct cache *cache = cache_create( BS * 4 );
+
+	fill( data, BS, 'a' );
+	cache_insert( cache, cache_epoch( cache ), 0, BS, data );
+
+	fill( data, BS * 2, 'w' );
+	cache_write( cache, BS - 10, 20, data );
+
+	fail_unless( cache_read( cache, 0, BS, out ), "Written block dropped" );
+	ck_assert_int_eq( 'a', out[BS - 11] );
+	ck_assert_int_eq( 'w', out[BS - 10] );
+	ck_assert_int_eq( 'w', out[BS - 1] );
+
+	fail_if( cache_contains( cache, BS, 1 ), "Write added a block" );
+
+	cache_destroy( cache );
+}
+END_TEST
+
+START_TEST( test_reads_overtaken_by_writes_are_not_cached )
+{
+	struct cache *cache = cache_create( BS * 4 );
+	uint64_t epoch = cache_epoch( cache );
+
+	/* A write arrives while the read of blocks 0 and 1 is in flight */
+	fill( data, BS * 2, 'w' );
+	cache_write( cache, BS, 1, data );
+
+	fill( data, BS * 2, 'r' );
+	cache_insert( cache, epoch, 0, BS * 2, data );
+
+	fail_unless( cache_contains( cache, 0, BS ), "Untouched block not cached" );
+	fail_if( cache_contains( cache, BS, BS ), "Stale block cached" );
+
+	cache_destroy( cache );
+}
+END_TEST
+
+START_TEST( test_invalidate_drops_only_overlapping_blocks )
+{
+	struct cache *cache = cache_create( BS * 4 );
+
+	fill( data, BS * 3, 'a' );
+	cache_insert( cache, cache_epoch( cache ), 0, BS * 3, data );
+	cache_invalidate( cache, BS + 1, 1 );
+
+	fail_unless( cache_contains( cache, 0, BS ), "Block 0 dropped" );
+	fail_if( cache_contains( cache, BS, BS ), "Block 1 kept" );
+	fail_unless( cache_contains( cache, BS * 2, BS ), "Block 2 dropped" );
+
+	cache_destroy( cache );
+}
+END_TEST
+
+START_TEST( test_clear_drops_everything )
+{
+	struct cache *cache = cache_create( BS * 4 );
+	uint64_t epoch;
+
+	fill( data, BS * 2, 'a' );
+	cache_insert( cache, cache_epoch( cache ), 0, BS * 2, data );
+	epoch = cache_epoch( cache );
+	cache_clear( cache );
+
+	fail_if( cache_contains( cache, 0, 1 ), "Block 0 kept" );
+	fail_if( cache_contains( cache, BS, 1 ), "Block 1 kept" );
+
+	/* A read sent before the clear can't fill the cache */
+	cache_insert( cache, epoch, 0, BS, data );
+	fail_if( cache_contains( cache, 0, 1 ), "Stale block cached" );
+
+	cache_destroy( cache );
+}
+END_TEST
+
+START_TEST( test_blocks_read_twice_survive_a_scan )
+{
+	struct cache *cache = cache_create( BS * 8 );
+	uint64_t block;
+
+	fill( data, BS, 'a' );
+
+	for ( block = 0; block < 9; block++ ) {
+		cache_insert( cache, cache_epoch( cache ), block * BS, BS, data );
+	}
+	fail_if( cache_contains( cache, 0, BS ), "Oldest block not evicted" );
+
+	/* Read again while we still remember it */
+	cache_insert( cache, cache_epoch( cache ), 0, BS, data );
+
+	for ( block = 100; block < 132; block++ ) {
+		cache_insert( cache, cache_epoch( cache ), block * BS, BS, data );
+	}
+
+	fail_unless( cache_contains( cache, 0, BS ), "Popular block evicted by a scan" );
+	fail_if( cache_contains( cache, BS, BS ), "Unpopular block kept" );
+	fail_unless( cache_contains( cache, 131 * BS, BS ), "Newest block not kept" );
+
+	cache_destroy( cache );
+}
+END_TEST
+
+
+Suite* cache_suite(void)
+{
+	Suite *s = suite_create("cache");
+	TCase *tc_cache = tcase_create("cache");
+
+	tcase_add_test(tc_cache, test_read_misses_when_empty);
+	tcase_add_test(tc_cache, test_size_is_rounded_up_to_whole_blocks);
+	tcase_add_test(tc_cache, test_inserted_blocks_can_be_read);
+	tcase_add_test(tc_cache, test_only_whole_blocks_are_inserted);
+	tcase_add_test(tc_cache, test_writes_update_cached_blocks);
+	tcase_add_test(tc_cache, test_reads_overtaken_by_writes_are_not_cached);
+	tcase_add_test(tc_cache, test_invalidate_drops_only_overlapping_blocks);
+	tcase_add_test(tc_cache, test_clear_drops_everything);
+	tcase_add_test(tc_cache, test_blocks_read_twice_survive_a_scan);
+	suite_add_tcase(s, tc_cache);
+
+	return s;
+}
+
+int main(void)
+{
+	int number_failed;
+	Suite *s = cache_suite();
+	SRunner *sr = srunner_create(s);
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? 0 : 1;
+}
+
@@ -3,11 +3,19 @@
 
 #include "self_pipe.h"
 #include "nbdtypes.h"
+#include "hash.h"
 
 #include "serve.h"
 #include "client.h"
+#include "util.h"
 
 #include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <lz4.h>
 
 struct server fake_server = {0};
 #define FAKE_SERVER &fake_server
@@ -85,6 +93,311 @@ START_TEST( test_read_request_quits_on_stop_signal )
 END_TEST
 
 
+/* Make a client of fake_server whose file is size bytes of 0xff, all
+ * allocated, with fds[1] as the other end of its socket */
+static struct client * mapped_client( char * filename, uint64_t size, int fds[2] )
+{
+	char *buf = malloc( size );
+	int fd = mkstemp( filename );
+
+	memset( buf, 0xff, size );
+	fail_unless( size == (uint64_t) write( fd, buf, size ), "Couldn't fill file" );
+	free( buf );
+	socketpair( AF_UNIX, SOCK_STREAM, 0, fds );
+
+	fake_server.size = size;
+	fake_server.allocation_map = bitset_alloc( size, block_allocation_resolution );
+	bitset_set_range( fake_server.allocation_map, 0, size );
+	fake_server.allocation_map_built = 1;
+
+	struct client *c = client_create( FAKE_SERVER, fds[0] );
+	c->fileno = fd;
+	c->mapped = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+
+	return c;
+}
+
+static void mapped_client_destroy( struct client * c, char * filename, int fds[2] )
+{
+	munmap( c->mapped, fake_server.size );
+	bitset_free( fake_server.allocation_map );
+	memset( &fake_server, 0, sizeof( fake_server ) );
+	close( c->fileno );
+	close( fds[0] );
+	close( fds[1] );
+	unlink( filename );
+}
+
+static void read_reply( int fd, struct nbd_reply * reply )
+{
+	struct nbd_reply_raw reply_raw;
+
+	fail_unless( sizeof( reply_raw ) == read( fd, &reply_raw, sizeof( reply_raw ) ),
+			"No reply was sent" );
+	nbd_r2h_reply( &reply_raw, reply );
+}
+
+
+START_TEST( test_write_zeroes_zeroes_only_its_range )
+{
+	char filename[] = "/tmp/check_client_XXXXXX";
+	uint64_t size = 4 * block_allocation_resolution;
+	uint64_t from = 100, len = 2 * block_allocation_resolution;
+	struct nbd_request request = {0};
+	struct nbd_reply reply;
+	int fds[2];
+	uint64_t i;
+
+	struct client *c = mapped_client( filename, size, fds );
+
+	request.magic = REQUEST_MAGIC;
+	request.type = REQUEST_WRITE_ZEROES;
+	request.from = from;
+	request.len = len;
+
+	void client_reply_to_write_zeroes( struct client *, struct nbd_request );
+	client_reply_to_write_zeroes( c, request );
+
+	read_reply( fds[1], &reply );
+	fail_unless( 0 == reply.error, "An error was returned" );
+
+	for ( i = 0; i < size; i++ ) {
+		if ( i >= from && i < from + len ) {
+			fail_unless( 0 == c->mapped[i], "Byte %d wasn't zeroed", i );
+		} else {
+			fail_unless( (char) 0xff == c->mapped[i], "Byte %d was zeroed", i );
+		}
+	}
+
+	mapped_client_destroy( c, filename, fds );
+}
+END_TEST
+
+
+START_TEST( test_hash_replies_with_block_hashes )
+{
+	char filename[] = "/tmp/check_client_XXXXXX";
+	uint64_t size = 2 * NBD_HASH_BLOCK_SIZE + 100;
+	struct nbd_request request = {0};
+	struct nbd_reply reply;
+	uint64_t hashes[3];
+	int fds[2];
+
+	struct client *c = mapped_client( filename, size, fds );
+
+	request.magic = REQUEST_MAGIC;
+	request.type = REQUEST_HASH;
+	request.from = 50;
+	request.len = size - 50;
+
+	void client_reply_to_hash( struct client *, struct nbd_request );
+	client_reply_to_hash( c, request );
+
+	read_reply( fds[1], &reply );
+	fail_unless( 0 == reply.error, "An error was returned" );
+	fail_unless( sizeof( hashes ) == read( fds[1], hashes, sizeof( hashes ) ),
+			"Hashes weren't sent" );
+
+	fail_unless( be64toh( hashes[0] ) == hash64( c->mapped + 50, NBD_HASH_BLOCK_SIZE, 0 ),
+			"First hash was wrong" );
+	fail_unless( be64toh( hashes[1] ) == hash64( c->mapped + 50 + NBD_HASH_BLOCK_SIZE, NBD_HASH_BLOCK_SIZE, 0 ),
+			"Second hash was wrong" );
+	fail_unless( be64toh( hashes[2] ) == hash64( c->mapped + 50 + 2 * NBD_HASH_BLOCK_SIZE, 50, 0 ),
+			"Hash of the short last block was wrong" );
+
+	mapped_client_destroy( c, filename, fds );
+}
+END_TEST
+
+
+START_TEST( test_write_lz4_writes_decompressed_data )
+{
+	char filename[] = "/tmp/check_client_XXXXXX";
+	uint64_t size = 4 * block_allocation_resolution;
+	uint64_t from = 100, len = 2 * block_allocation_resolution;
+	struct nbd_request request = {0};
+	struct nbd_reply reply;
+	char data[2 * 4096];
+	char compressed[LZ4_COMPRESSBOUND( sizeof( data ) )];
+	uint32_t clen_raw;
+	int clen, fds[2];
+	uint64_t i;
+
+	fail_unless( sizeof( data ) == len, "Test data is the wrong size" );
+	for ( i = 0; i < len; i++ ) {
+		data[i] = ( i / 64 ) % 7;
+	}
+	clen = LZ4_compress_default( data, compressed, len, sizeof( compressed ) );
+	fail_unless( clen > 0 && clen < (int) len, "Test data didn't compress" );
+
+	struct client *c = mapped_client( filename, size, fds );
+
+	request.magic = REQUEST_MAGIC;
+	request.type = REQUEST_WRITE_LZ4;
+	request.from = from;
+	request.len = len;
+
+	clen_raw = htobe32( clen );
+	fail_unless( sizeof( clen_raw ) == write( fds[1], &clen_raw, sizeof( clen_raw ) ),
+			"Couldn't send compressed length" );
+	fail_unless( clen == write( fds[1], compressed, clen ), "Couldn't send compressed data" );
+
+	void client_reply_to_write_lz4( struct client *, struct nbd_request );
+	client_reply_to_write_lz4( c, request );
+
+	read_reply( fds[1], &reply );
+	fail_unless( 0 == reply.error, "An error was returned" );
+
+	for ( i = 0; i < size; i++ ) {
+		if ( i >= from && i < from + len ) {
+			fail_unless( data[i - from] == c->mapped[i], "Byte %d wasn't written", i );
+		} else {
+			fail_unless( (char) 0xff == c->mapped[i], "Byte %d was written", i );
+		}
+	}
+
+	mapped_client_destroy( c, filename, fds );
+}
+END_TEST
+
+
+START_TEST( test_sink_write_leaves_unallocated_zero_blocks_alone )
+{
+	char filename[] = "/tmp/check_client_XXXXXX";
+	uint64_t size = 4 * block_allocation_resolution;
+	uint64_t from = 100, len = 3 * block_allocation_resolution;
+	struct nbd_request request = {0};
+	struct nbd_reply reply;
+	char data[3 * 4096];
+	int fds[2];
+	uint64_t i;
+
+	fail_unless( sizeof( data ) == len, "Test data is the wrong size" );
+	for ( i = 0; i < len; i++ ) {
+		data[i] = ( i / 64 ) % 7 + 1;
+	}
+	/* All of the second block of the file */
+	memset( data + block_allocation_resolution - from, 0, block_allocation_resolution );
+
+	struct client *c = mapped_client( filename, size, fds );
+	c->sink_fd = open( filename, O_RDWR );
+	bitset_clear_range( fake_server.allocation_map, block_allocation_resolution, block_allocation_resolution );
+
+	request.magic = REQUEST_MAGIC;
+	request.type = REQUEST_WRITE;
+	request.from = from;
+	request.len = len;
+
+	fail_unless( (ssize_t) len == write( fds[1], data, len ), "Couldn't send data" );
+
+	void client_reply_to_write( struct client *, struct nbd_request );
+	client_reply_to_write( c, request );
+
+	read_reply( fds[1], &reply );
+	fail_unless( 0 == reply.error, "An error was returned" );
+
+	for ( i = 0; i < size; i++ ) {
+		if ( i >= block_allocation_resolution && i < 2 * block_allocation_resolution ) {
+			fail_unless( (char) 0xff == c->mapped[i], "Byte %d of the zero block was written", i );
+		} else if ( i >= from && i < from + len ) {
+			fail_unless( data[i - from] == c->mapped[i], "Byte %d wasn't written", i );
+		} else {
+			fail_unless( (char) 0xff == c->mapped[i], "Byte %d was written", i );
+		}
+	}
+	fail_if( bitset_is_set_at( fake_server.allocation_map, block_allocation_resolution ),
+			"Zero block was marked allocated" );
+
+	close( c->sink_fd );
+	mapped_client_destroy( c, filename, fds );
+}
+END_TEST
+
+
+START_TEST( test_flush_replies )
+{
+	char filename[] = "/tmp/check_client_XXXXXX";
+	struct nbd_request request = {0};
+	struct nbd_reply reply;
+	int fds[2];
+
+	struct client *c = mapped_client( filename, 4096, fds );
+
+	request.magic = REQUEST_MAGIC;
+	request.type = REQUEST_FLUSH;
+
+	void client_reply_to_flush( struct client *, struct nbd_request );
+	client_reply_to_flush( c, request );
+
+	read_reply( fds[1], &reply );
+	fail_unless( 0 == reply.error, "An error was returned" );
+
+	mapped_client_destroy( c, filename, fds );
+}
+END_TEST
+
+
+START_TEST( test_generation_replies_with_the_last_one )
+{
+	char filename[] = "/tmp/check_client_XXXXXX";
+	struct nbd_request request = {0};
+	struct nbd_reply reply;
+	uint64_t generation_raw = htobe64( 0x1234 ), previous_raw;
+	int fds[2];
+
+	struct client *c = mapped_client( filename, 4096, fds );
+	fake_server.mirror_generation = 0x5678;
+
+	request.magic = REQUEST_MAGIC;
+	request.type = REQUEST_GENERATION;
+	request.from = 0;
+	request.len = sizeof( generation_raw );
+
+	fail_unless( sizeof( generation_raw ) == write( fds[1], &generation_raw, sizeof( generation_raw ) ),
+			"Couldn't send generation" );
+
+	void client_reply_to_generation( struct client *, struct nbd_request );
+	client_reply_to_generation( c, request );
+
+	read_reply( fds[1], &reply );
+	fail_unless( 0 == reply.error, "An error was returned" );
+	fail_unless( sizeof( previous_raw ) == read( fds[1], &previous_raw, sizeof( previous_raw ) ),
+			"Previous generation wasn't sent" );
+	fail_unless( 0x5678 == be64toh( previous_raw ), "Previous generation was wrong" );
+	fail_unless( 0x1234 == fake_server.mirror_generation, "Generation wasn't kept" );
+
+	mapped_client_destroy( c, filename, fds );
+}
+END_TEST
+
+
+START_TEST( test_throttle_pauses_writes_for_a_share_of_the_time )
+{
+	struct client *c = client_create( FAKE_SERVER, FAKE_SOCKET );
+	uint64_t started;
+
+	void client_throttle_write( struct client * );
+
+	client_throttle_write( c );
+	fail_unless( c->throttled_at > 0, "Didn't note the time" );
+
+	fake_server.write_throttle = 50;
+	c->throttled_at -= 100;
+	started = monotonic_time_ms();
+	client_throttle_write( c );
+	fail_unless( monotonic_time_ms() - started >= 100, "Write wasn't held up" );
+
+	fake_server.write_throttle = 0;
+	started = monotonic_time_ms();
+	c->throttled_at -= 100;
+	client_throttle_write( c );
+	fail_unless( monotonic_time_ms() - started < 50, "Unthrottled write was held up" );
+
+	client_destroy( c );
+}
+END_TEST
+
+
 Suite *client_suite(void)
 {
 	Suite *s = suite_create("client");
@@ -92,6 +405,7 @@ Suite *client_suite(void)
 	TCase *tc_create = tcase_create("create");
 	TCase *tc_signal = tcase_create("signal");
 	TCase *tc_destroy = tcase_create("destroy");
+	TCase *tc_reply = tcase_create("reply");
 
 	tcase_add_test(tc_create, test_assigns_socket);
 	tcase_add_test(tc_create, test_assigns_server);
@@ -101,9 +415,18 @@ Suite *client_suite(void)
 
 	tcase_add_test( tc_destroy, test_closes_stop_signal );
 
+	tcase_add_test( tc_reply, test_write_zeroes_zeroes_only_its_range );
+	tcase_add_test( tc_reply, test_hash_replies_with_block_hashes );
+	tcase_add_test( tc_reply, test_write_lz4_writes_decompressed_data );
+	tcase_add_test( tc_reply, test_sink_write_leaves_unallocated_zero_blocks_alone );
+	tcase_add_test( tc_reply, test_flush_replies );
+	tcase_add_test( tc_reply, test_generation_replies_with_the_last_one );
+	tcase_add_test( tc_reply, test_throttle_pauses_writes_for_a_share_of_the_time );
+
 	suite_add_tcase(s, tc_create);
 	suite_add_tcase(s, tc_signal);
 	suite_add_tcase(s, tc_destroy);
+	suite_add_tcase(s, tc_reply);
 
 	return s;
 }
@@ -0,0 +1,83 @@
+#include <check.h>
+
+#include "hash.h"
+
+#include <string.h>
+
+
+START_TEST( test_hash_empty )
+{
+	fail_unless( 0xEF46DB3751D8E999ULL == hash64( "", 0, 0 ),
+			"Empty hash didn't match the reference." );
+}
+END_TEST
+
+
+START_TEST( test_hash_short )
+{
+	fail_unless( 0x44BC2CF5AD770999ULL == hash64( "abc", 3, 0 ),
+			"Short hash didn't match the reference." );
+	fail_unless( 0xBEA9CA8199328908ULL == hash64( "abc", 3, 1 ),
+			"Seeded hash didn't match the reference." );
+}
+END_TEST
+
+
+START_TEST( test_hash_long )
+{
+	unsigned char buf[1024];
+	char xs[101];
+	int i;
+
+	for ( i = 0; i < 1024; i++ ) {
+		buf[i] = i % 256;
+	}
+	memset( xs, 'x', sizeof( xs ) );
+
+	fail_unless( 0x6F3914F18FE4DF57ULL == hash64( buf, sizeof( buf ), 0 ),
+			"Long hash didn't match the reference." );
+	fail_unless( 0xFB65B1D88F218076ULL == hash64( xs, sizeof( xs ), 0 ),
+			"Hash with a ragged tail didn't match the reference." );
+}
+END_TEST
+
+
+START_TEST( test_hash_sees_one_bit )
+{
+	char buf[4096] = {0};
+	uint64_t before = hash64( buf, sizeof( buf ), 0 );
+
+	buf[2000] = 0x10;
+	fail_if( before == hash64( buf, sizeof( buf ), 0 ),
+			"Changing a bit didn't change the hash." );
+}
+END_TEST
+
+
+Suite *hash_suite(void)
+{
+	Suite *s = suite_create("hash");
+
+	TCase *tc_hash = tcase_create("hash64");
+
+	tcase_add_test(tc_hash, test_hash_empty);
+	tcase_add_test(tc_hash, test_hash_short);
+	tcase_add_test(tc_hash, test_hash_long);
+	tcase_add_test(tc_hash, test_hash_sees_one_bit);
+
+	suite_add_tcase(s, tc_hash);
+
+	return s;
+}
+
+int main(void)
+{
+	int number_failed;
+
+	Suite *s = hash_suite();
+	SRunner *sr = srunner_create(s);
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? 0 : 1;
+}
@@ -51,6 +51,22 @@ START_TEST(test_init_size)
 END_TEST
 
 
+START_TEST(test_init_flags)
+{
+	struct nbd_init_raw init_raw;
+	struct nbd_init     init;
+
+	init_raw.flags = 12345;
+	nbd_r2h_init( &init_raw, &init );
+	fail_unless( be32toh( 12345 ) == init.flags, "Flags were not converted." );
+
+	init.flags = 67890;
+	nbd_h2r_init( &init, &init_raw );
+	fail_unless( htobe32( 67890 ) == init_raw.flags, "Flags were not converted back." );
+}
+END_TEST
+
+
 START_TEST(test_request_magic )
 {
 	struct nbd_request_raw request_raw;
@@ -210,6 +226,7 @@ Suite *nbdtypes_suite(void)
 	tcase_add_test( tc_init, test_init_passwd );
 	tcase_add_test( tc_init, test_init_magic );
 	tcase_add_test( tc_init, test_init_size );
+	tcase_add_test( tc_init, test_init_flags );
 	tcase_add_test( tc_request, test_request_magic );
 	tcase_add_test( tc_request, test_request_type );
 	tcase_add_test( tc_request, test_request_handle );
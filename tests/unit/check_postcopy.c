@@ -0,0 +1,200 @@
+#include <check.h>
+
+#include "postcopy.h"
+#include "nbdtypes.h"
+#include "readwrite.h"
+#include "ioutil.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define BS POSTCOPY_BLOCK_SIZE
+#define SIZE ( BS * 16 )
+
+/* A post-copy listener with a connection to fetch over. The mirror's end of
+ * it goes in mirror_fd */
+static struct postcopy* postcopy_with_channel( int *mirror_fd )
+{
+	struct postcopy *pc = postcopy_create( SIZE );
+	int fds[2];
+
+	fail_if( socketpair( AF_UNIX, SOCK_STREAM, 0, fds ) == -1, "Couldn't make a socketpair" );
+	fail_unless( socket_nbd_write_hello( fds[1], SIZE ), "Couldn't send hello" );
+	fail_unless( postcopy_open_channel( pc, fds[0] ), "Channel not taken" );
+
+	*mirror_fd = fds[1];
+	return pc;
+}
+
+/* Answer the next fetch with len bytes of c */
+static void mirror_reply( int fd, uint32_t len, char c )
+{
+	struct nbd_request_raw request_raw;
+	struct nbd_request request;
+	struct nbd_reply_raw reply_raw;
+	struct nbd_reply reply = { .magic = REPLY_MAGIC, .error = 0 };
+	char data[BS * 2];
+
+	fail_if( readloop( fd, &request_raw, sizeof( request_raw ) ) < 0, "No fetch" );
+	nbd_r2h_request( &request_raw, &request );
+	ck_assert_int_eq( len, request.len );
+
+	memcpy( reply.handle, request.handle, sizeof( reply.handle ) );
+	nbd_h2r_reply( &reply, &reply_raw );
+	memset( data, c, len );
+	fail_if( writeloop( fd, &reply_raw, sizeof( reply_raw ) ) < 0, "Couldn't reply" );
+	fail_if( writeloop( fd, data, len ) < 0, "Couldn't send data" );
+}
+
+/* Wait up to a second for something to arrive on fd */
+static int readable( int fd )
+{
+	fd_set fds;
+	struct timeval tv = { 1, 0 };
+
+	FD_ZERO( &fds );
+	FD_SET( fd, &fds );
+	return select( fd + 1, &fds, NULL, NULL, &tv ) == 1;
+}
+
+struct pull {
+	struct postcopy *pc;
+	uint64_t from;
+	char buf[BS];
+	int result;
+};
+
+static void* pull_thread( void *arg )
+{
+	struct pull *pull = arg;
+	struct postcopy *pc = pull->pc;
+
+	postcopy_lock( pc );
+	postcopy_fetch_start( pc, pull->from, BS );
+	pull->result = postcopy_pull( pc, pull->from, BS, pull->buf );
+	postcopy_fetch_done( pc, pull->from, BS, pull->result == 0 );
+	postcopy_unlock( pc );
+
+	return NULL;
+}
+
+START_TEST( test_lock_is_free_while_we_wait_for_the_mirror )
+{
+	int mirror_fd;
+	struct postcopy *pc = postcopy_with_channel( &mirror_fd );
+	struct pull pull = { .pc = pc, .from = BS * 2 };
+	pthread_t thread;
+	uint64_t run;
+	int missing, fetching;
+
+	postcopy_lock( pc );
+	postcopy_mark( pc, 0, BS );
+	postcopy_unlock( pc );
+
+	pthread_create( &thread, NULL, pull_thread, &pull );
+
+	/* Wait for the fetch to reach the mirror, which doesn't answer yet */
+	fail_unless( readable( mirror_fd ), "Fetch never arrived" );
+
+	ck_assert_int_eq( 0, pthread_mutex_trylock( &pc->lock ) );
+	run = postcopy_run( pc, 0, BS, &missing );
+	fail_if( missing || run != BS, "Block we have is missing" );
+	run = postcopy_fetching_run( pc, BS * 2, BS, &fetching );
+	fail_unless( fetching, "Block being fetched isn't marked" );
+	postcopy_unlock( pc );
+
+	mirror_reply( mirror_fd, BS, 'm' );
+	pthread_join( thread, NULL );
+
+	ck_assert_int_eq( 0, pull.result );
+	fail_unless( pull.buf[0] == 'm' && pull.buf[BS - 1] == 'm', "Fetched the wrong data" );
+
+	postcopy_lock( pc );
+	postcopy_run( pc, BS * 2, BS, &missing );
+	fail_if( missing, "Fetched block isn't here" );
+	postcopy_fetching_run( pc, BS * 2, BS, &fetching );
+	fail_if( fetching, "Fetched block is still being fetched" );
+	postcopy_unlock( pc );
+
+	close( mirror_fd );
+	postcopy_destroy( pc );
+}
+END_TEST
+
+START_TEST( test_connection_is_reused_after_a_fetch )
+{
+	int mirror_fd;
+	struct postcopy *pc = postcopy_with_channel( &mirror_fd );
+	struct pull first = { .pc = pc, .from = 0 };
+	struct pull second = { .pc = pc, .from = BS };
+	pthread_t thread;
+
+	pthread_create( &thread, NULL, pull_thread, &first );
+	mirror_reply( mirror_fd, BS, 'a' );
+	pthread_join( thread, NULL );
+	ck_assert_int_eq( 0, first.result );
+
+	pthread_create( &thread, NULL, pull_thread, &second );
+	mirror_reply( mirror_fd, BS, 'b' );
+	pthread_join( thread, NULL );
+	ck_assert_int_eq( 0, second.result );
+	fail_unless( second.buf[0] == 'b', "Fetched the wrong data" );
+
+	close( mirror_fd );
+	postcopy_destroy( pc );
+}
+END_TEST
+
+START_TEST( test_failed_fetch_drops_the_connection )
+{
+	int mirror_fd;
+	struct postcopy *pc = postcopy_with_channel( &mirror_fd );
+	struct pull pull = { .pc = pc, .from = 0 };
+	int missing, fetching;
+
+	/* The mirror goes away part-way through the reply */
+	shutdown( mirror_fd, SHUT_WR );
+	pull_thread( &pull );
+
+	ck_assert_int_eq( -1, pull.result );
+	ck_assert_int_eq( -1, pc->channel );
+
+	postcopy_lock( pc );
+	postcopy_run( pc, 0, BS, &missing );
+	fail_unless( missing, "Block we couldn't fetch is here" );
+	postcopy_fetching_run( pc, 0, BS, &fetching );
+	fail_if( fetching, "Block we couldn't fetch is still being fetched" );
+	postcopy_unlock( pc );
+
+	close( mirror_fd );
+	postcopy_destroy( pc );
+}
+END_TEST
+
+
+Suite* postcopy_suite(void)
+{
+	Suite *s = suite_create("postcopy");
+	TCase *tc_postcopy = tcase_create("postcopy");
+
+	tcase_add_test(tc_postcopy, test_lock_is_free_while_we_wait_for_the_mirror);
+	tcase_add_test(tc_postcopy, test_connection_is_reused_after_a_fetch);
+	tcase_add_test(tc_postcopy, test_failed_fetch_drops_the_connection);
+	suite_add_tcase(s, tc_postcopy);
+
+	return s;
+}
+
+int main(void)
+{
+	int number_failed;
+	Suite *s = postcopy_suite();
+	SRunner *sr = srunner_create(s);
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? 0 : 1;
+}
@@ -0,0 +1,92 @@
+#include <check.h>
+
+#include "proxy.h"
+
+#include <limits.h>
+
+/* The shortest wait we can get after this many failures */
+#define SHORTEST( attempts ) proxy_reconnect_delay( attempts, 0 )
+
+START_TEST( test_first_reconnect_is_immediate )
+{
+	ck_assert_int_eq( 0, proxy_reconnect_delay( 0, 0 ) );
+	ck_assert_int_eq( 0, proxy_reconnect_delay( 0, 12345 ) );
+}
+END_TEST
+
+START_TEST( test_reconnect_delay_starts_at_the_minimum )
+{
+	ck_assert_int_eq( UPSTREAM_RECONNECT_MIN / 2, SHORTEST( 1 ) );
+	ck_assert_int_eq( UPSTREAM_RECONNECT_MIN, proxy_reconnect_delay( 1, UPSTREAM_RECONNECT_MIN / 2 ) );
+}
+END_TEST
+
+START_TEST( test_reconnect_delay_doubles )
+{
+	int attempts;
+	uint64_t delay = UPSTREAM_RECONNECT_MIN;
+
+	for ( attempts = 1; delay <= UPSTREAM_RECONNECT_MAX; attempts++ ) {
+		ck_assert_int_eq( delay / 2, SHORTEST( attempts ) );
+		ck_assert_int_eq( delay, proxy_reconnect_delay( attempts, delay / 2 ) );
+		delay *= 2;
+	}
+}
+END_TEST
+
+START_TEST( test_reconnect_delay_is_capped )
+{
+	int attempts;
+
+	for ( attempts = 7; attempts < 64; attempts++ ) {
+		ck_assert_int_eq( UPSTREAM_RECONNECT_MAX / 2, SHORTEST( attempts ) );
+		ck_assert_int_eq( UPSTREAM_RECONNECT_MAX, proxy_reconnect_delay( attempts, UPSTREAM_RECONNECT_MAX / 2 ) );
+	}
+
+	ck_assert_int_eq( UPSTREAM_RECONNECT_MAX, proxy_reconnect_delay( INT_MAX, UPSTREAM_RECONNECT_MAX / 2 ) );
+}
+END_TEST
+
+START_TEST( test_reconnect_jitter_stays_in_the_top_half )
+{
+	int attempts;
+	unsigned int jitter;
+
+	for ( attempts = 1; attempts < 10; attempts++ ) {
+		for ( jitter = 0; jitter < 4 * UPSTREAM_RECONNECT_MAX; jitter += 7 ) {
+			uint64_t delay = proxy_reconnect_delay( attempts, jitter );
+
+			fail_if( delay < SHORTEST( attempts ), "Waited less than half the delay" );
+			fail_if( delay > UPSTREAM_RECONNECT_MAX, "Waited longer than the maximum" );
+			fail_if( delay > 2 * SHORTEST( attempts ), "Waited longer than the delay" );
+		}
+	}
+}
+END_TEST
+
+
+Suite* proxy_suite(void)
+{
+	Suite *s = suite_create("proxy");
+	TCase *tc_reconnect = tcase_create("reconnect");
+
+	tcase_add_test(tc_reconnect, test_first_reconnect_is_immediate);
+	tcase_add_test(tc_reconnect, test_reconnect_delay_starts_at_the_minimum);
+	tcase_add_test(tc_reconnect, test_reconnect_delay_doubles);
+	tcase_add_test(tc_reconnect, test_reconnect_delay_is_capped);
+	tcase_add_test(tc_reconnect, test_reconnect_jitter_stays_in_the_top_half);
+	suite_add_tcase(s, tc_reconnect);
+
+	return s;
+}
+
+int main(void)
+{
+	int number_failed;
+	Suite *s = proxy_suite();
+	SRunner *sr = srunner_create(s);
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? 0 : 1;
+}
@@ -0,0 +1,109 @@
+#include <check.h>
+
+#include "ratelimit.h"
+#include "mirror.h"
+
+#include <math.h>
+
+#define MB ( 1024 * 1024 )
+
+START_TEST( test_burst_defaults_to_a_fraction_of_a_second )
+{
+	ck_assert_int_eq( 100 * MB * MS_BURST_SECS, ratelimit_burst( 100 * MB, 0 ) );
+	ck_assert_int_eq( 1 * MB, ratelimit_burst( 100 * MB, 1 * MB ) );
+}
+END_TEST
+
+START_TEST( test_burst_is_at_least_one_xfer )
+{
+	ck_assert_int_eq( MS_XFER_MIN_SIZE, ratelimit_burst( 1024, 0 ) );
+	ck_assert_int_eq( MS_XFER_MIN_SIZE, ratelimit_burst( 100 * MB, 1 ) );
+}
+END_TEST
+
+START_TEST( test_tokens_refill_over_time_up_to_the_burst )
+{
+	struct ratelimit rl;
+	double burst = 1 * MB;
+
+	ratelimit_start( &rl, burst, 10.0 );
+	ratelimit_spend( &rl, burst );
+	fail_unless( ratelimit_wait( &rl, 1 * MB, burst, 10.0 ) > 0, "Went ahead with an empty bucket" );
+
+	fail_unless( ratelimit_wait( &rl, 1 * MB, burst, 10.5 ) == 0, "No tokens after waiting" );
+	ck_assert_int_eq( MB / 2, rl.tokens );
+
+	ratelimit_wait( &rl, 1 * MB, burst, 100.0 );
+	ck_assert_int_eq( burst, rl.tokens );
+}
+END_TEST
+
+START_TEST( test_wait_is_until_there_is_a_token )
+{
+	struct ratelimit rl;
+
+	ratelimit_start( &rl, MB, 0.0 );
+	ratelimit_spend( &rl, MB + 999 );
+
+	/* 1000 bytes short at 1000 bytes/s, to the millisecond */
+	fail_unless( fabs( ratelimit_wait( &rl, 1000, MB, 0.0 ) - 1.0 ) < 0.0005, "Waiting the wrong time" );
+	fail_unless( ratelimit_wait( &rl, 1000, MB, 1.0 ) == 0, "Still waiting once a token's due" );
+}
+END_TEST
+
+START_TEST( test_writes_are_capped_to_the_tokens_left )
+{
+	struct ratelimit rl;
+
+	ratelimit_start( &rl, 4096, 0.0 );
+	ck_assert_int_eq( 1024, ratelimit_allow( &rl, 1024 ) );
+	ck_assert_int_eq( 4096, ratelimit_allow( &rl, 65536 ) );
+
+	ratelimit_spend( &rl, 4000 );
+	ck_assert_int_eq( 96, ratelimit_allow( &rl, 65536 ) );
+
+	ratelimit_spend( &rl, 200 );
+	ck_assert_int_eq( 0, ratelimit_allow( &rl, 65536 ) );
+}
+END_TEST
+
+START_TEST( test_no_limit_and_paused )
+{
+	struct ratelimit rl;
+
+	ratelimit_start( &rl, 4096, 0.0 );
+	ratelimit_spend( &rl, 1 * MB );
+	fail_unless( ratelimit_wait( &rl, UINT64_MAX, 4096, 0.0 ) == 0, "Waited with no limit" );
+	ck_assert_int_eq( 1 * MB, ratelimit_allow( &rl, 1 * MB ) );
+
+	fail_unless( ratelimit_wait( &rl, 0, 4096, 1.0 ) == 1.0, "Didn't wait while paused" );
+}
+END_TEST
+
+
+Suite* ratelimit_suite(void)
+{
+	Suite *s = suite_create("ratelimit");
+	TCase *tc_ratelimit = tcase_create("ratelimit");
+
+	tcase_add_test(tc_ratelimit, test_burst_defaults_to_a_fraction_of_a_second);
+	tcase_add_test(tc_ratelimit, test_burst_is_at_least_one_xfer);
+	tcase_add_test(tc_ratelimit, test_tokens_refill_over_time_up_to_the_burst);
+	tcase_add_test(tc_ratelimit, test_wait_is_until_there_is_a_token);
+	tcase_add_test(tc_ratelimit, test_writes_are_capped_to_the_tokens_left);
+	tcase_add_test(tc_ratelimit, test_no_limit_and_paused);
+	suite_add_tcase(s, tc_ratelimit);
+
+	return s;
+}
+
+int main(void)
+{
+	int number_failed;
+	Suite *s = ratelimit_suite();
+	SRunner *sr = srunner_create(s);
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? 0 : 1;
+}
@@ -0,0 +1,167 @@
+#include <check.h>
+
+#include "readahead.h"
+#include "cache.h"
+
+#define KB 1024
+#define SIZE ( (uint64_t) 1024 * 1024 * 1024 )
+
+START_TEST( test_a_single_read_does_not_read_ahead )
+{
+	struct readahead *ra = readahead_create( READAHEAD_MAX_WINDOW );
+	struct readahead_stream *stream;
+	uint64_t from;
+	uint32_t len;
+
+	stream = readahead_note_read( ra, 0, 4 * KB );
+	fail_if( readahead_next_chunk( ra, stream, SIZE, &from, &len ), "Read ahead of a single read" );
+
+	readahead_destroy( ra );
+}
+END_TEST
+
+START_TEST( test_sequential_reads_read_ahead )
+{
+	struct readahead *ra = readahead_create( READAHEAD_MAX_WINDOW );
+	struct readahead_stream *stream;
+	uint64_t from;
+	uint32_t len;
+
+	readahead_note_read( ra, 0, 4 * KB );
+	stream = readahead_note_read( ra, 4 * KB, 4 * KB );
+
+	fail_unless( readahead_next_chunk( ra, stream, SIZE, &from, &len ), "Didn't read ahead" );
+	ck_assert_int_eq( 8 * KB, from );
+	ck_assert_int_eq( READAHEAD_MIN_WINDOW, len );
+	fail_if( readahead_next_chunk( ra, stream, SIZE, &from, &len ), "Read ahead too far" );
+
+	readahead_destroy( ra );
+}
+END_TEST
+
+START_TEST( test_window_grows_and_shrinks )
+{
+	struct readahead *ra = readahead_create( READAHEAD_MAX_WINDOW );
+	struct readahead_stream *stream;
+	uint64_t offset = 0;
+	int i;
+
+	for ( i = 0; i < 3; i++ ) {
+		stream = readahead_note_read( ra, offset, 64 * KB );
+		offset += 64 * KB;
+	}
+	ck_assert_int_eq( READAHEAD_MIN_WINDOW * 2, stream->window );
+
+	for ( i = 0; i < 16; i++ ) {
+		stream = readahead_note_read( ra, offset, 64 * KB );
+		offset += 64 * KB;
+	}
+	ck_assert_int_eq( READAHEAD_MAX_WINDOW, stream->window );
+
+	/* Going back over what's been read */
+	stream = readahead_note_read( ra, offset - 64 * KB, 64 * KB );
+	ck_assert_int_eq( READAHEAD_MAX_WINDOW / 2, stream->window );
+
+	readahead_destroy( ra );
+}
+END_TEST
+
+START_TEST( test_interleaved_streams_are_told_apart )
+{
+	struct readahead *ra = readahead_create( READAHEAD_MAX_WINDOW );
+	struct readahead_stream *a, *b;
+	uint64_t from;
+	uint32_t len;
+	int i;
+
+	for ( i = 0; i < 3; i++ ) {
+		a = readahead_note_read( ra, i * 64 * KB, 64 * KB );
+		b = readahead_note_read( ra, SIZE / 2 + i * 64 * KB, 64 * KB );
+	}
+
+	fail_if( a == b, "Streams weren't told apart" );
+	ck_assert_int_eq( READAHEAD_MIN_WINDOW * 2, a->window );
+	ck_assert_int_eq( READAHEAD_MIN_WINDOW * 2, b->window );
+
+	fail_unless( readahead_next_chunk( ra, b, SIZE, &from, &len ), "Didn't read ahead" );
+	ck_assert_int_eq( SIZE / 2 + 192 * KB, from );
+
+	readahead_destroy( ra );
+}
+END_TEST
+
+START_TEST( test_random_reads_do_not_read_ahead )
+{
+	struct readahead *ra = readahead_create( READAHEAD_MAX_WINDOW );
+	struct readahead_stream *stream;
+	uint64_t from;
+	uint32_t len;
+	int i;
+
+	for ( i = 0; i < 100; i++ ) {
+		stream = readahead_note_read( ra, ( i * 7919 % 1000 ) * 1024 * KB, 4 * KB );
+		fail_if(
+			readahead_next_chunk( ra, stream, SIZE, &from, &len ),
+			"Read ahead of a random read"
+		);
+	}
+
+	readahead_destroy( ra );
+}
+END_TEST
+
+START_TEST( test_reads_ahead_are_aligned_and_bounded )
+{
+	struct readahead *ra = readahead_create( 64 * KB );
+	struct readahead_stream *stream;
+	uint64_t from;
+	uint32_t len;
+
+	readahead_note_read( ra, 1000, 1000 );
+	stream = readahead_note_read( ra, 2000, 1000 );
+
+	fail_unless( readahead_next_chunk( ra, stream, SIZE, &from, &len ), "Didn't read ahead" );
+	ck_assert_int_eq( 0, from % CACHE_BLOCK_SIZE );
+	ck_assert_int_eq( 64 * KB, len );
+
+	/* Nor past the end of the disc */
+	readahead_reset( ra );
+	readahead_note_read( ra, SIZE - 12 * KB, 4 * KB );
+	stream = readahead_note_read( ra, SIZE - 8 * KB, 4 * KB );
+
+	fail_unless( readahead_next_chunk( ra, stream, SIZE, &from, &len ), "Didn't read ahead" );
+	ck_assert_int_eq( SIZE - 4 * KB, from );
+	ck_assert_int_eq( 4 * KB, len );
+
+	readahead_destroy( ra );
+}
+END_TEST
+
+
+Suite* readahead_suite(void)
+{
+	Suite *s = suite_create("readahead");
+	TCase *tc_readahead = tcase_create("readahead");
+
+	tcase_add_test(tc_readahead, test_a_single_read_does_not_read_ahead);
+	tcase_add_test(tc_readahead, test_sequential_reads_read_ahead);
+	tcase_add_test(tc_readahead, test_window_grows_and_shrinks);
+	tcase_add_test(tc_readahead, test_interleaved_streams_are_told_apart);
+	tcase_add_test(tc_readahead, test_random_reads_do_not_read_ahead);
+	tcase_add_test(tc_readahead, test_reads_ahead_are_aligned_and_bounded);
+	suite_add_tcase(s, tc_readahead);
+
+	return s;
+}
+
+int main(void)
+{
+	int number_failed;
+	Suite *s = readahead_suite();
+	SRunner *sr = srunner_create(s);
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? 0 : 1;
+}
+
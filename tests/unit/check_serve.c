@@ -231,10 +231,44 @@ START_TEST( test_acl_update_leaves_good_client )
 END_TEST
 
 
+START_TEST( test_postcopy_is_set_up_once )
+{
+	struct flexnbd flexnbd;
+	flexnbd.signal_fd = -1;
+	struct server * s = server_create( &flexnbd, "127.0.0.1", "0", dummy_file, 0, 0, NULL, 1, 0, 0 );
+	struct postcopy * pc;
+
+	pc = server_start_postcopy( s );
+	myfail_if( pc == NULL, "Post-copy wasn't set up." );
+	myfail_unless( s->postcopy == pc, "Post-copy wasn't published." );
+	myfail_unless( s->success, "We don't have control." );
+
+	myfail_unless( server_start_postcopy( s ) == pc, "Post-copy was set up again." );
+	server_destroy( s );
+}
+END_TEST
+
+
+START_TEST( test_postcopy_is_refused_once_we_have_control )
+{
+	struct flexnbd flexnbd;
+	flexnbd.signal_fd = -1;
+	struct server * s = server_create( &flexnbd, "127.0.0.1", "0", dummy_file, 0, 0, NULL, 1, 0, 0 );
+
+	server_control_arrived( s );
+
+	myfail_unless( server_start_postcopy( s ) == NULL, "Post-copy was set up." );
+	myfail_unless( s->postcopy == NULL, "Post-copy was published." );
+	server_destroy( s );
+}
+END_TEST
+
+
 Suite* serve_suite(void)
 {
 	Suite *s = suite_create("serve");
 	TCase *tc_acl_update = tcase_create("acl_update");
+	TCase *tc_postcopy = tcase_create("postcopy");
 
 	tcase_add_checked_fixture( tc_acl_update, setup, NULL );
 
@@ -246,6 +280,11 @@ Suite* serve_suite(void)
 
 	suite_add_tcase(s, tc_acl_update);
 
+	tcase_add_checked_fixture( tc_postcopy, setup, NULL );
+	tcase_add_test(tc_postcopy, test_postcopy_is_set_up_once);
+	tcase_add_test(tc_postcopy, test_postcopy_is_refused_once_we_have_control);
+	suite_add_tcase(s, tc_postcopy);
+
 	return s;
 }
 
@@ -184,6 +184,22 @@ START_TEST( test_gets_migration_statistics )
 }
 END_TEST
 
+START_TEST( test_gets_dirty_rate_and_throttle )
+{
+	struct server * server = mock_mirroring_server();
+	server->mirror->dirty_bps = 12345;
+	server->write_throttle = 30;
+
+	struct status * status = status_create( server );
+
+	fail_unless( 12345 == status->migration_dirty_rate, "migration_dirty_rate not read" );
+	fail_unless( 30 == status->migration_throttle, "migration_throttle not read" );
+
+	status_destroy( status );
+	destroy_mock_server( server );
+}
+END_TEST
+
 
 #define RENDER_TEST_SETUP \
 	struct status status; \
@@ -343,6 +359,32 @@ START_TEST( test_renders_migration_statistics )
 END_TEST
 
 
+START_TEST( test_renders_dirty_rate_and_throttle )
+{
+	RENDER_TEST_SETUP
+
+	status.is_mirroring = 0;
+	status.migration_speed_limit = UINT64_MAX;
+	status.migration_dirty_rate = 2000000;
+	status.migration_throttle = 40;
+
+	status_write( &status, fds[1] );
+	fail_if_rendered( fds[0], "migration_dirty_rate" );
+
+	status_write( &status, fds[1] );
+	fail_if_rendered( fds[0], "migration_throttle" );
+
+	status.is_mirroring = 1;
+
+	status_write( &status, fds[1] );
+	fail_unless_rendered( fds[0], "migration_dirty_rate=2000000" );
+
+	status_write( &status, fds[1] );
+	fail_unless_rendered( fds[0], "migration_throttle=40" );
+}
+END_TEST
+
+
 Suite *status_suite(void)
 {
 	Suite *s = suite_create("status");
@@ -357,6 +399,7 @@ Suite *status_suite(void)
 	tcase_add_test(tc_create, test_gets_pid);
 	tcase_add_test(tc_create, test_gets_size);
 	tcase_add_test(tc_create, test_gets_migration_statistics);
+	tcase_add_test(tc_create, test_gets_dirty_rate_and_throttle);
 
 
 	tcase_add_test(tc_render, test_renders_has_control);
@@ -366,6 +409,7 @@ Suite *status_suite(void)
 	tcase_add_test(tc_render, test_renders_pid);
 	tcase_add_test(tc_render, test_renders_size);
 	tcase_add_test(tc_render, test_renders_migration_statistics);
+	tcase_add_test(tc_render, test_renders_dirty_rate_and_throttle);
 
 	suite_add_tcase(s, tc_create);
 	suite_add_tcase(s, tc_render);
@@ -0,0 +1,432 @@
+#include <check.h>
+
+#include "writeback.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BS WRITEBACK_BLOCK_SIZE
+#define SIZE ( BS * 16 )
+
+static char data[BS * 4];
+static char out[BS * 4];
+
+/* The sync the last write has to wait for */
+static uint64_t wait_for;
+
+/* A write-back file for an image of size bytes, in a fresh file whose name
+ * goes in filename */
+static struct writeback* temp_writeback( char *filename, uint64_t size, int ordered )
+{
+	int fd = mkstemp( filename );
+	fail_if( fd == -1, "Couldn't make a temporary file" );
+	close( fd );
+
+	return writeback_open( filename, size, ordered );
+}
+
+/* Write len bytes of c at from, and sync them */
+static void write_synced( struct writeback *wb, uint64_t from, uint32_t len, char c )
+{
+	memset( data, c, len );
+	fail_if( writeback_write( wb, from, len, data, &wait_for ) == -1, "Write failed" );
+	fail_if( writeback_sync( wb ) == -1, "Sync failed" );
+}
+
+START_TEST( test_writes_are_here_and_dirty_once_synced )
+{
+	char filename[] = "/tmp/check_writeback_XXXXXX";
+	struct writeback *wb = temp_writeback( filename, SIZE, 1 );
+
+	fail_if( writeback_contains( wb, 0, BS ), "Empty file contains a block" );
+	fail_if( writeback_pending( wb ), "Empty file has something to write back" );
+
+	memset( data, 'a', BS );
+	fail_if( writeback_write( wb, BS, BS, data, &wait_for ) == -1, "Write failed" );
+	fail_unless( writeback_contains( wb, BS, BS ), "Written block isn't here" );
+	ck_assert_int_eq( 0, writeback_dirty_bytes( wb ) );
+	fail_unless( writeback_pending( wb ), "Unsynced write isn't pending" );
+
+	fail_if( writeback_sync( wb ) == -1, "Sync failed" );
+	ck_assert_int_eq( BS, writeback_dirty_bytes( wb ) );
+
+	fail_if( writeback_read( wb, BS, BS, out ) == -1, "Read failed" );
+	fail_unless( memcmp( data, out, BS ) == 0, "Read back the wrong data" );
+
+	writeback_close( wb );
+	unlink( filename );
+}
+END_TEST
+
+/* Wait for the sync thread to finish the sync we started */
+static int sync_finished( struct writeback *wb )
+{
+	int finished;
+
+	while ( ( finished = writeback_sync_finished( wb ) ) == 0 ) {
+		usleep( 1000 );
+	}
+
+	return finished;
+}
+
+START_TEST( test_writes_wait_for_their_syncs )
+{
+	char filename[] = "/tmp/check_writeback_XXXXXX";
+	struct writeback *wb = temp_writeback( filename, SIZE, 1 );
+	uint64_t first, second;
+
+	fail_if( writeback_sync_start( wb ), "Synced with nothing written" );
+
+	/* A new block's data is synced, then that it's dirty */
+	memset( data, 'a', BS );
+	fail_if( writeback_write( wb, 0, BS, data, &first ) == -1, "Write failed" );
+	fail_unless( writeback_sync_start( wb ), "Didn't sync a write" );
+	fail_if( writeback_sync_start( wb ), "Started a second sync at once" );
+
+	ck_assert_int_eq( 1, sync_finished( wb ) );
+	ck_assert_int_eq( BS, writeback_dirty_bytes( wb ) );
+	fail_if( writeback_synced( wb, first ), "New block acknowledged before it's marked dirty" );
+
+	/* One that's dirty already only needs its data synced, and goes with
+	 * the first's dirty bit */
+	fail_if( writeback_write( wb, 0, BS, data, &second ) == -1, "Write failed" );
+	fail_unless( writeback_sync_start( wb ), "Didn't sync the dirty bit and the write" );
+	ck_assert_int_eq( 1, sync_finished( wb ) );
+	fail_unless( writeback_synced( wb, first ), "New block not acknowledged" );
+	fail_unless( writeback_synced( wb, second ), "Dirty block not acknowledged" );
+
+	fail_if( writeback_sync_start( wb ), "Synced with nothing new" );
+	ck_assert_int_eq( BS, writeback_dirty_bytes( wb ) );
+
+	writeback_close( wb );
+	unlink( filename );
+}
+END_TEST
+
+START_TEST( test_partial_writes_need_the_block_here )
+{
+	char filename[] = "/tmp/check_writeback_XXXXXX";
+	struct writeback *wb = temp_writeback( filename, SIZE - 100, 1 );
+
+	fail_if( writeback_covers( wb, 100, 10 ), "Covers part of a block we don't have" );
+	fail_unless( writeback_covers( wb, 0, BS * 2 ), "Doesn't cover whole blocks" );
+	fail_unless( writeback_covers( wb, SIZE - BS, BS - 100 ), "Doesn't cover the short last block" );
+	fail_if( writeback_covers( wb, SIZE - BS, BS ), "Covers past the end of the image" );
+
+	write_synced( wb, 0, BS, 'a' );
+	fail_unless( writeback_covers( wb, 100, 10 ), "Doesn't cover part of a block we have" );
+	fail_if( writeback_covers( wb, 100, BS ), "Covers part of the next block" );
+
+	writeback_close( wb );
+	unlink( filename );
+}
+END_TEST
+
+START_TEST( test_blocks_are_clean_once_flushed_upstream )
+{
+	char filename[] = "/tmp/check_writeback_XXXXXX";
+	struct writeback *wb = temp_writeback( filename, SIZE, 1 );
+	uint64_t from;
+	uint32_t len;
+
+	write_synced( wb, BS, BS * 3, 'a' );
+
+	fail_unless( writeback_next_chunk( wb, &from, &len ), "Nothing to write back" );
+	ck_assert_int_eq( BS, from );
+	ck_assert_int_eq( BS * 3, len );
+	fail_if( writeback_next_chunk( wb, &from, &len ), "Wrote the same blocks back twice" );
+	fail_unless( writeback_busy( wb, BS * 2, 1 ), "Blocks being written back aren't busy" );
+	fail_if( writeback_flush_due( wb ), "Flush due before anything was written" );
+
+	writeback_sent( wb, BS, 1 );
+	ck_assert_int_eq( BS * 3, writeback_dirty_bytes( wb ) );
+	fail_unless( writeback_flush_due( wb ), "No flush due after writing" );
+
+	writeback_flush_sent( wb );
+	fail_if( writeback_flush_due( wb ), "Two flushes at once" );
+	writeback_flushed( wb, 1 );
+
+	ck_assert_int_eq( 0, writeback_dirty_bytes( wb ) );
+	fail_if( writeback_pending( wb ), "Still something to write back" );
+	fail_if( writeback_busy( wb, BS * 2, 1 ), "Clean blocks are busy" );
+	fail_unless( writeback_contains( wb, BS, BS * 3 ), "Clean blocks aren't here any more" );
+
+	writeback_close( wb );
+	unlink( filename );
+}
+END_TEST
+
+START_TEST( test_failures_are_written_back_again )
+{
+	char filename[] = "/tmp/check_writeback_XXXXXX";
+	struct writeback *wb = temp_writeback( filename, SIZE, 1 );
+	uint64_t from;
+	uint32_t len;
+
+	write_synced( wb, 0, BS, 'a' );
+
+	fail_unless( writeback_next_chunk( wb, &from, &len ), "Nothing to write back" );
+	writeback_sent( wb, from, 0 );
+	fail_unless( writeback_next_chunk( wb, &from, &len ), "Failed write not written back again" );
+
+	writeback_sent( wb, from, 1 );
+	writeback_flush_sent( wb );
+	writeback_flushed( wb, 0 );
+	ck_assert_int_eq( BS, writeback_dirty_bytes( wb ) );
+	fail_unless( writeback_flush_due( wb ), "Failed flush not sent again" );
+
+	writeback_flush_sent( wb );
+	writeback_flushed( wb, 1 );
+	ck_assert_int_eq( 0, writeback_dirty_bytes( wb ) );
+
+	writeback_close( wb );
+	unlink( filename );
+}
+END_TEST
+
+START_TEST( test_blocks_written_again_stay_dirty )
+{
+	char filename[] = "/tmp/check_writeback_XXXXXX";
+	struct writeback *wb = temp_writeback( filename, SIZE, 1 );
+	uint64_t from;
+	uint32_t len;
+
+	write_synced( wb, 0, BS * 2, 'a' );
+	fail_unless( writeback_next_chunk( wb, &from, &len ), "Nothing to write back" );
+
+	/* Written again while it's on its way upstream */
+	write_synced( wb, BS, 10, 'b' );
+	writeback_sent( wb, from, 1 );
+	fail_if( writeback_flush_due( wb ), "Flush due for blocks written again" );
+	ck_assert_int_eq( BS * 2, writeback_dirty_bytes( wb ) );
+
+	/* And after it's been written, before the flush */
+	fail_unless( writeback_next_chunk( wb, &from, &len ), "Not written back again" );
+	writeback_sent( wb, from, 1 );
+	write_synced( wb, 0, 10, 'c' );
+	writeback_flush_sent( wb );
+	writeback_flushed( wb, 1 );
+	ck_assert_int_eq( BS * 2, writeback_dirty_bytes( wb ) );
+
+	writeback_close( wb );
+	unlink( filename );
+}
+END_TEST
+
+START_TEST( test_chunks_are_bounded_and_go_round_in_order )
+{
+	char filename[] = "/tmp/check_writeback_XXXXXX";
+	uint64_t size = WRITEBACK_CHUNK * 2;
+	struct writeback *wb = temp_writeback( filename, size, 0 );
+	char *big = calloc( 1, size );
+	uint64_t from;
+	uint32_t len;
+
+	fail_if( writeback_write( wb, 0, size, big, &wait_for ) == -1, "Write failed" );
+	fail_if( writeback_sync( wb ) == -1, "Sync failed" );
+
+	fail_unless( writeback_next_chunk( wb, &from, &len ), "Nothing to write back" );
+	ck_assert_int_eq( 0, from );
+	ck_assert_int_eq( WRITEBACK_CHUNK, len );
+	writeback_sent( wb, from, 0 );
+
+	/* Having failed, the first chunk waits until we come round again */
+	fail_unless( writeback_next_chunk( wb, &from, &len ), "Nothing to write back" );
+	ck_assert_int_eq( WRITEBACK_CHUNK, from );
+	fail_unless( writeback_next_chunk( wb, &from, &len ), "Nothing to write back" );
+	ck_assert_int_eq( 0, from );
+
+	free( big );
+	writeback_close( wb );
+	unlink( filename );
+}
+END_TEST
+
+/* Write back everything that's due, then flush it, as the proxy would */
+static void write_back( struct writeback *wb )
+{
+	uint64_t from;
+	uint32_t len;
+
+	while ( writeback_next_chunk( wb, &from, &len ) ) {
+		writeback_sent( wb, from, 1 );
+	}
+	writeback_flush_sent( wb );
+	writeback_flushed( wb, 1 );
+}
+
+START_TEST( test_batches_go_back_in_the_order_written )
+{
+	char filename[] = "/tmp/check_writeback_XXXXXX";
+	struct writeback *wb = temp_writeback( filename, SIZE, 1 );
+	uint64_t from;
+	uint32_t len;
+
+	write_synced( wb, BS * 5, BS, 'a' );
+	write_synced( wb, BS * 1, BS, 'b' );
+
+	fail_unless( writeback_next_chunk( wb, &from, &len ), "Nothing to write back" );
+	ck_assert_int_eq( BS * 5, from );
+	fail_if( writeback_next_chunk( wb, &from, &len ), "Next batch went before a flush" );
+
+	writeback_sent( wb, BS * 5, 1 );
+	fail_if( writeback_next_chunk( wb, &from, &len ), "Next batch went before a flush" );
+	writeback_flush_sent( wb );
+	writeback_flushed( wb, 1 );
+
+	fail_unless( writeback_next_chunk( wb, &from, &len ), "Second batch not written back" );
+	ck_assert_int_eq( BS, from );
+
+	writeback_close( wb );
+	unlink( filename );
+}
+END_TEST
+
+START_TEST( test_blocks_written_again_take_later_batches_with_them )
+{
+	char filename[] = "/tmp/check_writeback_XXXXXX";
+	struct writeback *wb = temp_writeback( filename, SIZE, 1 );
+	uint64_t from, first;
+	uint32_t len;
+
+	write_synced( wb, BS * 9, BS, 'a' );
+	write_synced( wb, BS * 5, BS, 'b' );
+	write_synced( wb, BS * 1, BS, 'c' );
+
+	/* The second block now has data from after the third's, so they have
+	 * to go together. The first was written before either, and doesn't */
+	write_synced( wb, BS * 5, BS, 'd' );
+
+	fail_unless( writeback_next_chunk( wb, &from, &len ), "Nothing to write back" );
+	ck_assert_int_eq( BS * 9, from );
+	fail_if( writeback_next_chunk( wb, &from, &len ), "Next batch went before a flush" );
+	writeback_sent( wb, BS * 9, 1 );
+	writeback_flush_sent( wb );
+	writeback_flushed( wb, 1 );
+
+	fail_unless( writeback_next_chunk( wb, &from, &len ), "Nothing left to write back" );
+	first = from;
+	fail_unless( writeback_next_chunk( wb, &from, &len ), "Batches weren't merged" );
+	fail_unless( first + from == BS * 6, "Wrote back the wrong blocks" );
+	fail_if( writeback_next_chunk( wb, &from, &len ), "Wrote back too much at once" );
+
+	writeback_close( wb );
+	unlink( filename );
+}
+END_TEST
+
+START_TEST( test_straight_writes_wait_for_earlier_ones )
+{
+	char filename[] = "/tmp/check_writeback_XXXXXX";
+	struct writeback *wb = temp_writeback( filename, SIZE, 1 );
+	uint64_t before, after, from;
+	uint32_t len;
+
+	before = writeback_logged( wb );
+	write_synced( wb, BS * 5, BS, 'a' );
+	after = writeback_logged( wb );
+	write_synced( wb, BS * 7, BS, 'b' );
+
+	fail_if( writeback_waiting( wb, before ), "Waiting for later writes" );
+	fail_unless( writeback_waiting( wb, after ), "Not waiting for earlier writes" );
+
+	/* The proxy looks for more to write back before it sends anything */
+	write_back( wb );
+	fail_unless( writeback_next_chunk( wb, &from, &len ), "Second batch not written back" );
+	fail_if( writeback_waiting( wb, after ), "Still waiting once they're upstream" );
+	fail_unless( writeback_waiting( wb, writeback_logged( wb ) ), "Not waiting for the second batch" );
+
+	writeback_sent( wb, from, 1 );
+	write_back( wb );
+	writeback_next_chunk( wb, &from, &len );
+	fail_if( writeback_pending( wb ), "Still something to write back" );
+	fail_if( writeback_waiting( wb, writeback_logged( wb ) ), "Waiting with nothing to write back" );
+
+	writeback_close( wb );
+	unlink( filename );
+}
+END_TEST
+
+START_TEST( test_overlay_lays_blocks_here_over_a_read )
+{
+	char filename[] = "/tmp/check_writeback_XXXXXX";
+	struct writeback *wb = temp_writeback( filename, SIZE, 1 );
+
+	write_synced( wb, BS, BS, 'a' );
+	fail_unless( writeback_overlaps( wb, 0, BS * 3 ), "Doesn't overlap a block it has" );
+	fail_if( writeback_overlaps( wb, BS * 2, BS ), "Overlaps a block it doesn't have" );
+
+	memset( out, 'u', BS * 3 );
+	fail_if( writeback_overlay( wb, 0, BS * 3, out ) == -1, "Overlay failed" );
+	fail_unless( out[0] == 'u' && out[BS - 1] == 'u', "Overlaid a block we don't have" );
+	fail_unless( out[BS] == 'a' && out[BS * 2 - 1] == 'a', "Didn't overlay a block we have" );
+	fail_unless( out[BS * 2] == 'u', "Overlaid past what we have" );
+
+	/* Once written straight to upstream, it's out of date */
+	writeback_forget( wb, BS + 10, 10 );
+	fail_if( writeback_overlaps( wb, BS, BS ), "Still have a block written upstream" );
+
+	writeback_close( wb );
+	unlink( filename );
+}
+END_TEST
+
+START_TEST( test_dirty_blocks_survive_reopening )
+{
+	char filename[] = "/tmp/check_writeback_XXXXXX";
+	struct writeback *wb = temp_writeback( filename, SIZE, 1 );
+
+	write_synced( wb, BS * 2, BS, 'a' );
+	memset( data, 'b', BS );
+	fail_if( writeback_write( wb, BS * 4, BS, data, &wait_for ) == -1, "Write failed" );
+	writeback_close( wb );
+
+	wb = writeback_open( filename, SIZE, 1 );
+	ck_assert_int_eq( BS, writeback_dirty_bytes( wb ) );
+	fail_unless( writeback_contains( wb, BS * 2, BS ), "Dirty block isn't here" );
+	fail_if( writeback_contains( wb, BS * 4, BS ), "Unsynced block is here" );
+
+	fail_if( writeback_read( wb, BS * 2, BS, out ) == -1, "Read failed" );
+	fail_unless( out[0] == 'a' && out[BS - 1] == 'a', "Read back the wrong data" );
+
+	writeback_close( wb );
+	unlink( filename );
+}
+END_TEST
+
+
+Suite* writeback_suite(void)
+{
+	Suite *s = suite_create("writeback");
+	TCase *tc_writeback = tcase_create("writeback");
+
+	tcase_add_test(tc_writeback, test_writes_are_here_and_dirty_once_synced);
+	tcase_add_test(tc_writeback, test_writes_wait_for_their_syncs);
+	tcase_add_test(tc_writeback, test_partial_writes_need_the_block_here);
+	tcase_add_test(tc_writeback, test_blocks_are_clean_once_flushed_upstream);
+	tcase_add_test(tc_writeback, test_failures_are_written_back_again);
+	tcase_add_test(tc_writeback, test_blocks_written_again_stay_dirty);
+	tcase_add_test(tc_writeback, test_chunks_are_bounded_and_go_round_in_order);
+	tcase_add_test(tc_writeback, test_batches_go_back_in_the_order_written);
+	tcase_add_test(tc_writeback, test_blocks_written_again_take_later_batches_with_them);
+	tcase_add_test(tc_writeback, test_straight_writes_wait_for_earlier_ones);
+	tcase_add_test(tc_writeback, test_overlay_lays_blocks_here_over_a_read);
+	tcase_add_test(tc_writeback, test_dirty_blocks_survive_reopening);
+	suite_add_tcase(s, tc_writeback);
+
+	return s;
+}
+
+int main(void)
+{
+	int number_failed;
+	Suite *s = writeback_suite();
+	SRunner *sr = srunner_create(s);
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? 0 : 1;
+}
+